@@ -0,0 +1,216 @@
+#include "autotune.h"
+#include "bmp.h"
+#include "filters.h"
+#include "threadpool.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined C_IMPLEMENTATION && \
+    !defined SIMD_INTRINSICS_IMPLEMENTATION && \
+    !defined SIMD_ASM_IMPLEMENTATION
+#define C_IMPLEMENTATION 1
+#endif
+
+/*
+    Measures every point filter on synthetic images of every calibrated size
+    class with 1, 2, 4, ... threads, several grain sizes and, where the filter
+    has a streaming variant, with regular and non-temporal stores, and stores
+    the fastest configuration of each pair in the tuning file. The tools pick
+    the file up on their next run.
+*/
+
+#define AUTOTUNE_FIRST_SIZE_CLASS 6     /*  64x64 pixels */
+#define AUTOTUNE_LAST_SIZE_CLASS 12     /* 4096x4096 pixels */
+#define AUTOTUNE_ITERATIONS 5
+#define AUTOTUNE_GRAIN_DIVISORS 5
+#define AUTOTUNE_SMALLEST_GRAIN 4096
+
+static const float Autotune_Parameters[FILTERS_MAX_PARAMETERS] = { 20.0f, 1.2f };
+
+/* Returns the best time out of AUTOTUNE_ITERATIONS runs in nanoseconds. */
+static uint64_t autotune_measure(
+                    threadpool_t *threadpool,
+                    autotune_config_t config,
+                    const filters_chain_t *chain,
+                    uint8_t *pixels,
+                    size_t channels_count
+                )
+{
+    uint64_t best_time = UINT64_MAX;
+
+    /* Warm up the caches and the workers outside of the measurement */
+    filters_run_chain(threadpool, config.grain, config.streaming, chain, pixels, channels_count);
+
+    for (size_t i = 0; i < AUTOTUNE_ITERATIONS; ++i) {
+        uint64_t start_time = timing_get_time_ns();
+        filters_run_chain(threadpool, config.grain, config.streaming, chain, pixels, channels_count);
+        uint64_t time = timing_get_time_ns() - start_time;
+
+        best_time = UTILS_MIN(best_time, time);
+    }
+
+    return best_time;
+}
+
+int main(int argc, char *argv[])
+{
+    int result = EXIT_FAILURE;
+
+    if (argc > 2) {
+        fprintf(stderr, "Usage: %s [<tuning file>]\n", argv[0]);
+        return result;
+    }
+
+    const char *tuning_file_name = argc > 1 ? argv[1] : autotune_get_file_path();
+    size_t cores = utils_get_number_of_cpu_cores();
+    size_t kernel_count = sizeof(Filters_Kernels) / sizeof(Filters_Kernels[0]);
+    size_t class_count = AUTOTUNE_LAST_SIZE_CLASS - AUTOTUNE_FIRST_SIZE_CLASS + 1;
+    size_t maximum_channels_count = ((size_t) 4 << (2 * AUTOTUNE_LAST_SIZE_CLASS));
+
+    uint8_t *pixels = NULL;
+    threadpool_t **threadpools = NULL;
+    size_t threadpool_count = 0;
+    autotune_config_t *best_configs = NULL;
+    uint64_t *best_times = NULL;
+
+    autotune_table_t table; autotune_init(&table);
+
+    const char *error_message;
+    autotune_load(&table, tuning_file_name, &error_message);
+    if (error_message != NULL) {
+        fprintf(stderr, "Ignoring the tuning file '%s':\n\t%s\n", tuning_file_name, error_message);
+    }
+
+    pixels = aligned_alloc(64, maximum_channels_count);
+    best_configs = malloc(sizeof(*best_configs) * kernel_count * class_count);
+    best_times = malloc(sizeof(*best_times) * kernel_count * class_count);
+    if (pixels == NULL || best_configs == NULL || best_times == NULL) {
+        fputs("Out of memory.\n", stderr);
+        goto cleanup;
+    }
+    for (size_t i = 0; i < maximum_channels_count; ++i) {
+        pixels[i] = (uint8_t) (i * 7 + i / 4096);
+    }
+    for (size_t i = 0; i < kernel_count * class_count; ++i) {
+        best_times[i] = UINT64_MAX;
+    }
+
+    /* One pool per thread count, a single thread runs without a pool */
+    for (size_t threads = 1; threads < cores; threads *= 2) {
+        ++threadpool_count;
+    }
+    threadpools = calloc(threadpool_count + 1, sizeof(*threadpools));
+    if (threadpools == NULL) {
+        fputs("Out of memory.\n", stderr);
+        goto cleanup;
+    }
+    for (size_t i = 1; i <= threadpool_count; ++i) {
+        threadpools[i] = threadpool_create(UTILS_MIN((size_t) 1 << i, cores));
+        if (threadpools[i] == NULL) {
+            fputs("Failed to create a threadpool.\n", stderr);
+            goto cleanup;
+        }
+    }
+
+    for (size_t i = 0; i <= threadpool_count; ++i) {
+        size_t threads = UTILS_MIN((size_t) 1 << i, cores);
+
+        for (size_t k = 0; k < kernel_count; ++k) {
+            filters_chain_t chain;
+            chain.count = 1;
+            chain.stages[0].kernel = &Filters_Kernels[k];
+            memcpy(chain.stages[0].parameters, Autotune_Parameters, sizeof(Autotune_Parameters));
+
+            for (size_t c = 0; c < class_count; ++c) {
+                size_t channels_count = (size_t) 4 << (2 * (AUTOTUNE_FIRST_SIZE_CLASS + c));
+
+                for (size_t d = 0; d < AUTOTUNE_GRAIN_DIVISORS; ++d) {
+                    autotune_config_t config;
+                    config.threads = threads;
+                    config.grain = UTILS_MAX(channels_count / threads >> d, AUTOTUNE_SMALLEST_GRAIN);
+                    config.grain = UTILS_MIN(config.grain, channels_count);
+
+                    for (int streaming = 0; streaming <= (Filters_Kernels[k].apply_streaming != NULL); ++streaming) {
+                        config.streaming = 0 != streaming;
+
+                        uint64_t time = autotune_measure(threadpools[i], config, &chain, pixels, channels_count);
+                        if (time < best_times[k * class_count + c]) {
+                            best_times[k * class_count + c] = time;
+                            best_configs[k * class_count + c] = config;
+                        }
+                    }
+
+                    /* Without a pool the grain does not matter */
+                    if (threadpools[i] == NULL || config.grain == AUTOTUNE_SMALLEST_GRAIN) {
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    printf("%-18s %10s %7s %12s %9s %12s\n", "filter", "pixels", "threads", "grain", "streaming", "ms/pass");
+    for (size_t k = 0; k < kernel_count; ++k) {
+        for (size_t c = 0; c < class_count; ++c) {
+            size_t size_class = AUTOTUNE_FIRST_SIZE_CLASS + c;
+            autotune_config_t config = best_configs[k * class_count + c];
+
+            if (!autotune_set(&table, Filters_Kernels[k].name, size_class, config)) {
+                fputs("Out of memory.\n", stderr);
+                goto cleanup;
+            }
+
+            printf(
+                "%-18s %10zu %7zu %12zu %9s %12.3f\n",
+                Filters_Kernels[k].name,
+                (size_t) 1 << (2 * size_class),
+                config.threads,
+                config.grain,
+                config.streaming ? "yes" : "no",
+                best_times[k * class_count + c] / 1e6
+            );
+        }
+    }
+
+    autotune_save(&table, tuning_file_name, &error_message);
+    if (error_message != NULL) {
+        fprintf(stderr, "Failed to save the tuning file '%s':\n\t%s\n", tuning_file_name, error_message);
+        goto cleanup;
+    }
+
+    result = EXIT_SUCCESS;
+
+cleanup:
+    if (threadpools != NULL) {
+        for (size_t i = 1; i <= threadpool_count; ++i) {
+            threadpool_destroy(threadpools[i]);
+            threadpools[i] = NULL;
+        }
+        free(threadpools);
+        threadpools = NULL;
+    }
+
+    if (best_times != NULL) {
+        free(best_times);
+        best_times = NULL;
+    }
+
+    if (best_configs != NULL) {
+        free(best_configs);
+        best_configs = NULL;
+    }
+
+    if (pixels != NULL) {
+        free(pixels);
+        pixels = NULL;
+    }
+
+    autotune_free(&table);
+
+    return result;
+}
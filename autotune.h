@@ -0,0 +1,259 @@
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+#include "bmp.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static const char *Autotune_Error_Failed_to_Open_File =
+                    "Failed to open the tuning file",
+                  *Autotune_Error_Invalid_File =
+                    "Invalid tuning file (expected lines of <filter> <size class> <threads> <grain> [<streaming>])",
+                  *Autotune_Error_Not_Enough_Memory =
+                    "Not enough memory to store the tuning table",
+                  *Autotune_Error_Failed_to_Write_File =
+                    "Failed to write the tuning file";
+
+/*
+    The best thread count, grain size (channels per task) and store type of
+    a filter depend on the machine and on the size of the image. Images are
+    put into size classes by their pixel count, class `k` holds the images
+    with [4^k, 4^(k + 1)) pixels. The `autotune` tool measures every filter on
+    every class and stores the winners in a tuning file, one line per entry:
+
+        <filter> <size class> <threads> <grain> [<streaming>]
+
+    The file is read from the path in the environment variable
+    BMP_TUNING_FILE, or from AUTOTUNE_DEFAULT_FILE in the working directory.
+    Filters and classes without an entry fall back to an equal split over all
+    cores, and to a single thread for tiny images where the handoff to the
+    pool costs more than the work. They use streaming stores once the image
+    is larger than the last level cache.
+*/
+
+#define AUTOTUNE_DEFAULT_FILE ".bmp_tuning"
+#define AUTOTUNE_MAX_NAME_LENGTH 32
+#define AUTOTUNE_SIZE_CLASSES 16
+#define AUTOTUNE_MINIMUM_GRAIN 64
+#define AUTOTUNE_SINGLE_THREAD_PIXELS (256 * 256)
+#define AUTOTUNE_DEFAULT_CACHE_SIZE (8 * 1024 * 1024)
+
+typedef struct _autotune_config
+{
+    size_t threads;     /* 1 runs the filter on the calling thread without a pool */
+    size_t grain;       /* channels per task                                      */
+    bool streaming;     /* non-temporal stores in the last stage                  */
+} autotune_config_t;
+
+typedef struct _autotune_entry
+{
+    char filter[AUTOTUNE_MAX_NAME_LENGTH];
+    size_t size_class;
+    autotune_config_t config;
+} autotune_entry_t;
+
+typedef struct _autotune_table
+{
+    autotune_entry_t *entries;
+    size_t count;
+} autotune_table_t;
+
+static inline void autotune_init(autotune_table_t *table)
+{
+    table->entries = NULL;
+    table->count = 0;
+}
+
+static inline void autotune_free(autotune_table_t *table)
+{
+    if (NULL != table->entries) {
+        free(table->entries);
+        table->entries = NULL;
+    }
+    table->count = 0;
+}
+
+static inline const char *autotune_get_file_path(void)
+{
+    const char *path = getenv("BMP_TUNING_FILE");
+
+    return NULL != path && '\0' != path[0] ? path : AUTOTUNE_DEFAULT_FILE;
+}
+
+static inline size_t autotune_get_size_class(size_t pixels_count)
+{
+    size_t size_class = 0;
+    for (; pixels_count >= 4 && size_class + 1 < AUTOTUNE_SIZE_CLASSES; pixels_count /= 4) {
+        ++size_class;
+    }
+
+    return size_class;
+}
+
+/* The size of the last level cache in bytes. */
+static inline size_t autotune_get_cache_size(void)
+{
+    long size = -1;
+#ifdef _SC_LEVEL3_CACHE_SIZE
+    size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    if (size <= 0) {
+        size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    }
+#endif
+
+    return size > 0 ? (size_t) size : AUTOTUNE_DEFAULT_CACHE_SIZE;
+}
+
+static inline autotune_config_t autotune_get_default_config(size_t channels_count, size_t cores)
+{
+    autotune_config_t config;
+
+    config.threads = channels_count / 4 < AUTOTUNE_SINGLE_THREAD_PIXELS ? 1 : cores;
+    config.grain = channels_count / (config.threads > 0 ? config.threads : 1);
+    config.streaming = channels_count > autotune_get_cache_size();
+
+    return config;
+}
+
+static inline autotune_entry_t *autotune_find(const autotune_table_t *table, const char *filter, size_t size_class)
+{
+    for (size_t i = 0; i < table->count; ++i) {
+        if (table->entries[i].size_class == size_class && 0 == strcmp(table->entries[i].filter, filter)) {
+            return &table->entries[i];
+        }
+    }
+
+    return NULL;
+}
+
+static bool autotune_set(autotune_table_t *table, const char *filter, size_t size_class, autotune_config_t config)
+{
+    autotune_entry_t *entry = autotune_find(table, filter, size_class);
+    if (NULL == entry) {
+        if (strlen(filter) >= AUTOTUNE_MAX_NAME_LENGTH) {
+            return false;
+        }
+
+        autotune_entry_t *entries =
+            (autotune_entry_t *) realloc(table->entries, sizeof(*entries) * (table->count + 1));
+        if (NULL == entries) {
+            return false;
+        }
+        table->entries = entries;
+
+        entry = &table->entries[table->count++];
+        strcpy(entry->filter, filter);
+        entry->size_class = size_class;
+    }
+
+    entry->config = config;
+
+    return true;
+}
+
+/*
+    Returns the configuration to run `filter` over `channels_count` channels
+    with at most `cores` threads. The grain is a multiple of
+    AUTOTUNE_MINIMUM_GRAIN channels.
+*/
+static autotune_config_t autotune_get_config(
+                             const autotune_table_t *table,
+                             const char *filter,
+                             size_t channels_count,
+                             size_t cores
+                         )
+{
+    autotune_entry_t *entry = autotune_find(table, filter, autotune_get_size_class(channels_count / 4));
+    autotune_config_t config =
+        NULL != entry ?
+            entry->config :
+            autotune_get_default_config(channels_count, cores);
+
+    config.threads = UTILS_CLAMP(config.threads, 1, UTILS_MAX(cores, 1));
+    config.grain = (config.grain + AUTOTUNE_MINIMUM_GRAIN - 1) / AUTOTUNE_MINIMUM_GRAIN * AUTOTUNE_MINIMUM_GRAIN;
+    config.grain = UTILS_MAX(config.grain, AUTOTUNE_MINIMUM_GRAIN);
+
+    return config;
+}
+
+/* Reads a tuning file into `table`. A missing file leaves the table empty
+   and is not an error. */
+static void autotune_load(autotune_table_t *table, const char *path, const char **error_message)
+{
+    *error_message = NULL;
+
+    FILE *file = fopen(path, "r");
+    if (NULL == file) {
+        return;
+    }
+
+    char line[256];
+    while (NULL != fgets(line, sizeof(line), file)) {
+        if ('#' == line[0] || '\n' == line[0]) {
+            continue;
+        }
+
+        char filter[AUTOTUNE_MAX_NAME_LENGTH];
+        size_t size_class;
+        autotune_config_t config;
+        int streaming = -1;
+        int count = sscanf(line, "%31s %zu %zu %zu %d", filter, &size_class, &config.threads, &config.grain, &streaming);
+        if (count < 4 || size_class >= AUTOTUNE_SIZE_CLASSES || 0 == config.threads || 0 == config.grain) {
+            *error_message = Autotune_Error_Invalid_File;
+            break;
+        }
+
+        /* Files without the column use the default for the class */
+        config.streaming =
+            streaming >= 0 ?
+                0 != streaming :
+                ((size_t) 4 << (2 * size_class)) > autotune_get_cache_size();
+
+        if (!autotune_set(table, filter, size_class, config)) {
+            *error_message = Autotune_Error_Not_Enough_Memory;
+            break;
+        }
+    }
+
+    fclose(file);
+
+    if (NULL != *error_message) {
+        autotune_free(table);
+    }
+}
+
+static void autotune_save(const autotune_table_t *table, const char *path, const char **error_message)
+{
+    *error_message = NULL;
+
+    FILE *file = fopen(path, "w");
+    if (NULL == file) {
+        *error_message = Autotune_Error_Failed_to_Open_File;
+        return;
+    }
+
+    fputs("# <filter> <size class> <threads> <grain> <streaming>\n", file);
+    for (size_t i = 0; i < table->count; ++i) {
+        const autotune_entry_t *entry = &table->entries[i];
+        fprintf(
+            file,
+            "%s %zu %zu %zu %d\n",
+            entry->filter,
+            entry->size_class,
+            entry->config.threads,
+            entry->config.grain,
+            entry->config.streaming ? 1 : 0
+        );
+    }
+
+    if (0 != fclose(file)) {
+        *error_message = Autotune_Error_Failed_to_Write_File;
+    }
+}
+
+#endif // AUTOTUNE_H
@@ -0,0 +1,257 @@
+#include "bmp.h"
+#include "filters.h"
+#include "perf_counters.h"
+#include "threadpool.h"
+
+#include <semaphore.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined C_IMPLEMENTATION && \
+    !defined SIMD_INTRINSICS_IMPLEMENTATION && \
+    !defined SIMD_ASM_IMPLEMENTATION
+#define C_IMPLEMENTATION 1
+#endif
+
+/*
+    Runs every point filter implementation on an image with 1, 2, 4, ... threads
+    and reports the time per pass together with hardware counters: instructions
+    per cycle, last level cache misses per pixel, bytes per cycle and the
+    effective clock relative to the nominal one. The C, the AVX-512 and the
+    streaming AVX-512 kernels are all built when the program is compiled with
+    SIMD support.
+*/
+
+#define BENCHMARK_DEFAULT_ITERATIONS 20
+
+static const filters_kernel_t Benchmark_Kernels[] = {
+    { "sepia_c",           0, filters_sepia_c,                  NULL, NULL, 0 },
+    { "brightness_c",      2, filters_brightness_c,             NULL, NULL, 0 },
+#if defined FILTERS_AVX512_KERNELS
+    { "sepia_avx512",      0, filters_sepia_avx512,             NULL, NULL, 0 },
+    { "brightness_avx512", 2, filters_brightness_avx512,        NULL, NULL, 0 },
+    { "sepia_stream",      0, filters_sepia_avx512_stream,      NULL, NULL, 0 },
+    { "brightness_stream", 2, filters_brightness_avx512_stream, NULL, NULL, 0 },
+#endif
+};
+
+static const float Benchmark_Parameters[FILTERS_MAX_PARAMETERS] = { 20.0f, 1.2f };
+
+typedef struct _benchmark_data
+{
+    const filters_chain_t *chain;
+    uint8_t *pixels;
+    size_t position;
+    size_t channels_to_process;
+    sem_t *done;
+} benchmark_data_t;
+
+static void benchmark_processing_task(
+                void *task_data,
+                void (*result_callback)(void *result) __attribute__((unused))
+            )
+{
+    benchmark_data_t *data = task_data;
+
+    filters_apply_chain(data->chain, data->pixels, data->position, data->position + data->channels_to_process, false);
+    sem_post(data->done);
+}
+
+/*
+    Unlike `filters_run_chain`, the calling thread sleeps on a semaphore
+    instead of spinning, so the process-wide counters only see the work of
+    the pool.
+*/
+static void benchmark_run(
+                threadpool_t *threadpool,
+                size_t task_count,
+                const filters_chain_t *chain,
+                uint8_t *pixels,
+                size_t channels_count,
+                benchmark_data_t *tasks,
+                sem_t *done
+            )
+{
+    size_t channels_per_task = (channels_count / task_count + 63) / 64 * 64;
+    channels_per_task = UTILS_MAX(channels_per_task, 64);
+
+    size_t count = 0;
+    for (size_t position = 0; position < channels_count; position += channels_per_task, ++count) {
+        tasks[count].chain = chain;
+        tasks[count].pixels = pixels;
+        tasks[count].position = position;
+        tasks[count].channels_to_process = UTILS_MIN(channels_per_task, channels_count - position);
+        tasks[count].done = done;
+
+        threadpool_enqueue_task(threadpool, benchmark_processing_task, &tasks[count], NULL);
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        while (0 != sem_wait(done)) { }
+    }
+}
+
+static void benchmark_print_ratio(double numerator, double denominator, bool valid)
+{
+    if (valid && denominator > 0.0) {
+        printf(" %12.3f", numerator / denominator);
+    } else {
+        printf(" %12s", "n/a");
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int result = EXIT_FAILURE;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <source file> [<iterations> [<maximum threads>]]\n", argv[0]);
+        return result;
+    }
+
+    char *source_file_name = argv[1];
+    size_t iterations = argc > 2 ? strtoul(argv[2], NULL, 10) : BENCHMARK_DEFAULT_ITERATIONS;
+    size_t maximum_threads = argc > 3 ? strtoul(argv[3], NULL, 10) : utils_get_number_of_cpu_cores();
+    iterations = UTILS_MAX(iterations, 1);
+    maximum_threads = UTILS_MAX(maximum_threads, 1);
+
+    FILE *source_descriptor = NULL;
+    benchmark_data_t *tasks = NULL;
+    sem_t done;
+    bool done_initialized = false;
+
+    bmp_image image; bmp_init_image_structure(&image);
+
+    source_descriptor = fopen(source_file_name, "r");
+    if (source_descriptor == NULL) {
+        fprintf(stderr, "Failed to open the source image file '%s'\n", source_file_name);
+        goto cleanup;
+    }
+
+    const char *error_message;
+    bmp_open_image_headers(source_descriptor, &image, &error_message);
+    if (error_message != NULL) {
+        fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", source_file_name, error_message);
+        goto cleanup;
+    }
+
+    bmp_read_image_data(source_descriptor, &image, &error_message);
+    if (error_message != NULL) {
+        fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", source_file_name, error_message);
+        goto cleanup;
+    }
+
+    size_t pixels_count = image.absolute_image_width * image.absolute_image_height;
+    size_t channels_count = pixels_count * 4;
+
+    tasks = malloc(sizeof(*tasks) * (channels_count / 64 + 1));
+    if (tasks == NULL || 0 != sem_init(&done, 0, 0)) {
+        fputs("Out of memory.\n", stderr);
+        goto cleanup;
+    }
+    done_initialized = true;
+
+    perf_counters_t counters;
+    if (0 == perf_counters_open(&counters)) {
+        fputs("Hardware counters are not available, only the times are reported.\n", stderr);
+    }
+    perf_counters_close(&counters);
+
+    printf(
+        "%-18s %7s %12s %12s %12s %12s %12s %12s\n",
+        "kernel", "threads", "ms/pass", "GB/s", "IPC", "LLC miss/px", "bytes/cycle", "clock ratio"
+    );
+
+    for (size_t k = 0; k < sizeof(Benchmark_Kernels) / sizeof(Benchmark_Kernels[0]); ++k) {
+        filters_chain_t chain;
+        chain.count = 1;
+        chain.stages[0].kernel = &Benchmark_Kernels[k];
+        memcpy(chain.stages[0].parameters, Benchmark_Parameters, sizeof(Benchmark_Parameters));
+
+        for (size_t threads = 1;; threads = UTILS_MIN(threads * 2, maximum_threads)) {
+            /* Warm up the caches and the page tables outside of the measurement */
+            filters_apply_chain(&chain, image.pixels, 0, channels_count, false);
+
+            perf_counters_open(&counters);
+
+            threadpool_t *threadpool = threadpool_create(threads);
+            if (threadpool == NULL) {
+                perf_counters_close(&counters);
+                fputs("Failed to create a threadpool.\n", stderr);
+                goto cleanup;
+            }
+
+            uint64_t start_time = timing_get_time_ns();
+            for (size_t i = 0; i < iterations; ++i) {
+                benchmark_run(threadpool, threads, &chain, image.pixels, channels_count, tasks, &done);
+            }
+            uint64_t end_time = timing_get_time_ns();
+
+            /* The counts of the workers reach the process when they exit */
+            threadpool_destroy(threadpool);
+
+            perf_counters_sample_t sample;
+            perf_counters_read(&counters, &sample);
+            perf_counters_close(&counters);
+
+            double seconds = (double) (end_time - start_time) / 1e9;
+            double bytes = (double) channels_count * (double) iterations;
+            double pixels = (double) pixels_count * (double) iterations;
+            double cycles = (double) sample.values[PERF_COUNTERS_CYCLES];
+
+            printf(
+                "%-18s %7zu %12.3f %12.3f",
+                Benchmark_Kernels[k].name,
+                threads,
+                seconds * 1e3 / (double) iterations,
+                bytes / seconds / 1e9
+            );
+            benchmark_print_ratio(
+                (double) sample.values[PERF_COUNTERS_INSTRUCTIONS],
+                cycles,
+                sample.valid[PERF_COUNTERS_INSTRUCTIONS] && sample.valid[PERF_COUNTERS_CYCLES]
+            );
+            benchmark_print_ratio(
+                (double) sample.values[PERF_COUNTERS_CACHE_MISSES],
+                pixels,
+                sample.valid[PERF_COUNTERS_CACHE_MISSES]
+            );
+            benchmark_print_ratio(bytes, cycles, sample.valid[PERF_COUNTERS_CYCLES]);
+            benchmark_print_ratio(
+                cycles,
+                (double) sample.values[PERF_COUNTERS_REFERENCE_CYCLES],
+                sample.valid[PERF_COUNTERS_CYCLES] && sample.valid[PERF_COUNTERS_REFERENCE_CYCLES]
+            );
+            printf("\n");
+
+            if (threads == maximum_threads) {
+                break;
+            }
+        }
+    }
+
+    result = EXIT_SUCCESS;
+
+cleanup:
+    if (done_initialized) {
+        sem_destroy(&done);
+    }
+
+    if (tasks != NULL) {
+        free(tasks);
+        tasks = NULL;
+    }
+
+    bmp_free_image_structure(&image);
+
+    if (source_descriptor != NULL) {
+        fclose(source_descriptor);
+        source_descriptor = NULL;
+    }
+
+    return result;
+}
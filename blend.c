@@ -0,0 +1,224 @@
+#include "bmp.h"
+#include "image_io.h"
+#include "blend.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined C_IMPLEMENTATION && \
+    !defined SIMD_INTRINSICS_IMPLEMENTATION && \
+    !defined SIMD_ASM_IMPLEMENTATION
+#define C_IMPLEMENTATION 1
+#endif
+
+static bool blend_image_file(
+                const char *source_file_name,
+                const char *destination_file_name,
+                const bmp_image *overlay,
+                long overlay_x,
+                long overlay_y,
+                blend_mode_t mode,
+                bool premultiplied
+            )
+{
+    bool result = false;
+
+    FILE *source_descriptor = NULL;
+    FILE *destination_descriptor = NULL;
+
+    bmp_image image; bmp_init_image_structure(&image);
+    image_format source_format = IMAGE_FORMAT_BMP;
+
+    source_descriptor = fopen(source_file_name, "r");
+    if (source_descriptor == NULL) {
+        fprintf(stderr, "Failed to open the source image file '%s'\n", source_file_name);
+        goto cleanup;
+    }
+
+    const char *error_message;
+    image_io_open_image_headers(source_descriptor, &image, &source_format, &error_message);
+    if (error_message != NULL) {
+        fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", source_file_name, error_message);
+        goto cleanup;
+    }
+
+    /* The image keeps the row order of its file, so it is written back the
+       way it was stored. The overlay position is mapped to that order below. */
+    image_io_read_image_data(source_descriptor, &image, source_format, &error_message);
+    if (error_message != NULL) {
+        fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", source_file_name, error_message);
+        goto cleanup;
+    }
+
+    image_format destination_format = image_io_get_format_for_file_name(destination_file_name, source_format);
+    destination_descriptor = fopen(destination_file_name, "w");
+    if (destination_descriptor == NULL) {
+        fprintf(stderr, "Failed to create the output image '%s'\n", destination_file_name);
+        goto cleanup;
+    }
+
+    image_io_write_image_headers(destination_descriptor, &image, destination_format, &error_message);
+    if (error_message != NULL) {
+        fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", destination_file_name, error_message);
+        goto cleanup;
+    }
+
+    /* Main Image Processing Loop */
+    uint64_t kernel_start_time = timing_start();
+    size_t blended_pixels = 0;
+    {
+        long width = (long) image.absolute_image_width;
+        long height = (long) image.absolute_image_height;
+        long overlay_width = (long) overlay->absolute_image_width;
+        long overlay_height = (long) overlay->absolute_image_height;
+
+        long first_x = UTILS_MAX(overlay_x, 0);
+        long first_y = UTILS_MAX(overlay_y, 0);
+        long last_x = UTILS_MIN(overlay_x + overlay_width, width);
+        long last_y = UTILS_MIN(overlay_y + overlay_height, height);
+
+        /* An overlay outside of the image leaves it unchanged */
+        if (last_x <= first_x || last_y <= first_y) {
+            first_x = last_x = first_y = last_y = 0;
+        }
+
+        /* `y` counts from the top, the rows of bottom-up images are stored
+           from the bottom */
+        bool top_down = bmp_is_top_down(&image);
+        for (long y = first_y; y < last_y; ++y) {
+            size_t row = (size_t) (top_down ? y : height - 1 - y);
+            blend_row(
+                image.pixels + (row * (size_t) width + (size_t) first_x) * 4,
+                overlay->pixels + ((size_t) (y - overlay_y) * (size_t) overlay_width + (size_t) (first_x - overlay_x)) * 4,
+                (size_t) (last_x - first_x),
+                mode,
+                premultiplied
+            );
+        }
+
+        blended_pixels = (size_t) ((last_x - first_x) * (last_y - first_y));
+    }
+
+    timing_stop(TIMING_STAGE_KERNEL, kernel_start_time, blended_pixels * 4, blended_pixels);
+
+    image_io_write_image_data(destination_descriptor, &image, destination_format, &error_message);
+    if (error_message != NULL) {
+        fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", destination_file_name, error_message);
+        goto cleanup;
+    }
+
+    timing_finish_image(destination_file_name);
+
+    result = true;
+
+cleanup:
+    /* The stages of a failed image do not count towards the next one */
+    timing_take_image(NULL);
+
+    bmp_free_image_structure(&image);
+
+    if (source_descriptor != NULL) {
+        fclose(source_descriptor);
+        source_descriptor = NULL;
+    }
+
+    if (destination_descriptor != NULL) {
+        fclose(destination_descriptor);
+        destination_descriptor = NULL;
+    }
+
+    return result;
+}
+
+int main(int argc, char *argv[])
+{
+    int result = EXIT_FAILURE;
+
+    bool premultiplied = argc > 1 && 0 == strcmp(argv[1], "--premultiplied");
+    if (premultiplied) {
+        --argc;
+        ++argv;
+    }
+
+    if (argc < 7 || 0 != (argc - 5) % 2) {
+        fprintf(
+            stderr,
+            "Usage: %s [--premultiplied] <over|multiply|screen|overlay> <x> <y> <overlay file> "
+            "<source file> <dest. file> [<source file> <dest. file>...]\n",
+            argv[0]
+        );
+        return result;
+    }
+
+    blend_mode_t mode;
+    if (!blend_parse_mode(argv[1], &mode)) {
+        fprintf(stderr, "Unknown blend mode '%s'\n", argv[1]);
+        return result;
+    }
+
+    long overlay_x = strtol(argv[2], NULL, 10);
+    long overlay_y = strtol(argv[3], NULL, 10);
+
+    char *overlay_file_name = argv[4];
+    FILE *overlay_descriptor = NULL;
+
+    bmp_image overlay; bmp_init_image_structure(&overlay);
+    image_format overlay_format = IMAGE_FORMAT_BMP;
+
+    overlay_descriptor = fopen(overlay_file_name, "r");
+    if (overlay_descriptor == NULL) {
+        fprintf(stderr, "Failed to open the overlay image file '%s'\n", overlay_file_name);
+        goto cleanup;
+    }
+
+    const char *error_message;
+    image_io_open_image_headers(overlay_descriptor, &overlay, &overlay_format, &error_message);
+    if (error_message != NULL) {
+        fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", overlay_file_name, error_message);
+        goto cleanup;
+    }
+
+    /* The overlay is never written, so it is loaded top-down like the
+       overlay position counts its rows */
+    image_io_read_image_data_oriented(overlay_descriptor, &overlay, overlay_format, BMP_ORIENTATION_TOP_DOWN, &error_message);
+    if (error_message != NULL) {
+        fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", overlay_file_name, error_message);
+        goto cleanup;
+    }
+
+    /* The overlay is decoded and premultiplied once for the whole batch. */
+    if (!premultiplied) {
+        uint64_t kernel_start_time = timing_start();
+
+        blend_premultiply(overlay.pixels, overlay.absolute_image_width * overlay.absolute_image_height);
+
+        timing_stop(
+            TIMING_STAGE_KERNEL,
+            kernel_start_time,
+            overlay.absolute_image_width * overlay.absolute_image_height * 4,
+            overlay.absolute_image_width * overlay.absolute_image_height
+        );
+    }
+    timing_finish_image(overlay_file_name);
+
+    result = EXIT_SUCCESS;
+    for (int i = 5; i + 1 < argc; i += 2) {
+        if (!blend_image_file(argv[i], argv[i + 1], &overlay, overlay_x, overlay_y, mode, premultiplied)) {
+            result = EXIT_FAILURE;
+        }
+    }
+
+cleanup:
+    bmp_free_image_structure(&overlay);
+
+    if (overlay_descriptor != NULL) {
+        fclose(overlay_descriptor);
+        overlay_descriptor = NULL;
+    }
+
+    return result;
+}
@@ -0,0 +1,251 @@
+#ifndef BLEND_H
+#define BLEND_H
+
+#include "bmp.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined SIMD_INTRINSICS_IMPLEMENTATION || defined SIMD_ASM_IMPLEMENTATION
+#include <immintrin.h>
+#endif
+
+/*
+    Compositing of a BGRA source (the overlay) onto a BGRA destination. All
+    modes are evaluated on premultiplied colors; images with straight alpha
+    are premultiplied on the fly and divided back afterwards. Products of two
+    8-bit values are divided by 255 with exact rounding:
+
+        x * y / 255 = (t + (t >> 8)) >> 8, where t = x * y + 128
+*/
+
+typedef enum _blend_mode
+{
+    BLEND_MODE_OVER,
+    BLEND_MODE_MULTIPLY,
+    BLEND_MODE_SCREEN,
+    BLEND_MODE_OVERLAY
+} blend_mode_t;
+
+static inline bool blend_parse_mode(const char *name, blend_mode_t *mode)
+{
+    if (0 == strcmp(name, "over")) {
+        *mode = BLEND_MODE_OVER;
+    } else if (0 == strcmp(name, "multiply")) {
+        *mode = BLEND_MODE_MULTIPLY;
+    } else if (0 == strcmp(name, "screen")) {
+        *mode = BLEND_MODE_SCREEN;
+    } else if (0 == strcmp(name, "overlay")) {
+        *mode = BLEND_MODE_OVERLAY;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+static inline uint32_t blend_multiply_255(uint32_t x, uint32_t y)
+{
+    uint32_t t = x * y + 128;
+
+    return (t + (t >> 8)) >> 8;
+}
+
+/* Blends one premultiplied channel `d` of the destination with `s` of the
+   source, `da` and `sa` are the alpha values of the two pixels. */
+static inline uint32_t _blend_channel(blend_mode_t mode, uint32_t d, uint32_t s, uint32_t da, uint32_t sa, bool alpha)
+{
+    uint32_t result = 0;
+
+    switch (mode) {
+        case BLEND_MODE_OVER:
+            result = s + blend_multiply_255(d, 255 - sa);
+            break;
+        case BLEND_MODE_SCREEN:
+            result = s + d - blend_multiply_255(s, d);
+            break;
+        case BLEND_MODE_MULTIPLY:
+        case BLEND_MODE_OVERLAY:
+            if (alpha) {
+                result = s + blend_multiply_255(d, 255 - sa);
+                break;
+            }
+
+            result = blend_multiply_255(s, 255 - da) + blend_multiply_255(d, 255 - sa);
+            if (BLEND_MODE_MULTIPLY == mode) {
+                result += blend_multiply_255(s, d);
+            } else if (2 * d <= da) {
+                result += 2 * blend_multiply_255(s, d);
+            } else {
+                uint32_t term = 2 * blend_multiply_255(da > d ? da - d : 0, sa > s ? sa - s : 0);
+                uint32_t both = blend_multiply_255(sa, da);
+                result += both > term ? both - term : 0;
+            }
+            break;
+    }
+
+    return UTILS_MIN(result, 255);
+}
+
+/* Converts straight alpha colors of `count` pixels to premultiplied ones. */
+static inline void blend_premultiply(uint8_t *pixels, size_t count)
+{
+    for (size_t i = 0; i < count; ++i, pixels += 4) {
+        uint32_t alpha = pixels[3];
+        if (255 != alpha) {
+            pixels[0] = (uint8_t) blend_multiply_255(pixels[0], alpha);
+            pixels[1] = (uint8_t) blend_multiply_255(pixels[1], alpha);
+            pixels[2] = (uint8_t) blend_multiply_255(pixels[2], alpha);
+        }
+    }
+}
+
+/* Converts premultiplied colors of `count` pixels back to straight alpha. */
+static inline void blend_unpremultiply(uint8_t *pixels, size_t count)
+{
+    for (size_t i = 0; i < count; ++i, pixels += 4) {
+        uint32_t alpha = pixels[3];
+        if (255 != alpha) {
+            for (size_t channel = 0; channel < 3; ++channel) {
+                pixels[channel] =
+                    0 == alpha ?
+                        0 :
+                        (uint8_t) UTILS_MIN((pixels[channel] * 255 + alpha / 2) / alpha, 255);
+            }
+        }
+    }
+}
+
+#if (defined SIMD_INTRINSICS_IMPLEMENTATION || defined SIMD_ASM_IMPLEMENTATION) && \
+    defined __AVX512BW__
+
+static inline __m512i _blend_multiply_255_epu16(__m512i x, __m512i y)
+{
+    __m512i t = _mm512_add_epi16(_mm512_mullo_epi16(x, y), _mm512_set1_epi16(128));
+
+    /* (t + (t >> 8)) >> 8 == (t * 257) >> 16 for 16-bit t */
+    return _mm512_mulhi_epu16(t, _mm512_set1_epi16(257));
+}
+
+/* Copies the alpha word of every pixel into its four 16-bit channels. */
+static inline __m512i _blend_broadcast_alpha_epu16(__m512i pixels)
+{
+    const __m512i pattern =
+        _mm512_broadcast_i32x4(_mm_set_epi8(15, 14, 15, 14, 15, 14, 15, 14, 7, 6, 7, 6, 7, 6, 7, 6));
+
+    return _mm512_shuffle_epi8(pixels, pattern);
+}
+
+#endif
+
+/*
+    Blends `count` pixels of the row `overlay` onto the row `destination`.
+    With `premultiplied` both rows already hold premultiplied colors, otherwise
+    the destination holds straight alpha and the overlay must have been
+    premultiplied with `blend_premultiply` (once, so it can be reused).
+*/
+static void blend_row(
+                uint8_t *destination,
+                const uint8_t *overlay,
+                size_t count,
+                blend_mode_t mode,
+                bool premultiplied
+            )
+{
+    size_t x = 0;
+
+#if (defined SIMD_INTRINSICS_IMPLEMENTATION || defined SIMD_ASM_IMPLEMENTATION) && \
+    defined __AVX512BW__
+    const __m512i maximum = _mm512_set1_epi16(255);
+    const __mmask32 alpha_lanes = 0x88888888;
+
+    /* 8 pixels per step, one 16-bit lane per channel */
+    for (; x + 8 <= count; x += 8) {
+        __m512i d = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i *) &destination[x * 4]));
+        __m512i s = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i *) &overlay[x * 4]));
+
+        __m512i da = _blend_broadcast_alpha_epu16(d);
+        __m512i sa = _blend_broadcast_alpha_epu16(s);
+        __m512i inverse_sa = _mm512_sub_epi16(maximum, sa);
+
+        if (!premultiplied) {
+            d = _mm512_mask_mov_epi16(_blend_multiply_255_epu16(d, da), alpha_lanes, d);
+        }
+
+        /* Source over destination, which is also the alpha of every mode */
+        __m512i over = _mm512_add_epi16(s, _blend_multiply_255_epu16(d, inverse_sa));
+        __m512i result = over;
+
+        switch (mode) {
+            case BLEND_MODE_OVER:
+                break;
+            case BLEND_MODE_SCREEN:
+                result = _mm512_sub_epi16(_mm512_add_epi16(s, d), _blend_multiply_255_epu16(s, d));
+                break;
+            case BLEND_MODE_MULTIPLY:
+            case BLEND_MODE_OVERLAY: {
+                __m512i inverse_da = _mm512_sub_epi16(maximum, da);
+                __m512i product = _blend_multiply_255_epu16(s, d);
+                __m512i term;
+
+                if (BLEND_MODE_MULTIPLY == mode) {
+                    term = product;
+                } else {
+                    __mmask32 dark = _mm512_cmple_epu16_mask(_mm512_add_epi16(d, d), da);
+                    __m512i light =
+                        _mm512_subs_epu16(
+                            _blend_multiply_255_epu16(sa, da),
+                            _mm512_slli_epi16(
+                                _blend_multiply_255_epu16(_mm512_subs_epu16(da, d), _mm512_subs_epu16(sa, s)),
+                                1
+                            )
+                        );
+                    term = _mm512_mask_mov_epi16(light, dark, _mm512_slli_epi16(product, 1));
+                }
+
+                result =
+                    _mm512_add_epi16(
+                        _mm512_add_epi16(
+                            _blend_multiply_255_epu16(s, inverse_da),
+                            _blend_multiply_255_epu16(d, inverse_sa)
+                        ),
+                        term
+                    );
+                result = _mm512_mask_mov_epi16(result, alpha_lanes, over);
+                break;
+            }
+        }
+
+        result = _mm512_min_epu16(result, maximum);
+        _mm256_storeu_si256((__m256i *) &destination[x * 4], _mm512_cvtepi16_epi8(result));
+    }
+#endif
+
+    for (; x < count; ++x) {
+        uint8_t *d = &destination[x * 4];
+        const uint8_t *s = &overlay[x * 4];
+
+        uint32_t da = d[3], sa = s[3];
+        uint32_t channels[4];
+        for (size_t channel = 0; channel < 4; ++channel) {
+            uint32_t value = d[channel];
+            if (!premultiplied && channel < 3) {
+                value = blend_multiply_255(value, da);
+            }
+
+            channels[channel] = _blend_channel(mode, value, s[channel], da, sa, 3 == channel);
+        }
+
+        for (size_t channel = 0; channel < 4; ++channel) {
+            d[channel] = (uint8_t) channels[channel];
+        }
+    }
+
+    if (!premultiplied) {
+        blend_unpremultiply(destination, count);
+    }
+}
+
+#endif // BLEND_H
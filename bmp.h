@@ -1,6 +1,7 @@
 #ifndef BMP_H
 #define BMP_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -8,6 +9,9 @@
 #include <string.h>
 #include <sys/types.h>
 
+#include "buffer_pool.h"
+#include "timing.h"
+
 #define UTILS_MIN(A,B) (((A)<(B))?(A):(B))
 #define UTILS_MAX(A,B) (((A)>(B))?(A):(B))
 #define UTILS_CLAMP(X,MIN,MAX) (UTILS_MIN(UTILS_MAX((X),(MIN)),(MAX)))
@@ -24,7 +28,13 @@ static const char *BMP_Error_Invalid_File_Descriptor =
                   *BMP_Error_Invalid_Dib_Header_Size =
                     "Invalid DIB header size",
                   *BMP_Error_Unsupported_Color_Depth =
-                    "Invalid color depth (not 24 or 32 bits per pixel)",
+                    "Invalid color depth (not 1, 4, 8, 16, 24 or 32 bits per pixel)",
+                  *BMP_Error_Unsupported_Compression =
+                    "Unsupported compression method",
+                  *BMP_Error_Failed_to_Read_Color_Masks =
+                    "Failed to read the color masks",
+                  *BMP_Error_Invalid_Color_Masks =
+                    "Invalid color masks",
                   *BMP_Error_Invalid_Size_Information =
                     "The bitmap image containes invalid size information",
 
@@ -38,6 +48,14 @@ static const char *BMP_Error_Invalid_File_Descriptor =
                     "Invalid pixel offset or DIB header size",
                   *BMP_Error_Failed_to_Calculate_Padding =
                     "Failed to calculate padding information",
+                  *BMP_Error_Invalid_Image_Dimensions =
+                    "Invalid image dimensions",
+                  *BMP_Error_Invalid_Color_Table =
+                    "Invalid color table",
+                  *BMP_Error_Invalid_Compressed_Data =
+                    "Invalid compressed image data",
+                  *BMP_Error_Compressed_Image_Too_Large =
+                    "The compressed image expands to too many pixels",
 
                   *BMP_Error_Failed_to_Write_File_Header =
                     "Failed to write the bitmap file header",
@@ -50,6 +68,24 @@ static const char *BMP_Error_Invalid_File_Descriptor =
 static const int BMP_First_Magic_Byte  = 0x42,
                  BMP_Second_Magic_Byte = 0x4D;
 
+typedef enum _bmp_compression
+{
+    BMP_COMPRESSION_RGB            = 0,
+    BMP_COMPRESSION_RLE8           = 1,
+    BMP_COMPRESSION_RLE4           = 2,
+    BMP_COMPRESSION_BITFIELDS      = 3,
+    BMP_COMPRESSION_ALPHABITFIELDS = 6
+} bmp_compression;
+
+typedef enum _bmp_color_mask
+{
+    BMP_RED_MASK,
+    BMP_GREEN_MASK,
+    BMP_BLUE_MASK,
+    BMP_ALPHA_MASK,
+    BMP_COLOR_MASK_COUNT
+} bmp_color_mask;
+
 struct _bmp_file_header
 {
     uint8_t  signature[2];
@@ -96,6 +132,9 @@ typedef struct _bmp_image
     size_t image_size;              /* the total size of the image part in bytes                                     */
     size_t aligned_image_size;      /* the total size of the aligned image part without padding                      */
     size_t channels;                /* channel count (3 for 24-bit images, 4 for 32-bit images with an alpha channel */
+
+    uint32_t color_masks[BMP_COLOR_MASK_COUNT]; /* masks of 16-bit and BI_BITFIELDS images                           */
+    size_t color_masks_size;        /* size of the masks stored after a BITMAPINFOHEADER (not part of the payload)   */
 } bmp_image;
 
 static inline void bmp_init_image_structure(bmp_image *image)
@@ -105,15 +144,75 @@ static inline void bmp_init_image_structure(bmp_image *image)
     }
 }
 
+/*
+    The payloads and the pixel arrays are allocated through `BMP_Allocator`.
+    By default they come from `BMP_Buffer_Pool`, which backs them with huge
+    pages and recycles them for the next image (see buffer_pool.h). A tool
+    can replace the allocator with its own, `allocate` has to return memory
+    aligned on a 64-byte boundary.
+*/
+typedef struct _bmp_allocator
+{
+    void *(*allocate)(size_t size, void *context);
+    void (*deallocate)(void *memory, size_t size, void *context);
+    void *context;
+} bmp_allocator;
+
+static bmp_allocator BMP_Allocator = { NULL, NULL, NULL };
+
+static buffer_pool_t BMP_Buffer_Pool = BUFFER_POOL_INITIALIZER;
+
+static inline void bmp_set_allocator(
+                       void *(*allocate)(size_t size, void *context),
+                       void (*deallocate)(void *memory, size_t size, void *context),
+                       void *context
+                   )
+{
+    BMP_Allocator.allocate = allocate;
+    BMP_Allocator.deallocate = deallocate;
+    BMP_Allocator.context = context;
+}
+
+static inline uint8_t *bmp_allocate_buffer(size_t size)
+{
+    return
+        NULL != BMP_Allocator.allocate ?
+            (uint8_t *) BMP_Allocator.allocate(size, BMP_Allocator.context) :
+            (uint8_t *) buffer_pool_get(&BMP_Buffer_Pool, size);
+}
+
+static inline void bmp_free_buffer(uint8_t *buffer, size_t size)
+{
+    if (NULL != BMP_Allocator.deallocate) {
+        BMP_Allocator.deallocate(buffer, size, BMP_Allocator.context);
+    } else {
+        buffer_pool_put(&BMP_Buffer_Pool, buffer, size);
+    }
+}
+
+static inline uint8_t *bmp_allocate_aligned_pixels(size_t image_size, size_t *aligned_image_size)
+{
+    size_t alignment = 64;
+    size_t size = (((image_size - 1) / alignment) + 1) * alignment;
+    size += alignment;
+
+    uint8_t *pixels = bmp_allocate_buffer(size);
+    if (NULL != pixels && NULL != aligned_image_size) {
+        *aligned_image_size = size;
+    }
+
+    return pixels;
+}
+
 static inline void bmp_free_image_structure(bmp_image *image)
 {
     if (NULL != image) {
         if (NULL != image->payload) {
-            free(image->payload);
+            bmp_free_buffer(image->payload, image->payload_size);
             image->payload = NULL;
         }
         if (NULL != image->pixels) {
-            free(image->pixels);
+            bmp_free_buffer(image->pixels, image->aligned_image_size);
             image->pixels = NULL;
         }
     }
@@ -143,6 +242,8 @@ static void bmp_open_image_headers(
         goto end;
     }
 
+    uint64_t start_time = timing_start();
+
     size_t bmp_header_size =
         sizeof(image->file_header);
     size_t dib_header_size =
@@ -198,17 +299,82 @@ static void bmp_open_image_headers(
         }
     }
 
-    if (24 != image->dib_header.bits_per_pixel &&
-        32 != image->dib_header.bits_per_pixel) {
+    uint16_t bits_per_pixel = image->dib_header.bits_per_pixel;
+    if (1  != bits_per_pixel && 4  != bits_per_pixel && 8  != bits_per_pixel &&
+        16 != bits_per_pixel && 24 != bits_per_pixel && 32 != bits_per_pixel) {
         if (NULL != error_message) {
             *error_message = BMP_Error_Unsupported_Color_Depth;
         }
 
         goto end;
     }
-    image->channels = 24 == image->dib_header.bits_per_pixel ? 3 : 4;
 
-    if (image->file_header.file_size <= total_header_size) {
+    /* Run-length encoded images are always stored bottom-up */
+    uint32_t compression = image->dib_header.compression;
+    bool bitfields =
+        BMP_COMPRESSION_BITFIELDS == compression || BMP_COMPRESSION_ALPHABITFIELDS == compression;
+    if (!(BMP_COMPRESSION_RGB == compression ||
+          (BMP_COMPRESSION_RLE8 == compression && 8 == bits_per_pixel && image->dib_header.image_height > 0) ||
+          (BMP_COMPRESSION_RLE4 == compression && 4 == bits_per_pixel && image->dib_header.image_height > 0) ||
+          (bitfields && (16 == bits_per_pixel || 32 == bits_per_pixel)))) {
+        if (NULL != error_message) {
+            *error_message = BMP_Error_Unsupported_Compression;
+        }
+
+        goto end;
+    }
+
+    /* V2 and later headers hold the masks, a BITMAPINFOHEADER is followed
+       by them. 16-bit images without masks are stored as 5-5-5. */
+    memset(image->color_masks, 0, sizeof(image->color_masks));
+    image->color_masks_size = 0;
+    if (bitfields) {
+        size_t mask_count =
+            BMP_COMPRESSION_ALPHABITFIELDS == compression ? 4 : 3;
+        size_t header_mask_count =
+            dib_header_size + 12 <= image->dib_header.dib_header_size ?
+                UTILS_MIN((image->dib_header.dib_header_size - dib_header_size) / 4, 4) :
+                0;
+
+        if (header_mask_count > 0) {
+            memcpy(image->color_masks, image->rest_of_dib_header, header_mask_count * 4);
+        } else {
+            if (!fread(image->color_masks, mask_count * 4, 1, file_descriptor)) {
+                if (NULL != error_message) {
+                    *error_message = BMP_Error_Failed_to_Read_Color_Masks;
+                }
+
+                goto end;
+            }
+            image->color_masks_size = mask_count * 4;
+        }
+
+        for (size_t i = 0; i < BMP_COLOR_MASK_COUNT; ++i) {
+            uint32_t mask = image->color_masks[i];
+            uint32_t shifted_mask = 0 != mask ? mask >> __builtin_ctz(mask) : 0;
+            bool overlaps = false;
+            for (size_t j = 0; j < i; ++j) {
+                overlaps = overlaps || 0 != (mask & image->color_masks[j]);
+            }
+            if (0 != (shifted_mask & (shifted_mask + 1)) || overlaps ||
+                (16 == bits_per_pixel && mask > UINT16_MAX)) {
+                if (NULL != error_message) {
+                    *error_message = BMP_Error_Invalid_Color_Masks;
+                }
+
+                goto end;
+            }
+        }
+    } else if (16 == bits_per_pixel) {
+        image->color_masks[BMP_RED_MASK]   = 0x7C00;
+        image->color_masks[BMP_GREEN_MASK] = 0x03E0;
+        image->color_masks[BMP_BLUE_MASK]  = 0x001F;
+    }
+
+    image->channels =
+        32 == bits_per_pixel || 0 != image->color_masks[BMP_ALPHA_MASK] ? 4 : 3;
+
+    if (image->file_header.file_size <= total_header_size + image->color_masks_size) {
         if (NULL != error_message) {
             *error_message = BMP_Error_Invalid_Size_Information;
         }
@@ -216,13 +382,553 @@ static void bmp_open_image_headers(
         goto end;
     }
 
+    timing_stop(
+        TIMING_STAGE_HEADERS,
+        start_time,
+        bmp_header_size + image->dib_header.dib_header_size + image->color_masks_size,
+        0
+    );
+
 end:
     return;
 }
 
-static void bmp_read_image_data(
+/* Returns true if the pixel array of the image holds BGR or BGRA pixels
+   that can be used as they are, e.g. filtered in a mapped file. Other
+   images are expanded while they are read. */
+static inline bool bmp_has_plain_pixel_array(const bmp_image *image)
+{
+    uint16_t bits_per_pixel = image->dib_header.bits_per_pixel;
+    uint32_t compression = image->dib_header.compression;
+
+    if (BMP_COMPRESSION_RGB == compression) {
+        return 24 == bits_per_pixel || 32 == bits_per_pixel;
+    }
+
+    return
+        32 == bits_per_pixel &&
+        (BMP_COMPRESSION_BITFIELDS == compression || BMP_COMPRESSION_ALPHABITFIELDS == compression) &&
+        0x00FF0000 == image->color_masks[BMP_RED_MASK] &&
+        0x0000FF00 == image->color_masks[BMP_GREEN_MASK] &&
+        0x000000FF == image->color_masks[BMP_BLUE_MASK] &&
+        (0xFF000000 == image->color_masks[BMP_ALPHA_MASK] || 0 == image->color_masks[BMP_ALPHA_MASK]);
+}
+
+/* Sets up the headers of an uncompressed 24-bit (3 channels) or 32-bit
+   (4 channels) image with a BITMAPINFOHEADER and no gap before the pixel
+   array. */
+static void bmp_init_plain_headers(bmp_image *image, size_t width, size_t height, bool top_down, size_t channels)
+{
+    size_t bmp_header_size =
+        sizeof(image->file_header);
+    size_t dib_header_size =
+        sizeof(image->dib_header);
+    size_t padding =
+        (channels * 8 * width + 31) / 32 * 4 - width * channels;
+    size_t image_size =
+        height * (width * channels + padding);
+
+    memset(&image->file_header, 0, sizeof(image->file_header));
+    image->file_header.signature[0] = (uint8_t) BMP_First_Magic_Byte;
+    image->file_header.signature[1] = (uint8_t) BMP_Second_Magic_Byte;
+    image->file_header.file_size = (uint32_t) (bmp_header_size + dib_header_size + image_size);
+    image->file_header.pixel_array_offset = (uint32_t) (bmp_header_size + dib_header_size);
+
+    memset(&image->dib_header, 0, sizeof(image->dib_header));
+    image->dib_header.dib_header_size = (uint32_t) dib_header_size;
+    image->dib_header.image_width = (int32_t) width;
+    image->dib_header.image_height = top_down ? -(int32_t) height : (int32_t) height;
+    image->dib_header.planes = 1;
+    image->dib_header.bits_per_pixel = (uint16_t) (channels * 8);
+    image->dib_header.compression = BMP_COMPRESSION_RGB;
+    image->dib_header.image_size = (uint32_t) image_size;
+    image->dib_header.x_pixels_per_meter = 2835;    /* 72 DPI */
+    image->dib_header.y_pixels_per_meter = 2835;
+
+    memset(image->color_masks, 0, sizeof(image->color_masks));
+    image->color_masks_size = 0;
+    image->channels = channels;
+}
+
+typedef enum _bmp_orientation
+{
+    BMP_ORIENTATION_AS_STORED,
+    BMP_ORIENTATION_TOP_DOWN,   /* first row of `pixels` is the top of the image    */
+    BMP_ORIENTATION_BOTTOM_UP   /* first row of `pixels` is the bottom of the image */
+} bmp_orientation;
+
+static inline bool bmp_is_top_down(const bmp_image *image)
+{
+    return image->dib_header.image_height < 0;
+}
+
+#define BMP_PALETTE_SIZE 256
+
+/* Reads the color table into BGRA entries that are stored into `pixels`
+   directly. Entries missing from the file are opaque black, so every index
+   of a malformed pixel array still has a color. */
+static bool _bmp_read_palette(
+                const bmp_image *image,
+                size_t first_pixel_index,
+                uint8_t palette[BMP_PALETTE_SIZE][4]
+            )
+{
+    size_t maximum_count =
+        (size_t) 1 << image->dib_header.bits_per_pixel;
+    size_t count =
+        0 != image->dib_header.colors_in_color_table ?
+            UTILS_MIN((size_t) image->dib_header.colors_in_color_table, maximum_count) :
+            maximum_count;
+
+    /* The table lies between the headers and the pixel array */
+    if (count * 4 > first_pixel_index) {
+        return false;
+    }
+
+    for (size_t i = 0; i < BMP_PALETTE_SIZE; ++i) {
+        if (i < count) {
+            memcpy(palette[i], &image->payload[i * 4], 3);
+        } else {
+            memset(palette[i], 0, 3);
+        }
+        palette[i][3] = 255;
+    }
+
+    return true;
+}
+
+/*
+    A two-byte RLE record encodes at most 255 pixels, so an image that has
+    fewer than one byte of data per BMP_RLE_PIXELS_PER_BYTE pixels can only
+    be described by skipping most of it. Such images are accepted up to
+    BMP_MAX_RLE_PIXELS pixels, which the environment variable of the same
+    name can change. Larger ones are rejected before anything is allocated,
+    so a small file cannot claim gigabytes of memory.
+*/
+#define BMP_RLE_PIXELS_PER_BYTE 128
+#define BMP_MAX_RLE_PIXELS ((size_t) 1 << 26)
+
+static bool _bmp_is_rle_size_plausible(size_t data_size, size_t width, size_t height)
+{
+    size_t maximum_pixels = BMP_MAX_RLE_PIXELS;
+
+    const char *maximum = getenv("BMP_MAX_RLE_PIXELS");
+    if (NULL != maximum && '\0' != maximum[0]) {
+        char *end = NULL;
+        unsigned long long value = strtoull(maximum, &end, 10);
+        if ('\0' == *end) {
+            maximum_pixels = (size_t) value;
+        }
+    }
+
+    return width * height <= maximum_pixels ||
+           width * height / BMP_RLE_PIXELS_PER_BYTE <= data_size;
+}
+
+/*
+    Expands BI_RLE8 and BI_RLE4 data. Runs are cut off at the end of a row,
+    a delta or an end of line past the last row ends the image, and pixels
+    the data skips keep the first palette color. Returns false if a record
+    is truncated.
+*/
+static bool _bmp_expand_rle(
+                const uint8_t *data,
+                size_t data_size,
+                bool rle4,
+                const uint8_t palette[BMP_PALETTE_SIZE][4],
+                uint8_t *pixels,
+                size_t width,
+                size_t height,
+                bool flip
+            )
+{
+    for (size_t position = 0; position < width * height * 4; position += 4) {
+        memcpy(&pixels[position], palette[0], 4);
+    }
+
+    size_t x = 0, y = 0;
+    uint8_t *row = pixels + (flip ? height - 1 : 0) * width * 4;
+
+    size_t position = 0;
+    while (y < height && position + 2 <= data_size) {
+        size_t count = data[position];
+        uint8_t value = data[position + 1];
+        position += 2;
+
+        if (count > 0) {
+            /* Encoded mode: `count` pixels of one index, or two alternating
+               indices in RLE4 */
+            size_t end = x + UTILS_MIN(count, width - x);
+            for (size_t i = 0; x < end; ++x, ++i) {
+                uint8_t index = rle4 ? (0 == (i & 1) ? value >> 4 : value & 0x0F) : value;
+                memcpy(&row[x * 4], palette[index], 4);
+            }
+        } else if (0 == value) {
+            /* End of line */
+            x = 0;
+            ++y;
+            row = y < height ? pixels + (flip ? height - 1 - y : y) * width * 4 : NULL;
+        } else if (1 == value) {
+            /* End of bitmap */
+            break;
+        } else if (2 == value) {
+            /* Delta */
+            if (position + 2 > data_size) {
+                return false;
+            }
+            x = UTILS_MIN(x + data[position], width);
+            y += data[position + 1];
+            row = y < height ? pixels + (flip ? height - 1 - y : y) * width * 4 : NULL;
+            position += 2;
+        } else {
+            /* Absolute mode: `value` indices padded to a 16-bit boundary */
+            size_t size = rle4 ? ((size_t) value + 1) / 2 : value;
+            if (position + size > data_size) {
+                return false;
+            }
+
+            const uint8_t *indices = &data[position];
+            size_t end = x + UTILS_MIN((size_t) value, width - x);
+            for (size_t i = 0; x < end; ++x, ++i) {
+                uint8_t index = rle4 ? (0 == (i & 1) ? indices[i / 2] >> 4 : indices[i / 2] & 0x0F) : indices[i];
+                memcpy(&row[x * 4], palette[index], 4);
+            }
+
+            position += (size + 1) & ~(size_t) 1;
+        }
+    }
+
+    return true;
+}
+
+static void _bmp_expand_indexed_rows(
+                const uint8_t *data,
+                size_t stride,
+                size_t bits_per_pixel,
+                const uint8_t palette[BMP_PALETTE_SIZE][4],
+                uint8_t *pixels,
+                size_t width,
+                size_t height,
+                bool flip
+            )
+{
+    for (size_t y = 0; y < height; ++y) {
+        const uint8_t *source = data + y * stride;
+        uint8_t *destination = pixels + (flip ? height - 1 - y : y) * width * 4;
+
+        if (8 == bits_per_pixel) {
+            for (size_t x = 0; x < width; ++x) {
+                memcpy(&destination[x * 4], palette[source[x]], 4);
+            }
+        } else if (4 == bits_per_pixel) {
+            for (size_t x = 0; x < width; ++x) {
+                uint8_t index = (source[x / 2] >> (0 == (x & 1) ? 4 : 0)) & 0x0F;
+                memcpy(&destination[x * 4], palette[index], 4);
+            }
+        } else {
+            for (size_t x = 0; x < width; ++x) {
+                uint8_t index = (source[x / 8] >> (7 - (x & 7))) & 0x01;
+                memcpy(&destination[x * 4], palette[index], 4);
+            }
+        }
+    }
+}
+
+/* Extracts one channel from a pixel of a bit field image: the bits are
+   shifted down to at most 8 and scaled to the full 8-bit range through a
+   table. */
+typedef struct _bmp_channel_decoder
+{
+    uint32_t shift;
+    uint32_t mask;
+    uint8_t values[256];
+} bmp_channel_decoder;
+
+static void _bmp_init_channel_decoder(bmp_channel_decoder *decoder, uint32_t mask, uint8_t missing_value)
+{
+    if (0 == mask) {
+        decoder->shift = 0;
+        decoder->mask = 0;
+        decoder->values[0] = missing_value;
+
+        return;
+    }
+
+    uint32_t shift = (uint32_t) __builtin_ctz(mask);
+    uint32_t bits = (uint32_t) __builtin_popcount(mask);
+    if (bits > 8) {
+        shift += bits - 8;
+        bits = 8;
+    }
+
+    decoder->shift = shift;
+    decoder->mask = (1u << bits) - 1;
+    for (uint32_t value = 0; value <= decoder->mask; ++value) {
+        decoder->values[value] = (uint8_t) ((value * 255 + decoder->mask / 2) / decoder->mask);
+    }
+}
+
+static inline uint32_t _bmp_decode_bitfield_pixel(const bmp_channel_decoder decoders[BMP_COLOR_MASK_COUNT], uint32_t value)
+{
+    return
+        (uint32_t) decoders[BMP_BLUE_MASK].values[(value >> decoders[BMP_BLUE_MASK].shift) & decoders[BMP_BLUE_MASK].mask] |
+        (uint32_t) decoders[BMP_GREEN_MASK].values[(value >> decoders[BMP_GREEN_MASK].shift) & decoders[BMP_GREEN_MASK].mask] << 8 |
+        (uint32_t) decoders[BMP_RED_MASK].values[(value >> decoders[BMP_RED_MASK].shift) & decoders[BMP_RED_MASK].mask] << 16 |
+        (uint32_t) decoders[BMP_ALPHA_MASK].values[(value >> decoders[BMP_ALPHA_MASK].shift) & decoders[BMP_ALPHA_MASK].mask] << 24;
+}
+
+/* Returns false if there is not enough memory for the lookup table of
+   16-bit pixels. */
+static bool _bmp_expand_bitfield_rows(
+                const bmp_image *image,
+                const uint8_t *data,
+                size_t stride,
+                uint8_t *pixels,
+                size_t width,
+                size_t height,
+                bool flip
+            )
+{
+    bmp_channel_decoder decoders[BMP_COLOR_MASK_COUNT];
+    for (size_t i = 0; i < BMP_COLOR_MASK_COUNT; ++i) {
+        _bmp_init_channel_decoder(&decoders[i], image->color_masks[i], BMP_ALPHA_MASK == i ? 255 : 0);
+    }
+
+    if (16 == image->dib_header.bits_per_pixel) {
+        /* Every 16-bit value is decoded once into a table of BGRA pixels */
+        uint32_t *table = (uint32_t *) malloc(sizeof(*table) * (UINT16_MAX + 1));
+        if (NULL == table) {
+            return false;
+        }
+        for (uint32_t value = 0; value <= UINT16_MAX; ++value) {
+            table[value] = _bmp_decode_bitfield_pixel(decoders, value);
+        }
+
+        for (size_t y = 0; y < height; ++y) {
+            const uint8_t *source = data + y * stride;
+            uint8_t *destination = pixels + (flip ? height - 1 - y : y) * width * 4;
+
+            for (size_t x = 0; x < width; ++x) {
+                uint16_t value;
+                memcpy(&value, &source[x * 2], 2);
+                memcpy(&destination[x * 4], &table[value], 4);
+            }
+        }
+
+        free(table);
+
+        return true;
+    }
+
+    /* Channels of 8 and more bits need no scaling and are extracted with
+       shifts alone */
+    bool scaled = false;
+    for (size_t i = 0; i < BMP_COLOR_MASK_COUNT; ++i) {
+        scaled = scaled || (0 != decoders[i].mask && 0xFF != decoders[i].mask);
+    }
+    uint32_t blue_shift  = decoders[BMP_BLUE_MASK].shift,  blue_mask  = decoders[BMP_BLUE_MASK].mask;
+    uint32_t green_shift = decoders[BMP_GREEN_MASK].shift, green_mask = decoders[BMP_GREEN_MASK].mask;
+    uint32_t red_shift   = decoders[BMP_RED_MASK].shift,   red_mask   = decoders[BMP_RED_MASK].mask;
+    uint32_t alpha_shift = decoders[BMP_ALPHA_MASK].shift, alpha_mask = decoders[BMP_ALPHA_MASK].mask;
+    uint32_t missing_alpha = 0 == alpha_mask ? 0xFF000000 : 0;
+
+    for (size_t y = 0; y < height; ++y) {
+        const uint8_t *source = data + y * stride;
+        uint8_t *destination = pixels + (flip ? height - 1 - y : y) * width * 4;
+
+        if (scaled) {
+            for (size_t x = 0; x < width; ++x) {
+                uint32_t value;
+                memcpy(&value, &source[x * 4], 4);
+                uint32_t pixel = _bmp_decode_bitfield_pixel(decoders, value);
+                memcpy(&destination[x * 4], &pixel, 4);
+            }
+        } else {
+            for (size_t x = 0; x < width; ++x) {
+                uint32_t value;
+                memcpy(&value, &source[x * 4], 4);
+                uint32_t pixel =
+                    ((value >> blue_shift)  & blue_mask)         |
+                    ((value >> green_shift) & green_mask) << 8   |
+                    ((value >> red_shift)   & red_mask)   << 16  |
+                    ((value >> alpha_shift) & alpha_mask) << 24  |
+                    missing_alpha;
+                memcpy(&destination[x * 4], &pixel, 4);
+            }
+        }
+    }
+
+    return true;
+}
+
+/*
+    Expands a palette, run-length encoded or bit field pixel array into BGRA
+    `pixels`. The image becomes an uncompressed 24-bit image, or a 32-bit one
+    if it has an alpha channel, and is written back in that form. Every read
+    is checked against the payload, so malformed files fail with an error.
+*/
+static void _bmp_expand_pixel_array(
+                bmp_image *image,
+                size_t first_pixel_index,
+                size_t width,
+                size_t height,
+                bmp_orientation orientation,
+                const char **error_message
+            )
+{
+    *error_message = NULL;
+
+    const uint8_t *data =
+        image->raw_pixels;
+    size_t data_size =
+        image->payload_size - first_pixel_index;
+    size_t bits_per_pixel =
+        image->dib_header.bits_per_pixel;
+    uint32_t compression =
+        image->dib_header.compression;
+    bool run_length_encoded =
+        BMP_COMPRESSION_RLE8 == compression || BMP_COMPRESSION_RLE4 == compression;
+    size_t channels =
+        image->channels;
+
+    /* The expanded image has to fit into the size fields of the headers */
+    size_t total_header_size =
+        sizeof(image->file_header) + sizeof(image->dib_header);
+    size_t padding =
+        (channels * 8 * width + 31) / 32 * 4 - width * channels;
+    if (0 == width || 0 == height ||
+        width * channels + padding > (UINT32_MAX - total_header_size) / height) {
+        if (NULL != error_message) {
+            *error_message = BMP_Error_Invalid_Image_Dimensions;
+        }
+
+        return;
+    }
+
+    size_t stride = (bits_per_pixel * width + 31) / 32 * 4;
+    if (!run_length_encoded && height > data_size / stride) {
+        if (NULL != error_message) {
+            *error_message = BMP_Error_Failed_to_Calculate_Padding;
+        }
+
+        return;
+    }
+
+    if (run_length_encoded && !_bmp_is_rle_size_plausible(data_size, width, height)) {
+        if (NULL != error_message) {
+            *error_message = BMP_Error_Compressed_Image_Too_Large;
+        }
+
+        return;
+    }
+
+    uint8_t palette[BMP_PALETTE_SIZE][4];
+    if (bits_per_pixel <= 8 && !_bmp_read_palette(image, first_pixel_index, palette)) {
+        if (NULL != error_message) {
+            *error_message = BMP_Error_Invalid_Color_Table;
+        }
+
+        return;
+    }
+
+    size_t extended_to_4_image_size =
+        height * (width * 4 + padding);
+
+    image->pixels = bmp_allocate_aligned_pixels(extended_to_4_image_size, &image->aligned_image_size);
+    if (NULL == image->pixels) {
+        if (NULL != error_message) {
+            *error_message = BMP_Error_Not_Enough_Memory_to_Read;
+        }
+
+        return;
+    }
+
+    uint64_t start_time = timing_start();
+
+    bool flip =
+        (BMP_ORIENTATION_TOP_DOWN == orientation && !bmp_is_top_down(image)) ||
+        (BMP_ORIENTATION_BOTTOM_UP == orientation && bmp_is_top_down(image));
+    if (flip) {
+        image->dib_header.image_height = -image->dib_header.image_height;
+    }
+
+    if (run_length_encoded) {
+        bool rle4 = BMP_COMPRESSION_RLE4 == compression;
+        if (!_bmp_expand_rle(data, data_size, rle4, palette, image->pixels, width, height, flip)) {
+            if (NULL != error_message) {
+                *error_message = BMP_Error_Invalid_Compressed_Data;
+            }
+
+            return;
+        }
+    } else if (bits_per_pixel <= 8) {
+        _bmp_expand_indexed_rows(data, stride, bits_per_pixel, palette, image->pixels, width, height, flip);
+    } else {
+        if (!_bmp_expand_bitfield_rows(image, data, stride, image->pixels, width, height, flip)) {
+            if (NULL != error_message) {
+                *error_message = BMP_Error_Not_Enough_Memory_to_Read;
+            }
+
+            return;
+        }
+    }
+
+    for (size_t linear_position = height * width * 4; linear_position < image->aligned_image_size; ++linear_position) {
+        image->pixels[linear_position] = 0;
+    }
+
+    /* The payload of the uncompressed image replaces the read one, which
+       is reused when it is large enough */
+    size_t image_size = height * (width * channels + padding);
+    uint8_t *payload = image->payload;
+    if (image->payload_size < image_size) {
+        payload = bmp_allocate_buffer(image_size);
+        if (NULL == payload) {
+            if (NULL != error_message) {
+                *error_message = BMP_Error_Not_Enough_Memory_to_Read;
+            }
+
+            return;
+        }
+
+        bmp_free_buffer(image->payload, image->payload_size);
+        image->payload = payload;
+        image->payload_size = image_size;
+    }
+    image->raw_pixels = payload;
+
+    for (size_t y = 0; y < height && 0 != padding; ++y) {
+        memset(&payload[y * (width * channels + padding) + width * channels], 0, padding);
+    }
+
+    int32_t x_pixels_per_meter = image->dib_header.x_pixels_per_meter;
+    int32_t y_pixels_per_meter = image->dib_header.y_pixels_per_meter;
+    bmp_init_plain_headers(image, width, height, bmp_is_top_down(image), channels);
+    image->dib_header.x_pixels_per_meter = x_pixels_per_meter;
+    image->dib_header.y_pixels_per_meter = y_pixels_per_meter;
+
+    image->absolute_image_width  =
+        width;
+    image->absolute_image_height =
+        height;
+    image->pixel_row_padding =
+        padding;
+    image->image_size =
+        image_size;
+
+    timing_stop(TIMING_STAGE_UNPACK, start_time, data_size, width * height);
+}
+
+/*
+    Reads the pixel data and reorders the rows of `pixels` to the requested
+    orientation while they are copied out of the payload. The sign of
+    `dib_header.image_height` is updated to match, so the image is written
+    back in the new orientation.
+*/
+static void bmp_read_image_data_oriented(
                 FILE *file_descriptor,
                 bmp_image *image,
+                bmp_orientation orientation,
                 const char **error_message
             )
 {
@@ -252,10 +958,10 @@ static void bmp_read_image_data(
         bmp_header_size + dib_header_size;
 
     size_t payload_size =
-        ((size_t) image->file_header.file_size) - total_header_size;
+        ((size_t) image->file_header.file_size) - total_header_size - image->color_masks_size;
 
     image->payload_size = payload_size;
-    image->payload = (uint8_t *) malloc(payload_size);
+    image->payload = bmp_allocate_buffer(payload_size);
     if (NULL == image->payload) {
         if (NULL != error_message) {
             *error_message = BMP_Error_Not_Enough_Memory_to_Read;
@@ -264,6 +970,8 @@ static void bmp_read_image_data(
         goto end;
     }
 
+    uint64_t start_time = timing_start();
+
     if (!fread(image->payload, payload_size, 1, file_descriptor)) {
         if (NULL != error_message) {
             *error_message = BMP_Error_Failed_to_Read_Image_Data;
@@ -274,7 +982,7 @@ static void bmp_read_image_data(
 
     size_t first_pixel_index =
         ((size_t) image->file_header.pixel_array_offset) -
-            (bmp_header_size + (size_t) image->dib_header.dib_header_size);
+            (total_header_size + image->color_masks_size);
 
     if (first_pixel_index >= payload_size) {
         if (NULL != error_message) {
@@ -297,6 +1005,17 @@ static void bmp_read_image_data(
             (size_t) -image->dib_header.image_height :
             (size_t)  image->dib_header.image_height;
 
+    if (!bmp_has_plain_pixel_array(image)) {
+        timing_stop(TIMING_STAGE_READ, start_time, payload_size, width * height);
+
+        _bmp_expand_pixel_array(image, first_pixel_index, width, height, orientation, error_message);
+        if (NULL != *error_message) {
+            goto cleanup;
+        }
+
+        goto end;
+    }
+
     size_t row_size_extend_to_4 =
         width * 4;
     size_t row_size =
@@ -314,6 +1033,8 @@ static void bmp_read_image_data(
     image->image_size =
         height * (row_size + padding);
 
+    timing_stop(TIMING_STAGE_READ, start_time, payload_size, width * height);
+
     if (image->image_size > payload_size) {
         if (NULL != error_message) {
             *error_message = BMP_Error_Failed_to_Calculate_Padding;
@@ -325,11 +1046,7 @@ static void bmp_read_image_data(
     size_t extended_to_4_image_size =
         height * (width * 4 + padding);
 
-    size_t alignment = 64;
-    size_t aligned_image_size = (((extended_to_4_image_size - 1) / alignment) + 1) * alignment;
-    aligned_image_size += alignment;
-
-    image->pixels = (uint8_t *) aligned_alloc(64, aligned_image_size);
+    image->pixels = bmp_allocate_aligned_pixels(extended_to_4_image_size, &image->aligned_image_size);
     if (NULL == image->pixels) {
         if (NULL != error_message) {
             *error_message = BMP_Error_Not_Enough_Memory_to_Read;
@@ -337,18 +1054,27 @@ static void bmp_read_image_data(
 
         goto cleanup;
     }
-    image->aligned_image_size = aligned_image_size;
+    size_t aligned_image_size = image->aligned_image_size;
+
+    start_time = timing_start();
+
+    bool flip =
+        (BMP_ORIENTATION_TOP_DOWN == orientation && !bmp_is_top_down(image)) ||
+        (BMP_ORIENTATION_BOTTOM_UP == orientation && bmp_is_top_down(image));
+    if (flip) {
+        image->dib_header.image_height = -image->dib_header.image_height;
+    }
 
     if (4 == image->channels) {
         for (
             size_t y = 0,
-                   src_linear_position  = 0,
-                   dest_linear_position = 0;
+                   src_linear_position  = 0;
             y < height;
             ++y,
-            src_linear_position += row_size + padding,
-            dest_linear_position += row_size
+            src_linear_position += row_size + padding
         ) {
+            size_t dest_linear_position =
+                (flip ? height - 1 - y : y) * row_size;
             memcpy(
                 image->pixels + dest_linear_position,
                 image->raw_pixels + src_linear_position,
@@ -358,13 +1084,13 @@ static void bmp_read_image_data(
     } else {
         for (
             size_t y = 0,
-                   src_linear_position  = 0,
-                   dest_linear_position = 0;
+                   src_linear_position  = 0;
             y < height;
             ++y,
-            src_linear_position += row_size + padding,
-            dest_linear_position += row_size_extend_to_4
+            src_linear_position += row_size + padding
         ) {
+            size_t dest_linear_position =
+                (flip ? height - 1 - y : y) * row_size_extend_to_4;
             uint8_t *source = image->raw_pixels + src_linear_position;
             uint8_t *destination = image->pixels + dest_linear_position;
             for (int i = 0, j = 0; i < row_size; i += 3, j += 4) {
@@ -383,22 +1109,149 @@ static void bmp_read_image_data(
         image->pixels[linear_position] = 0;
     }
 
+    /* BGRA bit field images are written back as BI_RGB ones, the masks
+       after a BITMAPINFOHEADER are dropped */
+    if (BMP_COMPRESSION_RGB != image->dib_header.compression) {
+        image->dib_header.compression = BMP_COMPRESSION_RGB;
+        image->file_header.pixel_array_offset -= (uint32_t) image->color_masks_size;
+        image->file_header.file_size -= (uint32_t) image->color_masks_size;
+        image->color_masks_size = 0;
+    }
+
+    timing_stop(TIMING_STAGE_UNPACK, start_time, height * row_size, width * height);
+
 end:
     return;
 
 cleanup:
     if (NULL != image->payload)
     {
-        free(image->payload);
+        bmp_free_buffer(image->payload, image->payload_size);
         image->payload = NULL;
     }
     if (NULL != image->pixels)
     {
-        free(image->pixels);
+        bmp_free_buffer(image->pixels, image->aligned_image_size);
         image->pixels = NULL;
     }
 }
 
+static inline void bmp_read_image_data(
+                       FILE *file_descriptor,
+                       bmp_image *image,
+                       const char **error_message
+                   )
+{
+    bmp_read_image_data_oriented(file_descriptor, image, BMP_ORIENTATION_AS_STORED, error_message);
+}
+
+static void bmp_create_image_from_template(
+                bmp_image *image,
+                const bmp_image *template_image,
+                size_t width,
+                size_t height,
+                const char **error_message
+            )
+{
+    *error_message = NULL;
+
+    if (NULL == image || NULL == template_image || NULL == template_image->payload) {
+        if (NULL != error_message) {
+            *error_message = BMP_Error_Invalid_Image_Structure;
+        }
+
+        goto end;
+    }
+
+    bmp_init_image_structure(image);
+
+    image->file_header = template_image->file_header;
+    image->dib_header = template_image->dib_header;
+    memcpy(image->rest_of_dib_header, template_image->rest_of_dib_header, REST_OF_DIB_HEADER_SIZE);
+    image->channels = template_image->channels;
+
+    size_t bmp_header_size =
+        sizeof(image->file_header);
+    size_t dib_header_size =
+        image->dib_header.dib_header_size;
+    size_t first_pixel_index =
+        (size_t) (template_image->raw_pixels - template_image->payload);
+
+    size_t row_size =
+        width * image->channels;
+    size_t padding = (size_t) image->dib_header.bits_per_pixel;
+    padding = (padding * width + 31) / 32 * 4 - row_size;
+
+    size_t image_size =
+        height * (row_size + padding);
+    size_t payload_size =
+        first_pixel_index + image_size;
+
+    if (0 == width || 0 == height ||
+        width > INT32_MAX || height > INT32_MAX ||
+        bmp_header_size + dib_header_size + payload_size > UINT32_MAX) {
+        if (NULL != error_message) {
+            *error_message = BMP_Error_Invalid_Image_Dimensions;
+        }
+
+        goto end;
+    }
+
+    image->payload_size = payload_size;
+    image->payload = bmp_allocate_buffer(payload_size);
+    if (NULL == image->payload) {
+        if (NULL != error_message) {
+            *error_message = BMP_Error_Not_Enough_Memory_to_Read;
+        }
+
+        goto cleanup;
+    }
+    memcpy(image->payload, template_image->payload, first_pixel_index);
+    memset(image->payload + first_pixel_index, 0, image_size);
+
+    image->raw_pixels =
+        &image->payload[first_pixel_index];
+
+    image->file_header.file_size =
+        (uint32_t) (bmp_header_size + dib_header_size + payload_size);
+    image->dib_header.image_width =
+        (int32_t) width;
+    image->dib_header.image_height =
+        template_image->dib_header.image_height < 0 ?
+            -(int32_t) height :
+             (int32_t) height;
+    image->dib_header.image_size =
+        (uint32_t) image_size;
+
+    image->absolute_image_width  =
+        width;
+    image->absolute_image_height =
+        height;
+    image->pixel_row_padding =
+        padding;
+    image->image_size =
+        image_size;
+
+    size_t extended_to_4_image_size =
+        height * (width * 4 + padding);
+
+    image->pixels = bmp_allocate_aligned_pixels(extended_to_4_image_size, &image->aligned_image_size);
+    if (NULL == image->pixels) {
+        if (NULL != error_message) {
+            *error_message = BMP_Error_Not_Enough_Memory_to_Read;
+        }
+
+        goto cleanup;
+    }
+    memset(image->pixels, 0, image->aligned_image_size);
+
+end:
+    return;
+
+cleanup:
+    bmp_free_image_structure(image);
+}
+
 static void bmp_write_image_headers(
                 FILE *file_descriptor,
                 bmp_image *image,
@@ -423,6 +1276,8 @@ static void bmp_write_image_headers(
         goto end;
     }
 
+    uint64_t start_time = timing_start();
+
     size_t bmp_header_size =
         sizeof(image->file_header);
 
@@ -445,6 +1300,8 @@ static void bmp_write_image_headers(
         goto end;
     }
 
+    timing_stop(TIMING_STAGE_WRITE, start_time, bmp_header_size + dib_header_size, 0);
+
 end:
     return;
 }
@@ -494,6 +1351,8 @@ static void bmp_write_image_data(
     size_t row_size =
         width * image->channels;
 
+    uint64_t start_time = timing_start();
+
     if (4 == image->channels) {
         for (
             size_t y = 0,
@@ -532,6 +1391,10 @@ static void bmp_write_image_data(
         }
     }
 
+    timing_stop(TIMING_STAGE_PACK, start_time, height * row_size, width * height);
+
+    start_time = timing_start();
+
     if (!fwrite(image->payload, payload_size, 1, file_descriptor)) {
         if (NULL != error_message) {
             *error_message = BMP_Error_Failed_to_Write_Image_Data;
@@ -540,6 +1403,13 @@ static void bmp_write_image_data(
         goto end;
     }
 
+    /* Include the time to hand the buffered data over to the kernel */
+    if (timing_is_enabled()) {
+        fflush(file_descriptor);
+    }
+
+    timing_stop(TIMING_STAGE_WRITE, start_time, payload_size, width * height);
+
 end:
     return;
 }
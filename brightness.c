@@ -1,4 +1,6 @@
 #include "bmp.h"
+#include "image_io.h"
+#include "roi.h"
 
 #include <stddef.h>
 #include <stdint.h>
@@ -17,8 +19,12 @@ int main(int argc, char *argv[])
 {
     int result = EXIT_FAILURE;
 
-    if (argc < 3) {
-        fprintf(stderr, "Usage: %s <brightness> <contrast> <source file> <dest. file>\n", argv[0]);
+    if (argc < 5) {
+        fprintf(
+            stderr,
+            "Usage: %s <brightness> <contrast> <source file> <dest. file> [<x,y,width,height>[;<x,y,width,height>...]]\n",
+            argv[0]
+        );
         return result;
     }
 
@@ -27,10 +33,13 @@ int main(int argc, char *argv[])
 
     char *source_file_name = argv[3];
     char *destination_file_name = argv[4];
+    char *region = argc > 5 ? argv[5] : NULL;
     FILE *source_descriptor = NULL;
     FILE *destination_descriptor = NULL;
 
     bmp_image image; bmp_init_image_structure(&image);
+    image_format source_format = IMAGE_FORMAT_BMP;
+    roi_t roi; roi_init(&roi);
 
     source_descriptor = fopen(source_file_name, "r");
     if (source_descriptor == NULL) {
@@ -39,38 +48,51 @@ int main(int argc, char *argv[])
     }
 
     const char *error_message;
-    bmp_open_image_headers(source_descriptor, &image, &error_message);
+    image_io_open_image_headers(source_descriptor, &image, &source_format, &error_message);
     if (error_message != NULL) {
         fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", source_file_name, error_message);
         goto cleanup;
     }
 
-    bmp_read_image_data(source_descriptor, &image, &error_message);
+    image_io_read_image_data(source_descriptor, &image, source_format, &error_message);
     if (error_message != NULL) {
         fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", source_file_name, error_message);
         goto cleanup;
     }
 
+    if (region != NULL) {
+        roi_parse(region, &roi, &error_message);
+    } else if (!roi_set_full(&roi, image.absolute_image_width, image.absolute_image_height)) {
+        error_message = ROI_Error_Not_Enough_Memory;
+    }
+    if (error_message == NULL) {
+        roi_prepare(&roi, image.absolute_image_width, image.absolute_image_height, bmp_is_top_down(&image), &error_message);
+    }
+    if (error_message != NULL) {
+        fprintf(stderr, "Failed to process the region '%s':\n\t%s\n", region != NULL ? region : "", error_message);
+        goto cleanup;
+    }
+
+    image_format destination_format = image_io_get_format_for_file_name(destination_file_name, source_format);
     destination_descriptor = fopen(destination_file_name, "w");
     if (destination_descriptor == NULL) {
         fprintf(stderr, "Failed to create the output image '%s'\n", destination_file_name);
         goto cleanup;
     }
 
-    bmp_write_image_headers(destination_descriptor, &image, &error_message);
+    image_io_write_image_headers(destination_descriptor, &image, destination_format, &error_message);
     if (error_message != NULL) {
         fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", destination_file_name, error_message);
         goto cleanup;
     }
 
+    uint64_t kernel_start_time = timing_start();
+
     /* Main Image Processing Loop */
     {
         uint8_t *pixels = image.pixels;
 
         size_t width = image.absolute_image_width;
-        size_t height = image.absolute_image_height;
-
-        size_t channels_count = width * height * 4;
 
 #if defined SIMD_INTRINSICS_IMPLEMENTATION || defined SIMD_ASM_IMPLEMENTATION
         size_t step = 16;
@@ -78,54 +100,77 @@ int main(int argc, char *argv[])
         size_t step = 4;
 #endif
 
-        for (size_t position = 0; position < channels_count; position += step) {
+        for (size_t i = 0; i < roi.count; ++i) {
+            roi_rectangle_t *rectangle = &roi.rectangles[i];
+            size_t span_count = roi_rectangle_get_span_count(rectangle, width);
+
+            for (size_t span = 0; span < span_count; ++span) {
+                size_t position, end;
+                roi_rectangle_get_span(rectangle, width, span, &position, &end);
+
+                for (; position < end; position += step) {
 #if defined C_IMPLEMENTATION
 
-            pixels[position] =
-                (uint8_t) UTILS_CLAMP(pixels[position] * contrast + brightness, 0.0f, 255.0f);
-            pixels[position + 1] =
-                (uint8_t) UTILS_CLAMP(pixels[position + 1] * contrast + brightness, 0.0f, 255.0f);
-            pixels[position + 2] =
-                (uint8_t) UTILS_CLAMP(pixels[position + 2] * contrast + brightness, 0.0f, 255.0f);
+                    pixels[position] =
+                        (uint8_t) UTILS_CLAMP(pixels[position] * contrast + brightness, 0.0f, 255.0f);
+                    pixels[position + 1] =
+                        (uint8_t) UTILS_CLAMP(pixels[position + 1] * contrast + brightness, 0.0f, 255.0f);
+                    pixels[position + 2] =
+                        (uint8_t) UTILS_CLAMP(pixels[position + 2] * contrast + brightness, 0.0f, 255.0f);
 
 #elif defined SIMD_INTRINSICS_IMPLEMENTATION
 
-            /*
-                Write the intrinsics for the SIMD assembly bellow in
-                SIMD_ASM_IMPLEMENTATION here in SIMD_INTRINSICS_IMPLEMENTATION.
-            */
+                    /*
+                        Write the intrinsics for the SIMD assembly bellow in
+                        SIMD_ASM_IMPLEMENTATION here in SIMD_INTRINSICS_IMPLEMENTATION.
+                    */
 
-            // TODO
+                    // TODO
 
 #elif defined SIMD_ASM_IMPLEMENTATION
 
-            __asm__ __volatile__ (
-                "vbroadcastss (%0), %%zmm2\n\t"
-                "vbroadcastss (%1), %%zmm1\n\t"
-                "vpmovzxbd (%2,%3), %%zmm0\n\t"
-                "vcvtdq2ps %%zmm0, %%zmm0\n\t"
-                "vfmadd132ps %%zmm1, %%zmm2, %%zmm0\n\t"
-                "vcvtps2dq %%zmm0, %%zmm0\n\t"
-                "vpmovusdb %%zmm0, (%2,%3)\n\t"
-            ::
-                "S"(&brightness), "D"(&contrast), "b"(pixels), "c"(position)
-            :
-                "%zmm0", "%zmm1", "%zmm2"
-            );
+                    uint32_t mask = end - position >= 16 ? 0xffff : (1u << (end - position)) - 1;
+
+                    __asm__ __volatile__ (
+                        "kmovw %4, %%k1\n\t"
+                        "vbroadcastss (%0), %%zmm2\n\t"
+                        "vbroadcastss (%1), %%zmm1\n\t"
+                        "vpmovzxbd (%2,%3), %%zmm0\n\t"
+                        "vcvtdq2ps %%zmm0, %%zmm0\n\t"
+                        "vfmadd132ps %%zmm1, %%zmm2, %%zmm0\n\t"
+                        "vcvtps2dq %%zmm0, %%zmm0\n\t"
+                        "vpmovusdb %%zmm0, (%2,%3)%{%%k1%}\n\t"
+                    ::
+                        "S"(&brightness), "D"(&contrast), "b"(pixels), "c"(position), "r"(mask)
+                    :
+                        "%zmm0", "%zmm1", "%zmm2", "%k1", "memory"
+                    );
 
 #endif
+                }
+            }
         }
     }
 
-    bmp_write_image_data(destination_descriptor, &image, &error_message);
+    timing_stop(
+        TIMING_STAGE_KERNEL,
+        kernel_start_time,
+        roi_get_channel_count(&roi),
+        roi_get_channel_count(&roi) / 4
+    );
+
+    image_io_write_image_data(destination_descriptor, &image, destination_format, &error_message);
     if (error_message != NULL) {
         fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", destination_file_name, error_message);
         goto cleanup;
     }
 
+    timing_finish_image(destination_file_name);
+
     result = EXIT_SUCCESS;
 
 cleanup:
+    roi_free(&roi);
     bmp_free_image_structure(&image);
 
     if (source_descriptor != NULL) {
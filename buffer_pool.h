@@ -0,0 +1,316 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+    Image buffers mapped directly from the kernel, backed by 2 MiB huge pages
+    where possible and recycled between images. Sizes are rounded up to a
+    power of two, and every size has a bucket of released buffers, so a
+    daemon or a batch that processes images of similar sizes stops mapping
+    and unmapping memory after the first few images.
+
+    The environment variable BMP_HUGE_PAGES selects the huge pages:
+
+        BMP_HUGE_PAGES=transparent  madvise(MADV_HUGEPAGE) on 2 MiB aligned
+                                    buffers (the default)
+        BMP_HUGE_PAGES=explicit     MAP_HUGETLB from the pages reserved in
+                                    vm.nr_hugepages, transparent huge pages
+                                    when the reserve is exhausted
+        BMP_HUGE_PAGES=off          regular pages
+
+    With BUFFER_POOL_STATISTICS set, `buffer_pool_deinit` prints how many
+    requests were served from the buckets.
+*/
+
+#define BUFFER_POOL_HUGE_PAGE_SIZE ((size_t) 2 * 1024 * 1024)
+#define BUFFER_POOL_MINIMUM_BUCKET 16       /* 64 KiB */
+#define BUFFER_POOL_BUCKETS 48
+#define BUFFER_POOL_BUFFERS_PER_BUCKET 4
+
+typedef enum _buffer_pool_huge_pages
+{
+    BUFFER_POOL_HUGE_PAGES_UNKNOWN,
+    BUFFER_POOL_HUGE_PAGES_OFF,
+    BUFFER_POOL_HUGE_PAGES_TRANSPARENT,
+    BUFFER_POOL_HUGE_PAGES_EXPLICIT
+} buffer_pool_huge_pages_t;
+
+typedef struct _buffer_pool_statistics
+{
+    uint64_t requests;
+    uint64_t reuses;            /* requests served from a bucket          */
+    uint64_t maps;
+    uint64_t explicit_maps;     /* maps from the reserved huge page pool  */
+    uint64_t unmaps;
+} buffer_pool_statistics_t;
+
+typedef struct _buffer_pool
+{
+    pthread_mutex_t access_mutex;
+
+    void *buffers[BUFFER_POOL_BUCKETS][BUFFER_POOL_BUFFERS_PER_BUCKET];
+    size_t counts[BUFFER_POOL_BUCKETS];
+    buffer_pool_huge_pages_t huge_pages;
+
+    /* Called for new mappings before they are handed out, e.g. to touch
+       their pages from the threads that will process them */
+    void (*touch)(void *memory, size_t size, void *context);
+    void *touch_context;
+
+    buffer_pool_statistics_t statistics;
+} buffer_pool_t;
+
+#define BUFFER_POOL_INITIALIZER { .access_mutex = PTHREAD_MUTEX_INITIALIZER }
+
+static inline buffer_pool_t *buffer_pool_allocate()
+{
+    return (buffer_pool_t *) malloc(sizeof(buffer_pool_t));
+}
+
+static inline buffer_pool_t *buffer_pool_init(buffer_pool_t *pool)
+{
+    memset(pool, 0, sizeof(*pool));
+
+    if (0 != pthread_mutex_init(&pool->access_mutex, NULL)) {
+        return NULL;
+    }
+
+    return pool;
+}
+
+static inline buffer_pool_t *buffer_pool_create()
+{
+    buffer_pool_t *pool = buffer_pool_allocate();
+    if (NULL == pool) {
+        return pool;
+    }
+
+    if (NULL == buffer_pool_init(pool)) {
+        free(pool);
+
+        return NULL;
+    }
+
+    return pool;
+}
+
+static inline void buffer_pool_set_touch(
+                       buffer_pool_t *pool,
+                       void (*touch)(void *memory, size_t size, void *context),
+                       void *context
+                   )
+{
+    pthread_mutex_lock(&pool->access_mutex);
+    pool->touch = touch;
+    pool->touch_context = context;
+    pthread_mutex_unlock(&pool->access_mutex);
+}
+
+static inline size_t _buffer_pool_get_bucket(size_t size)
+{
+    size_t bucket = size <= 1 ? 0 : (size_t) (64 - __builtin_clzll((unsigned long long) size - 1));
+
+    return bucket < BUFFER_POOL_MINIMUM_BUCKET ? BUFFER_POOL_MINIMUM_BUCKET : bucket;
+}
+
+static buffer_pool_huge_pages_t _buffer_pool_get_huge_pages(buffer_pool_t *pool)
+{
+    if (BUFFER_POOL_HUGE_PAGES_UNKNOWN == pool->huge_pages) {
+        const char *huge_pages = getenv("BMP_HUGE_PAGES");
+        if (NULL != huge_pages && (0 == strcmp(huge_pages, "off") || 0 == strcmp(huge_pages, "0"))) {
+            pool->huge_pages = BUFFER_POOL_HUGE_PAGES_OFF;
+        } else if (NULL != huge_pages && 0 == strcmp(huge_pages, "explicit")) {
+            pool->huge_pages = BUFFER_POOL_HUGE_PAGES_EXPLICIT;
+        } else {
+            pool->huge_pages = BUFFER_POOL_HUGE_PAGES_TRANSPARENT;
+        }
+    }
+
+    return pool->huge_pages;
+}
+
+/* Maps `size` bytes, a power of two. Buffers of at least a huge page are
+   aligned on a huge page boundary. */
+static void *_buffer_pool_map(buffer_pool_t *pool, size_t size)
+{
+    buffer_pool_huge_pages_t huge_pages = _buffer_pool_get_huge_pages(pool);
+    bool huge = size >= BUFFER_POOL_HUGE_PAGE_SIZE && BUFFER_POOL_HUGE_PAGES_OFF != huge_pages;
+
+#ifdef MAP_HUGETLB
+    if (huge && BUFFER_POOL_HUGE_PAGES_EXPLICIT == huge_pages) {
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+#ifdef MAP_HUGE_2MB
+        flags |= MAP_HUGE_2MB;
+#endif
+        void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (MAP_FAILED != memory) {
+            pool->statistics.explicit_maps += 1;
+
+            return memory;
+        }
+    }
+#endif
+
+    if (!huge) {
+        void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        return MAP_FAILED == memory ? NULL : memory;
+    }
+
+    /* Transparent huge pages only back 2 MiB aligned ranges, so map one huge
+       page more and cut off the unaligned ends */
+    uint8_t *mapping =
+        (uint8_t *) mmap(NULL, size + BUFFER_POOL_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == mapping) {
+        return NULL;
+    }
+
+    uintptr_t address = (uintptr_t) mapping;
+    uintptr_t aligned_address = (address + BUFFER_POOL_HUGE_PAGE_SIZE - 1) & ~(uintptr_t) (BUFFER_POOL_HUGE_PAGE_SIZE - 1);
+    size_t head = aligned_address - address;
+    size_t tail = BUFFER_POOL_HUGE_PAGE_SIZE - head;
+    if (head > 0) {
+        munmap(mapping, head);
+    }
+    if (tail > 0) {
+        munmap((uint8_t *) aligned_address + size, tail);
+    }
+
+#ifdef MADV_HUGEPAGE
+    madvise((void *) aligned_address, size, MADV_HUGEPAGE);
+#endif
+
+    return (void *) aligned_address;
+}
+
+/* Returns a page aligned buffer of at least `size` bytes. Fresh buffers are
+   zeroed, recycled ones keep the data of their previous owner. */
+static void *buffer_pool_get(buffer_pool_t *pool, size_t size)
+{
+    size_t bucket = _buffer_pool_get_bucket(size);
+    if (bucket >= BUFFER_POOL_BUCKETS) {
+        return NULL;
+    }
+
+    void *memory = NULL;
+    bool mapped = false;
+
+    pthread_mutex_lock(&pool->access_mutex);
+
+    pool->statistics.requests += 1;
+    if (pool->counts[bucket] > 0) {
+        memory = pool->buffers[bucket][--pool->counts[bucket]];
+        pool->statistics.reuses += 1;
+    } else {
+        memory = _buffer_pool_map(pool, (size_t) 1 << bucket);
+        mapped = NULL != memory;
+        if (mapped) {
+            pool->statistics.maps += 1;
+        }
+    }
+
+    void (*touch)(void *memory, size_t size, void *context) = pool->touch;
+    void *touch_context = pool->touch_context;
+
+    pthread_mutex_unlock(&pool->access_mutex);
+
+    if (mapped && NULL != touch) {
+        touch(memory, size, touch_context);
+    }
+
+    return memory;
+}
+
+/* Gives a buffer of `size` bytes from `buffer_pool_get` back for reuse, or
+   unmaps it if its bucket is full. */
+static void buffer_pool_put(buffer_pool_t *pool, void *memory, size_t size)
+{
+    if (NULL == memory) {
+        return;
+    }
+
+    size_t bucket = _buffer_pool_get_bucket(size);
+
+    pthread_mutex_lock(&pool->access_mutex);
+
+    if (pool->counts[bucket] < BUFFER_POOL_BUFFERS_PER_BUCKET) {
+        pool->buffers[bucket][pool->counts[bucket]++] = memory;
+        memory = NULL;
+    } else {
+        pool->statistics.unmaps += 1;
+    }
+
+    pthread_mutex_unlock(&pool->access_mutex);
+
+    if (NULL != memory) {
+        munmap(memory, (size_t) 1 << bucket);
+    }
+}
+
+/* Unmaps all buffers waiting in the buckets. */
+static void buffer_pool_trim(buffer_pool_t *pool)
+{
+    pthread_mutex_lock(&pool->access_mutex);
+
+    for (size_t bucket = 0; bucket < BUFFER_POOL_BUCKETS; ++bucket) {
+        for (size_t i = 0; i < pool->counts[bucket]; ++i) {
+            munmap(pool->buffers[bucket][i], (size_t) 1 << bucket);
+            pool->statistics.unmaps += 1;
+        }
+        pool->counts[bucket] = 0;
+    }
+
+    pthread_mutex_unlock(&pool->access_mutex);
+}
+
+static void buffer_pool_print_statistics(buffer_pool_t *pool, FILE *file)
+{
+    pthread_mutex_lock(&pool->access_mutex);
+    buffer_pool_statistics_t statistics = pool->statistics;
+    pthread_mutex_unlock(&pool->access_mutex);
+
+    fprintf(
+        file,
+        "buffer pool: %llu requests, %llu reused, %llu maps (%llu explicit huge pages), %llu unmaps\n",
+        (unsigned long long) statistics.requests,
+        (unsigned long long) statistics.reuses,
+        (unsigned long long) statistics.maps,
+        (unsigned long long) statistics.explicit_maps,
+        (unsigned long long) statistics.unmaps
+    );
+}
+
+/* Unmaps the buffers in the buckets, also of statically initialized pools. */
+static void buffer_pool_deinit(buffer_pool_t *pool)
+{
+    buffer_pool_trim(pool);
+
+    const char *print_statistics = getenv("BUFFER_POOL_STATISTICS");
+    if (NULL != print_statistics && '\0' != print_statistics[0] && 0 != strcmp(print_statistics, "0")) {
+        buffer_pool_print_statistics(pool, stderr);
+    }
+
+    pthread_mutex_destroy(&pool->access_mutex);
+}
+
+static void buffer_pool_destroy(buffer_pool_t *pool)
+{
+    if (NULL == pool) {
+        return;
+    }
+
+    buffer_pool_deinit(pool);
+    free(pool);
+}
+
+#endif // BUFFER_POOL_H
@@ -0,0 +1,735 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "bmp.h"
+#include "filters.h"
+#include "image_io.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+    An on-disk cache of filtered images. Batch jobs are retried and rerun
+    with the same images and chains, so the encoded output of every chain is
+    kept in a directory, named after a 128-bit key of everything that
+    determines it:
+
+        the kernel version and kernel set (FILTERS_KERNEL_VERSION, FILTERS_KERNEL_SET)
+        the stages of the chain and their parameters
+        the destination format
+        the headers and the decoded pixels of the source image
+
+    The key is taken from the decoded image, so the same pixels hit the cache
+    whatever format they were read from. On a hit the stored file is cloned
+    into the destination (FICLONE reflinks on Btrfs and XFS), or copied in
+    the kernel with `copy_file_range` or `sendfile`, instead of filtering and
+    encoding the image again.
+
+    The cache is bounded in size. Every hit touches the modification time of
+    its entry, and once the entries grow over the bound the least recently
+    used ones are removed until they take 7/8 of it, so a full cache is not
+    scanned on every store. Several processes can share a directory: entries
+    are written to temporary files and renamed into place.
+
+    The directory is taken from the environment variable BMP_CACHE_DIR, the
+    bound from BMP_CACHE_SIZE in MiB (CACHE_DEFAULT_SIZE by default). With
+    BMP_CACHE_STATISTICS set, `cache_close` prints the hits and misses.
+*/
+
+static const char *Cache_Error_Failed_to_Create_Directory =
+                    "Failed to create the cache directory",
+                  *Cache_Error_Failed_to_Read_Directory =
+                    "Failed to read the cache directory",
+                  *Cache_Error_Failed_to_Store_Entry =
+                    "Failed to store the image in the cache",
+                  *Cache_Error_Failed_to_Copy_Entry =
+                    "Failed to copy the cached image to the destination",
+                  *Cache_Error_Not_Enough_Memory =
+                    "Not enough memory for the cache";
+
+#define CACHE_DEFAULT_SIZE 1024     /* MiB */
+#define CACHE_KEY_LENGTH 32         /* hex digits of a key */
+#define CACHE_COPY_BUFFER_SIZE (1024 * 1024)
+
+/* Hashing */
+
+typedef struct _cache_key
+{
+    uint64_t low;
+    uint64_t high;
+} cache_key_t;
+
+/*
+    A streaming 64-bit hash with four independent lanes (the XXH64 rounds),
+    which runs at memory speed on large pixel arrays. The second half of the
+    key mixes the lanes in another order.
+*/
+typedef struct _cache_hasher
+{
+    uint64_t lanes[4];
+    uint8_t buffer[32];
+    size_t buffered;
+    uint64_t length;
+    uint64_t seed;
+} cache_hasher_t;
+
+#define CACHE_PRIME_1 0x9E3779B185EBCA87ull
+#define CACHE_PRIME_2 0xC2B2AE3D27D4EB4Full
+#define CACHE_PRIME_3 0x165667B19E3779F9ull
+#define CACHE_PRIME_4 0x85EBCA77C2B2AE63ull
+#define CACHE_PRIME_5 0x27D4EB2F165667C5ull
+
+static inline uint64_t _cache_rotate(uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static inline uint64_t _cache_read_64(const uint8_t *data)
+{
+    uint64_t value;
+    memcpy(&value, data, sizeof(value));
+
+    return value;
+}
+
+static inline uint64_t _cache_round(uint64_t lane, uint64_t input)
+{
+    lane += input * CACHE_PRIME_2;
+    lane = _cache_rotate(lane, 31);
+
+    return lane * CACHE_PRIME_1;
+}
+
+static inline uint64_t _cache_merge(uint64_t hash, uint64_t lane)
+{
+    hash ^= _cache_round(0, lane);
+
+    return hash * CACHE_PRIME_1 + CACHE_PRIME_4;
+}
+
+static inline uint64_t _cache_avalanche(uint64_t hash)
+{
+    hash ^= hash >> 33;
+    hash *= CACHE_PRIME_2;
+    hash ^= hash >> 29;
+    hash *= CACHE_PRIME_3;
+    hash ^= hash >> 32;
+
+    return hash;
+}
+
+static inline void cache_hasher_init(cache_hasher_t *hasher, uint64_t seed)
+{
+    hasher->lanes[0] = seed + CACHE_PRIME_1 + CACHE_PRIME_2;
+    hasher->lanes[1] = seed + CACHE_PRIME_2;
+    hasher->lanes[2] = seed;
+    hasher->lanes[3] = seed - CACHE_PRIME_1;
+    hasher->buffered = 0;
+    hasher->length = 0;
+    hasher->seed = seed;
+}
+
+static inline void _cache_hasher_consume(uint64_t lanes[4], const uint8_t *stripe)
+{
+    lanes[0] = _cache_round(lanes[0], _cache_read_64(stripe));
+    lanes[1] = _cache_round(lanes[1], _cache_read_64(stripe + 8));
+    lanes[2] = _cache_round(lanes[2], _cache_read_64(stripe + 16));
+    lanes[3] = _cache_round(lanes[3], _cache_read_64(stripe + 24));
+}
+
+static void cache_hasher_update(cache_hasher_t *hasher, const void *data, size_t size)
+{
+    const uint8_t *bytes = data;
+    hasher->length += size;
+
+    if (hasher->buffered > 0) {
+        size_t count = UTILS_MIN(size, sizeof(hasher->buffer) - hasher->buffered);
+        memcpy(&hasher->buffer[hasher->buffered], bytes, count);
+        hasher->buffered += count;
+        bytes += count;
+        size -= count;
+
+        if (hasher->buffered < sizeof(hasher->buffer)) {
+            return;
+        }
+        _cache_hasher_consume(hasher->lanes, hasher->buffer);
+        hasher->buffered = 0;
+    }
+
+    /* The lanes are kept in registers for the bulk of the data */
+    uint64_t lanes[4] = { hasher->lanes[0], hasher->lanes[1], hasher->lanes[2], hasher->lanes[3] };
+    for (; size >= 32; bytes += 32, size -= 32) {
+        _cache_hasher_consume(lanes, bytes);
+    }
+    memcpy(hasher->lanes, lanes, sizeof(lanes));
+
+    memcpy(hasher->buffer, bytes, size);
+    hasher->buffered = size;
+}
+
+static cache_key_t cache_hasher_finish(const cache_hasher_t *hasher)
+{
+    const uint64_t *lanes = hasher->lanes;
+
+    uint64_t low, high;
+    if (hasher->length >= 32) {
+        low =
+            _cache_rotate(lanes[0], 1) + _cache_rotate(lanes[1], 7) +
+            _cache_rotate(lanes[2], 12) + _cache_rotate(lanes[3], 18);
+        high =
+            _cache_rotate(lanes[3], 1) + _cache_rotate(lanes[2], 7) +
+            _cache_rotate(lanes[1], 12) + _cache_rotate(lanes[0], 18);
+        for (size_t i = 0; i < 4; ++i) {
+            low = _cache_merge(low, lanes[i]);
+            high = _cache_merge(high, lanes[3 - i]);
+        }
+    } else {
+        low = hasher->seed + CACHE_PRIME_5;
+        high = hasher->seed + CACHE_PRIME_4;
+    }
+    low += hasher->length;
+
+    const uint8_t *tail = hasher->buffer;
+    size_t size = hasher->buffered;
+    for (; size >= 8; tail += 8, size -= 8) {
+        low ^= _cache_round(0, _cache_read_64(tail));
+        low = _cache_rotate(low, 27) * CACHE_PRIME_1 + CACHE_PRIME_4;
+    }
+    for (; size > 0; ++tail, --size) {
+        low ^= *tail * CACHE_PRIME_5;
+        low = _cache_rotate(low, 11) * CACHE_PRIME_1;
+    }
+
+    cache_key_t key;
+    key.low = _cache_avalanche(low);
+    key.high = _cache_avalanche(high ^ low * CACHE_PRIME_3);
+
+    return key;
+}
+
+/* Adds the kernel version and the stages of `chain` with their parameters. */
+static void cache_hasher_update_chain(cache_hasher_t *hasher, const filters_chain_t *chain)
+{
+    uint32_t version = FILTERS_KERNEL_VERSION;
+    cache_hasher_update(hasher, &version, sizeof(version));
+    cache_hasher_update(hasher, FILTERS_KERNEL_SET, sizeof(FILTERS_KERNEL_SET));
+
+    for (size_t i = 0; i < chain->count; ++i) {
+        const filters_stage_t *stage = &chain->stages[i];
+        cache_hasher_update(hasher, stage->kernel->name, strlen(stage->kernel->name) + 1);
+        cache_hasher_update(hasher, stage->parameters, stage->kernel->parameter_count * sizeof(float));
+    }
+}
+
+/* The key of the result of `chain` on `image` written as `destination_format`.
+   The image has to be decoded. */
+static cache_key_t cache_get_image_key(
+                       const bmp_image *image,
+                       const filters_chain_t *chain,
+                       image_format destination_format
+                   )
+{
+    cache_hasher_t hasher;
+    cache_hasher_init(&hasher, 0);
+    cache_hasher_update_chain(&hasher, chain);
+
+    uint32_t format = (uint32_t) destination_format;
+    cache_hasher_update(&hasher, &format, sizeof(format));
+
+    /* The BMP writer copies the headers and everything up to the pixel array */
+    size_t dib_header_size =
+        UTILS_MIN(
+            (size_t) image->dib_header.dib_header_size,
+            sizeof(image->dib_header) + sizeof(image->rest_of_dib_header)
+        );
+    size_t gap_size =
+        NULL != image->raw_pixels && image->raw_pixels > image->payload ?
+            UTILS_MIN((size_t) (image->raw_pixels - image->payload), image->payload_size) :
+            0;
+    cache_hasher_update(&hasher, &image->file_header, sizeof(image->file_header));
+    cache_hasher_update(&hasher, &image->dib_header, dib_header_size);
+    cache_hasher_update(&hasher, image->payload, gap_size);
+
+    cache_hasher_update(
+        &hasher,
+        image->pixels,
+        image->absolute_image_width * image->absolute_image_height * 4
+    );
+
+    return cache_hasher_finish(&hasher);
+}
+
+/* Cache */
+
+typedef struct _cache_statistics
+{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t stores;
+    uint64_t evictions;
+    uint64_t served_bytes;      /* bytes copied out of the cache on hits */
+    uint64_t stored_bytes;
+} cache_statistics_t;
+
+typedef struct _cache
+{
+    char *directory;            /* NULL while the cache is closed          */
+    uint64_t maximum_size;
+    uint64_t size;              /* recounted from the directory on eviction */
+
+    cache_statistics_t statistics;
+} cache_t;
+
+static inline void cache_init(cache_t *cache)
+{
+    memset(cache, 0, sizeof(*cache));
+}
+
+static inline bool cache_is_open(const cache_t *cache)
+{
+    return NULL != cache->directory;
+}
+
+/* Returns the cache directory from BMP_CACHE_DIR, NULL if caching is off. */
+static inline const char *cache_get_directory(void)
+{
+    const char *directory = getenv("BMP_CACHE_DIR");
+
+    return NULL != directory && '\0' != directory[0] ? directory : NULL;
+}
+
+static inline uint64_t cache_get_maximum_size(void)
+{
+    const char *size = getenv("BMP_CACHE_SIZE");
+    unsigned long long megabytes = NULL != size ? strtoull(size, NULL, 10) : 0;
+
+    return (uint64_t) (0 != megabytes ? megabytes : CACHE_DEFAULT_SIZE) * 1024 * 1024;
+}
+
+static inline bool _cache_is_entry_name(const char *name)
+{
+    for (size_t i = 0; i < CACHE_KEY_LENGTH; ++i) {
+        if (!((name[i] >= '0' && name[i] <= '9') || (name[i] >= 'a' && name[i] <= 'f'))) {
+            return false;
+        }
+    }
+
+    return '.' == name[CACHE_KEY_LENGTH] || '\0' == name[CACHE_KEY_LENGTH];
+}
+
+static inline bool _cache_get_entry_path(
+                       const cache_t *cache,
+                       cache_key_t key,
+                       const char *extension,
+                       char *path,
+                       size_t size
+                   )
+{
+    return (size_t) snprintf(
+               path,
+               size,
+               "%s/%016llx%016llx%s",
+               cache->directory,
+               (unsigned long long) key.high,
+               (unsigned long long) key.low,
+               extension
+           ) < size;
+}
+
+typedef struct _cache_entry
+{
+    char name[NAME_MAX + 1];
+    uint64_t size;
+    struct timespec last_use;
+} cache_entry_t;
+
+static int _cache_compare_entries(const void *first, const void *second)
+{
+    const struct timespec *a = &((const cache_entry_t *) first)->last_use;
+    const struct timespec *b = &((const cache_entry_t *) second)->last_use;
+
+    if (a->tv_sec != b->tv_sec) {
+        return a->tv_sec < b->tv_sec ? -1 : 1;
+    }
+
+    return a->tv_nsec < b->tv_nsec ? -1 : a->tv_nsec > b->tv_nsec;
+}
+
+/* Recounts the size of the entries and removes the least recently used ones
+   until the rest take at most `target_size` bytes. */
+static void _cache_evict(cache_t *cache, uint64_t target_size, const char **error_message)
+{
+    *error_message = NULL;
+
+    cache_entry_t *entries = NULL;
+    size_t count = 0, capacity = 0;
+
+    DIR *directory = opendir(cache->directory);
+    if (NULL == directory) {
+        if (NULL != error_message) {
+            *error_message = Cache_Error_Failed_to_Read_Directory;
+        }
+
+        goto end;
+    }
+
+    int directory_descriptor = dirfd(directory);
+    uint64_t size = 0;
+
+    struct dirent *item;
+    while (NULL != (item = readdir(directory))) {
+        struct stat status;
+        if (!_cache_is_entry_name(item->d_name) ||
+            0 != fstatat(directory_descriptor, item->d_name, &status, AT_SYMLINK_NOFOLLOW) ||
+            !S_ISREG(status.st_mode)) {
+            continue;
+        }
+
+        if (count == capacity) {
+            capacity = UTILS_MAX(capacity * 2, 64);
+            cache_entry_t *grown = realloc(entries, capacity * sizeof(*entries));
+            if (NULL == grown) {
+                if (NULL != error_message) {
+                    *error_message = Cache_Error_Not_Enough_Memory;
+                }
+
+                goto end;
+            }
+            entries = grown;
+        }
+
+        cache_entry_t *entry = &entries[count++];
+        snprintf(entry->name, sizeof(entry->name), "%s", item->d_name);
+        entry->size = (uint64_t) status.st_size;
+        entry->last_use = status.st_mtim;
+        size += entry->size;
+    }
+
+    if (size > target_size) {
+        qsort(entries, count, sizeof(*entries), _cache_compare_entries);
+        for (size_t i = 0; i < count && size > target_size; ++i) {
+            if (0 == unlinkat(directory_descriptor, entries[i].name, 0)) {
+                size -= entries[i].size;
+                cache->statistics.evictions += 1;
+            }
+        }
+    }
+
+    cache->size = size;
+
+end:
+    if (NULL != directory) {
+        closedir(directory);
+    }
+
+    free(entries);
+}
+
+/* Opens the cache in `directory`, creates the directory if it does not
+   exist and trims the entries to `maximum_size` bytes. */
+static void cache_open(cache_t *cache, const char *directory, uint64_t maximum_size, const char **error_message)
+{
+    *error_message = NULL;
+
+    if (0 != mkdir(directory, 0755) && EEXIST != errno) {
+        if (NULL != error_message) {
+            *error_message = Cache_Error_Failed_to_Create_Directory;
+        }
+
+        goto end;
+    }
+
+    cache->directory = strdup(directory);
+    if (NULL == cache->directory) {
+        if (NULL != error_message) {
+            *error_message = Cache_Error_Not_Enough_Memory;
+        }
+
+        goto end;
+    }
+    cache->maximum_size = maximum_size;
+
+    _cache_evict(cache, maximum_size, error_message);
+    if (NULL != *error_message) {
+        free(cache->directory);
+        cache->directory = NULL;
+    }
+
+end:
+    return;
+}
+
+static void cache_print_statistics(const cache_t *cache, FILE *file)
+{
+    const cache_statistics_t *statistics = &cache->statistics;
+
+    fprintf(
+        file,
+        "cache: %llu hits, %llu misses, %llu stores, %llu evictions, %.1f MiB served, %.1f MiB stored\n",
+        (unsigned long long) statistics->hits,
+        (unsigned long long) statistics->misses,
+        (unsigned long long) statistics->stores,
+        (unsigned long long) statistics->evictions,
+        statistics->served_bytes / (1024.0 * 1024.0),
+        statistics->stored_bytes / (1024.0 * 1024.0)
+    );
+}
+
+static void cache_close(cache_t *cache)
+{
+    if (!cache_is_open(cache)) {
+        return;
+    }
+
+    const char *print_statistics = getenv("BMP_CACHE_STATISTICS");
+    if (NULL != print_statistics && '\0' != print_statistics[0] && 0 != strcmp(print_statistics, "0")) {
+        cache_print_statistics(cache, stderr);
+    }
+
+    free(cache->directory);
+    cache->directory = NULL;
+}
+
+/* Copying */
+
+static inline ssize_t _cache_copy_file_range(int source, off_t *offset, int destination, size_t size)
+{
+#if defined SYS_copy_file_range
+    return (ssize_t) syscall(SYS_copy_file_range, source, offset, destination, NULL, size, 0);
+#else
+    errno = ENOSYS;
+
+    return -1;
+#endif
+}
+
+/*
+    Copies the first `size` bytes of the regular file `source` to the
+    current position of `destination`. An empty regular destination gets a
+    reflink of the source where the file system supports it, other files are
+    copied in the kernel, with `copy_file_range` between files of one file
+    system and `sendfile` to anything else, e.g. a pipe. A plain read and
+    write loop is the last resort.
+*/
+static bool _cache_copy(int source, int destination, uint64_t size)
+{
+    struct stat status;
+    if (0 == fstat(destination, &status) && S_ISREG(status.st_mode) && 0 == status.st_size &&
+        0 == ioctl(destination, FICLONE, source)) {
+        return lseek(destination, (off_t) size, SEEK_SET) >= 0;
+    }
+
+    off_t offset = 0;
+    while ((uint64_t) offset < size) {
+        ssize_t copied = _cache_copy_file_range(source, &offset, destination, (size_t) (size - (uint64_t) offset));
+        if (copied <= 0) {
+            break;
+        }
+    }
+    while ((uint64_t) offset < size) {
+        ssize_t copied = sendfile(destination, source, &offset, (size_t) (size - (uint64_t) offset));
+        if (copied <= 0) {
+            break;
+        }
+    }
+    if ((uint64_t) offset == size) {
+        return true;
+    }
+
+    uint8_t *buffer = malloc(CACHE_COPY_BUFFER_SIZE);
+    if (NULL == buffer) {
+        return false;
+    }
+
+    while ((uint64_t) offset < size) {
+        ssize_t count = pread(source, buffer, CACHE_COPY_BUFFER_SIZE, offset);
+        if (count < 0 && EINTR == errno) {
+            continue;
+        }
+        if (count <= 0) {
+            break;
+        }
+
+        ssize_t written = 0;
+        while (written < count) {
+            ssize_t result = write(destination, buffer + written, (size_t) (count - written));
+            if (result < 0 && EINTR == errno) {
+                continue;
+            }
+            if (result <= 0) {
+                goto end;
+            }
+            written += result;
+        }
+        offset += count;
+    }
+
+end:
+    free(buffer);
+
+    return (uint64_t) offset == size;
+}
+
+/* Lookups */
+
+/*
+    Copies the entry of `key` to `destination` and returns true on a hit. A
+    miss returns false without an error. A hit that fails to copy returns
+    false with an error, the destination may hold part of the image then.
+*/
+static bool cache_fetch(
+                cache_t *cache,
+                cache_key_t key,
+                const char *extension,
+                int destination,
+                const char **error_message
+            )
+{
+    *error_message = NULL;
+
+    bool hit = false;
+    int descriptor = -1;
+
+    char path[PATH_MAX];
+    if (!_cache_get_entry_path(cache, key, extension, path, sizeof(path))) {
+        goto end;
+    }
+
+    descriptor = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat status;
+    if (descriptor < 0 || 0 != fstat(descriptor, &status)) {
+        goto end;
+    }
+
+    if (!_cache_copy(descriptor, destination, (uint64_t) status.st_size)) {
+        if (NULL != error_message) {
+            *error_message = Cache_Error_Failed_to_Copy_Entry;
+        }
+
+        goto end;
+    }
+
+    /* The modification time orders the entries for eviction */
+    futimens(descriptor, NULL);
+
+    cache->statistics.served_bytes += (uint64_t) status.st_size;
+    hit = true;
+
+end:
+    if (descriptor >= 0) {
+        close(descriptor);
+    }
+
+    if (hit) {
+        cache->statistics.hits += 1;
+    } else {
+        cache->statistics.misses += 1;
+    }
+
+    return hit;
+}
+
+/*
+    Creates a temporary file in the cache directory for the output of a miss
+    and writes its path to `temporary_path`. Returns NULL if it could not be
+    created, the image is then written to its destination directly.
+*/
+static FILE *cache_create_entry(cache_t *cache, char *temporary_path, size_t size)
+{
+    if ((size_t) snprintf(temporary_path, size, "%s/.entry-XXXXXX", cache->directory) >= size) {
+        return NULL;
+    }
+
+    int descriptor = mkstemp(temporary_path);
+    if (descriptor < 0) {
+        return NULL;
+    }
+    fchmod(descriptor, 0644);
+
+    FILE *file = fdopen(descriptor, "w+");
+    if (NULL == file) {
+        close(descriptor);
+        unlink(temporary_path);
+    }
+
+    return file;
+}
+
+/* Removes a temporary entry of `cache_create_entry` and closes it. */
+static void cache_discard_entry(FILE *entry, const char *temporary_path)
+{
+    unlink(temporary_path);
+    fclose(entry);
+}
+
+/*
+    Moves the encoded image in `entry` into the cache under `key`, copies it
+    to `destination` and closes `entry`. The least recently used entries are
+    evicted once the cache grows over its bound.
+*/
+static void cache_commit_entry(
+                cache_t *cache,
+                FILE *entry,
+                const char *temporary_path,
+                cache_key_t key,
+                const char *extension,
+                int destination,
+                const char **error_message
+            )
+{
+    *error_message = NULL;
+
+    char path[PATH_MAX];
+    struct stat status;
+    if (0 != fflush(entry) ||
+        0 != fstat(fileno(entry), &status) ||
+        !_cache_get_entry_path(cache, key, extension, path, sizeof(path))) {
+        if (NULL != error_message) {
+            *error_message = Cache_Error_Failed_to_Store_Entry;
+        }
+
+        cache_discard_entry(entry, temporary_path);
+        goto end;
+    }
+
+    /* An entry is stored even if the copy fails, it holds a valid image.
+       Images larger than the whole cache would only push out the others. */
+    if ((uint64_t) status.st_size > cache->maximum_size || 0 != rename(temporary_path, path)) {
+        unlink(temporary_path);
+    } else {
+        cache->statistics.stores += 1;
+        cache->statistics.stored_bytes += (uint64_t) status.st_size;
+        cache->size += (uint64_t) status.st_size;
+    }
+
+    if (!_cache_copy(fileno(entry), destination, (uint64_t) status.st_size)) {
+        if (NULL != error_message) {
+            *error_message = Cache_Error_Failed_to_Copy_Entry;
+        }
+    }
+    fclose(entry);
+
+    if (cache->size > cache->maximum_size) {
+        const char *eviction_error;
+        _cache_evict(cache, cache->maximum_size / 8 * 7, &eviction_error);
+    }
+
+end:
+    return;
+}
+
+#endif // CACHE_H
@@ -0,0 +1,309 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define CLIENT_MAX_RESPONSE_SIZE 1024
+#define CLIENT_MAX_REQUEST_SIZE 8192
+
+typedef enum _client_mode
+{
+    CLIENT_MODE_PATHS,          /* the server opens the files by their absolute paths          */
+    CLIENT_MODE_DESCRIPTORS,    /* the client opens the files and passes their descriptors     */
+    CLIENT_MODE_SHARED          /* the image is handed over in a memfd and filtered in place   */
+} client_mode_t;
+
+/* The server may run in a different working directory, so relative paths are
+   resolved here. The destination may not exist yet. */
+static bool client_get_absolute_path(const char *path, char *absolute_path, size_t size)
+{
+    if ('/' == path[0]) {
+        return (size_t) snprintf(absolute_path, size, "%s", path) < size;
+    }
+
+    char working_directory[PATH_MAX];
+    if (getcwd(working_directory, sizeof(working_directory)) == NULL) {
+        return false;
+    }
+
+    return (size_t) snprintf(absolute_path, size, "%s/%s", working_directory, path) < size;
+}
+
+/* Sends `request` with `descriptors` attached in a single message. */
+static bool client_send_request(int connection, const char *request, const int *descriptors, size_t descriptor_count)
+{
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int) * 2)];
+    } control;
+
+    size_t length = strlen(request);
+    struct iovec vector = { .iov_base = (void *) request, .iov_len = length };
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &vector;
+    message.msg_iovlen = 1;
+
+    if (descriptor_count > 0) {
+        memset(&control, 0, sizeof(control));
+        message.msg_control = control.buffer;
+        message.msg_controllen = CMSG_SPACE(sizeof(int) * descriptor_count);
+
+        struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(sizeof(int) * descriptor_count);
+        memcpy(CMSG_DATA(header), descriptors, sizeof(int) * descriptor_count);
+    }
+
+    ssize_t sent = sendmsg(connection, &message, MSG_NOSIGNAL);
+    if (sent < 0) {
+        return false;
+    }
+
+    /* The descriptors went with the first byte, the rest is plain data */
+    for (size_t position = (size_t) sent; position < length; position += (size_t) sent) {
+        sent = send(connection, request + position, length - position, MSG_NOSIGNAL);
+        if (sent < 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Copies a file into an anonymous memory file. A producer that already holds
+   the image in memory would write it into the memfd directly. */
+static int client_create_shared_image(const char *path)
+{
+    int result = -1;
+
+    int source = open(path, O_RDONLY);
+    if (source < 0) {
+        return result;
+    }
+
+    struct stat status;
+    int memory = memfd_create("image", MFD_CLOEXEC);
+    if (memory < 0 || fstat(source, &status) < 0 || ftruncate(memory, status.st_size) < 0) {
+        goto cleanup;
+    }
+
+    for (off_t offset = 0; offset < status.st_size;) {
+        if (sendfile(memory, source, &offset, (size_t) (status.st_size - offset)) <= 0) {
+            goto cleanup;
+        }
+    }
+
+    result = memory;
+    memory = -1;
+
+cleanup:
+    if (memory >= 0) {
+        close(memory);
+    }
+    close(source);
+
+    return result;
+}
+
+/* Writes the whole content of `source` to a new file at `path`. */
+static bool client_save_shared_image(int source, const char *path)
+{
+    bool result = false;
+
+    int destination = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (destination < 0) {
+        return result;
+    }
+
+    struct stat status;
+    if (fstat(source, &status) < 0) {
+        goto cleanup;
+    }
+
+    for (off_t offset = 0; offset < status.st_size;) {
+        if (sendfile(destination, source, &offset, (size_t) (status.st_size - offset)) <= 0) {
+            goto cleanup;
+        }
+    }
+
+    result = true;
+
+cleanup:
+    close(destination);
+
+    return result;
+}
+
+static bool client_read_line(int descriptor, char *line, size_t size)
+{
+    size_t length = 0;
+    while (length + 1 < size) {
+        ssize_t received = read(descriptor, &line[length], 1);
+        if (received <= 0) {
+            return false;
+        }
+        if ('\n' == line[length]) {
+            break;
+        }
+        ++length;
+    }
+    line[length] = '\0';
+
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    int result = EXIT_FAILURE;
+
+    client_mode_t mode = CLIENT_MODE_PATHS;
+    if (argc > 1 && 0 == strcmp(argv[1], "--descriptors")) {
+        mode = CLIENT_MODE_DESCRIPTORS;
+    } else if (argc > 1 && 0 == strcmp(argv[1], "--shared")) {
+        mode = CLIENT_MODE_SHARED;
+    }
+    if (CLIENT_MODE_PATHS != mode) {
+        --argc;
+        ++argv;
+    }
+
+    if (argc < 5 || 0 != (argc - 3) % 2) {
+        fprintf(
+            stderr,
+            "Usage: %s [--descriptors|--shared] <socket path> <filter chain> "
+            "<source file> <dest. file> [<source file> <dest. file>...]\n",
+            argv[0]
+        );
+        return result;
+    }
+
+    char *socket_path = argv[1];
+    char *chain = argv[2];
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "The socket path '%s' is too long\n", socket_path);
+        return result;
+    }
+    strcpy(address.sun_path, socket_path);
+
+    int client_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (client_socket < 0) {
+        perror("socket");
+        goto cleanup;
+    }
+
+    if (connect(client_socket, (struct sockaddr *) &address, sizeof(address)) < 0) {
+        fprintf(stderr, "Failed to connect to the server at '%s'\n", socket_path);
+        goto cleanup;
+    }
+
+    result = EXIT_SUCCESS;
+    for (int i = 3; i + 1 < argc; i += 2) {
+        char request[CLIENT_MAX_REQUEST_SIZE];
+        int descriptors[2] = { -1, -1 };
+        size_t descriptor_count = 0;
+
+        if (CLIENT_MODE_PATHS == mode) {
+            char source_path[PATH_MAX], destination_path[PATH_MAX];
+            if (!client_get_absolute_path(argv[i], source_path, sizeof(source_path)) ||
+                !client_get_absolute_path(argv[i + 1], destination_path, sizeof(destination_path)) ||
+                (size_t) snprintf(
+                    request, sizeof(request), "%s\t%s\t%s\n", chain, source_path, destination_path
+                ) >= sizeof(request)) {
+                fprintf(stderr, "Failed to resolve the paths '%s' and '%s'\n", argv[i], argv[i + 1]);
+                result = EXIT_FAILURE;
+                continue;
+            }
+        } else {
+            if (CLIENT_MODE_DESCRIPTORS == mode) {
+                descriptors[0] = open(argv[i], O_RDONLY | O_CLOEXEC);
+                descriptors[1] = open(argv[i + 1], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+                descriptor_count = 2;
+            } else {
+                descriptors[0] = client_create_shared_image(argv[i]);
+                descriptor_count = 1;
+            }
+            snprintf(request, sizeof(request), "%s\n", chain);
+        }
+
+        bool opened = descriptor_count < 1 || descriptors[0] >= 0;
+        opened = opened && (descriptor_count < 2 || descriptors[1] >= 0);
+        bool sent = opened && client_send_request(client_socket, request, descriptors, descriptor_count);
+
+        /* The server holds its own copies of the descriptors now, the memory
+           file is kept to save the result. */
+        int shared_image = CLIENT_MODE_SHARED == mode ? descriptors[0] : -1;
+        for (size_t j = CLIENT_MODE_SHARED == mode ? 1 : 0; j < descriptor_count; ++j) {
+            if (descriptors[j] >= 0) {
+                close(descriptors[j]);
+            }
+        }
+
+        if (!opened) {
+            fprintf(stderr, "Failed to open the images '%s' and '%s'\n", argv[i], argv[i + 1]);
+            result = EXIT_FAILURE;
+            if (shared_image >= 0) {
+                close(shared_image);
+            }
+            continue;
+        }
+
+        char response[CLIENT_MAX_RESPONSE_SIZE];
+        if (!sent || !client_read_line(client_socket, response, sizeof(response))) {
+            fputs("The server closed the connection\n", stderr);
+            result = EXIT_FAILURE;
+            if (shared_image >= 0) {
+                close(shared_image);
+            }
+            goto cleanup;
+        }
+
+        unsigned long long decode_ns, filter_ns, encode_ns, total_ns;
+        if (4 == sscanf(response, "OK\t%llu\t%llu\t%llu\t%llu", &decode_ns, &filter_ns, &encode_ns, &total_ns)) {
+            printf(
+                "%s: decode %.3f ms, filter %.3f ms, encode %.3f ms, total %.3f ms%s\n",
+                argv[i + 1],
+                decode_ns / 1e6, filter_ns / 1e6, encode_ns / 1e6, total_ns / 1e6,
+                NULL != strstr(response, "\tcached") ? " (cached)" : ""
+            );
+
+            if (shared_image >= 0 && !client_save_shared_image(shared_image, argv[i + 1])) {
+                fprintf(stderr, "Failed to create the output image '%s'\n", argv[i + 1]);
+                result = EXIT_FAILURE;
+            }
+        } else {
+            char *message = strchr(response, '\t');
+            fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", argv[i], message != NULL ? message + 1 : response);
+            result = EXIT_FAILURE;
+        }
+
+        if (shared_image >= 0) {
+            close(shared_image);
+        }
+    }
+
+cleanup:
+    if (client_socket >= 0) {
+        close(client_socket);
+        client_socket = -1;
+    }
+
+    return result;
+}
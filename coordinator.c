@@ -0,0 +1,1184 @@
+#define _GNU_SOURCE
+
+#include "autotune.h"
+#include "bmp.h"
+#include "filters.h"
+#include "image_io.h"
+#include "threadpool.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#if !defined C_IMPLEMENTATION && \
+    !defined SIMD_INTRINSICS_IMPLEMENTATION && \
+    !defined SIMD_ASM_IMPLEMENTATION
+#define C_IMPLEMENTATION 1
+#endif
+
+/*
+    The coordinator shards a batch of images, or the row bands of a single
+    image, over worker processes. A crash in one worker loses only the item
+    it was filtering, and every worker gets its own share of the CPUs, so the
+    workers of a machine with several NUMA nodes run on different nodes.
+
+    Every worker is a forked process connected to the coordinator by a Unix
+    socket pair. It receives one item at a time, with tab-separated fields:
+
+        <item>\t<filter chain>\t<source file>\t<dest. file>\n
+        <item>\t<filter chain>\t<first channel>\t<channel count>\n
+
+    The first is an image of the batch. The worker writes it to a temporary
+    file next to the destination and renames it when it is complete. The
+    second is a band of rows of a single image. It comes with two descriptors
+    (SCM_RIGHTS) of shared memory files holding the pixels of the source and
+    of the destination image. The worker maps the band, filters a copy and
+    writes it to the destination, so an item can be run again and nothing
+    crosses the socket but the request. Every item is answered with
+
+        <item>\tOK\n
+        <item>\tERROR\t<message>\n
+
+    A worker asks for the next item when it is done with the last one, so
+    fast workers take more items than slow ones, and a single image is cut
+    into COORDINATOR_BANDS_PER_WORKER bands per worker to keep them all busy
+    until the end. Once no items are left, an idle worker also runs items
+    that have taken COORDINATOR_STRAGGLER_FACTOR times longer than the mean
+    on another worker, and the first result counts.
+
+    The coordinator starts a new worker in place of one that exited and gives
+    its item to the next idle worker. An item that crashed
+    COORDINATOR_MAX_ATTEMPTS workers fails. With COORDINATOR_CRASH_EVERY set
+    to n, every worker aborts on its n-th item to test the recovery.
+
+    Workers only need a stream socket and the files of the batch, so remote
+    workers on a shared file system could serve the same requests over TCP.
+    The local worker processes stand in for them, except that row bands need
+    shared memory.
+*/
+
+#define COORDINATOR_MAX_WORKERS 256
+#define COORDINATOR_MAX_MESSAGE_SIZE 8192
+#define COORDINATOR_MAX_ERROR_SIZE 256
+#define COORDINATOR_MAX_DESCRIPTORS 2
+#define COORDINATOR_MAX_ATTEMPTS 3
+#define COORDINATOR_BANDS_PER_WORKER 8
+#define COORDINATOR_STRAGGLER_FACTOR 3
+#define COORDINATOR_POLL_INTERVAL 50 /* ms */
+
+typedef struct _coordinator_item
+{
+    const char *source_path;                    /* NULL for a band of rows      */
+    const char *destination_path;
+    size_t first_channel;                       /* of a band of rows            */
+    size_t channels_count;
+
+    size_t runners;                             /* workers filtering it now     */
+    size_t attempts;                            /* workers that crashed on it   */
+    bool done;
+    char error_message[COORDINATOR_MAX_ERROR_SIZE];  /* empty on success   */
+} coordinator_item_t;
+
+typedef struct _coordinator_worker
+{
+    pid_t pid;                                  /* -1 if the worker could not be started */
+    int connection;
+    ssize_t item;                               /* the item it runs, or -1      */
+    uint64_t start_time;
+
+    char reply[COORDINATOR_MAX_MESSAGE_SIZE];
+    size_t reply_length;
+
+    size_t items_completed;
+    uint64_t busy_time;
+} coordinator_worker_t;
+
+typedef struct _coordinator
+{
+    const char *chain_text;
+
+    coordinator_item_t *items;
+    size_t item_count;
+    size_t next_item;
+    size_t done_count;
+
+    coordinator_worker_t workers[COORDINATOR_MAX_WORKERS];
+    size_t worker_count;
+
+    /* Shared memory of the source and destination pixels of a banded
+       image, -1 for a batch */
+    int band_descriptors[COORDINATOR_MAX_DESCRIPTORS];
+    size_t row_channels;
+
+    uint64_t completed_time;                    /* of all first results         */
+    size_t completed_count;
+    size_t rebalanced_count;
+    size_t restart_count;
+} coordinator_t;
+
+/* Tuned thread counts and grain sizes, loaded once and shared by the workers */
+static autotune_table_t coordinator_tuning;
+
+/* Worker */
+
+static inline bool coordinator_get_temporary_path(const char *destination_path, pid_t pid, char *path, size_t size)
+{
+    return (size_t) snprintf(path, size, "%s.tmp-%d", destination_path, (int) pid) < size;
+}
+
+/*
+    Gives worker `slot` of `slot_count` its own contiguous share of the CPUs
+    the process may use. Neighboring CPU numbers mostly share a NUMA node, so
+    the threads of a worker and the memory they touch first stay on one node.
+    With fewer CPUs than workers, the workers share all of them.
+*/
+static void coordinator_restrict_to_cpus(size_t slot, size_t slot_count)
+{
+#ifdef __linux__
+    int cpus[UTILS_MAX_CPUS];
+    size_t count = utils_get_allowed_cpus(cpus, UTILS_MAX_CPUS);
+    count = UTILS_MIN(count, UTILS_MAX_CPUS);
+    if (count < slot_count) {
+        return;
+    }
+
+    unsigned long mask[UTILS_MAX_CPUS / (8 * sizeof(unsigned long))];
+    memset(mask, 0, sizeof(mask));
+    for (size_t i = slot * count / slot_count; i < (slot + 1) * count / slot_count; ++i) {
+        mask[cpus[i] / (8 * sizeof(unsigned long))] |= 1ul << (cpus[i] % (8 * sizeof(unsigned long)));
+    }
+
+    syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask);
+#else
+    (void) slot;
+    (void) slot_count;
+#endif
+}
+
+static bool coordinator_run_chain(
+                threadpool_t *threadpool,
+                size_t pool_size,
+                const filters_chain_t *chain,
+                uint8_t *pixels,
+                size_t channels_count
+            )
+{
+    autotune_config_t config =
+        autotune_get_config(&coordinator_tuning, chain->stages[0].kernel->name, channels_count, pool_size);
+
+    return filters_run_chain(
+               1 == config.threads ? NULL : threadpool,
+               config.grain,
+               config.streaming,
+               chain,
+               pixels,
+               channels_count
+           );
+}
+
+static void coordinator_process_file(
+                threadpool_t *threadpool,
+                size_t pool_size,
+                const filters_chain_t *chain,
+                const char *source_path,
+                const char *destination_path,
+                char *response,
+                size_t response_size
+            )
+{
+    bmp_image image; bmp_init_image_structure(&image);
+    image_format source_format = IMAGE_FORMAT_BMP;
+
+    FILE *source_descriptor = NULL;
+    FILE *destination_descriptor = NULL;
+
+    char temporary_path[PATH_MAX];
+    if (!coordinator_get_temporary_path(destination_path, getpid(), temporary_path, sizeof(temporary_path))) {
+        snprintf(response, response_size, "ERROR\tThe output path is too long\n");
+        goto cleanup;
+    }
+
+    source_descriptor = fopen(source_path, "r");
+    if (source_descriptor == NULL) {
+        snprintf(response, response_size, "ERROR\tFailed to open the source image file\n");
+        goto cleanup;
+    }
+
+    const char *error_message;
+    image_io_open_image_headers(source_descriptor, &image, &source_format, &error_message);
+    if (error_message != NULL) {
+        snprintf(response, response_size, "ERROR\t%s\n", error_message);
+        goto cleanup;
+    }
+
+    image_io_read_image_data(source_descriptor, &image, source_format, &error_message);
+    if (error_message != NULL) {
+        snprintf(response, response_size, "ERROR\t%s\n", error_message);
+        goto cleanup;
+    }
+
+    size_t channels_count = image.absolute_image_width * image.absolute_image_height * 4;
+    if (!coordinator_run_chain(threadpool, pool_size, chain, image.pixels, channels_count)) {
+        snprintf(response, response_size, "ERROR\tOut of memory\n");
+        goto cleanup;
+    }
+
+    destination_descriptor = fopen(temporary_path, "w");
+    if (destination_descriptor == NULL) {
+        snprintf(response, response_size, "ERROR\tFailed to create the output image\n");
+        goto cleanup;
+    }
+
+    image_format destination_format = image_io_get_format_for_file_name(destination_path, source_format);
+    image_io_write_image_headers(destination_descriptor, &image, destination_format, &error_message);
+    if (error_message != NULL) {
+        snprintf(response, response_size, "ERROR\t%s\n", error_message);
+        goto cleanup;
+    }
+
+    image_io_write_image_data(destination_descriptor, &image, destination_format, &error_message);
+    if (error_message != NULL) {
+        snprintf(response, response_size, "ERROR\t%s\n", error_message);
+        goto cleanup;
+    }
+
+    int closed = fclose(destination_descriptor);
+    destination_descriptor = NULL;
+    if (0 != closed || 0 != rename(temporary_path, destination_path)) {
+        snprintf(response, response_size, "ERROR\tFailed to write the output image\n");
+        goto cleanup;
+    }
+
+    snprintf(response, response_size, "OK\n");
+
+cleanup:
+    if (source_descriptor != NULL) {
+        fclose(source_descriptor);
+        source_descriptor = NULL;
+    }
+
+    if (destination_descriptor != NULL) {
+        fclose(destination_descriptor);
+        destination_descriptor = NULL;
+    }
+
+    if (0 != strncmp(response, "OK", 2)) {
+        unlink(temporary_path);
+    }
+
+    bmp_free_image_structure(&image);
+}
+
+/* Maps the pages of `descriptor` that hold the `size` bytes at `offset` and
+   returns the mapping of the first byte. */
+static uint8_t *coordinator_map_band(int descriptor, size_t offset, size_t size, int protection, size_t *map_offset)
+{
+    struct stat status;
+    if (fstat(descriptor, &status) < 0 || status.st_size < 0 ||
+        offset > (size_t) status.st_size || size > (size_t) status.st_size - offset) {
+        return NULL;
+    }
+
+    *map_offset = offset % (size_t) sysconf(_SC_PAGESIZE);
+    uint8_t *map =
+        mmap(NULL, *map_offset + size, protection, MAP_SHARED, descriptor, (off_t) (offset - *map_offset));
+
+    return map == MAP_FAILED ? NULL : map + *map_offset;
+}
+
+/* Filters a band of the source pixels into the destination. The band is
+   filtered in a private copy, so the destination only ever receives
+   finished pixels, even while another worker runs the same band. */
+static void coordinator_process_band(
+                threadpool_t *threadpool,
+                size_t pool_size,
+                const filters_chain_t *chain,
+                size_t first_channel,
+                size_t channels_count,
+                const int *descriptors,
+                char *response,
+                size_t response_size
+            )
+{
+    size_t source_offset = 0, destination_offset = 0;
+    uint8_t *source = NULL, *destination = NULL, *band = NULL;
+
+    if (0 != first_channel % 4 || 0 != channels_count % 4 || 0 == channels_count) {
+        snprintf(response, response_size, "ERROR\tMalformed band\n");
+        goto cleanup;
+    }
+
+    source = coordinator_map_band(descriptors[0], first_channel, channels_count, PROT_READ, &source_offset);
+    destination =
+        coordinator_map_band(descriptors[1], first_channel, channels_count, PROT_WRITE, &destination_offset);
+    if (NULL == source || NULL == destination) {
+        snprintf(response, response_size, "ERROR\tFailed to map the shared image\n");
+        goto cleanup;
+    }
+
+    band = malloc(channels_count);
+    if (NULL == band) {
+        snprintf(response, response_size, "ERROR\tOut of memory\n");
+        goto cleanup;
+    }
+    memcpy(band, source, channels_count);
+
+    if (!coordinator_run_chain(threadpool, pool_size, chain, band, channels_count)) {
+        snprintf(response, response_size, "ERROR\tOut of memory\n");
+        goto cleanup;
+    }
+    memcpy(destination, band, channels_count);
+
+    snprintf(response, response_size, "OK\n");
+
+cleanup:
+    free(band);
+
+    if (NULL != source) {
+        munmap(source - source_offset, source_offset + channels_count);
+    }
+
+    if (NULL != destination) {
+        munmap(destination - destination_offset, destination_offset + channels_count);
+    }
+}
+
+/* Runs the item of one request line and writes the reply to `response`. */
+static void coordinator_process_item(
+                threadpool_t *threadpool,
+                size_t pool_size,
+                char *request,
+                const int *descriptors,
+                size_t descriptor_count,
+                char *response,
+                size_t response_size
+            )
+{
+    char *fields[4];
+    size_t field_count = 0;
+    for (char *cursor = request; field_count < 4; ++field_count) {
+        fields[field_count] = cursor;
+        cursor = strchr(cursor, '\t');
+        if (NULL == cursor) {
+            ++field_count;
+            break;
+        }
+        *cursor++ = '\0';
+    }
+
+    char *end;
+    unsigned long long item = strtoull(fields[0], &end, 10);
+    if (4 != field_count || '\0' != *end || end == fields[0] ||
+        (0 != descriptor_count && COORDINATOR_MAX_DESCRIPTORS != descriptor_count)) {
+        snprintf(response, response_size, "%s\tERROR\tMalformed request\n", fields[0]);
+        return;
+    }
+
+    int prefix_length = snprintf(response, response_size, "%llu\t", item);
+    response += prefix_length;
+    response_size -= (size_t) prefix_length;
+
+    const char *error_message;
+    filters_chain_t chain;
+    filters_parse_chain(fields[1], &chain, &error_message);
+    if (error_message != NULL) {
+        snprintf(response, response_size, "ERROR\t%s '%s'\n", error_message, fields[1]);
+        return;
+    }
+
+    if (0 == descriptor_count) {
+        coordinator_process_file(threadpool, pool_size, &chain, fields[2], fields[3], response, response_size);
+    } else {
+        coordinator_process_band(
+            threadpool,
+            pool_size,
+            &chain,
+            strtoull(fields[2], NULL, 10),
+            strtoull(fields[3], NULL, 10),
+            descriptors,
+            response,
+            response_size
+        );
+    }
+}
+
+static bool coordinator_write_all(int descriptor, const char *data, size_t size)
+{
+    while (size > 0) {
+        ssize_t written = write(descriptor, data, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+
+        data += written;
+        size -= (size_t) written;
+    }
+
+    return true;
+}
+
+/* Sends `data` with `descriptors` attached to its first part. */
+static bool coordinator_send(int connection, const char *data, size_t size, const int *descriptors, size_t descriptor_count)
+{
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int) * COORDINATOR_MAX_DESCRIPTORS)];
+    } control;
+
+    struct iovec vector = { .iov_base = (void *) data, .iov_len = size };
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &vector;
+    message.msg_iovlen = 1;
+
+    if (descriptor_count > 0) {
+        memset(&control, 0, sizeof(control));
+        message.msg_control = control.buffer;
+        message.msg_controllen = CMSG_SPACE(sizeof(int) * descriptor_count);
+
+        struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(sizeof(int) * descriptor_count);
+        memcpy(CMSG_DATA(header), descriptors, sizeof(int) * descriptor_count);
+    }
+
+    ssize_t sent;
+    do {
+        sent = sendmsg(connection, &message, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+    if (sent < 0) {
+        return false;
+    }
+
+    return coordinator_write_all(connection, data + sent, size - (size_t) sent);
+}
+
+/* Receives the next part of the request stream. Descriptors attached to it
+   are appended to `descriptors`, ones that do not fit are closed. */
+static ssize_t coordinator_receive(int connection, char *buffer, size_t size, int *descriptors, size_t *descriptor_count)
+{
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int) * COORDINATOR_MAX_DESCRIPTORS)];
+    } control;
+
+    struct iovec vector = { .iov_base = buffer, .iov_len = size };
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &vector;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+
+    ssize_t received = recvmsg(connection, &message, MSG_CMSG_CLOEXEC);
+    if (received < 0) {
+        return received;
+    }
+
+    for (struct cmsghdr *header = CMSG_FIRSTHDR(&message); header != NULL; header = CMSG_NXTHDR(&message, header)) {
+        if (SOL_SOCKET != header->cmsg_level || SCM_RIGHTS != header->cmsg_type) {
+            continue;
+        }
+
+        size_t count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < count; ++i) {
+            int descriptor;
+            memcpy(&descriptor, CMSG_DATA(header) + i * sizeof(int), sizeof(int));
+            if (*descriptor_count < COORDINATOR_MAX_DESCRIPTORS) {
+                descriptors[(*descriptor_count)++] = descriptor;
+            } else {
+                close(descriptor);
+            }
+        }
+    }
+
+    return received;
+}
+
+/* The main loop of a worker process: answers items until the coordinator
+   closes the connection. */
+static int coordinator_run_worker(int connection, size_t slot, size_t slot_count)
+{
+    coordinator_restrict_to_cpus(slot, slot_count);
+
+    size_t pool_size = utils_get_number_of_cpu_cores();
+    threadpool_t *threadpool = pool_size > 1 ? threadpool_create(pool_size) : NULL;
+
+    const char *crash_every_text = getenv("COORDINATOR_CRASH_EVERY");
+    size_t crash_every = NULL != crash_every_text ? (size_t) strtoull(crash_every_text, NULL, 10) : 0;
+    size_t items_received = 0;
+
+    char request[COORDINATOR_MAX_MESSAGE_SIZE];
+    char response[COORDINATOR_MAX_MESSAGE_SIZE];
+    size_t length = 0;
+
+    int descriptors[COORDINATOR_MAX_DESCRIPTORS];
+    size_t descriptor_count = 0;
+
+    while (true) {
+        ssize_t received =
+            coordinator_receive(
+                connection,
+                request + length,
+                sizeof(request) - 1 - length,
+                descriptors,
+                &descriptor_count
+            );
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            break;
+        }
+        length += (size_t) received;
+        request[length] = '\0';
+
+        char *line = request;
+        char *line_end;
+        while ((line_end = strchr(line, '\n')) != NULL) {
+            *line_end = '\0';
+
+            ++items_received;
+            if (0 != crash_every && 0 == items_received % crash_every) {
+                abort();
+            }
+
+            coordinator_process_item(
+                threadpool,
+                pool_size,
+                line,
+                descriptors,
+                descriptor_count,
+                response,
+                sizeof(response)
+            );
+            for (size_t i = 0; i < descriptor_count; ++i) {
+                close(descriptors[i]);
+            }
+            descriptor_count = 0;
+
+            if (!coordinator_write_all(connection, response, strlen(response))) {
+                goto cleanup;
+            }
+
+            line = line_end + 1;
+        }
+
+        length = strlen(line);
+        memmove(request, line, length + 1);
+        if (length == sizeof(request) - 1) {
+            goto cleanup;
+        }
+    }
+
+cleanup:
+    for (size_t i = 0; i < descriptor_count; ++i) {
+        close(descriptors[i]);
+    }
+
+    threadpool_destroy(threadpool);
+    threadpool = NULL;
+
+    buffer_pool_deinit(&BMP_Buffer_Pool);
+
+    close(connection);
+
+    return EXIT_SUCCESS;
+}
+
+/* Coordinator */
+
+static bool coordinator_start_worker(coordinator_t *coordinator, size_t slot)
+{
+    coordinator_worker_t *worker = &coordinator->workers[slot];
+    worker->pid = -1;
+    worker->connection = -1;
+    worker->item = -1;
+    worker->reply_length = 0;
+
+    int sockets[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) < 0) {
+        return false;
+    }
+
+    /* Buffered output would be written again by the child */
+    fflush(stdout);
+    fflush(stderr);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(sockets[0]);
+        close(sockets[1]);
+
+        return false;
+    }
+
+    if (0 == pid) {
+        close(sockets[0]);
+        for (size_t i = 0; i < coordinator->worker_count; ++i) {
+            if (coordinator->workers[i].connection >= 0) {
+                close(coordinator->workers[i].connection);
+            }
+        }
+
+        _exit(coordinator_run_worker(sockets[1], slot, coordinator->worker_count));
+    }
+
+    close(sockets[1]);
+    worker->pid = pid;
+    worker->connection = sockets[0];
+
+    return true;
+}
+
+static void coordinator_send_item(coordinator_t *coordinator, size_t slot, size_t index)
+{
+    coordinator_worker_t *worker = &coordinator->workers[slot];
+    coordinator_item_t *item = &coordinator->items[index];
+
+    char message[COORDINATOR_MAX_MESSAGE_SIZE];
+    int length;
+    if (NULL != item->source_path) {
+        length =
+            snprintf(
+                message,
+                sizeof(message),
+                "%zu\t%s\t%s\t%s\n",
+                index,
+                coordinator->chain_text,
+                item->source_path,
+                item->destination_path
+            );
+    } else {
+        length =
+            snprintf(
+                message,
+                sizeof(message),
+                "%zu\t%s\t%zu\t%zu\n",
+                index,
+                coordinator->chain_text,
+                item->first_channel,
+                item->channels_count
+            );
+    }
+
+    worker->item = (ssize_t) index;
+    worker->start_time = timing_get_time_ns();
+    item->runners += 1;
+
+    /* A worker that is gone is noticed by the next poll */
+    coordinator_send(
+        worker->connection,
+        message,
+        UTILS_MIN((size_t) length, sizeof(message) - 1),
+        coordinator->band_descriptors,
+        NULL != item->source_path ? 0 : COORDINATOR_MAX_DESCRIPTORS
+    );
+}
+
+static void coordinator_finish_item(coordinator_t *coordinator, size_t index, const char *error_message)
+{
+    coordinator_item_t *item = &coordinator->items[index];
+
+    item->done = true;
+    coordinator->done_count += 1;
+    if (NULL != error_message) {
+        snprintf(item->error_message, sizeof(item->error_message), "%s", error_message);
+    }
+}
+
+/* The next item nobody runs: a new one, or one of a crashed worker. */
+static ssize_t coordinator_get_next_item(coordinator_t *coordinator)
+{
+    if (coordinator->next_item < coordinator->item_count) {
+        return (ssize_t) coordinator->next_item++;
+    }
+
+    for (size_t i = 0; i < coordinator->item_count; ++i) {
+        if (!coordinator->items[i].done && 0 == coordinator->items[i].runners) {
+            return (ssize_t) i;
+        }
+    }
+
+    return -1;
+}
+
+/* The item that has run the longest on a single worker, if it has run for
+   COORDINATOR_STRAGGLER_FACTOR times the mean time of an item. */
+static ssize_t coordinator_get_straggler(coordinator_t *coordinator, uint64_t time)
+{
+    if (0 == coordinator->completed_count) {
+        return -1;
+    }
+
+    uint64_t limit = COORDINATOR_STRAGGLER_FACTOR * (coordinator->completed_time / coordinator->completed_count);
+
+    ssize_t straggler = -1;
+    uint64_t longest = limit;
+    for (size_t i = 0; i < coordinator->worker_count; ++i) {
+        coordinator_worker_t *worker = &coordinator->workers[i];
+        if (worker->item < 0) {
+            continue;
+        }
+
+        coordinator_item_t *item = &coordinator->items[worker->item];
+        if (!item->done && 1 == item->runners && time - worker->start_time > longest) {
+            longest = time - worker->start_time;
+            straggler = worker->item;
+        }
+    }
+
+    return straggler;
+}
+
+/* Handles the replies in the buffer of a worker. */
+static void coordinator_read_replies(coordinator_t *coordinator, size_t slot)
+{
+    coordinator_worker_t *worker = &coordinator->workers[slot];
+
+    char *line = worker->reply;
+    char *line_end;
+    while ((line_end = memchr(line, '\n', worker->reply_length - (size_t) (line - worker->reply))) != NULL) {
+        *line_end = '\0';
+
+        char *end;
+        unsigned long long index = strtoull(line, &end, 10);
+        if ('\t' == *end && worker->item >= 0 && (size_t) worker->item == index) {
+            uint64_t elapsed_time = timing_get_time_ns() - worker->start_time;
+            coordinator_item_t *item = &coordinator->items[index];
+
+            item->runners -= 1;
+            worker->item = -1;
+            worker->items_completed += 1;
+            worker->busy_time += elapsed_time;
+
+            if (!item->done) {
+                const char *status = end + 1;
+                coordinator_finish_item(
+                    coordinator,
+                    (size_t) index,
+                    0 == strncmp(status, "ERROR\t", 6) ? status + 6 : NULL
+                );
+                coordinator->completed_time += elapsed_time;
+                coordinator->completed_count += 1;
+            }
+        }
+
+        line = line_end + 1;
+    }
+
+    worker->reply_length -= (size_t) (line - worker->reply);
+    memmove(worker->reply, line, worker->reply_length);
+}
+
+/* Collects a worker that exited, returns its item and starts a new worker in
+   its place. */
+static void coordinator_restart_worker(coordinator_t *coordinator, size_t slot)
+{
+    coordinator_worker_t *worker = &coordinator->workers[slot];
+
+    close(worker->connection);
+    worker->connection = -1;
+
+    int status = 0;
+    while (waitpid(worker->pid, &status, 0) < 0 && errno == EINTR);
+    if (WIFSIGNALED(status)) {
+        fprintf(stderr, "Worker %zu (process %d) was killed by signal %d\n", slot, (int) worker->pid, WTERMSIG(status));
+    } else {
+        fprintf(stderr, "Worker %zu (process %d) exited with %d\n", slot, (int) worker->pid, WEXITSTATUS(status));
+    }
+
+    if (worker->item >= 0) {
+        coordinator_item_t *item = &coordinator->items[worker->item];
+        item->runners -= 1;
+
+        if (NULL != item->source_path) {
+            char temporary_path[PATH_MAX];
+            if (coordinator_get_temporary_path(item->destination_path, worker->pid, temporary_path, sizeof(temporary_path))) {
+                unlink(temporary_path);
+            }
+        }
+
+        item->attempts += 1;
+        if (!item->done && COORDINATOR_MAX_ATTEMPTS == item->attempts) {
+            coordinator_finish_item(coordinator, (size_t) worker->item, "The workers crashed while filtering it");
+        }
+    }
+    worker->pid = -1;
+    worker->item = -1;
+
+    if (coordinator->done_count < coordinator->item_count) {
+        coordinator->restart_count += 1;
+        if (!coordinator_start_worker(coordinator, slot)) {
+            fprintf(stderr, "Failed to restart worker %zu\n", slot);
+        }
+    }
+}
+
+/* Runs all items on the workers. */
+static void coordinator_run(coordinator_t *coordinator)
+{
+    struct pollfd descriptors[COORDINATOR_MAX_WORKERS];
+    size_t slots[COORDINATOR_MAX_WORKERS];
+
+    while (coordinator->done_count < coordinator->item_count) {
+        uint64_t time = timing_get_time_ns();
+
+        size_t descriptor_count = 0;
+        for (size_t slot = 0; slot < coordinator->worker_count; ++slot) {
+            coordinator_worker_t *worker = &coordinator->workers[slot];
+            if (worker->pid < 0) {
+                continue;
+            }
+
+            if (worker->item < 0) {
+                ssize_t index = coordinator_get_next_item(coordinator);
+                if (index < 0) {
+                    index = coordinator_get_straggler(coordinator, time);
+                    coordinator->rebalanced_count += index >= 0;
+                }
+                if (index >= 0) {
+                    coordinator_send_item(coordinator, slot, (size_t) index);
+                }
+            }
+
+            descriptors[descriptor_count].fd = worker->connection;
+            descriptors[descriptor_count].events = POLLIN;
+            descriptors[descriptor_count].revents = 0;
+            slots[descriptor_count++] = slot;
+        }
+
+        if (0 == descriptor_count) {
+            for (size_t i = 0; i < coordinator->item_count; ++i) {
+                if (!coordinator->items[i].done) {
+                    coordinator_finish_item(coordinator, i, "No workers are left");
+                }
+            }
+            break;
+        }
+
+        int ready = poll(descriptors, descriptor_count, COORDINATOR_POLL_INTERVAL);
+        if (ready < 0 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+
+        for (size_t i = 0; ready > 0 && i < descriptor_count; ++i) {
+            if (0 == descriptors[i].revents) {
+                continue;
+            }
+
+            coordinator_worker_t *worker = &coordinator->workers[slots[i]];
+            ssize_t received =
+                read(
+                    worker->connection,
+                    worker->reply + worker->reply_length,
+                    sizeof(worker->reply) - worker->reply_length
+                );
+            if (received < 0 && errno == EINTR) {
+                continue;
+            }
+            if (received <= 0 || (size_t) received == sizeof(worker->reply) - worker->reply_length) {
+                if (received > 0) {
+                    kill(worker->pid, SIGKILL);
+                }
+                coordinator_restart_worker(coordinator, slots[i]);
+                continue;
+            }
+
+            worker->reply_length += (size_t) received;
+            coordinator_read_replies(coordinator, slots[i]);
+        }
+    }
+}
+
+/* Ends all workers. Ones still running an item that another worker finished
+   first are killed. */
+static void coordinator_stop_workers(coordinator_t *coordinator)
+{
+    for (size_t slot = 0; slot < coordinator->worker_count; ++slot) {
+        coordinator_worker_t *worker = &coordinator->workers[slot];
+        if (worker->pid < 0) {
+            continue;
+        }
+
+        if (worker->item >= 0) {
+            kill(worker->pid, SIGKILL);
+        }
+        close(worker->connection);
+        worker->connection = -1;
+    }
+
+    for (size_t slot = 0; slot < coordinator->worker_count; ++slot) {
+        coordinator_worker_t *worker = &coordinator->workers[slot];
+        if (worker->pid < 0) {
+            continue;
+        }
+
+        while (waitpid(worker->pid, NULL, 0) < 0 && errno == EINTR);
+
+        coordinator_item_t *item = worker->item >= 0 ? &coordinator->items[worker->item] : NULL;
+        if (NULL != item && NULL != item->source_path) {
+            char temporary_path[PATH_MAX];
+            if (coordinator_get_temporary_path(item->destination_path, worker->pid, temporary_path, sizeof(temporary_path))) {
+                unlink(temporary_path);
+            }
+        }
+        worker->pid = -1;
+    }
+}
+
+/* Creates a shared memory file of `size` bytes and maps it. */
+static uint8_t *coordinator_create_shared_pixels(size_t size, int *descriptor)
+{
+    *descriptor = memfd_create("pixels", MFD_CLOEXEC);
+    if (*descriptor < 0) {
+        return NULL;
+    }
+
+    if (ftruncate(*descriptor, (off_t) size) < 0) {
+        return NULL;
+    }
+
+    uint8_t *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, *descriptor, 0);
+
+    return map == MAP_FAILED ? NULL : map;
+}
+
+int main(int argc, char *argv[])
+{
+    int result = EXIT_FAILURE;
+
+    if (argc < 5 || 0 != (argc - 3) % 2) {
+        fprintf(
+            stderr,
+            "Usage: %s <workers> <filter chain> <source file> <dest. file> [<source file> <dest. file> ...]\n",
+            argv[0]
+        );
+        return result;
+    }
+
+    coordinator_t coordinator;
+    memset(&coordinator, 0, sizeof(coordinator));
+    coordinator.chain_text = argv[2];
+    coordinator.worker_count = (size_t) atoi(argv[1]);
+    coordinator.band_descriptors[0] = coordinator.band_descriptors[1] = -1;
+    for (size_t slot = 0; slot < COORDINATOR_MAX_WORKERS; ++slot) {
+        coordinator.workers[slot].pid = -1;
+        coordinator.workers[slot].connection = -1;
+        coordinator.workers[slot].item = -1;
+    }
+
+    size_t image_count = (size_t) (argc - 3) / 2;
+
+    bmp_image image; bmp_init_image_structure(&image);
+    image_format source_format = IMAGE_FORMAT_BMP;
+    FILE *source_descriptor = NULL;
+    FILE *destination_descriptor = NULL;
+    uint8_t *band_pixels[COORDINATOR_MAX_DESCRIPTORS] = { NULL, NULL };
+    size_t channels_count = 0;
+
+    autotune_init(&coordinator_tuning);
+
+    if (0 == coordinator.worker_count || coordinator.worker_count > COORDINATOR_MAX_WORKERS) {
+        fprintf(stderr, "The number of workers has to be between 1 and %d\n", COORDINATOR_MAX_WORKERS);
+        goto cleanup;
+    }
+
+    const char *error_message;
+    filters_chain_t chain;
+    filters_parse_chain(coordinator.chain_text, &chain, &error_message);
+    if (error_message != NULL) {
+        fprintf(stderr, "%s '%s'\n", error_message, coordinator.chain_text);
+        goto cleanup;
+    }
+
+    autotune_load(&coordinator_tuning, autotune_get_file_path(), &error_message);
+    if (error_message != NULL) {
+        fprintf(stderr, "Ignoring the tuning file '%s':\n\t%s\n", autotune_get_file_path(), error_message);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    /* A single image is cut into bands of rows if its pixels do not depend
+       on their neighbors */
+    bool banded = 1 == image_count && coordinator.worker_count > 1 && 0 == filters_get_chain_radius(&chain);
+    if (banded) {
+        source_descriptor = fopen(argv[3], "r");
+        if (source_descriptor == NULL) {
+            fprintf(stderr, "Failed to open the source image file '%s'\n", argv[3]);
+            goto cleanup;
+        }
+
+        image_io_open_image_headers(source_descriptor, &image, &source_format, &error_message);
+        if (error_message == NULL) {
+            image_io_read_image_data(source_descriptor, &image, source_format, &error_message);
+        }
+        if (error_message != NULL) {
+            fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", argv[3], error_message);
+            goto cleanup;
+        }
+
+        channels_count = image.absolute_image_width * image.absolute_image_height * 4;
+        for (size_t i = 0; i < COORDINATOR_MAX_DESCRIPTORS; ++i) {
+            band_pixels[i] = coordinator_create_shared_pixels(channels_count, &coordinator.band_descriptors[i]);
+            if (NULL == band_pixels[i]) {
+                fputs("Failed to create the shared memory of the image.\n", stderr);
+                goto cleanup;
+            }
+        }
+        memcpy(band_pixels[0], image.pixels, channels_count);
+
+        size_t height = image.absolute_image_height;
+        size_t band_count = UTILS_MIN(coordinator.worker_count * COORDINATOR_BANDS_PER_WORKER, height);
+        coordinator.row_channels = image.absolute_image_width * 4;
+        coordinator.item_count = band_count;
+    } else {
+        coordinator.item_count = image_count;
+    }
+
+    coordinator.items = calloc(coordinator.item_count, sizeof(*coordinator.items));
+    if (NULL == coordinator.items) {
+        fputs("Out of memory.\n", stderr);
+        goto cleanup;
+    }
+    for (size_t i = 0; i < coordinator.item_count; ++i) {
+        coordinator_item_t *item = &coordinator.items[i];
+        if (banded) {
+            size_t height = image.absolute_image_height;
+            size_t first_row = i * height / coordinator.item_count;
+            size_t last_row = (i + 1) * height / coordinator.item_count;
+            item->first_channel = first_row * coordinator.row_channels;
+            item->channels_count = (last_row - first_row) * coordinator.row_channels;
+        } else {
+            item->source_path = argv[3 + 2 * i];
+            item->destination_path = argv[4 + 2 * i];
+        }
+    }
+
+    uint64_t start_time = timing_get_time_ns();
+
+    for (size_t slot = 0; slot < coordinator.worker_count; ++slot) {
+        if (!coordinator_start_worker(&coordinator, slot)) {
+            fprintf(stderr, "Failed to start worker %zu\n", slot);
+        }
+    }
+
+    coordinator_run(&coordinator);
+    coordinator_stop_workers(&coordinator);
+
+    bool failed = false;
+    for (size_t i = 0; i < coordinator.item_count; ++i) {
+        coordinator_item_t *item = &coordinator.items[i];
+        if (item->done && '\0' == item->error_message[0]) {
+            continue;
+        }
+
+        failed = true;
+        const char *message = item->done ? item->error_message : "The item was not filtered";
+        if (banded) {
+            fprintf(
+                stderr,
+                "Failed to process the rows %zu to %zu of the image '%s':\n\t%s\n",
+                item->first_channel / coordinator.row_channels,
+                (item->first_channel + item->channels_count) / coordinator.row_channels - 1,
+                argv[3],
+                message
+            );
+        } else {
+            fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", item->source_path, message);
+        }
+    }
+
+    if (banded && !failed) {
+        memcpy(image.pixels, band_pixels[1], channels_count);
+
+        destination_descriptor = fopen(argv[4], "w");
+        if (destination_descriptor == NULL) {
+            fprintf(stderr, "Failed to create the output image '%s'\n", argv[4]);
+            goto cleanup;
+        }
+
+        image_format destination_format = image_io_get_format_for_file_name(argv[4], source_format);
+        image_io_write_image_headers(destination_descriptor, &image, destination_format, &error_message);
+        if (error_message == NULL) {
+            image_io_write_image_data(destination_descriptor, &image, destination_format, &error_message);
+        }
+        if (error_message != NULL) {
+            fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", argv[3], error_message);
+            goto cleanup;
+        }
+    }
+
+    double seconds = (timing_get_time_ns() - start_time) / 1e9;
+    printf(
+        "%zu %s in %.3f s on %zu workers, %zu rebalanced, %zu workers restarted\n",
+        coordinator.item_count,
+        banded ? "bands" : "images",
+        seconds,
+        coordinator.worker_count,
+        coordinator.rebalanced_count,
+        coordinator.restart_count
+    );
+    for (size_t slot = 0; slot < coordinator.worker_count; ++slot) {
+        coordinator_worker_t *worker = &coordinator.workers[slot];
+        printf(
+            "\tworker %zu: %zu items, %.0f%% busy\n",
+            slot,
+            worker->items_completed,
+            100.0 * worker->busy_time / 1e9 / seconds
+        );
+    }
+
+    if (!failed) {
+        result = EXIT_SUCCESS;
+    }
+
+cleanup:
+    coordinator_stop_workers(&coordinator);
+
+    if (source_descriptor != NULL) {
+        fclose(source_descriptor);
+        source_descriptor = NULL;
+    }
+
+    if (destination_descriptor != NULL) {
+        fclose(destination_descriptor);
+        destination_descriptor = NULL;
+    }
+
+    for (size_t i = 0; i < COORDINATOR_MAX_DESCRIPTORS; ++i) {
+        if (NULL != band_pixels[i]) {
+            munmap(band_pixels[i], channels_count);
+        }
+        if (coordinator.band_descriptors[i] >= 0) {
+            close(coordinator.band_descriptors[i]);
+        }
+    }
+
+    free(coordinator.items);
+    coordinator.items = NULL;
+
+    bmp_free_image_structure(&image);
+
+    autotune_free(&coordinator_tuning);
+
+    return result;
+}
@@ -0,0 +1,404 @@
+#ifndef FILTERS_H
+#define FILTERS_H
+
+#include "bmp.h"
+#include "kernels.h"
+#include "planar.h"
+#include "threadpool.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined SIMD_INTRINSICS_IMPLEMENTATION || defined SIMD_ASM_IMPLEMENTATION
+#include <immintrin.h>
+#endif
+
+#if (defined SIMD_INTRINSICS_IMPLEMENTATION || defined SIMD_ASM_IMPLEMENTATION) && \
+    defined __AVX512F__
+#define FILTERS_AVX512_KERNELS 1
+#endif
+
+static const char *Filters_Error_Unknown_Filter =
+                    "Unknown filter",
+                  *Filters_Error_Invalid_Parameters =
+                    "Invalid number of filter parameters",
+                  *Filters_Error_Too_Many_Stages =
+                    "Too many stages in the filter chain";
+
+/*
+    Point filters that can be applied to any range of channels of the BGRA
+    `pixels` buffer. A kernel processes the channels [position, end), where
+    both ends are multiples of 4, and leaves the alpha channel untouched.
+
+    The streaming variants are meant for images much larger than the last
+    level cache. They write whole 64-byte lines with non-temporal stores,
+    which skip the read for ownership of the line and do not evict other
+    data, and prefetch the lines ahead of the loads.
+*/
+
+/* Chains with at least this many stages run on planar blocks (see planar.h):
+   a block of pixels is split into planes that stay in the L1 cache, every
+   stage runs on the planes, and the block is merged back. Only the SIMD
+   kernels have planar variants, the scalar split and merge cost more than
+   the C kernels save on planes. */
+#define FILTERS_PLANAR_MINIMUM_STAGES 2
+#define FILTERS_PLANAR_BLOCK_PIXELS 1024
+
+typedef void (*filters_kernel_function_t)(uint8_t *pixels, size_t position, size_t end, const float *parameters);
+
+/* Point Kernels
+
+   Every point operation of kernels.h gets a C kernel and a planar C kernel
+   and, with AVX-512, a regular, a streaming and a planar AVX-512 kernel. */
+
+#define _FILTERS_DEFINE_C_KERNELS(name)                                                                  \
+    static inline void filters_##name##_c(                                                               \
+                           uint8_t *pixels, size_t position, size_t end, const float *parameters)        \
+    {                                                                                                    \
+        kernels_run_c(                                                                                   \
+            pixels, position, end, parameters, kernels_##name##_setup, kernels_##name##_c);              \
+    }                                                                                                    \
+    static inline void planar_##name##_c(                                                                \
+                           uint8_t *const *planes, size_t position, size_t end, const float *parameters) \
+    {                                                                                                    \
+        kernels_run_planar_c(                                                                            \
+            planes, position, end, parameters, kernels_##name##_setup, kernels_##name##_c);              \
+    }
+
+#if defined FILTERS_AVX512_KERNELS
+#define _FILTERS_DEFINE_AVX512_KERNELS(name)                                                             \
+    static inline void filters_##name##_avx512(                                                          \
+                           uint8_t *pixels, size_t position, size_t end, const float *parameters)        \
+    {                                                                                                    \
+        kernels_run_avx512(                                                                              \
+            pixels, position, end, parameters, kernels_##name##_setup, kernels_##name##_avx512);         \
+    }                                                                                                    \
+    static inline void filters_##name##_avx512_stream(                                                   \
+                           uint8_t *pixels, size_t position, size_t end, const float *parameters)        \
+    {                                                                                                    \
+        kernels_run_avx512_stream(                                                                       \
+            pixels, position, end, parameters, kernels_##name##_setup, kernels_##name##_avx512);         \
+    }                                                                                                    \
+    static inline void planar_##name##_avx512(                                                           \
+                           uint8_t *const *planes, size_t position, size_t end, const float *parameters) \
+    {                                                                                                    \
+        kernels_run_planar_avx512(                                                                       \
+            planes, position, end, parameters, kernels_##name##_setup, kernels_##name##_avx512);         \
+    }
+#else
+#define _FILTERS_DEFINE_AVX512_KERNELS(name)
+#endif
+
+#define FILTERS_DEFINE_POINT_KERNELS(name) \
+    _FILTERS_DEFINE_C_KERNELS(name)        \
+    _FILTERS_DEFINE_AVX512_KERNELS(name)
+
+FILTERS_DEFINE_POINT_KERNELS(sepia)
+FILTERS_DEFINE_POINT_KERNELS(brightness)
+
+/* Dispatch Table */
+
+/* Part of the keys of cached results (see cache.h). Bump the version when a
+   kernel changes its output. The scalar and the AVX-512 kernels round
+   differently, so results of one set are never served to the other. */
+#define FILTERS_KERNEL_VERSION 2
+#if defined FILTERS_AVX512_KERNELS
+#define FILTERS_KERNEL_SET "avx512"
+#else
+#define FILTERS_KERNEL_SET "c"
+#endif
+
+typedef struct _filters_kernel
+{
+    const char *name;
+    size_t parameter_count;
+    filters_kernel_function_t apply;
+    filters_kernel_function_t apply_streaming;  /* NULL if there is no streaming variant */
+    planar_kernel_function_t apply_planar;      /* NULL if there is no planar variant    */
+    size_t radius;                              /* pixels read around every output pixel */
+} filters_kernel_t;
+
+static const filters_kernel_t Filters_Kernels[] = {
+#if defined FILTERS_AVX512_KERNELS
+    { "sepia",      0, filters_sepia_avx512,      filters_sepia_avx512_stream,      planar_sepia_avx512,      0 },
+    { "brightness", 2, filters_brightness_avx512, filters_brightness_avx512_stream, planar_brightness_avx512, 0 },
+#else
+    { "sepia",      0, filters_sepia_c,           NULL,                             NULL,                     0 },
+    { "brightness", 2, filters_brightness_c,      NULL,                             NULL,                     0 },
+#endif
+};
+
+static inline const filters_kernel_t *filters_find_kernel(const char *name, size_t name_length)
+{
+    for (size_t i = 0; i < sizeof(Filters_Kernels) / sizeof(Filters_Kernels[0]); ++i) {
+        if (strlen(Filters_Kernels[i].name) == name_length &&
+            0 == strncmp(Filters_Kernels[i].name, name, name_length)) {
+            return &Filters_Kernels[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* Filter Chains */
+
+#define FILTERS_MAX_STAGES 16
+#define FILTERS_MAX_PARAMETERS 4
+
+typedef struct _filters_stage
+{
+    const filters_kernel_t *kernel;
+    float parameters[FILTERS_MAX_PARAMETERS];
+} filters_stage_t;
+
+typedef struct _filters_chain
+{
+    filters_stage_t stages[FILTERS_MAX_STAGES];
+    size_t count;
+} filters_chain_t;
+
+/*
+    Parses a chain of stages separated by commas, every stage is a filter name
+    followed by its parameters separated by colons, for example
+
+        brightness:20:1.2,sepia
+*/
+static void filters_parse_chain(const char *text, filters_chain_t *chain, const char **error_message)
+{
+    *error_message = NULL;
+
+    chain->count = 0;
+
+    const char *cursor = text;
+    while ('\0' != *cursor) {
+        if (FILTERS_MAX_STAGES == chain->count) {
+            *error_message = Filters_Error_Too_Many_Stages;
+            return;
+        }
+
+        size_t name_length = strcspn(cursor, ":,");
+        filters_stage_t *stage = &chain->stages[chain->count];
+        stage->kernel = filters_find_kernel(cursor, name_length);
+        if (NULL == stage->kernel) {
+            *error_message = Filters_Error_Unknown_Filter;
+            return;
+        }
+        cursor += name_length;
+
+        size_t parameter_count = 0;
+        while (':' == *cursor) {
+            char *end;
+            float value = strtof(cursor + 1, &end);
+            if (end == cursor + 1 || FILTERS_MAX_PARAMETERS == parameter_count) {
+                *error_message = Filters_Error_Invalid_Parameters;
+                return;
+            }
+            stage->parameters[parameter_count++] = value;
+            cursor = end;
+        }
+
+        if (parameter_count != stage->kernel->parameter_count || (',' != *cursor && '\0' != *cursor)) {
+            *error_message = Filters_Error_Invalid_Parameters;
+            return;
+        }
+        if (',' == *cursor) {
+            ++cursor;
+        }
+
+        chain->count += 1;
+    }
+
+    if (0 == chain->count) {
+        *error_message = Filters_Error_Unknown_Filter;
+    }
+}
+
+/* The distance in pixels from an output pixel of the chain to the farthest
+   input pixel it depends on. Point filters have a radius of 0. */
+static inline size_t filters_get_chain_radius(const filters_chain_t *chain)
+{
+    size_t radius = 0;
+    for (size_t i = 0; i < chain->count; ++i) {
+        radius += chain->stages[i].kernel->radius;
+    }
+
+    return radius;
+}
+
+static inline bool _filters_is_planar(const filters_chain_t *chain)
+{
+    if (chain->count < FILTERS_PLANAR_MINIMUM_STAGES) {
+        return false;
+    }
+
+    for (size_t i = 0; i < chain->count; ++i) {
+        if (NULL == chain->stages[i].kernel->apply_planar) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void _filters_apply_chain_planar(
+                const filters_chain_t *chain,
+                uint8_t *pixels,
+                size_t position,
+                size_t end,
+                bool streaming
+            )
+{
+    static __thread uint8_t Scratch[PLANAR_CHANNEL_COUNT][FILTERS_PLANAR_BLOCK_PIXELS] __attribute__((aligned(64)));
+    uint8_t *const planes[PLANAR_CHANNEL_COUNT] = { Scratch[0], Scratch[1], Scratch[2], Scratch[3] };
+
+    for (size_t first = position / 4; first < end / 4; first += FILTERS_PLANAR_BLOCK_PIXELS) {
+        size_t count = UTILS_MIN(FILTERS_PLANAR_BLOCK_PIXELS, end / 4 - first);
+        uint8_t *block = &pixels[first * 4];
+
+        planar_split(planes, block, 0, count);
+        for (size_t i = 0; i < chain->count; ++i) {
+            chain->stages[i].kernel->apply_planar(planes, 0, count, chain->stages[i].parameters);
+        }
+        planar_merge((const uint8_t *const *) planes, block, 0, count, streaming);
+    }
+}
+
+/* Applies every stage of the chain to the channels [position, end) before
+   moving on, so a chunk stays in cache for the whole chain. With `streaming`
+   only the last stage uses its streaming variant, the earlier ones have to
+   leave the chunk in cache for the next stage. */
+static inline void filters_apply_chain(
+                       const filters_chain_t *chain,
+                       uint8_t *pixels,
+                       size_t position,
+                       size_t end,
+                       bool streaming
+                   )
+{
+    if (_filters_is_planar(chain)) {
+        _filters_apply_chain_planar(chain, pixels, position, end, streaming);
+        return;
+    }
+
+    for (size_t i = 0; i < chain->count; ++i) {
+        const filters_kernel_t *kernel = chain->stages[i].kernel;
+        filters_kernel_function_t apply =
+            streaming && i + 1 == chain->count && NULL != kernel->apply_streaming ?
+                kernel->apply_streaming :
+                kernel->apply;
+
+        apply(pixels, position, end, chain->stages[i].parameters);
+    }
+}
+
+/* Parallel Execution */
+
+typedef struct _filters_chain_data
+{
+    const filters_chain_t *chain;
+    uint8_t *pixels;
+    size_t position;
+    size_t channels_to_process;
+    bool streaming;
+    volatile ssize_t *channels_left;
+    volatile bool *barrier_sense;
+} filters_chain_data_t;
+
+static void filters_chain_processing_task(
+                void *task_data,
+                void (*result_callback)(void *result) __attribute__((unused))
+            )
+{
+    filters_chain_data_t *data = task_data;
+
+    filters_apply_chain(
+        data->chain,
+        data->pixels,
+        data->position,
+        data->position + data->channels_to_process,
+        data->streaming
+    );
+
+    ssize_t channels_left = __sync_sub_and_fetch(data->channels_left, (ssize_t) data->channels_to_process);
+    if (channels_left <= 0) {
+        __sync_lock_test_and_set(data->barrier_sense, true);
+    }
+
+    free(data);
+    data = NULL;
+}
+
+/*
+    Splits `channels_count` channels of `pixels` into chunks of
+    `channels_per_task` channels, runs the chain over them on the threadpool
+    and waits for all of them. Without a threadpool the chain runs on the
+    calling thread. `streaming` selects the streaming variant for the last
+    stage. Returns false if the tasks could not be allocated.
+*/
+static bool filters_run_chain(
+                threadpool_t *threadpool,
+                size_t channels_per_task,
+                bool streaming,
+                const filters_chain_t *chain,
+                uint8_t *pixels,
+                size_t channels_count
+            )
+{
+    volatile ssize_t channels_left = (ssize_t) channels_count;
+    volatile bool barrier_sense = false;
+
+    if (0 == channels_count) {
+        return true;
+    }
+
+    if (NULL == threadpool) {
+        filters_apply_chain(chain, pixels, 0, channels_count, streaming);
+
+        return true;
+    }
+
+    channels_per_task = UTILS_MAX(((channels_per_task + 63) / 64) * 64, 64);
+
+    for (size_t position = 0; position < channels_count; position += channels_per_task) {
+        filters_chain_data_t *task_data = malloc(sizeof(*task_data));
+        if (task_data == NULL) {
+            /* Let the tasks that were already queued finish. The last of them
+               still writes `barrier_sense` after its decrement, so wait for
+               that write unless no task is left to do it. */
+            if (__sync_sub_and_fetch(&channels_left, (ssize_t) (channels_count - position)) <= 0) {
+                barrier_sense = true;
+            }
+            while (!barrier_sense) { }
+
+            return false;
+        }
+
+        task_data->chain = chain;
+        task_data->pixels = pixels;
+        task_data->position = position;
+        task_data->channels_to_process =
+            position + channels_per_task > channels_count ?
+                channels_count - position :
+                channels_per_task;
+        task_data->streaming = streaming;
+        task_data->channels_left = &channels_left;
+        task_data->barrier_sense = &barrier_sense;
+
+        threadpool_enqueue_task_on(
+            threadpool,
+            threadpool_get_band_worker(threadpool, position, channels_count),
+            filters_chain_processing_task,
+            task_data,
+            NULL
+        );
+    }
+
+    while (!barrier_sense) { }
+
+    return true;
+}
+
+#endif // FILTERS_H
@@ -0,0 +1,236 @@
+#include "bmp.h"
+#include "graph.h"
+#include "threadpool.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined C_IMPLEMENTATION && \
+    !defined SIMD_INTRINSICS_IMPLEMENTATION && \
+    !defined SIMD_ASM_IMPLEMENTATION
+#define C_IMPLEMENTATION 1
+#endif
+
+/*
+    Builds a graph (see graph.h) from a script and evaluates it. Statements
+    are separated by semicolons or new lines, their words by spaces:
+
+        <name> = load <file>
+        <name> = brightness <input> <brightness> <contrast>
+        <name> = sepia <input>
+        <name> = matrix <input> <12 weights, see graph_color_matrix>
+        <name> = convolve <input> <size> <size x size weights>
+        <name> = resize <input> <width> <height> [<bilinear|bicubic|lanczos>]
+        <name> = blend <over|multiply|screen|overlay> <bottom> <top>
+        save <input> <file>
+
+    For example
+
+        ./graph 'a = load in.bmp; b = brightness a 20 1.2; save b out.bmp'
+*/
+
+#define GRAPH_TOOL_MAX_WORDS 64
+#define GRAPH_TOOL_MAX_NAMES 256
+
+typedef struct _graph_tool_name
+{
+    const char *name;
+    size_t node;
+} graph_tool_name_t;
+
+static graph_tool_name_t graph_tool_names[GRAPH_TOOL_MAX_NAMES];
+static size_t graph_tool_name_count = 0;
+
+static size_t graph_tool_find_node(const char *name)
+{
+    for (size_t i = graph_tool_name_count; i-- > 0;) {
+        if (0 == strcmp(graph_tool_names[i].name, name)) {
+            return graph_tool_names[i].node;
+        }
+    }
+
+    return GRAPH_INVALID_NODE;
+}
+
+static bool graph_tool_parse_numbers(char **words, size_t count, float *numbers)
+{
+    for (size_t i = 0; i < count; ++i) {
+        char *end;
+        numbers[i] = strtof(words[i], &end);
+        if (end == words[i] || '\0' != *end) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Adds the node of one statement to the graph. Returns false with a message
+   in `error_message` for statements that cannot be parsed. */
+static bool graph_tool_parse_statement(graph_t *graph, char *statement, const char **error_message)
+{
+    *error_message = NULL;
+
+    char *words[GRAPH_TOOL_MAX_WORDS];
+    size_t count = 0;
+    char *state;
+    for (char *word = strtok_r(statement, " \t", &state); NULL != word; word = strtok_r(NULL, " \t", &state)) {
+        if (GRAPH_TOOL_MAX_WORDS == count) {
+            *error_message = "Too many words in the statement";
+            return false;
+        }
+        words[count++] = word;
+    }
+
+    if (0 == count) {
+        return true;
+    }
+
+    if (0 == strcmp(words[0], "save")) {
+        if (3 != count || GRAPH_INVALID_NODE == graph_tool_find_node(words[1])) {
+            *error_message = "Expected save <input> <file>";
+            return false;
+        }
+
+        graph_save(graph, graph_tool_find_node(words[1]), words[2]);
+        return true;
+    }
+
+    if (count < 3 || 0 != strcmp(words[1], "=")) {
+        *error_message = "Expected <name> = <operation> ...";
+        return false;
+    }
+    if (GRAPH_TOOL_MAX_NAMES == graph_tool_name_count) {
+        *error_message = "Too many names";
+        return false;
+    }
+
+    const char *operation = words[2];
+    char **arguments = &words[3];
+    size_t argument_count = count - 3;
+
+    size_t input = argument_count > 0 ? graph_tool_find_node(arguments[0]) : GRAPH_INVALID_NODE;
+    float numbers[GRAPH_MAX_KERNEL_SIZE * GRAPH_MAX_KERNEL_SIZE + 1];
+    size_t node = GRAPH_INVALID_NODE;
+
+    if (0 == strcmp(operation, "load") && 1 == argument_count) {
+        node = graph_load(graph, arguments[0]);
+    } else if (0 == strcmp(operation, "brightness") && 3 == argument_count &&
+               graph_tool_parse_numbers(&arguments[1], 2, numbers)) {
+        node = graph_brightness(graph, input, numbers[0], numbers[1]);
+    } else if (0 == strcmp(operation, "sepia") && 1 == argument_count) {
+        node = graph_sepia(graph, input);
+    } else if (0 == strcmp(operation, "matrix") && 13 == argument_count &&
+               graph_tool_parse_numbers(&arguments[1], 12, numbers)) {
+        node = graph_color_matrix(graph, input, numbers);
+    } else if (0 == strcmp(operation, "convolve") && argument_count > 2 &&
+               graph_tool_parse_numbers(&arguments[1], 1, numbers) &&
+               numbers[0] >= 1 && numbers[0] <= GRAPH_MAX_KERNEL_SIZE &&
+               argument_count == 2 + (size_t) numbers[0] * (size_t) numbers[0] &&
+               graph_tool_parse_numbers(&arguments[2], argument_count - 2, numbers + 1)) {
+        node = graph_convolve(graph, input, (size_t) numbers[0], numbers + 1);
+    } else if (0 == strcmp(operation, "resize") && (3 == argument_count || 4 == argument_count) &&
+               graph_tool_parse_numbers(&arguments[1], 2, numbers) && numbers[0] >= 1 && numbers[1] >= 1) {
+        resize_filter_t filter = RESIZE_FILTER_BICUBIC;
+        if (4 == argument_count && !resize_parse_filter(arguments[3], &filter)) {
+            *error_message = "Unknown resampling filter";
+            return false;
+        }
+        node = graph_resize(graph, input, (size_t) numbers[0], (size_t) numbers[1], filter);
+    } else if (0 == strcmp(operation, "blend") && 3 == argument_count) {
+        blend_mode_t mode;
+        if (!blend_parse_mode(arguments[0], &mode)) {
+            *error_message = "Unknown blend mode";
+            return false;
+        }
+        node = graph_blend(graph, graph_tool_find_node(arguments[1]), graph_tool_find_node(arguments[2]), mode);
+    } else {
+        *error_message = "Unknown operation or wrong arguments";
+        return false;
+    }
+
+    if (GRAPH_INVALID_NODE == node) {
+        *error_message = graph->error_message;
+        return false;
+    }
+
+    graph_tool_names[graph_tool_name_count].name = words[0];
+    graph_tool_names[graph_tool_name_count].node = node;
+    graph_tool_name_count += 1;
+
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    int result = EXIT_FAILURE;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <script>\n", argv[0]);
+        return result;
+    }
+
+    threadpool_t *threadpool = NULL;
+
+    graph_t graph;
+    graph_init(&graph);
+
+    /* The names point into the script */
+    char *script = strdup(argv[1]);
+    if (NULL == script) {
+        fputs("Out of memory.\n", stderr);
+        goto cleanup;
+    }
+
+    const char *error_message;
+    char *state;
+    for (char *statement = strtok_r(script, ";\n", &state);
+         NULL != statement;
+         statement = strtok_r(NULL, ";\n", &state)) {
+        /* The words of the statement are cut out in place */
+        size_t length = strlen(statement);
+        char text[length + 1];
+        memcpy(text, statement, length + 1);
+
+        if (!graph_tool_parse_statement(&graph, statement, &error_message)) {
+            fprintf(stderr, "%s: '%s'\n", error_message, text);
+            goto cleanup;
+        }
+    }
+
+    size_t pool_size = utils_get_number_of_cpu_cores();
+    if (pool_size > 1) {
+        threadpool = threadpool_create(pool_size);
+        if (threadpool == NULL) {
+            fputs("Failed to create a threadpool.\n", stderr);
+            goto cleanup;
+        }
+    }
+
+    graph_evaluate(&graph, threadpool, &error_message);
+    if (error_message != NULL) {
+        if (NULL != graph.error_path) {
+            fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", graph.error_path, error_message);
+        } else {
+            fprintf(stderr, "%s\n", error_message);
+        }
+        goto cleanup;
+    }
+
+    graph_print_plan(&graph, stdout);
+    timing_finish_image("graph");
+
+    result = EXIT_SUCCESS;
+
+cleanup:
+    threadpool_destroy(threadpool);
+    threadpool = NULL;
+
+    graph_free(&graph);
+    free(script);
+
+    return result;
+}
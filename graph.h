@@ -0,0 +1,1441 @@
+#ifndef GRAPH_H
+#define GRAPH_H
+
+#include "blend.h"
+#include "bmp.h"
+#include "image_io.h"
+#include "resize.h"
+#include "threadpool.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+    A graph of image operations that is only evaluated when its results are
+    saved. The builders add nodes and return their ids, nothing is read or
+    computed until `graph_evaluate`:
+
+        graph_t graph; graph_init(&graph);
+        size_t image = graph_load(&graph, "in.bmp");
+        image = graph_brightness(&graph, image, 20, 1.2f);
+        graph_save(&graph, graph_sepia(&graph, image), "out.bmp");
+        graph_evaluate(&graph, threadpool, &error_message);
+
+    A builder that fails returns GRAPH_INVALID_NODE and the graph keeps the
+    error for `graph_evaluate`, so a whole graph can be built before errors
+    are checked.
+
+    Before the evaluation the planner
+
+        removes nodes that do nothing: identity tables and matrices (e.g.
+        brightness 0 with contrast 1) and kernels with a single 1 in the
+        center,
+        drops the nodes no saved result depends on,
+        fuses point operations (tables and color matrices) into the stage
+        that computes their input, so they run on each band while it is
+        still in the cache instead of in a pass of their own,
+        collapses consecutive tables into one and consecutive matrices into
+        one (see `_graph_append_point_operation`),
+        picks the rows of the bands of every stage, about GRAPH_TILE_SIZE
+        bytes but at least GRAPH_BANDS_PER_THREAD bands per thread.
+
+    Every stage holds its result in a whole image. Bands are the tiles: the
+    kernels work on full rows. All bands of all stages are then computed in
+    one parallel pass. Every band counts the input bands it reads that are
+    not computed yet, and the task that computes the last of them queues the
+    band, so no task ever waits for another one and a band is usually
+    filtered by the next stage soon after it was computed.
+
+    Point operations are applied to 8-bit channels one after another. The
+    only exception is a matrix collapsed into the next one, whose
+    intermediate result is not rounded. Only pairs are collapsed, and only
+    when the first matrix cannot leave [0, 255] and the weights of every row
+    of the second one add up to at most 1 in absolute value, so the lost
+    rounding is not amplified. Every collapsed pair may change the result
+    by at most one.
+*/
+
+static const char *Graph_Error_Invalid_Node =
+                    "Invalid input node",
+                  *Graph_Error_Invalid_Kernel_Size =
+                    "Invalid convolution kernel size (expected an odd size up to 7)",
+                  *Graph_Error_Invalid_Size =
+                    "Invalid output size",
+                  *Graph_Error_Nothing_to_Save =
+                    "The graph has no saved results",
+                  *Graph_Error_Failed_to_Open_Source =
+                    "Failed to open the source image file",
+                  *Graph_Error_Failed_to_Create_Destination =
+                    "Failed to create the output image",
+                  *Graph_Error_Not_Enough_Memory =
+                    "Not enough memory to evaluate the graph";
+
+#define GRAPH_INVALID_NODE SIZE_MAX
+#define GRAPH_MAX_KERNEL_SIZE 7
+#define GRAPH_MAX_POINT_OPERATIONS 8
+#define GRAPH_TILE_SIZE (256 * 1024)    /* bytes of output rows in a band */
+#define GRAPH_BANDS_PER_THREAD 4
+
+/* Bands of a resize need all source rows under their filter windows, so
+   thin bands read the same source rows again (see resize.c) */
+#define GRAPH_RESIZE_MINIMUM_BAND_ROWS 16
+
+typedef enum _graph_operation
+{
+    GRAPH_OPERATION_LOAD,
+    GRAPH_OPERATION_TABLE,      /* a lookup table per color channel    */
+    GRAPH_OPERATION_MATRIX,     /* a 3x4 color matrix                  */
+    GRAPH_OPERATION_CONVOLVE,
+    GRAPH_OPERATION_RESIZE,
+    GRAPH_OPERATION_BLEND
+} graph_operation_t;
+
+static const char *Graph_Operation_Names[] = {
+    "load", "table", "matrix", "convolve", "resize", "blend"
+};
+
+typedef struct _graph_node
+{
+    graph_operation_t operation;
+    const char *name;                   /* of the builder, e.g. brightness  */
+    size_t inputs[2];                   /* GRAPH_INVALID_NODE if not used   */
+
+    union {
+        char *path;                                 /* load             */
+        uint8_t table[3][256];                      /* blue, green, red */
+        float matrix[12];                           /* see graph_color_matrix */
+        struct {
+            size_t size;
+            float weights[GRAPH_MAX_KERNEL_SIZE * GRAPH_MAX_KERNEL_SIZE];
+        } convolution;
+        struct {
+            size_t width;
+            size_t height;
+            resize_filter_t filter;
+        } resize;
+        blend_mode_t blend_mode;
+    };
+} graph_node_t;
+
+typedef struct _graph_save
+{
+    size_t node;
+    char *path;
+} graph_save_t;
+
+typedef struct _graph_point_operation
+{
+    bool matrix;
+    bool collapsed;                     /* a product of two matrices            */
+    uint8_t table[3][256];
+    float coefficients[12];
+} graph_point_operation_t;
+
+typedef struct _graph_stage
+{
+    graph_operation_t operation;        /* a table or a matrix copies its input */
+    size_t node;                        /* the node that starts the stage       */
+    size_t inputs[2];                   /* stages, GRAPH_INVALID_NODE if unused */
+    size_t fused_count;                 /* point nodes fused into the stage     */
+
+    graph_point_operation_t program[GRAPH_MAX_POINT_OPERATIONS];
+    size_t program_length;
+
+    bmp_image image;                    /* top-down                             */
+    image_format format;                /* of the source the stage comes from   */
+    resize_weights_t *horizontal_weights;
+    resize_weights_t *vertical_weights;
+
+    size_t rows_per_band;
+    size_t band_count;
+    size_t first_band;                  /* id of band 0 among all bands         */
+    size_t bands_scheduled;             /* while the schedule is made           */
+} graph_stage_t;
+
+typedef struct _graph_task
+{
+    size_t stage;
+    size_t band;
+} graph_task_t;
+
+typedef struct _graph
+{
+    graph_node_t *nodes;
+    size_t node_count;
+    size_t node_capacity;
+
+    graph_save_t *saves;
+    size_t save_count;
+    size_t save_capacity;
+
+    const char *error_message;          /* the first error of a builder         */
+    const char *error_path;             /* the file of an evaluation error      */
+
+    /* The plan of the last evaluation */
+    size_t *node_stages;                /* GRAPH_INVALID_NODE for removed nodes */
+    graph_stage_t *stages;
+    size_t stage_count;
+    size_t removed_count;               /* nodes that did nothing               */
+    size_t dead_count;                  /* nodes no result depends on           */
+    size_t task_count;
+    volatile bool failed;               /* a band ran out of memory             */
+
+    /* The bands of all stages by id, and which bands read which */
+    graph_task_t *bands;
+    size_t band_count;
+    volatile ssize_t *inputs_left;      /* input bands not computed yet         */
+    size_t *dependent_offsets;          /* the readers of band i are in         */
+    size_t *dependents;                 /* [offsets[i], offsets[i + 1])         */
+} graph_t;
+
+static inline void graph_init(graph_t *graph)
+{
+    memset(graph, 0, sizeof(*graph));
+}
+
+static void _graph_free_plan(graph_t *graph)
+{
+    for (size_t i = 0; i < graph->stage_count; ++i) {
+        graph_stage_t *stage = &graph->stages[i];
+
+        bmp_free_image_structure(&stage->image);
+        resize_weights_destroy(stage->horizontal_weights);
+        resize_weights_destroy(stage->vertical_weights);
+    }
+
+    free(graph->stages);
+    graph->stages = NULL;
+    graph->stage_count = 0;
+
+    free(graph->bands);
+    graph->bands = NULL;
+    graph->band_count = 0;
+    free((void *) graph->inputs_left);
+    graph->inputs_left = NULL;
+    free(graph->dependent_offsets);
+    graph->dependent_offsets = NULL;
+    free(graph->dependents);
+    graph->dependents = NULL;
+
+    free(graph->node_stages);
+    graph->node_stages = NULL;
+}
+
+static void graph_free(graph_t *graph)
+{
+    _graph_free_plan(graph);
+
+    for (size_t i = 0; i < graph->node_count; ++i) {
+        if (GRAPH_OPERATION_LOAD == graph->nodes[i].operation) {
+            free(graph->nodes[i].path);
+        }
+    }
+    free(graph->nodes);
+
+    for (size_t i = 0; i < graph->save_count; ++i) {
+        free(graph->saves[i].path);
+    }
+    free(graph->saves);
+
+    graph_init(graph);
+}
+
+/* Builders */
+
+static graph_node_t *_graph_add_node(
+                         graph_t *graph,
+                         graph_operation_t operation,
+                         const char *name,
+                         size_t first_input,
+                         size_t second_input,
+                         size_t *id
+                     )
+{
+    *id = GRAPH_INVALID_NODE;
+    if (NULL != graph->error_message) {
+        return NULL;
+    }
+
+    size_t input_count = GRAPH_OPERATION_LOAD == operation ? 0 : GRAPH_OPERATION_BLEND == operation ? 2 : 1;
+    if ((input_count > 0 && first_input >= graph->node_count) ||
+        (input_count > 1 && second_input >= graph->node_count)) {
+        graph->error_message = Graph_Error_Invalid_Node;
+        return NULL;
+    }
+
+    if (graph->node_count == graph->node_capacity) {
+        size_t capacity = UTILS_MAX(graph->node_capacity * 2, 16);
+        graph_node_t *nodes = realloc(graph->nodes, capacity * sizeof(*nodes));
+        if (NULL == nodes) {
+            graph->error_message = Graph_Error_Not_Enough_Memory;
+            return NULL;
+        }
+        graph->nodes = nodes;
+        graph->node_capacity = capacity;
+    }
+
+    graph_node_t *node = &graph->nodes[graph->node_count];
+    memset(node, 0, sizeof(*node));
+    node->operation = operation;
+    node->name = name;
+    node->inputs[0] = input_count > 0 ? first_input : GRAPH_INVALID_NODE;
+    node->inputs[1] = input_count > 1 ? second_input : GRAPH_INVALID_NODE;
+
+    *id = graph->node_count++;
+
+    return node;
+}
+
+static size_t graph_load(graph_t *graph, const char *path)
+{
+    size_t id;
+    graph_node_t *node = _graph_add_node(graph, GRAPH_OPERATION_LOAD, "load", 0, 0, &id);
+    if (NULL == node) {
+        return id;
+    }
+
+    node->path = strdup(path);
+    if (NULL == node->path) {
+        graph->error_message = Graph_Error_Not_Enough_Memory;
+        graph->node_count -= 1;
+        id = GRAPH_INVALID_NODE;
+    }
+
+    return id;
+}
+
+/* Maps every blue, green and red value through its table, alpha is kept. */
+static size_t graph_table(graph_t *graph, size_t input, const uint8_t table[3][256])
+{
+    size_t id;
+    graph_node_t *node = _graph_add_node(graph, GRAPH_OPERATION_TABLE, "table", input, 0, &id);
+    if (NULL != node) {
+        memcpy(node->table, table, sizeof(node->table));
+    }
+
+    return id;
+}
+
+/* The brightness filter (see filters_brightness_c) as a table */
+static size_t graph_brightness(graph_t *graph, size_t input, float brightness, float contrast)
+{
+    size_t id;
+    graph_node_t *node = _graph_add_node(graph, GRAPH_OPERATION_TABLE, "brightness", input, 0, &id);
+    if (NULL == node) {
+        return id;
+    }
+
+    for (size_t value = 0; value < 256; ++value) {
+        uint8_t result = (uint8_t) UTILS_CLAMP(value * contrast + brightness, 0.0f, 255.0f);
+        node->table[0][value] = node->table[1][value] = node->table[2][value] = result;
+    }
+
+    return id;
+}
+
+/*
+    Every output color is a row of `matrix`: the weights of the input blue,
+    green and red and an offset,
+
+        blue'  = matrix[0] * blue + matrix[1] * green + matrix[2]  * red + matrix[3]
+        green' = matrix[4] * blue + ...                                  + matrix[7]
+        red'   = matrix[8] * blue + ...                                  + matrix[11]
+
+    clamped to [0, 255] and truncated. Alpha is kept.
+*/
+static size_t graph_color_matrix(graph_t *graph, size_t input, const float matrix[12])
+{
+    size_t id;
+    graph_node_t *node = _graph_add_node(graph, GRAPH_OPERATION_MATRIX, "matrix", input, 0, &id);
+    if (NULL != node) {
+        memcpy(node->matrix, matrix, sizeof(node->matrix));
+    }
+
+    return id;
+}
+
+/* The sepia filter (see filters_sepia_c) as a matrix */
+static size_t graph_sepia(graph_t *graph, size_t input)
+{
+    static const float Sepia_Matrix[12] = {
+        0.272f, 0.534f, 0.131f, 0.0f,
+        0.349f, 0.686f, 0.168f, 0.0f,
+        0.393f, 0.769f, 0.189f, 0.0f
+    };
+
+    size_t id = graph_color_matrix(graph, input, Sepia_Matrix);
+    if (GRAPH_INVALID_NODE != id) {
+        graph->nodes[id].name = "sepia";
+    }
+
+    return id;
+}
+
+/* Convolves the colors with a `size` x `size` kernel of row-major `weights`,
+   the edge pixels are repeated outside of the image. Alpha is kept. */
+static size_t graph_convolve(graph_t *graph, size_t input, size_t size, const float *weights)
+{
+    if (NULL == graph->error_message && (0 == size % 2 || size > GRAPH_MAX_KERNEL_SIZE)) {
+        graph->error_message = Graph_Error_Invalid_Kernel_Size;
+    }
+
+    size_t id;
+    graph_node_t *node = _graph_add_node(graph, GRAPH_OPERATION_CONVOLVE, "convolve", input, 0, &id);
+    if (NULL != node) {
+        node->convolution.size = size;
+        memcpy(node->convolution.weights, weights, size * size * sizeof(*weights));
+    }
+
+    return id;
+}
+
+static size_t graph_resize(graph_t *graph, size_t input, size_t width, size_t height, resize_filter_t filter)
+{
+    if (NULL == graph->error_message && (0 == width || 0 == height || width > INT32_MAX || height > INT32_MAX)) {
+        graph->error_message = Graph_Error_Invalid_Size;
+    }
+
+    size_t id;
+    graph_node_t *node = _graph_add_node(graph, GRAPH_OPERATION_RESIZE, "resize", input, 0, &id);
+    if (NULL != node) {
+        node->resize.width = width;
+        node->resize.height = height;
+        node->resize.filter = filter;
+    }
+
+    return id;
+}
+
+/* Blends `top` onto `bottom` with their top left corners aligned, the result
+   has the size of `bottom`. */
+static size_t graph_blend(graph_t *graph, size_t bottom, size_t top, blend_mode_t mode)
+{
+    size_t id;
+    graph_node_t *node = _graph_add_node(graph, GRAPH_OPERATION_BLEND, "blend", bottom, top, &id);
+    if (NULL != node) {
+        node->blend_mode = mode;
+    }
+
+    return id;
+}
+
+/* Marks the result of `input` to be written to `path` by `graph_evaluate`.
+   The format follows the extension of `path`. */
+static void graph_save(graph_t *graph, size_t input, const char *path)
+{
+    if (NULL != graph->error_message) {
+        return;
+    }
+
+    if (input >= graph->node_count) {
+        graph->error_message = Graph_Error_Invalid_Node;
+        return;
+    }
+
+    if (graph->save_count == graph->save_capacity) {
+        size_t capacity = UTILS_MAX(graph->save_capacity * 2, 4);
+        graph_save_t *saves = realloc(graph->saves, capacity * sizeof(*saves));
+        if (NULL == saves) {
+            graph->error_message = Graph_Error_Not_Enough_Memory;
+            return;
+        }
+        graph->saves = saves;
+        graph->save_capacity = capacity;
+    }
+
+    char *copy = strdup(path);
+    if (NULL == copy) {
+        graph->error_message = Graph_Error_Not_Enough_Memory;
+        return;
+    }
+
+    graph->saves[graph->save_count].node = input;
+    graph->saves[graph->save_count].path = copy;
+    graph->save_count += 1;
+}
+
+/* Point Operations */
+
+static inline bool _graph_is_point_operation(graph_operation_t operation)
+{
+    return GRAPH_OPERATION_TABLE == operation || GRAPH_OPERATION_MATRIX == operation;
+}
+
+static inline bool _graph_is_identity_table(const uint8_t table[3][256])
+{
+    for (size_t channel = 0; channel < 3; ++channel) {
+        for (size_t value = 0; value < 256; ++value) {
+            if (table[channel][value] != value) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+static inline bool _graph_is_identity_matrix(const float matrix[12])
+{
+    static const float Identity[12] = {
+        1.0f, 0.0f, 0.0f, 0.0f,
+        0.0f, 1.0f, 0.0f, 0.0f,
+        0.0f, 0.0f, 1.0f, 0.0f
+    };
+
+    for (size_t i = 0; i < 12; ++i) {
+        if (matrix[i] != Identity[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* True if no input color makes the matrix leave [0, 255], so clamping its
+   result does nothing. */
+static inline bool _graph_matrix_stays_in_range(const float matrix[12])
+{
+    for (size_t row = 0; row < 3; ++row) {
+        const float *weights = &matrix[row * 4];
+        float lowest = weights[3], highest = weights[3];
+        for (size_t column = 0; column < 3; ++column) {
+            lowest += UTILS_MIN(weights[column], 0.0f) * 255.0f;
+            highest += UTILS_MAX(weights[column], 0.0f) * 255.0f;
+        }
+
+        if (lowest < 0.0f || highest > 255.0f) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* True if the absolute weights of every row add up to at most 1, so an error
+   in the input colors leads to at most the same error in the result. */
+static inline bool _graph_matrix_damps_errors(const float matrix[12])
+{
+    for (size_t row = 0; row < 3; ++row) {
+        float sum = 0.0f;
+        for (size_t column = 0; column < 3; ++column) {
+            sum += fabsf(matrix[row * 4 + column]);
+        }
+
+        if (sum > 1.0f) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static inline bool _graph_is_noop(const graph_node_t *node)
+{
+    switch (node->operation) {
+        case GRAPH_OPERATION_TABLE:
+            return _graph_is_identity_table(node->table);
+        case GRAPH_OPERATION_MATRIX:
+            return _graph_is_identity_matrix(node->matrix);
+        case GRAPH_OPERATION_CONVOLVE: {
+            size_t size = node->convolution.size;
+            for (size_t i = 0; i < size * size; ++i) {
+                if (node->convolution.weights[i] != (i == size * size / 2 ? 1.0f : 0.0f)) {
+                    return false;
+                }
+            }
+
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+/*
+    Appends the operation of a point node to the program of a stage. A table
+    after a table becomes one table. A matrix after a matrix becomes their
+    product if the first one stays in range and the second one damps errors
+    (see `_graph_matrix_damps_errors`), so losing the rounding of the first
+    result changes the product by at most one. A product is not collapsed
+    again, every further rounding lost could add one more. Operations that
+    end up as the identity are removed. Returns false if the program is full.
+*/
+static bool _graph_append_point_operation(graph_stage_t *stage, const graph_node_t *node)
+{
+    graph_point_operation_t *last =
+        stage->program_length > 0 ? &stage->program[stage->program_length - 1] : NULL;
+    bool matrix = GRAPH_OPERATION_MATRIX == node->operation;
+
+    if (NULL != last && !last->matrix && !matrix) {
+        for (size_t channel = 0; channel < 3; ++channel) {
+            for (size_t value = 0; value < 256; ++value) {
+                last->table[channel][value] = node->table[channel][last->table[channel][value]];
+            }
+        }
+    } else if (NULL != last && last->matrix && matrix && !last->collapsed &&
+               _graph_matrix_stays_in_range(last->coefficients) &&
+               _graph_matrix_damps_errors(node->matrix)) {
+        float product[12];
+        for (size_t row = 0; row < 3; ++row) {
+            for (size_t column = 0; column < 4; ++column) {
+                float value = 3 == column ? node->matrix[row * 4 + 3] : 0.0f;
+                for (size_t k = 0; k < 3; ++k) {
+                    value += node->matrix[row * 4 + k] * last->coefficients[k * 4 + column];
+                }
+                product[row * 4 + column] = value;
+            }
+        }
+        memcpy(last->coefficients, product, sizeof(product));
+        last->collapsed = true;
+    } else {
+        if (GRAPH_MAX_POINT_OPERATIONS == stage->program_length) {
+            return false;
+        }
+
+        last = &stage->program[stage->program_length++];
+        last->matrix = matrix;
+        last->collapsed = false;
+        if (matrix) {
+            memcpy(last->coefficients, node->matrix, sizeof(last->coefficients));
+        } else {
+            memcpy(last->table, node->table, sizeof(last->table));
+        }
+    }
+
+    if (last->matrix ? _graph_is_identity_matrix(last->coefficients) : _graph_is_identity_table(last->table)) {
+        stage->program_length -= 1;
+    }
+
+    return true;
+}
+
+/* Applies `operation` to the channels [0, count) of `source` and writes
+   them to `destination`, which may be `source`. */
+static inline void _graph_apply_point_operation(
+                       const graph_point_operation_t *operation,
+                       const uint8_t *source,
+                       uint8_t *destination,
+                       size_t count
+                   )
+{
+    if (!operation->matrix) {
+        for (size_t position = 0; position < count; position += 4) {
+            destination[position] = operation->table[0][source[position]];
+            destination[position + 1] = operation->table[1][source[position + 1]];
+            destination[position + 2] = operation->table[2][source[position + 2]];
+            destination[position + 3] = source[position + 3];
+        }
+
+        return;
+    }
+
+    const float *m = operation->coefficients;
+    for (size_t position = 0; position < count; position += 4) {
+        float blue = source[position];
+        float green = source[position + 1];
+        float red = source[position + 2];
+
+        destination[position] =
+            (uint8_t) UTILS_CLAMP(m[0] * blue + m[1] * green + m[2] * red + m[3], 0.0f, 255.0f);
+        destination[position + 1] =
+            (uint8_t) UTILS_CLAMP(m[4] * blue + m[5] * green + m[6] * red + m[7], 0.0f, 255.0f);
+        destination[position + 2] =
+            (uint8_t) UTILS_CLAMP(m[8] * blue + m[9] * green + m[10] * red + m[11], 0.0f, 255.0f);
+        destination[position + 3] = source[position + 3];
+    }
+}
+
+/* Kernels */
+
+static void _graph_convolve_rows(
+                const graph_node_t *node,
+                const bmp_image *source,
+                bmp_image *destination,
+                size_t first_row,
+                size_t end_row
+            )
+{
+    size_t width = source->absolute_image_width;
+    size_t height = source->absolute_image_height;
+    size_t size = node->convolution.size;
+    size_t radius = size / 2;
+    const float *weights = node->convolution.weights;
+
+    for (size_t y = first_row; y < end_row; ++y) {
+        const uint8_t *rows[GRAPH_MAX_KERNEL_SIZE];
+        for (size_t ky = 0; ky < size; ++ky) {
+            size_t row = (size_t) UTILS_CLAMP((long) (y + ky) - (long) radius, 0L, (long) height - 1);
+            rows[ky] = source->pixels + row * width * 4;
+        }
+
+        uint8_t *output = destination->pixels + y * width * 4;
+        for (size_t x = 0; x < width; ++x) {
+            size_t columns[GRAPH_MAX_KERNEL_SIZE];
+            for (size_t kx = 0; kx < size; ++kx) {
+                columns[kx] = (size_t) UTILS_CLAMP((long) (x + kx) - (long) radius, 0L, (long) width - 1) * 4;
+            }
+
+            float blue = 0.0f, green = 0.0f, red = 0.0f;
+            for (size_t ky = 0; ky < size; ++ky) {
+                for (size_t kx = 0; kx < size; ++kx) {
+                    const uint8_t *pixel = rows[ky] + columns[kx];
+                    float weight = weights[ky * size + kx];
+                    blue += weight * pixel[0];
+                    green += weight * pixel[1];
+                    red += weight * pixel[2];
+                }
+            }
+
+            output[x * 4] = (uint8_t) UTILS_CLAMP(blue + 0.5f, 0.0f, 255.0f);
+            output[x * 4 + 1] = (uint8_t) UTILS_CLAMP(green + 0.5f, 0.0f, 255.0f);
+            output[x * 4 + 2] = (uint8_t) UTILS_CLAMP(red + 0.5f, 0.0f, 255.0f);
+            output[x * 4 + 3] = rows[radius][x * 4 + 3];
+        }
+    }
+}
+
+static bool _graph_resize_rows(const graph_stage_t *stage, const bmp_image *source, size_t first_row, size_t end_row)
+{
+    const resize_weights_t *horizontal_weights = stage->horizontal_weights;
+    const resize_weights_t *vertical_weights = stage->vertical_weights;
+
+    size_t source_row_size = source->absolute_image_width * 4;
+    size_t destination_row_size = stage->image.absolute_image_width * 4;
+    size_t band_row_stride = ((destination_row_size - 1) / 16 + 1) * 16;
+
+    size_t band_first_row = vertical_weights->first[first_row];
+    size_t band_last_row =
+        UTILS_MIN(vertical_weights->first[end_row - 1] + vertical_weights->taps, vertical_weights->in_size);
+    size_t band_rows = band_last_row - band_first_row;
+
+    size_t band_size = sizeof(float) * band_rows * band_row_stride;
+    band_size = ((band_size - 1) / 64 + 1) * 64;
+    float *band = (float *) aligned_alloc(64, band_size);
+    if (band == NULL) {
+        return false;
+    }
+
+    for (size_t y = band_first_row; y < band_last_row; ++y) {
+        resize_horizontal_row(
+            source->pixels + y * source_row_size,
+            band + (y - band_first_row) * band_row_stride,
+            horizontal_weights
+        );
+    }
+
+    for (size_t y = first_row; y < end_row; ++y) {
+        resize_vertical_row(
+            band,
+            band_first_row,
+            band_row_stride,
+            stage->image.pixels + y * destination_row_size,
+            destination_row_size,
+            vertical_weights,
+            y
+        );
+    }
+
+    free(band);
+
+    return true;
+}
+
+static bool _graph_blend_rows(
+                const graph_node_t *node,
+                const bmp_image *bottom,
+                const bmp_image *top,
+                bmp_image *destination,
+                size_t first_row,
+                size_t end_row
+            )
+{
+    size_t width = bottom->absolute_image_width;
+    size_t count = UTILS_MIN(width, top->absolute_image_width);
+
+    memcpy(destination->pixels + first_row * width * 4, bottom->pixels + first_row * width * 4, (end_row - first_row) * width * 4);
+
+    end_row = UTILS_MIN(end_row, top->absolute_image_height);
+    if (first_row >= end_row) {
+        return true;
+    }
+
+    /* The overlay is premultiplied a row at a time, its pixels stay unchanged
+       for the other readers */
+    uint8_t *overlay = malloc(count * 4);
+    if (NULL == overlay) {
+        return false;
+    }
+
+    for (size_t y = first_row; y < end_row; ++y) {
+        memcpy(overlay, top->pixels + y * top->absolute_image_width * 4, count * 4);
+        blend_premultiply(overlay, count);
+        blend_row(destination->pixels + y * width * 4, overlay, count, node->blend_mode, false);
+    }
+
+    free(overlay);
+
+    return true;
+}
+
+/* Planning */
+
+/* A load without point operations is complete once it is decoded */
+static inline bool _graph_is_complete_load(const graph_stage_t *stage)
+{
+    return GRAPH_OPERATION_LOAD == stage->operation && 0 == stage->program_length;
+}
+
+/* The rows [*first, *end) of input `index` that the rows [first_row, end_row)
+   of `stage` read. */
+static void _graph_get_input_rows(
+                const graph_t *graph,
+                const graph_stage_t *stage,
+                size_t index,
+                size_t first_row,
+                size_t end_row,
+                size_t *first,
+                size_t *end
+            )
+{
+    const graph_stage_t *input = &graph->stages[stage->inputs[index]];
+    size_t height = input->image.absolute_image_height;
+
+    if (GRAPH_OPERATION_CONVOLVE == stage->operation) {
+        size_t radius = graph->nodes[stage->node].convolution.size / 2;
+        *first = first_row - UTILS_MIN(first_row, radius);
+        *end = UTILS_MIN(end_row + radius, height);
+    } else if (GRAPH_OPERATION_RESIZE == stage->operation) {
+        const resize_weights_t *weights = stage->vertical_weights;
+        *first = weights->first[first_row];
+        *end = UTILS_MIN(weights->first[end_row - 1] + weights->taps, height);
+    } else {
+        *first = UTILS_MIN(first_row, height);
+        *end = UTILS_MIN(end_row, height);
+    }
+}
+
+static void _graph_choose_bands(graph_stage_t *stage, size_t thread_count)
+{
+    size_t width = stage->image.absolute_image_width;
+    size_t height = stage->image.absolute_image_height;
+
+    size_t rows = UTILS_MAX(GRAPH_TILE_SIZE / (width * 4), 1);
+    rows = UTILS_MIN(rows, (height - 1) / (thread_count * GRAPH_BANDS_PER_THREAD) + 1);
+    if (GRAPH_OPERATION_RESIZE == stage->operation) {
+        rows = UTILS_MAX(rows, GRAPH_RESIZE_MINIMUM_BAND_ROWS);
+    }
+
+    stage->rows_per_band = rows;
+    stage->band_count = (height - 1) / rows + 1;
+}
+
+/* Decodes a loaded image, top-down like every other stage. */
+static void _graph_load_stage(graph_t *graph, graph_stage_t *stage, const char **error_message)
+{
+    const char *path = graph->nodes[stage->node].path;
+
+    FILE *source_descriptor = fopen(path, "r");
+    if (NULL == source_descriptor) {
+        if (NULL != error_message) {
+            *error_message = Graph_Error_Failed_to_Open_Source;
+        }
+        graph->error_path = path;
+
+        return;
+    }
+
+    stage->format = IMAGE_FORMAT_BMP;
+    image_io_open_image_headers(source_descriptor, &stage->image, &stage->format, error_message);
+    if (NULL == *error_message) {
+        image_io_read_image_data_oriented(
+            source_descriptor,
+            &stage->image,
+            stage->format,
+            BMP_ORIENTATION_TOP_DOWN,
+            error_message
+        );
+    }
+    if (NULL != *error_message) {
+        graph->error_path = path;
+    }
+
+    fclose(source_descriptor);
+}
+
+/* Sets up the output image and the bands of a stage that is not a load. */
+static void _graph_prepare_stage(graph_t *graph, graph_stage_t *stage, const char **error_message)
+{
+    *error_message = NULL;
+
+    const graph_node_t *node = &graph->nodes[stage->node];
+    const graph_stage_t *input = &graph->stages[stage->inputs[0]];
+
+    size_t width = input->image.absolute_image_width;
+    size_t height = input->image.absolute_image_height;
+    if (GRAPH_OPERATION_RESIZE == stage->operation) {
+        width = node->resize.width;
+        height = node->resize.height;
+
+        stage->horizontal_weights =
+            resize_weights_create(input->image.absolute_image_width, width, node->resize.filter);
+        stage->vertical_weights =
+            resize_weights_create(input->image.absolute_image_height, height, node->resize.filter);
+        if (NULL == stage->horizontal_weights || NULL == stage->vertical_weights) {
+            if (NULL != error_message) {
+                *error_message = Graph_Error_Not_Enough_Memory;
+            }
+
+            return;
+        }
+    }
+
+    stage->format = input->format;
+    bmp_create_image_from_template(&stage->image, &input->image, width, height, error_message);
+}
+
+/*
+    Gives every band an id and links the bands to the input bands they read:
+    `inputs_left` counts the input bands of a band, `dependents` lists the
+    bands that read a band. Complete loads are never waited for.
+*/
+static void _graph_link_bands(graph_t *graph, const char **error_message)
+{
+    *error_message = NULL;
+
+    size_t band_count = 0;
+    for (size_t i = 0; i < graph->stage_count; ++i) {
+        graph->stages[i].first_band = band_count;
+        band_count += graph->stages[i].band_count;
+    }
+
+    size_t *cursors = NULL;
+    graph->band_count = band_count;
+    graph->bands = malloc(UTILS_MAX(band_count, 1) * sizeof(*graph->bands));
+    graph->inputs_left = calloc(UTILS_MAX(band_count, 1), sizeof(*graph->inputs_left));
+    graph->dependent_offsets = calloc(band_count + 1, sizeof(*graph->dependent_offsets));
+    if (NULL == graph->bands || NULL == graph->inputs_left || NULL == graph->dependent_offsets) {
+        goto fail;
+    }
+
+    /* The first pass counts the links, the second one records them */
+    for (size_t pass = 0; pass < 2; ++pass) {
+        for (size_t i = 0; i < graph->stage_count; ++i) {
+            graph_stage_t *stage = &graph->stages[i];
+
+            for (size_t band = 0; band < stage->band_count; ++band) {
+                size_t id = stage->first_band + band;
+                graph->bands[id].stage = i;
+                graph->bands[id].band = band;
+
+                size_t first_row = band * stage->rows_per_band;
+                size_t end_row = UTILS_MIN(first_row + stage->rows_per_band, stage->image.absolute_image_height);
+
+                for (size_t j = 0; j < 2 && GRAPH_INVALID_NODE != stage->inputs[j]; ++j) {
+                    const graph_stage_t *input = &graph->stages[stage->inputs[j]];
+                    size_t first, end;
+                    _graph_get_input_rows(graph, stage, j, first_row, end_row, &first, &end);
+                    if (_graph_is_complete_load(input) || first >= end) {
+                        continue;
+                    }
+
+                    size_t last_band = input->first_band + (end - 1) / input->rows_per_band;
+                    for (size_t input_band = input->first_band + first / input->rows_per_band;
+                         input_band <= last_band;
+                         ++input_band) {
+                        if (0 == pass) {
+                            graph->inputs_left[id] += 1;
+                            graph->dependent_offsets[input_band + 1] += 1;
+                        } else {
+                            graph->dependents[cursors[input_band]++] = id;
+                        }
+                    }
+                }
+            }
+        }
+
+        if (0 == pass) {
+            for (size_t id = 0; id < band_count; ++id) {
+                graph->dependent_offsets[id + 1] += graph->dependent_offsets[id];
+            }
+
+            graph->dependents = malloc(UTILS_MAX(graph->dependent_offsets[band_count], 1) * sizeof(*graph->dependents));
+            cursors = malloc(UTILS_MAX(band_count, 1) * sizeof(*cursors));
+            if (NULL == graph->dependents || NULL == cursors) {
+                goto fail;
+            }
+            memcpy(cursors, graph->dependent_offsets, band_count * sizeof(*cursors));
+        }
+    }
+
+    free(cursors);
+
+    return;
+
+fail:
+    free(cursors);
+    if (NULL != error_message) {
+        *error_message = Graph_Error_Not_Enough_Memory;
+    }
+}
+
+/*
+    Plans the evaluation: removes no-ops and dead nodes, groups the nodes
+    into stages, loads the sources and sets up the outputs and bands.
+*/
+static void _graph_plan(graph_t *graph, size_t thread_count, const char **error_message)
+{
+    *error_message = NULL;
+
+    size_t count = graph->node_count;
+    size_t *resolved = malloc(UTILS_MAX(count, 1) * sizeof(*resolved));
+    size_t *consumers = calloc(UTILS_MAX(count, 1), sizeof(*consumers));
+    graph->node_stages = malloc(UTILS_MAX(count, 1) * sizeof(*graph->node_stages));
+    graph->stages = calloc(UTILS_MAX(count, 1), sizeof(*graph->stages));
+    if (NULL == resolved || NULL == consumers || NULL == graph->node_stages || NULL == graph->stages) {
+        if (NULL != error_message) {
+            *error_message = Graph_Error_Not_Enough_Memory;
+        }
+
+        goto cleanup;
+    }
+
+    /* A node that does nothing stands for its input */
+    graph->removed_count = 0;
+    for (size_t i = 0; i < count; ++i) {
+        resolved[i] = i;
+        if (_graph_is_noop(&graph->nodes[i])) {
+            resolved[i] = resolved[graph->nodes[i].inputs[0]];
+            graph->removed_count += 1;
+        }
+    }
+
+    /* Inputs always come before their nodes, so one backward sweep finds
+       every node that a saved result depends on */
+    for (size_t i = 0; i < graph->save_count; ++i) {
+        consumers[resolved[graph->saves[i].node]] += 1;
+    }
+    graph->dead_count = 0;
+    for (size_t i = count; i-- > 0;) {
+        if (resolved[i] != i) {
+            continue;
+        }
+        if (0 == consumers[i]) {
+            graph->dead_count += 1;
+            continue;
+        }
+
+        for (size_t j = 0; j < 2 && GRAPH_INVALID_NODE != graph->nodes[i].inputs[j]; ++j) {
+            consumers[resolved[graph->nodes[i].inputs[j]]] += 1;
+        }
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        graph->node_stages[i] = GRAPH_INVALID_NODE;
+        if (resolved[i] != i || 0 == consumers[i]) {
+            continue;
+        }
+
+        const graph_node_t *node = &graph->nodes[i];
+
+        /* A point node joins the stage of its input if nothing else reads the
+           input */
+        if (_graph_is_point_operation(node->operation)) {
+            size_t input = resolved[node->inputs[0]];
+            graph_stage_t *stage = &graph->stages[graph->node_stages[input]];
+            if (1 == consumers[input] && _graph_append_point_operation(stage, node)) {
+                graph->node_stages[i] = graph->node_stages[input];
+                stage->fused_count += 1;
+                continue;
+            }
+        }
+
+        graph_stage_t *stage = &graph->stages[graph->stage_count];
+        bmp_init_image_structure(&stage->image);
+        stage->operation = node->operation;
+        stage->node = i;
+        for (size_t j = 0; j < 2; ++j) {
+            stage->inputs[j] =
+                GRAPH_INVALID_NODE == node->inputs[j] ?
+                    GRAPH_INVALID_NODE :
+                    graph->node_stages[resolved[node->inputs[j]]];
+        }
+        graph->node_stages[i] = graph->stage_count++;
+
+        if (_graph_is_point_operation(node->operation)) {
+            _graph_append_point_operation(stage, node);
+        }
+    }
+
+    for (size_t i = 0; i < graph->save_count; ++i) {
+        graph->saves[i].node = resolved[graph->saves[i].node];
+    }
+
+    for (size_t i = 0; i < graph->stage_count; ++i) {
+        graph_stage_t *stage = &graph->stages[i];
+        if (GRAPH_OPERATION_LOAD == stage->operation) {
+            _graph_load_stage(graph, stage, error_message);
+        } else {
+            _graph_prepare_stage(graph, stage, error_message);
+        }
+        if (NULL != *error_message) {
+            goto cleanup;
+        }
+
+        _graph_choose_bands(stage, thread_count);
+    }
+
+    _graph_link_bands(graph, error_message);
+
+cleanup:
+    free(resolved);
+    free(consumers);
+}
+
+/* Evaluation */
+
+static void _graph_compute_band(graph_t *graph, graph_stage_t *stage, size_t band)
+{
+    const graph_node_t *node = &graph->nodes[stage->node];
+    size_t row_size = stage->image.absolute_image_width * 4;
+    size_t first_row = band * stage->rows_per_band;
+    size_t end_row = UTILS_MIN(first_row + stage->rows_per_band, stage->image.absolute_image_height);
+
+    const bmp_image *input = GRAPH_INVALID_NODE != stage->inputs[0] ? &graph->stages[stage->inputs[0]].image : NULL;
+    uint8_t *pixels = stage->image.pixels + first_row * row_size;
+    size_t channels_count = (end_row - first_row) * row_size;
+    size_t first_operation = 0;
+
+    bool computed = true;
+    switch (stage->operation) {
+        case GRAPH_OPERATION_LOAD:
+            break;
+        case GRAPH_OPERATION_TABLE:
+        case GRAPH_OPERATION_MATRIX:
+            /* The first operation reads the input directly */
+            if (0 == stage->program_length) {
+                memcpy(pixels, input->pixels + first_row * row_size, channels_count);
+            } else {
+                _graph_apply_point_operation(
+                    &stage->program[0],
+                    input->pixels + first_row * row_size,
+                    pixels,
+                    channels_count
+                );
+                first_operation = 1;
+            }
+            break;
+        case GRAPH_OPERATION_CONVOLVE:
+            _graph_convolve_rows(node, input, &stage->image, first_row, end_row);
+            break;
+        case GRAPH_OPERATION_RESIZE:
+            computed = _graph_resize_rows(stage, input, first_row, end_row);
+            break;
+        case GRAPH_OPERATION_BLEND:
+            computed =
+                _graph_blend_rows(
+                    node,
+                    input,
+                    &graph->stages[stage->inputs[1]].image,
+                    &stage->image,
+                    first_row,
+                    end_row
+                );
+            break;
+    }
+    if (!computed) {
+        graph->failed = true;
+    }
+
+    for (size_t i = first_operation; i < stage->program_length; ++i) {
+        _graph_apply_point_operation(&stage->program[i], pixels, pixels, channels_count);
+    }
+}
+
+typedef struct _graph_band_data
+{
+    graph_t *graph;
+    threadpool_t *threadpool;
+    size_t band;                        /* id among the bands of all stages     */
+    volatile ssize_t *tasks_left;
+    volatile bool *barrier_sense;
+} graph_band_data_t;
+
+static void _graph_enqueue_band(const graph_band_data_t *data, size_t band);
+
+/* Computes a band and queues the bands that only waited for it. */
+static void _graph_run_band(const graph_band_data_t *data)
+{
+    graph_t *graph = data->graph;
+    const graph_task_t *task = &graph->bands[data->band];
+
+    _graph_compute_band(graph, &graph->stages[task->stage], task->band);
+
+    /* The readers are queued before the band counts as done, so the barrier
+       cannot open while some of them are still to be queued */
+    for (size_t i = graph->dependent_offsets[data->band]; i < graph->dependent_offsets[data->band + 1]; ++i) {
+        size_t dependent = graph->dependents[i];
+        if (0 == __sync_sub_and_fetch(&graph->inputs_left[dependent], 1)) {
+            _graph_enqueue_band(data, dependent);
+        }
+    }
+
+    ssize_t tasks_left = __sync_sub_and_fetch(data->tasks_left, 1);
+    if (tasks_left <= 0) {
+        __sync_lock_test_and_set(data->barrier_sense, true);
+    }
+}
+
+static void graph_band_processing_task(
+                void *task_data,
+                void (*result_callback)(void *result) __attribute__((unused))
+            )
+{
+    graph_band_data_t *data = task_data;
+
+    _graph_run_band(data);
+
+    free(data);
+    data = NULL;
+}
+
+/* Queues band `band` with the pool and barrier of `data`. Without memory
+   for the task the band is computed right away. */
+static void _graph_enqueue_band(const graph_band_data_t *data, size_t band)
+{
+    graph_band_data_t *task_data = malloc(sizeof(*task_data));
+    if (NULL == task_data) {
+        graph_band_data_t inline_data = *data;
+        inline_data.band = band;
+        _graph_run_band(&inline_data);
+
+        return;
+    }
+
+    *task_data = *data;
+    task_data->band = band;
+
+    threadpool_enqueue_task(data->threadpool, graph_band_processing_task, task_data, NULL);
+}
+
+/*
+    Orders the ids of the bands of all stages so that every band comes after
+    the input bands it reads, the order in which the calling thread computes
+    them without a pool. Every sweep over the stages takes the next band of
+    each stage whose inputs are scheduled, so the stages advance together row
+    by row. The earliest stage with bands left always has its inputs
+    complete, so every sweep takes at least one band.
+*/
+static size_t _graph_schedule(graph_t *graph, size_t *order)
+{
+    size_t task_count = 0;
+    size_t total = 0;
+    for (size_t i = 0; i < graph->stage_count; ++i) {
+        graph_stage_t *stage = &graph->stages[i];
+        stage->bands_scheduled = _graph_is_complete_load(stage) ? stage->band_count : 0;
+        total += stage->band_count - stage->bands_scheduled;
+    }
+
+    while (task_count < total) {
+        for (size_t i = 0; i < graph->stage_count; ++i) {
+            graph_stage_t *stage = &graph->stages[i];
+            if (stage->bands_scheduled == stage->band_count) {
+                continue;
+            }
+
+            size_t first_row = stage->bands_scheduled * stage->rows_per_band;
+            size_t end_row = UTILS_MIN(first_row + stage->rows_per_band, stage->image.absolute_image_height);
+
+            bool ready = true;
+            for (size_t j = 0; j < 2 && GRAPH_INVALID_NODE != stage->inputs[j]; ++j) {
+                const graph_stage_t *input = &graph->stages[stage->inputs[j]];
+                size_t first, end;
+                _graph_get_input_rows(graph, stage, j, first_row, end_row, &first, &end);
+                ready = ready &&
+                    (input->bands_scheduled == input->band_count ||
+                     input->bands_scheduled * input->rows_per_band >= end);
+            }
+
+            if (ready) {
+                order[task_count++] = stage->first_band + stage->bands_scheduled++;
+            }
+        }
+    }
+
+    return task_count;
+}
+
+static void _graph_save_results(graph_t *graph, const char **error_message)
+{
+    *error_message = NULL;
+
+    for (size_t i = 0; i < graph->save_count; ++i) {
+        const char *path = graph->saves[i].path;
+        graph_stage_t *stage = &graph->stages[graph->node_stages[graph->saves[i].node]];
+
+        FILE *destination_descriptor = fopen(path, "w");
+        if (NULL == destination_descriptor) {
+            if (NULL != error_message) {
+                *error_message = Graph_Error_Failed_to_Create_Destination;
+            }
+            graph->error_path = path;
+
+            return;
+        }
+
+        image_format destination_format = image_io_get_format_for_file_name(path, stage->format);
+        image_io_write_image_headers(destination_descriptor, &stage->image, destination_format, error_message);
+        if (NULL == *error_message) {
+            image_io_write_image_data(destination_descriptor, &stage->image, destination_format, error_message);
+        }
+        fclose(destination_descriptor);
+
+        if (NULL != *error_message) {
+            graph->error_path = path;
+
+            return;
+        }
+    }
+}
+
+/*
+    Plans the graph, computes everything the saved results depend on in one
+    pass on `threadpool` (or the calling thread without one) and writes the
+    saved results. On errors with a file, `graph->error_path` names it.
+*/
+static void graph_evaluate(graph_t *graph, threadpool_t *threadpool, const char **error_message)
+{
+    *error_message = NULL;
+
+    size_t *order = NULL;
+
+    _graph_free_plan(graph);
+    graph->error_path = NULL;
+    graph->task_count = 0;
+    graph->failed = false;
+
+    if (NULL != graph->error_message || 0 == graph->save_count) {
+        if (NULL != error_message) {
+            *error_message = NULL != graph->error_message ? graph->error_message : Graph_Error_Nothing_to_Save;
+        }
+
+        goto end;
+    }
+
+    _graph_plan(graph, NULL != threadpool ? threadpool->thread_count : 1, error_message);
+    if (NULL != *error_message) {
+        goto end;
+    }
+
+    order = malloc(UTILS_MAX(graph->band_count, 1) * sizeof(*order));
+    if (NULL == order) {
+        if (NULL != error_message) {
+            *error_message = Graph_Error_Not_Enough_Memory;
+        }
+
+        goto end;
+    }
+    graph->task_count = _graph_schedule(graph, order);
+
+    uint64_t kernel_start_time = timing_start();
+
+    if (NULL == threadpool) {
+        for (size_t i = 0; i < graph->task_count; ++i) {
+            const graph_task_t *task = &graph->bands[order[i]];
+            _graph_compute_band(graph, &graph->stages[task->stage], task->band);
+        }
+    } else if (graph->task_count > 0) {
+        volatile ssize_t tasks_left = (ssize_t) graph->task_count;
+        volatile bool barrier_sense = false;
+
+        graph_band_data_t data = {
+            .graph = graph,
+            .threadpool = threadpool,
+            .tasks_left = &tasks_left,
+            .barrier_sense = &barrier_sense
+        };
+
+        /* The bands without inputs to wait for are picked before any task
+           runs, the rest are queued by the tasks that compute their inputs */
+        size_t ready_count = 0;
+        for (size_t i = 0; i < graph->task_count; ++i) {
+            if (0 == graph->inputs_left[order[i]]) {
+                order[ready_count++] = order[i];
+            }
+        }
+        for (size_t i = 0; i < ready_count; ++i) {
+            _graph_enqueue_band(&data, order[i]);
+        }
+
+        while (!barrier_sense) { }
+    }
+
+    size_t channels_count = 0;
+    for (size_t i = 0; i < graph->stage_count; ++i) {
+        channels_count += graph->stages[i].image.absolute_image_width * graph->stages[i].image.absolute_image_height * 4;
+    }
+    timing_stop(TIMING_STAGE_KERNEL, kernel_start_time, channels_count, channels_count / 4);
+
+    if (graph->failed) {
+        if (NULL != error_message) {
+            *error_message = Graph_Error_Not_Enough_Memory;
+        }
+
+        goto end;
+    }
+
+    _graph_save_results(graph, error_message);
+
+end:
+    free(order);
+}
+
+/* Prints the stages of the last plan and what was fused into them. */
+static void graph_print_plan(const graph_t *graph, FILE *file)
+{
+    fprintf(
+        file,
+        "%zu nodes: %zu removed as no-ops, %zu dead, %zu stages, %zu bands in one pass\n",
+        graph->node_count,
+        graph->removed_count,
+        graph->dead_count,
+        graph->stage_count,
+        graph->task_count
+    );
+
+    for (size_t i = 0; i < graph->stage_count; ++i) {
+        const graph_stage_t *stage = &graph->stages[i];
+        const graph_node_t *node = &graph->nodes[stage->node];
+
+        fprintf(file, "\tstage %zu: %s", i, _graph_is_point_operation(stage->operation) ? "copy" : node->name);
+        for (size_t j = 0; j < 2 && GRAPH_INVALID_NODE != stage->inputs[j]; ++j) {
+            fprintf(file, "%s%zu", 0 == j ? " of stage " : " and ", stage->inputs[j]);
+        }
+        fprintf(
+            file,
+            ", %zux%zu, %zu bands of %zu rows",
+            stage->image.absolute_image_width,
+            stage->image.absolute_image_height,
+            stage->band_count,
+            stage->rows_per_band
+        );
+
+        size_t point_nodes = stage->fused_count + (_graph_is_point_operation(stage->operation) ? 1 : 0);
+        if (point_nodes > 0) {
+            fprintf(file, ", %zu point operations as", point_nodes);
+            for (size_t j = 0; j < stage->program_length; ++j) {
+                fprintf(file, " %s", Graph_Operation_Names[stage->program[j].matrix ? GRAPH_OPERATION_MATRIX : GRAPH_OPERATION_TABLE]);
+            }
+            if (0 == stage->program_length) {
+                fprintf(file, " nothing");
+            }
+        }
+        fputc('\n', file);
+    }
+}
+
+#endif // GRAPH_H
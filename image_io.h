@@ -0,0 +1,196 @@
+#ifndef IMAGE_IO_H
+#define IMAGE_IO_H
+
+#include "bmp.h"
+#include "pnm.h"
+#include "tiled.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+/*
+    Reads and writes the images of all supported formats through one set of
+    functions. The format of a source image is detected from its signature,
+    the format of a destination from the extension of its file name. Images
+    of every format are decoded into the same `bmp_image` with BGRA `pixels`,
+    so an image can be written in a format other than the one it was read
+    from.
+*/
+
+typedef enum _image_format
+{
+    IMAGE_FORMAT_BMP,
+    IMAGE_FORMAT_PPM,
+    IMAGE_FORMAT_PAM,
+    IMAGE_FORMAT_TILED,
+    IMAGE_FORMAT_PACKED_TILED
+} image_format;
+
+/* Returns the format for the extension of `file_name`, or `fallback` for an
+   unknown extension, e.g. the format of the source image. */
+static inline image_format image_io_get_format_for_file_name(const char *file_name, image_format fallback)
+{
+    const char *extension = NULL != file_name ? strrchr(file_name, '.') : NULL;
+    if (NULL == extension) {
+        return fallback;
+    }
+
+    if (0 == strcasecmp(extension, ".bmp")) {
+        return IMAGE_FORMAT_BMP;
+    }
+    if (0 == strcasecmp(extension, ".ppm") || 0 == strcasecmp(extension, ".pnm")) {
+        return IMAGE_FORMAT_PPM;
+    }
+    if (0 == strcasecmp(extension, ".pam")) {
+        return IMAGE_FORMAT_PAM;
+    }
+    if (0 == strcasecmp(extension, ".tiled")) {
+        return IMAGE_FORMAT_TILED;
+    }
+    if (0 == strcasecmp(extension, ".ptiled")) {
+        return IMAGE_FORMAT_PACKED_TILED;
+    }
+
+    return fallback;
+}
+
+static inline const char *image_io_get_extension(image_format format)
+{
+    switch (format) {
+        case IMAGE_FORMAT_PPM: return ".ppm";
+        case IMAGE_FORMAT_PAM: return ".pam";
+        case IMAGE_FORMAT_TILED: return ".tiled";
+        case IMAGE_FORMAT_PACKED_TILED: return ".ptiled";
+        default:               return ".bmp";
+    }
+}
+
+/* Detects the format of a stream from its first byte without consuming it.
+   Both PNM signatures start with 'P', the tiled one with 'T' and BMP ones
+   with 'B'. */
+static inline image_format image_io_peek_format(FILE *file_descriptor)
+{
+    int first_byte = getc(file_descriptor);
+    if (EOF != first_byte) {
+        ungetc(first_byte, file_descriptor);
+    }
+
+    switch (first_byte) {
+        case 'P': return IMAGE_FORMAT_PPM;
+        case 'T': return IMAGE_FORMAT_TILED;
+        default:  return IMAGE_FORMAT_BMP;
+    }
+}
+
+static void image_io_open_image_headers(
+                FILE *file_descriptor,
+                bmp_image *image,
+                image_format *format,
+                const char **error_message
+            )
+{
+    *error_message = NULL;
+
+    if (NULL == file_descriptor) {
+        if (NULL != error_message) {
+            *error_message = BMP_Error_Invalid_File_Descriptor;
+        }
+
+        return;
+    }
+
+    *format = image_io_peek_format(file_descriptor);
+    if (IMAGE_FORMAT_PPM == *format) {
+        pnm_format pnm_format = PNM_FORMAT_PPM;
+        pnm_open_image_headers(file_descriptor, image, &pnm_format, error_message);
+        *format = PNM_FORMAT_PAM == pnm_format ? IMAGE_FORMAT_PAM : IMAGE_FORMAT_PPM;
+    } else if (IMAGE_FORMAT_TILED == *format) {
+        tiled_format tiled_format = TILED_FORMAT_RAW;
+        tiled_open_image_headers(file_descriptor, image, &tiled_format, error_message);
+        *format = TILED_FORMAT_PACKED == tiled_format ? IMAGE_FORMAT_PACKED_TILED : IMAGE_FORMAT_TILED;
+    } else {
+        bmp_open_image_headers(file_descriptor, image, error_message);
+    }
+}
+
+static inline void image_io_read_image_data_oriented(
+                       FILE *file_descriptor,
+                       bmp_image *image,
+                       image_format format,
+                       bmp_orientation orientation,
+                       const char **error_message
+                   )
+{
+    if (IMAGE_FORMAT_BMP == format) {
+        bmp_read_image_data_oriented(file_descriptor, image, orientation, error_message);
+    } else if (IMAGE_FORMAT_TILED == format || IMAGE_FORMAT_PACKED_TILED == format) {
+        tiled_read_image_data_oriented(file_descriptor, image, orientation, error_message);
+    } else {
+        pnm_read_image_data_oriented(file_descriptor, image, orientation, error_message);
+    }
+}
+
+static inline void image_io_read_image_data(
+                       FILE *file_descriptor,
+                       bmp_image *image,
+                       image_format format,
+                       const char **error_message
+                   )
+{
+    image_io_read_image_data_oriented(file_descriptor, image, format, BMP_ORIENTATION_AS_STORED, error_message);
+}
+
+static inline void image_io_write_image_headers(
+                       FILE *file_descriptor,
+                       bmp_image *image,
+                       image_format format,
+                       const char **error_message
+                   )
+{
+    if (IMAGE_FORMAT_BMP == format) {
+        bmp_write_image_headers(file_descriptor, image, error_message);
+    } else if (IMAGE_FORMAT_TILED == format || IMAGE_FORMAT_PACKED_TILED == format) {
+        tiled_write_image_headers(
+            file_descriptor,
+            image,
+            IMAGE_FORMAT_PACKED_TILED == format ? TILED_FORMAT_PACKED : TILED_FORMAT_RAW,
+            error_message
+        );
+    } else {
+        pnm_write_image_headers(
+            file_descriptor,
+            image,
+            IMAGE_FORMAT_PAM == format ? PNM_FORMAT_PAM : PNM_FORMAT_PPM,
+            error_message
+        );
+    }
+}
+
+static inline void image_io_write_image_data(
+                       FILE *file_descriptor,
+                       bmp_image *image,
+                       image_format format,
+                       const char **error_message
+                   )
+{
+    if (IMAGE_FORMAT_BMP == format) {
+        bmp_write_image_data(file_descriptor, image, error_message);
+    } else if (IMAGE_FORMAT_TILED == format || IMAGE_FORMAT_PACKED_TILED == format) {
+        tiled_write_image_data(
+            file_descriptor,
+            image,
+            IMAGE_FORMAT_PACKED_TILED == format ? TILED_FORMAT_PACKED : TILED_FORMAT_RAW,
+            error_message
+        );
+    } else {
+        pnm_write_image_data(
+            file_descriptor,
+            image,
+            IMAGE_FORMAT_PAM == format ? PNM_FORMAT_PAM : PNM_FORMAT_PPM,
+            error_message
+        );
+    }
+}
+
+#endif // IMAGE_IO_H
@@ -0,0 +1,279 @@
+#ifndef INCREMENTAL_H
+#define INCREMENTAL_H
+
+#include "cache.h"
+#include "filters.h"
+#include "tiled.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+    Successive versions of a large image often differ in a few regions only.
+    The output of a chain is kept as a tiled image (see tiled.h), and a state
+    file next to it holds a hash of every input tile of the version it was
+    made from:
+
+        header      `incremental_header`, with the geometry of the tiles and
+                    the key of the chain (see cache_hasher_update_chain)
+        hashes      one `cache_key_t` per tile, row by row
+
+    For the next version only the tiles whose hashes changed are dirty, which
+    holds for chains of point filters (a radius of 0) only. Only the dirty
+    tiles are filtered again and written over their old versions in the
+    output. A state of another geometry or chain, or a missing one,
+    makes every tile dirty.
+*/
+
+static const char *Incremental_Error_Failed_to_Open_File =
+                    "Failed to open the tile state file",
+                  *Incremental_Error_Invalid_File =
+                    "Invalid tile state file",
+                  *Incremental_Error_Not_Enough_Memory =
+                    "Not enough memory for the tile state",
+                  *Incremental_Error_Failed_to_Write_File =
+                    "Failed to write the tile state file";
+
+static const uint8_t Incremental_Signature[8] = { 'T', 'I', 'L', 'E', 'H', 'A', 'S', 'H' };
+
+#define INCREMENTAL_VERSION 1
+#define INCREMENTAL_STATE_EXTENSION ".hashes"
+
+struct _incremental_header
+{
+    uint8_t  signature[8];
+    uint32_t version;
+    uint32_t image_width;
+    uint32_t image_height;
+    uint32_t tile_width;
+    uint32_t tile_height;
+    uint32_t tiles_across;
+    uint32_t tiles_down;
+    uint32_t reserved;
+    cache_key_t chain;
+} __attribute__((packed));
+
+typedef struct _incremental_header incremental_header;
+
+typedef struct _incremental_state
+{
+    incremental_header header;
+    cache_key_t *hashes;
+} incremental_state_t;
+
+static inline void incremental_init_state(incremental_state_t *state)
+{
+    memset(state, 0, sizeof(*state));
+}
+
+static inline void incremental_free_state(incremental_state_t *state)
+{
+    if (NULL != state->hashes) {
+        free(state->hashes);
+        state->hashes = NULL;
+    }
+}
+
+static inline size_t incremental_get_tile_count(const incremental_state_t *state)
+{
+    return (size_t) state->header.tiles_across * state->header.tiles_down;
+}
+
+/* The key of everything in a chain that changes its output */
+static inline cache_key_t incremental_get_chain_key(const filters_chain_t *chain)
+{
+    cache_hasher_t hasher;
+    cache_hasher_init(&hasher, 0);
+    cache_hasher_update_chain(&hasher, chain);
+
+    return cache_hasher_finish(&hasher);
+}
+
+/* Writes the path of the state file of the output `file_name`. */
+static inline bool incremental_get_state_path(const char *file_name, char *path, size_t size)
+{
+    return (size_t) snprintf(path, size, "%s%s", file_name, INCREMENTAL_STATE_EXTENSION) < size;
+}
+
+/* Sets up a state without hashes for the tiles of `tiles` and `chain`. */
+static void incremental_create_state(
+                incremental_state_t *state,
+                const tiled_header *tiles,
+                const filters_chain_t *chain,
+                const char **error_message
+            )
+{
+    *error_message = NULL;
+
+    memset(&state->header, 0, sizeof(state->header));
+    memcpy(state->header.signature, Incremental_Signature, sizeof(Incremental_Signature));
+    state->header.version = INCREMENTAL_VERSION;
+    state->header.image_width = tiles->image_width;
+    state->header.image_height = tiles->image_height;
+    state->header.tile_width = tiles->tile_width;
+    state->header.tile_height = tiles->tile_height;
+    state->header.tiles_across = tiles->tiles_across;
+    state->header.tiles_down = tiles->tiles_down;
+    state->header.chain = incremental_get_chain_key(chain);
+
+    state->hashes = calloc(incremental_get_tile_count(state), sizeof(*state->hashes));
+    if (NULL == state->hashes) {
+        if (NULL != error_message) {
+            *error_message = Incremental_Error_Not_Enough_Memory;
+        }
+    }
+}
+
+static void incremental_load_state(incremental_state_t *state, const char *path, const char **error_message)
+{
+    *error_message = NULL;
+
+    FILE *file = fopen(path, "rb");
+    if (NULL == file) {
+        if (NULL != error_message) {
+            *error_message = Incremental_Error_Failed_to_Open_File;
+        }
+
+        goto end;
+    }
+
+    incremental_header *header = &state->header;
+    if (1 != fread(header, sizeof(*header), 1, file) ||
+        0 != memcmp(header->signature, Incremental_Signature, sizeof(Incremental_Signature)) ||
+        INCREMENTAL_VERSION != header->version ||
+        !tiled_is_valid_tile_size(header->tile_width) ||
+        !tiled_is_valid_tile_size(header->tile_height) ||
+        header->tiles_across != (header->image_width + header->tile_width - 1) / header->tile_width ||
+        header->tiles_down != (header->image_height + header->tile_height - 1) / header->tile_height) {
+        if (NULL != error_message) {
+            *error_message = Incremental_Error_Invalid_File;
+        }
+
+        goto end;
+    }
+
+    size_t count = incremental_get_tile_count(state);
+    state->hashes = malloc(UTILS_MAX(count, 1) * sizeof(*state->hashes));
+    if (NULL == state->hashes) {
+        if (NULL != error_message) {
+            *error_message = Incremental_Error_Not_Enough_Memory;
+        }
+
+        goto end;
+    }
+
+    if (count != fread(state->hashes, sizeof(*state->hashes), count, file)) {
+        if (NULL != error_message) {
+            *error_message = Incremental_Error_Invalid_File;
+        }
+
+        incremental_free_state(state);
+    }
+
+end:
+    if (NULL != file) {
+        fclose(file);
+    }
+}
+
+/* Replaces the state file at `path` in one step, a crash leaves either the
+   old or the new state behind. */
+static void incremental_save_state(const incremental_state_t *state, const char *path, const char **error_message)
+{
+    *error_message = NULL;
+
+    char temporary_path[PATH_MAX];
+    if ((size_t) snprintf(temporary_path, sizeof(temporary_path), "%s.tmp", path) >= sizeof(temporary_path)) {
+        if (NULL != error_message) {
+            *error_message = Incremental_Error_Failed_to_Write_File;
+        }
+
+        goto end;
+    }
+
+    FILE *file = fopen(temporary_path, "wb");
+    if (NULL == file) {
+        if (NULL != error_message) {
+            *error_message = Incremental_Error_Failed_to_Write_File;
+        }
+
+        goto end;
+    }
+
+    size_t count = incremental_get_tile_count(state);
+    bool written =
+        1 == fwrite(&state->header, sizeof(state->header), 1, file) &&
+        count == fwrite(state->hashes, sizeof(*state->hashes), count, file);
+    if (0 != fclose(file) || !written || 0 != rename(temporary_path, path)) {
+        unlink(temporary_path);
+        if (NULL != error_message) {
+            *error_message = Incremental_Error_Failed_to_Write_File;
+        }
+    }
+
+end:
+    return;
+}
+
+/* Hashes the part of a tile inside the image straight from the BGRA pixels
+   of the whole image. `top_down` is the row order of `pixels`. */
+static cache_key_t incremental_hash_tile(
+                       const tiled_header *header,
+                       const uint8_t *pixels,
+                       bool top_down,
+                       size_t tile_x,
+                       size_t tile_y
+                   )
+{
+    size_t x, y, width, height;
+    tiled_get_tile_bounds(header, tile_x, tile_y, &x, &y, &width, &height);
+
+    size_t image_row_size = (size_t) header->image_width * 4;
+
+    cache_hasher_t hasher;
+    cache_hasher_init(&hasher, 0);
+    for (size_t row = 0; row < height; ++row) {
+        size_t image_row = top_down ? y + row : header->image_height - 1 - (y + row);
+        cache_hasher_update(&hasher, pixels + image_row * image_row_size + x * 4, width * 4);
+    }
+
+    return cache_hasher_finish(&hasher);
+}
+
+/*
+    Marks the tiles of `current` that have to be filtered again in `dirty`
+    and returns their count: the tiles whose hashes differ from `previous`.
+    Without a usable previous state, e.g. one with NULL hashes, every tile is
+    dirty.
+*/
+static size_t incremental_mark_dirty_tiles(
+                  const incremental_state_t *previous,
+                  const incremental_state_t *current,
+                  bool *dirty
+              )
+{
+    size_t count = incremental_get_tile_count(current);
+
+    if (NULL == previous->hashes ||
+        0 != memcmp(&previous->header, &current->header, sizeof(current->header))) {
+        memset(dirty, true, count * sizeof(*dirty));
+
+        return count;
+    }
+
+    size_t dirty_count = 0;
+    for (size_t i = 0; i < count; ++i) {
+        const cache_key_t *old_hash = &previous->hashes[i];
+        const cache_key_t *new_hash = &current->hashes[i];
+        dirty[i] = old_hash->low != new_hash->low || old_hash->high != new_hash->high;
+        dirty_count += dirty[i];
+    }
+
+    return dirty_count;
+}
+
+#endif // INCREMENTAL_H
@@ -0,0 +1,342 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include "bmp.h"
+#include "planar.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined SIMD_INTRINSICS_IMPLEMENTATION || defined SIMD_ASM_IMPLEMENTATION
+#include <immintrin.h>
+#endif
+
+#if (defined SIMD_INTRINSICS_IMPLEMENTATION || defined SIMD_ASM_IMPLEMENTATION) && \
+    defined __AVX512F__
+#define KERNELS_AVX512_KERNELS 1
+#endif
+
+/*
+    Point operations written once and specialized for every pixel layout and
+    instruction set. An operation only describes what happens to the blue,
+    green and red values of one pixel:
+
+        kernels_<name>_setup   turns the filter parameters into at most
+                               KERNELS_MAX_CONSTANTS constants
+        kernels_<name>_c       computes the new values of one pixel and
+                               converts them to bytes
+        kernels_<name>_avx512  computes the new values of 16 pixels, one
+                               register per channel, the loops round them
+                               to the nearest whole number (an operation
+                               that truncates does it itself)
+
+    The loops below (kernels_run_*) walk interleaved BGRA pixels or planes
+    (see planar.h), load the channels, call the operation and store the
+    results, leaving the alpha channel untouched. The AVX-512 loops clamp the
+    results to [0, 255] like UTILS_CLAMP does in the C operations, so both
+    agree on values far out of range. The loops are always inlined, so when
+    a filter instantiates them with its operation (see
+    FILTERS_DEFINE_POINT_KERNELS in filters.h) the compiler sees constant
+    function pointers, inlines the operation and generates a loop for every
+    combination without indirect calls or branches on the filter. The
+    constants are copied into locals once per call, so they stay in registers
+    while the loops store pixels.
+
+    The interleaved AVX-512 loops split 16 pixels into channel registers in
+    place, so they run the same operation code as the planar ones.
+*/
+
+#define KERNELS_MAX_CONSTANTS 12
+#define KERNELS_PREFETCH_DISTANCE 512   /* bytes ahead of the current line */
+
+#define KERNELS_INLINE static inline __attribute__((always_inline))
+
+typedef void (*kernels_setup_function_t)(const float *parameters, float *constants);
+typedef void (*kernels_c_function_t)(const float *channels, const float *constants, uint8_t *results);
+
+/* Scalar Loops */
+
+KERNELS_INLINE void kernels_run_c(
+                        uint8_t *pixels,
+                        size_t position,
+                        size_t end,
+                        const float *parameters,
+                        kernels_setup_function_t setup,
+                        kernels_c_function_t operation
+                    )
+{
+    float constants[KERNELS_MAX_CONSTANTS] = { 0 };
+    setup(parameters, constants);
+
+    for (; position < end; position += 4) {
+        float channels[3] = { pixels[position], pixels[position + 1], pixels[position + 2] };
+        operation(channels, constants, &pixels[position]);
+    }
+}
+
+KERNELS_INLINE void kernels_run_planar_c(
+                        uint8_t *const *planes,
+                        size_t position,
+                        size_t end,
+                        const float *parameters,
+                        kernels_setup_function_t setup,
+                        kernels_c_function_t operation
+                    )
+{
+    float constants[KERNELS_MAX_CONSTANTS] = { 0 };
+    setup(parameters, constants);
+
+    uint8_t *blues = planes[PLANAR_BLUE], *greens = planes[PLANAR_GREEN], *reds = planes[PLANAR_RED];
+
+    for (; position < end; ++position) {
+        float channels[3] = { blues[position], greens[position], reds[position] };
+        uint8_t results[3];
+        operation(channels, constants, results);
+
+        blues[position] = results[0];
+        greens[position] = results[1];
+        reds[position] = results[2];
+    }
+}
+
+/* AVX-512 Loops */
+
+#if defined KERNELS_AVX512_KERNELS
+typedef void (*kernels_avx512_function_t)(const __m512 *channels, const __m512 *constants, __m512 *results);
+
+KERNELS_INLINE void _kernels_broadcast_constants(
+                        const float *parameters,
+                        kernels_setup_function_t setup,
+                        __m512 *vectors
+                    )
+{
+    float constants[KERNELS_MAX_CONSTANTS] = { 0 };
+    setup(parameters, constants);
+
+    for (size_t i = 0; i < KERNELS_MAX_CONSTANTS; ++i) {
+        vectors[i] = _mm512_set1_ps(constants[i]);
+    }
+}
+
+/* Clamps 16 results to [0, 255] before they are rounded to integers, so
+   values too large for an integer become 255 and not the integer indefinite.
+   Like UTILS_CLAMP, a NaN becomes 0. The bounds are whole numbers, so
+   clamping first rounds the same as clamping the rounded results. */
+static inline __m512i _kernels_saturate(__m512 results)
+{
+    results = _mm512_min_ps(_mm512_max_ps(results, _mm512_setzero_ps()), _mm512_set1_ps(255.0f));
+
+    return _mm512_cvtps_epi32(results);
+}
+
+/* Filters the 16 BGRA pixels in `quads` and keeps their alpha channels. */
+KERNELS_INLINE __m512i _kernels_apply_avx512(
+                           __m512i quads,
+                           const __m512 *constants,
+                           kernels_avx512_function_t operation
+                       )
+{
+    __m512i byte_mask = _mm512_set1_epi32(0xff);
+
+    __m512 channels[3] = {
+        _mm512_cvtepi32_ps(_mm512_and_si512(quads, byte_mask)),
+        _mm512_cvtepi32_ps(_mm512_and_si512(_mm512_srli_epi32(quads, 8), byte_mask)),
+        _mm512_cvtepi32_ps(_mm512_and_si512(_mm512_srli_epi32(quads, 16), byte_mask))
+    };
+    __m512 results[3];
+    operation(channels, constants, results);
+
+    __m512i pixels = _mm512_and_si512(quads, _mm512_set1_epi32((int) 0xff000000));
+    pixels = _mm512_or_si512(pixels, _kernels_saturate(results[0]));
+    pixels = _mm512_or_si512(pixels, _mm512_slli_epi32(_kernels_saturate(results[1]), 8));
+    pixels = _mm512_or_si512(pixels, _mm512_slli_epi32(_kernels_saturate(results[2]), 16));
+
+    return pixels;
+}
+
+KERNELS_INLINE void kernels_run_avx512(
+                        uint8_t *pixels,
+                        size_t position,
+                        size_t end,
+                        const float *parameters,
+                        kernels_setup_function_t setup,
+                        kernels_avx512_function_t operation
+                    )
+{
+    __m512 constants[KERNELS_MAX_CONSTANTS];
+    _kernels_broadcast_constants(parameters, setup, constants);
+
+    for (; position + 64 <= end; position += 64) {
+        __m512i quads = _mm512_loadu_si512((__m512i *) &pixels[position]);
+        _mm512_storeu_si512((__m512i *) &pixels[position], _kernels_apply_avx512(quads, constants, operation));
+    }
+
+    if (position < end) {
+        /* The pixels past `end` are neither loaded nor stored */
+        __mmask16 mask = (__mmask16) ((1u << ((end - position) / 4)) - 1);
+        __m512i quads = _mm512_maskz_loadu_epi32(mask, &pixels[position]);
+        _mm512_mask_storeu_epi32(&pixels[position], mask, _kernels_apply_avx512(quads, constants, operation));
+    }
+}
+
+/* Finds the whole 64-byte lines in [position, end). Lines only start on
+   pixels if the buffer is 4-byte aligned, otherwise there are none. */
+static inline void _kernels_get_full_lines(
+                       const uint8_t *pixels,
+                       size_t position,
+                       size_t end,
+                       size_t *first_line,
+                       size_t *last_line
+                   )
+{
+    if (0 != ((uintptr_t) pixels & 3)) {
+        *first_line = *last_line = end;
+        return;
+    }
+
+    *first_line = position + ((64 - ((uintptr_t) &pixels[position] & 63)) & 63);
+    *first_line = UTILS_MIN(*first_line, end);
+    *last_line = *first_line + ((end - *first_line) & ~(size_t) 63);
+}
+
+/* Writes whole lines with non-temporal stores (see filters.h), the partial
+   lines at both ends go through the regular loop. */
+KERNELS_INLINE void kernels_run_avx512_stream(
+                        uint8_t *pixels,
+                        size_t position,
+                        size_t end,
+                        const float *parameters,
+                        kernels_setup_function_t setup,
+                        kernels_avx512_function_t operation
+                    )
+{
+    size_t first_line, last_line;
+    _kernels_get_full_lines(pixels, position, end, &first_line, &last_line);
+    kernels_run_avx512(pixels, position, first_line, parameters, setup, operation);
+
+    __m512 constants[KERNELS_MAX_CONSTANTS];
+    _kernels_broadcast_constants(parameters, setup, constants);
+
+    for (position = first_line; position < last_line; position += 64) {
+        _mm_prefetch((const char *) &pixels[position + KERNELS_PREFETCH_DISTANCE], _MM_HINT_NTA);
+
+        __m512i quads = _mm512_load_si512((__m512i *) &pixels[position]);
+        _mm512_stream_si512((__m512i *) &pixels[position], _kernels_apply_avx512(quads, constants, operation));
+    }
+
+    kernels_run_avx512(pixels, last_line, end, parameters, setup, operation);
+
+    /* Make the streamed lines visible before the task reports completion */
+    _mm_sfence();
+}
+
+static inline __m512 _kernels_load_plane(const uint8_t *plane)
+{
+    return _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *) plane)));
+}
+
+static inline void _kernels_store_plane(uint8_t *plane, __m512 results)
+{
+    _mm_storeu_si128((__m128i *) plane, _mm512_cvtepi32_epi8(_kernels_saturate(results)));
+}
+
+/* Processes whole groups of 16 pixels, up to 15 pixels past `end` (see
+   planar.h). */
+KERNELS_INLINE void kernels_run_planar_avx512(
+                        uint8_t *const *planes,
+                        size_t position,
+                        size_t end,
+                        const float *parameters,
+                        kernels_setup_function_t setup,
+                        kernels_avx512_function_t operation
+                    )
+{
+    __m512 constants[KERNELS_MAX_CONSTANTS];
+    _kernels_broadcast_constants(parameters, setup, constants);
+
+    uint8_t *blues = planes[PLANAR_BLUE], *greens = planes[PLANAR_GREEN], *reds = planes[PLANAR_RED];
+
+    for (; position < end; position += 16) {
+        __m512 channels[3] = {
+            _kernels_load_plane(&blues[position]),
+            _kernels_load_plane(&greens[position]),
+            _kernels_load_plane(&reds[position])
+        };
+        __m512 results[3];
+        operation(channels, constants, results);
+
+        _kernels_store_plane(&blues[position], results[0]);
+        _kernels_store_plane(&greens[position], results[1]);
+        _kernels_store_plane(&reds[position], results[2]);
+    }
+}
+#endif
+
+/* Sepia */
+
+KERNELS_INLINE void kernels_sepia_setup(const float *parameters __attribute__((unused)), float *constants)
+{
+    static const float Sepia_Coefficients[] = {
+        0.272f, 0.534f, 0.131f,
+        0.349f, 0.686f, 0.168f,
+        0.393f, 0.769f, 0.189f
+    };
+
+    memcpy(constants, Sepia_Coefficients, sizeof(Sepia_Coefficients));
+}
+
+/* The results are never negative, only the upper end needs clamping */
+KERNELS_INLINE void kernels_sepia_c(const float *channels, const float *constants, uint8_t *results)
+{
+    for (size_t i = 0; i < 3; ++i) {
+        results[i] =
+            (uint8_t) UTILS_MIN(
+                          constants[i * 3]     * channels[0] +
+                          constants[i * 3 + 1] * channels[1] +
+                          constants[i * 3 + 2] * channels[2],
+                          255.0f
+                      );
+    }
+}
+
+#if defined KERNELS_AVX512_KERNELS
+KERNELS_INLINE void kernels_sepia_avx512(const __m512 *channels, const __m512 *constants, __m512 *results)
+{
+    for (size_t i = 0; i < 3; ++i) {
+        results[i] = _mm512_mul_ps(constants[i * 3], channels[0]);
+        results[i] = _mm512_fmadd_ps(constants[i * 3 + 1], channels[1], results[i]);
+        results[i] = _mm512_fmadd_ps(constants[i * 3 + 2], channels[2], results[i]);
+    }
+}
+#endif
+
+/* Brightness and Contrast, parameters: brightness, contrast */
+
+KERNELS_INLINE void kernels_brightness_setup(const float *parameters, float *constants)
+{
+    constants[0] = parameters[0];
+    constants[1] = parameters[1];
+}
+
+KERNELS_INLINE void kernels_brightness_c(const float *channels, const float *constants, uint8_t *results)
+{
+    for (size_t i = 0; i < 3; ++i) {
+        results[i] = (uint8_t) UTILS_CLAMP(channels[i] * constants[1] + constants[0], 0.0f, 255.0f);
+    }
+}
+
+#if defined KERNELS_AVX512_KERNELS
+KERNELS_INLINE void kernels_brightness_avx512(const __m512 *channels, const __m512 *constants, __m512 *results)
+{
+    for (size_t i = 0; i < 3; ++i) {
+        results[i] =
+            _mm512_roundscale_ps(
+                _mm512_fmadd_ps(channels[i], constants[1], constants[0]),
+                _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC
+            );
+    }
+}
+#endif
+
+#endif // KERNELS_H
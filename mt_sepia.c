@@ -1,4 +1,8 @@
+#include "autotune.h"
 #include "bmp.h"
+#include "image_io.h"
+#include "filters.h"
+#include "roi.h"
 #include "threadpool.h"
 
 #include <stddef.h>
@@ -20,7 +24,10 @@ typedef struct _filters_sepia_data
 {
     uint8_t *pixels;
     size_t position;
-    size_t channels_to_process;
+    size_t span_channels;   /* channels processed in every row                  */
+    size_t row_stride;      /* channels between the starts of consecutive rows  */
+    size_t rows;
+    bool streaming;         /* non-temporal stores for images larger than the cache */
     volatile ssize_t *channels_left;
     volatile bool *barrier_sense;
 } filters_sepia_data_t;
@@ -33,88 +40,100 @@ static void sepia_processing_task(
     filters_sepia_data_t *data = task_data;
 
     uint8_t *pixels = data->pixels;
-    size_t position = data->position;
-    size_t channels_to_process = data->channels_to_process;
-    size_t end = position + channels_to_process;
+    size_t channels_to_process = data->span_channels * data->rows;
 #if defined SIMD_INTRINSICS_IMPLEMENTATION || defined SIMD_ASM_IMPLEMENTATION
     size_t step = 16;
 #else
     size_t step = 4;
 #endif
 
-    for (; position < end; position += step) {
+    for (size_t row = 0; row < data->rows; ++row) {
+        size_t position = data->position + row * data->row_stride;
+        size_t end = position + data->span_channels;
+
+#if defined FILTERS_AVX512_KERNELS
+        if (data->streaming) {
+            filters_sepia_avx512_stream(pixels, position, end, NULL);
+            continue;
+        }
+#endif
+
+        for (; position < end; position += step) {
 #if defined C_IMPLEMENTATION
 
-        static const float Sepia_Coefficients[] = {
-            0.272f, 0.534f, 0.131f,
-            0.349f, 0.686f, 0.168f,
-            0.393f, 0.769f, 0.189f
-        };
-
-        uint32_t blue =
-            pixels[position];
-        uint32_t green =
-            pixels[position + 1];
-        uint32_t red =
-            pixels[position + 2];
-
-        pixels[position] =
-            (uint8_t) UTILS_MIN(
-                          Sepia_Coefficients[0] * blue  +
-                          Sepia_Coefficients[1] * green +
-                          Sepia_Coefficients[2] * red,
-                          255.0f
-                      );
-        pixels[position + 1] =
-            (uint8_t) UTILS_MIN(
-                          Sepia_Coefficients[3] * blue  +
-                          Sepia_Coefficients[4] * green +
-                          Sepia_Coefficients[5] * red,
-                          255.0f
-                      );
-        pixels[position + 2] =
-            (uint8_t) UTILS_MIN(
-                          Sepia_Coefficients[6] * blue  +
-                          Sepia_Coefficients[7] * green +
-                          Sepia_Coefficients[8] * red,
-                          255.0f
-                      );
+            static const float Sepia_Coefficients[] = {
+                0.272f, 0.534f, 0.131f,
+                0.349f, 0.686f, 0.168f,
+                0.393f, 0.769f, 0.189f
+            };
+
+            uint32_t blue =
+                pixels[position];
+            uint32_t green =
+                pixels[position + 1];
+            uint32_t red =
+                pixels[position + 2];
+
+            pixels[position] =
+                (uint8_t) UTILS_MIN(
+                              Sepia_Coefficients[0] * blue  +
+                              Sepia_Coefficients[1] * green +
+                              Sepia_Coefficients[2] * red,
+                              255.0f
+                          );
+            pixels[position + 1] =
+                (uint8_t) UTILS_MIN(
+                              Sepia_Coefficients[3] * blue  +
+                              Sepia_Coefficients[4] * green +
+                              Sepia_Coefficients[5] * red,
+                              255.0f
+                          );
+            pixels[position + 2] =
+                (uint8_t) UTILS_MIN(
+                              Sepia_Coefficients[6] * blue  +
+                              Sepia_Coefficients[7] * green +
+                              Sepia_Coefficients[8] * red,
+                              255.0f
+                          );
 
 #elif defined SIMD_INTRINSICS_IMPLEMENTATION
 
-        static const float Sepia_Coefficients[] __attribute__((aligned(0x40))) = {
-            0.272f, 0.349f, 0.393f, 1.0f, 0.272f, 0.349f, 0.393f, 1.0f, 0.272f, 0.349f, 0.393f, 1.0f, 0.272f, 0.349f, 0.393f, 1.0f,
-            0.534f, 0.686f, 0.769f, 1.0f, 0.534f, 0.686f, 0.769f, 1.0f, 0.534f, 0.686f, 0.769f, 1.0f, 0.534f, 0.686f, 0.769f, 1.0f,
-            0.131f, 0.168f, 0.189f, 1.0f, 0.131f, 0.168f, 0.189f, 1.0f, 0.131f, 0.168f, 0.189f, 1.0f, 0.131f, 0.168f, 0.189f, 1.0f
-        };
-
-        __m512 coeff1 = _mm512_load_ps(&Sepia_Coefficients[0]);
-        __m512 coeff2 = _mm512_load_ps(&Sepia_Coefficients[16]);
-        __m512 coeff3 = _mm512_load_ps(&Sepia_Coefficients[32]);
-        __m512i ints = _mm512_cvtepu8_epi32(_mm_load_si128((__m128i *) &pixels[position]));
-        __m512 floats = _mm512_cvtepi32_ps(ints);
-        __m512 temp1 = floats;
-        __m512 temp2 = floats;
-        __m512 temp3 = floats;
-        temp1 = _mm512_permute_ps(temp1, 0b11000000);
-        temp2 = _mm512_permute_ps(temp2, 0b11010101);
-        temp3 = _mm512_permute_ps(temp3, 0b11101010);
-        floats = _mm512_mul_ps(coeff1, temp1);
-        floats = _mm512_fmadd_ps(coeff2, temp2, floats);
-        floats = _mm512_fmadd_ps(coeff3, temp3, floats);
-        ints = _mm512_cvtps_epi32(floats);
-        _mm512_mask_cvtusepi32_storeu_epi8(&pixels[position], 0xffff, ints);
+            static const float Sepia_Coefficients[] __attribute__((aligned(0x40))) = {
+                0.272f, 0.349f, 0.393f, 1.0f, 0.272f, 0.349f, 0.393f, 1.0f, 0.272f, 0.349f, 0.393f, 1.0f, 0.272f, 0.349f, 0.393f, 1.0f,
+                0.534f, 0.686f, 0.769f, 1.0f, 0.534f, 0.686f, 0.769f, 1.0f, 0.534f, 0.686f, 0.769f, 1.0f, 0.534f, 0.686f, 0.769f, 1.0f,
+                0.131f, 0.168f, 0.189f, 1.0f, 0.131f, 0.168f, 0.189f, 1.0f, 0.131f, 0.168f, 0.189f, 1.0f, 0.131f, 0.168f, 0.189f, 1.0f
+            };
+
+            __m512 coeff1 = _mm512_load_ps(&Sepia_Coefficients[0]);
+            __m512 coeff2 = _mm512_load_ps(&Sepia_Coefficients[16]);
+            __m512 coeff3 = _mm512_load_ps(&Sepia_Coefficients[32]);
+            /* Alpha lanes are never stored */
+            __mmask16 mask = end - position >= 16 ? 0x7777 : (__mmask16) (((1u << (end - position)) - 1) & 0x7777);
+            __m512i ints = _mm512_cvtepu8_epi32(_mm_loadu_si128((__m128i *) &pixels[position]));
+            __m512 floats = _mm512_cvtepi32_ps(ints);
+            __m512 temp1 = floats;
+            __m512 temp2 = floats;
+            __m512 temp3 = floats;
+            temp1 = _mm512_permute_ps(temp1, 0b11000000);
+            temp2 = _mm512_permute_ps(temp2, 0b11010101);
+            temp3 = _mm512_permute_ps(temp3, 0b11101010);
+            floats = _mm512_mul_ps(coeff1, temp1);
+            floats = _mm512_fmadd_ps(coeff2, temp2, floats);
+            floats = _mm512_fmadd_ps(coeff3, temp3, floats);
+            ints = _mm512_cvtps_epi32(floats);
+            _mm512_mask_cvtusepi32_storeu_epi8(&pixels[position], mask, ints);
 
 #elif defined SIMD_ASM_IMPLEMENTATION
 
-        /*
-           Write the inline assembly representation of the intrinsics above
-           in SIMD_INTRINSICS_IMPLEMENTATION here in SIMD_ASM_IMPLEMENTATION.
-        */
+            /*
+               Write the inline assembly representation of the intrinsics above
+               in SIMD_INTRINSICS_IMPLEMENTATION here in SIMD_ASM_IMPLEMENTATION.
+            */
 
-        // TODO
+            // TODO
 
 #endif
+        }
     }
 
     ssize_t channels_left = __sync_sub_and_fetch(data->channels_left, (ssize_t) channels_to_process);
@@ -131,16 +150,20 @@ int main(int argc, char *argv[])
     int result = EXIT_FAILURE;
 
     if (argc < 3) {
-        fprintf(stderr, "Usage: %s <source file> <dest. file>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <source file> <dest. file> [<x,y,width,height>[;<x,y,width,height>...]]\n", argv[0]);
         return result;
     }
 
     char *source_file_name = argv[1];
     char *destination_file_name = argv[2];
+    char *region = argc > 3 ? argv[3] : NULL;
     FILE *source_descriptor = NULL;
     FILE *destination_descriptor = NULL;
+    threadpool_t *threadpool = NULL;
 
     bmp_image image; bmp_init_image_structure(&image);
+    image_format source_format = IMAGE_FORMAT_BMP;
+    roi_t roi; roi_init(&roi);
 
     source_descriptor = fopen(source_file_name, "r");
     if (source_descriptor == NULL) {
@@ -150,36 +173,63 @@ int main(int argc, char *argv[])
     }
 
     const char *error_message;
-    bmp_open_image_headers(source_descriptor, &image, &error_message);
+    image_io_open_image_headers(source_descriptor, &image, &source_format, &error_message);
     if (error_message != NULL) {
         fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", source_file_name, error_message);
         goto cleanup;
     }
 
-    bmp_read_image_data(source_descriptor, &image, &error_message);
+    image_io_read_image_data(source_descriptor, &image, source_format, &error_message);
     if (error_message != NULL) {
         fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", source_file_name, error_message);
         goto cleanup;
     }
 
+    if (region != NULL) {
+        roi_parse(region, &roi, &error_message);
+    } else if (!roi_set_full(&roi, image.absolute_image_width, image.absolute_image_height)) {
+        error_message = ROI_Error_Not_Enough_Memory;
+    }
+    if (error_message == NULL) {
+        roi_prepare(&roi, image.absolute_image_width, image.absolute_image_height, bmp_is_top_down(&image), &error_message);
+    }
+    if (error_message != NULL) {
+        fprintf(stderr, "Failed to process the region '%s':\n\t%s\n", region != NULL ? region : "", error_message);
+        goto cleanup;
+    }
+
+    image_format destination_format = image_io_get_format_for_file_name(destination_file_name, source_format);
     destination_descriptor = fopen(destination_file_name, "w");
     if (destination_descriptor == NULL) {
         fprintf(stderr, "Failed to create the output image '%s'\n", destination_file_name);
         goto cleanup;
     }
 
-    bmp_write_image_headers(destination_descriptor, &image, &error_message);
+    image_io_write_image_headers(destination_descriptor, &image, destination_format, &error_message);
     if (error_message != NULL) {
         fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", destination_file_name, error_message);
         goto cleanup;
     }
 
-    size_t pool_size = utils_get_number_of_cpu_cores();
-    threadpool_t *threadpool = threadpool_create(pool_size);
-    if (threadpool == NULL) {
-        fputs("Failed to create a threadpool.\n", stderr);
-        goto cleanup;
+    autotune_table_t tuning; autotune_init(&tuning);
+    autotune_load(&tuning, autotune_get_file_path(), &error_message);
+    if (error_message != NULL) {
+        fprintf(stderr, "Ignoring the tuning file '%s':\n\t%s\n", autotune_get_file_path(), error_message);
     }
+    autotune_config_t config =
+        autotune_get_config(&tuning, "sepia", roi_get_channel_count(&roi), utils_get_number_of_cpu_cores());
+    autotune_free(&tuning);
+
+    /* Small images are filtered on the main thread without a pool */
+    if (config.threads > 1) {
+        threadpool = threadpool_create(config.threads);
+        if (threadpool == NULL) {
+            fputs("Failed to create a threadpool.\n", stderr);
+            goto cleanup;
+        }
+    }
+
+    uint64_t kernel_start_time = timing_start();
 
     /* Main Image Processing Loop */
     {
@@ -189,50 +239,97 @@ int main(int argc, char *argv[])
         uint8_t *pixels = image.pixels;
 
         size_t width = image.absolute_image_width;
-        size_t height = image.absolute_image_height;
-
-        size_t channels_count = width * height * 4;
-        channels_left = channels_count;
-        size_t channels_per_thread = channels_count / pool_size;
 
 #if defined SIMD_INTRINSICS_IMPLEMENTATION || defined SIMD_ASM_IMPLEMENTATION
-        channels_per_thread = ((channels_per_thread - 1) / 16 + 1) * 16;
+        size_t step = 16;
 #else
-        channels_per_thread = ((channels_per_thread - 1) / 4 + 1) * 4;
+        size_t step = 4;
 #endif
 
-        for (size_t position = 0; position < channels_count; position += channels_per_thread) {
-            filters_sepia_data_t *task_data = malloc(sizeof(*task_data));
-            if (task_data == NULL) {
-                fputs("Out of memory.\n", stderr);
-                goto cleanup;
+        size_t channels_count = roi_get_channel_count(&roi);
+        channels_left = channels_count;
+        size_t channels_per_thread = config.grain;
+        channels_per_thread = UTILS_MAX(((channels_per_thread + step - 1) / step) * step, step);
+
+        for (size_t i = 0; i < roi.count; ++i) {
+            roi_rectangle_t *rectangle = &roi.rectangles[i];
+
+            /* Rectangles covering whole rows are one contiguous span that is
+               cut into equal chunks, the others are split into groups of rows. */
+            size_t span_count = roi_rectangle_get_span_count(rectangle, width);
+            size_t start, end;
+            roi_rectangle_get_span(rectangle, width, 0, &start, &end);
+
+            size_t span_channels = 1 == span_count ? channels_per_thread : end - start;
+            size_t rows_per_task = 1 == span_count ? 1 : UTILS_MAX(channels_per_thread / span_channels, 1);
+            size_t chunk_count = 1 == span_count ? (end - start - 1) / span_channels + 1 : span_count;
+
+            for (size_t chunk = 0; chunk < chunk_count; chunk += rows_per_task) {
+                filters_sepia_data_t *task_data = malloc(sizeof(*task_data));
+                if (task_data == NULL) {
+                    fputs("Out of memory.\n", stderr);
+                    goto cleanup;
+                }
+
+                task_data->pixels = pixels;
+                task_data->row_stride = width * 4;
+
+                if (1 == span_count) {
+                    size_t position = start + chunk * span_channels;
+
+                    task_data->position = position;
+                    task_data->span_channels =
+                        position + span_channels > end ?
+                            end - position :
+                            span_channels;
+                    task_data->rows = 1;
+                } else {
+                    task_data->position = start + chunk * task_data->row_stride;
+                    task_data->span_channels = span_channels;
+                    task_data->rows =
+                        chunk + rows_per_task > chunk_count ?
+                            chunk_count - chunk :
+                            rows_per_task;
+                }
+
+                task_data->streaming = config.streaming;
+                task_data->channels_left = &channels_left;
+                task_data->barrier_sense = &barrier_sense;
+
+                if (threadpool == NULL) {
+                    sepia_processing_task(task_data, NULL);
+                } else {
+                    threadpool_enqueue_task(threadpool, sepia_processing_task, task_data, NULL);
+                }
             }
-
-            task_data->pixels = pixels;
-            task_data->position = position;
-
-            task_data->channels_to_process =
-                position + channels_per_thread > channels_count ?
-                    channels_count - position :
-                    channels_per_thread;
-            task_data->channels_left = &channels_left;
-            task_data->barrier_sense = &barrier_sense;
-
-            threadpool_enqueue_task(threadpool, sepia_processing_task, task_data, NULL);
         }
 
-        while (!barrier_sense) { }
+        while (channels_count > 0 && !barrier_sense) { }
     }
 
-    bmp_write_image_data(destination_descriptor, &image, &error_message);
+    timing_stop(
+        TIMING_STAGE_KERNEL,
+        kernel_start_time,
+        roi_get_channel_count(&roi),
+        roi_get_channel_count(&roi) / 4
+    );
+
+    image_io_write_image_data(destination_descriptor, &image, destination_format, &error_message);
     if (error_message != NULL) {
         fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", destination_file_name, error_message);
         goto cleanup;
     }
 
+    timing_finish_image(destination_file_name);
+
     result = EXIT_SUCCESS;
 
 cleanup:
+    /* The pool finishes its queued tasks before the pixels are freed */
+    threadpool_destroy(threadpool);
+    threadpool = NULL;
+
+    roi_free(&roi);
     bmp_free_image_structure(&image);
 
     if (source_descriptor != NULL) {
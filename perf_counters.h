@@ -0,0 +1,123 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/*
+    Hardware counters of the calling process read through perf_event_open.
+    The counters are inherited by threads created after `perf_counters_open`,
+    but the kernel adds the counts of a thread to its parent only when the
+    thread exits, so a measured threadpool has to be created after the
+    counters are opened and destroyed before they are read.
+
+    The ratio of core cycles to reference cycles is the effective clock
+    relative to the nominal one and shows frequency drops such as the AVX-512
+    license changes. Events the machine or the permissions
+    (perf_event_paranoid) do not allow are marked as unavailable, and every
+    function keeps working without them.
+*/
+
+typedef enum _perf_counters_event
+{
+    PERF_COUNTERS_CYCLES,
+    PERF_COUNTERS_INSTRUCTIONS,
+    PERF_COUNTERS_CACHE_MISSES,         /* last level cache misses */
+    PERF_COUNTERS_REFERENCE_CYCLES,
+    PERF_COUNTERS_EVENT_COUNT
+} perf_counters_event_t;
+
+typedef struct _perf_counters
+{
+    int descriptors[PERF_COUNTERS_EVENT_COUNT];
+} perf_counters_t;
+
+typedef struct _perf_counters_sample
+{
+    uint64_t values[PERF_COUNTERS_EVENT_COUNT];
+    bool valid[PERF_COUNTERS_EVENT_COUNT];
+} perf_counters_sample_t;
+
+/* Opens and starts the counters, returns the number of available events. */
+static size_t perf_counters_open(perf_counters_t *counters)
+{
+    size_t count = 0;
+
+    for (size_t event = 0; event < PERF_COUNTERS_EVENT_COUNT; ++event) {
+        counters->descriptors[event] = -1;
+    }
+
+#ifdef __linux__
+    static const uint64_t Configurations[PERF_COUNTERS_EVENT_COUNT] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_REF_CPU_CYCLES
+    };
+
+    for (size_t event = 0; event < PERF_COUNTERS_EVENT_COUNT; ++event) {
+        struct perf_event_attr attributes;
+        memset(&attributes, 0, sizeof(attributes));
+        attributes.size = sizeof(attributes);
+        attributes.type = PERF_TYPE_HARDWARE;
+        attributes.config = Configurations[event];
+        attributes.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        attributes.inherit = 1;
+        attributes.exclude_kernel = 1;
+        attributes.exclude_hv = 1;
+
+        counters->descriptors[event] = (int) syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0);
+        if (counters->descriptors[event] >= 0) {
+            ++count;
+        }
+    }
+#endif
+
+    return count;
+}
+
+static void perf_counters_close(perf_counters_t *counters)
+{
+    for (size_t event = 0; event < PERF_COUNTERS_EVENT_COUNT; ++event) {
+        if (counters->descriptors[event] >= 0) {
+#ifdef __linux__
+            close(counters->descriptors[event]);
+#endif
+            counters->descriptors[event] = -1;
+        }
+    }
+}
+
+/* Reads the counts since `perf_counters_open`. Counts of events that shared
+   the hardware with others are scaled up to the whole time they were enabled. */
+static void perf_counters_read(perf_counters_t *counters, perf_counters_sample_t *sample)
+{
+    memset(sample, 0, sizeof(*sample));
+
+#ifdef __linux__
+    for (size_t event = 0; event < PERF_COUNTERS_EVENT_COUNT; ++event) {
+        uint64_t values[3];
+        if (counters->descriptors[event] < 0 ||
+            sizeof(values) != read(counters->descriptors[event], values, sizeof(values)) ||
+            0 == values[2]) {
+            continue;
+        }
+
+        sample->values[event] =
+            values[1] == values[2] ?
+                values[0] :
+                (uint64_t) ((double) values[0] * (double) values[1] / (double) values[2]);
+        sample->valid[event] = true;
+    }
+#endif
+}
+
+#endif // PERF_COUNTERS_H
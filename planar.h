@@ -0,0 +1,175 @@
+#ifndef PLANAR_H
+#define PLANAR_H
+
+#include "bmp.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined SIMD_INTRINSICS_IMPLEMENTATION || defined SIMD_ASM_IMPLEMENTATION
+#include <immintrin.h>
+#endif
+
+#if (defined SIMD_INTRINSICS_IMPLEMENTATION || defined SIMD_ASM_IMPLEMENTATION) && \
+    defined __AVX512F__
+#define PLANAR_AVX512_KERNELS 1
+#endif
+
+static const char *Planar_Error_Not_Enough_Memory =
+                    "Not enough memory to store the image planes";
+
+/*
+    A planar (structure of arrays) copy of BGRA pixels: one plane of bytes per
+    channel, `planes[PLANAR_BLUE][i]` is the blue channel of pixel `i`. A
+    kernel written against planes loads 16 values of one channel into a full
+    register and needs no shuffles to separate the channels, and it never
+    spends lanes on alpha.
+
+    Every plane is padded to a multiple of PLANAR_ALIGNMENT bytes. Planar
+    kernels may process the pixels up to the next multiple of 16 past `end`,
+    which stays inside the padding.
+*/
+
+#define PLANAR_ALIGNMENT 64
+
+typedef enum _planar_channel
+{
+    PLANAR_BLUE,
+    PLANAR_GREEN,
+    PLANAR_RED,
+    PLANAR_ALPHA,
+    PLANAR_CHANNEL_COUNT
+} planar_channel_t;
+
+typedef void (*planar_kernel_function_t)(uint8_t *const *planes, size_t position, size_t end, const float *parameters);
+
+typedef struct _planar_image
+{
+    uint8_t *buffer;
+    size_t buffer_size;
+    uint8_t *planes[PLANAR_CHANNEL_COUNT];
+    size_t pixels_count;
+} planar_image_t;
+
+static inline size_t planar_get_plane_size(size_t pixels_count)
+{
+    return (pixels_count + PLANAR_ALIGNMENT - 1) / PLANAR_ALIGNMENT * PLANAR_ALIGNMENT;
+}
+
+static inline void planar_image_init(planar_image_t *planar)
+{
+    memset(planar, 0, sizeof(*planar));
+}
+
+static inline void planar_image_free(planar_image_t *planar)
+{
+    if (NULL != planar->buffer) {
+        bmp_free_buffer(planar->buffer, planar->buffer_size);
+    }
+    planar_image_init(planar);
+}
+
+static void planar_image_allocate_planes(planar_image_t *planar, size_t pixels_count, const char **error_message)
+{
+    *error_message = NULL;
+
+    size_t plane_size = planar_get_plane_size(UTILS_MAX(pixels_count, 1));
+    planar->buffer_size = plane_size * PLANAR_CHANNEL_COUNT;
+    planar->buffer = bmp_allocate_buffer(planar->buffer_size);
+    if (NULL == planar->buffer) {
+        planar_image_init(planar);
+        *error_message = Planar_Error_Not_Enough_Memory;
+
+        return;
+    }
+
+    for (size_t channel = 0; channel < PLANAR_CHANNEL_COUNT; ++channel) {
+        planar->planes[channel] = planar->buffer + channel * plane_size;
+    }
+    planar->pixels_count = pixels_count;
+}
+
+/* Converters */
+
+/* Copies the pixels [first, end) of the interleaved `pixels` into the same
+   positions of the planes. */
+static void planar_split(uint8_t *const *planes, const uint8_t *pixels, size_t first, size_t end)
+{
+    size_t i = first;
+
+#if defined PLANAR_AVX512_KERNELS
+    __m512i byte_mask = _mm512_set1_epi32(0xff);
+    for (; i + 16 <= end; i += 16) {
+        __m512i quads = _mm512_loadu_si512((const __m512i *) &pixels[i * 4]);
+
+        _mm_storeu_si128((__m128i *) &planes[PLANAR_BLUE][i], _mm512_cvtepi32_epi8(_mm512_and_si512(quads, byte_mask)));
+        _mm_storeu_si128((__m128i *) &planes[PLANAR_GREEN][i], _mm512_cvtepi32_epi8(_mm512_and_si512(_mm512_srli_epi32(quads, 8), byte_mask)));
+        _mm_storeu_si128((__m128i *) &planes[PLANAR_RED][i], _mm512_cvtepi32_epi8(_mm512_and_si512(_mm512_srli_epi32(quads, 16), byte_mask)));
+        _mm_storeu_si128((__m128i *) &planes[PLANAR_ALPHA][i], _mm512_cvtepi32_epi8(_mm512_srli_epi32(quads, 24)));
+    }
+#endif
+
+    for (; i < end; ++i) {
+        planes[PLANAR_BLUE][i] = pixels[i * 4];
+        planes[PLANAR_GREEN][i] = pixels[i * 4 + 1];
+        planes[PLANAR_RED][i] = pixels[i * 4 + 2];
+        planes[PLANAR_ALPHA][i] = pixels[i * 4 + 3];
+    }
+}
+
+/* Copies the pixels [first, end) of the planes back into `pixels`. With
+   `streaming`, whole 64-byte lines are written with non-temporal stores. */
+static void planar_merge(const uint8_t *const *planes, uint8_t *pixels, size_t first, size_t end, bool streaming)
+{
+    size_t i = first;
+
+#if defined PLANAR_AVX512_KERNELS
+    streaming = streaming && 0 == ((uintptr_t) &pixels[i * 4] & 63);
+    for (; i + 16 <= end; i += 16) {
+        __m512i quads = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *) &planes[PLANAR_BLUE][i]));
+        quads = _mm512_or_si512(quads, _mm512_slli_epi32(_mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *) &planes[PLANAR_GREEN][i])), 8));
+        quads = _mm512_or_si512(quads, _mm512_slli_epi32(_mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *) &planes[PLANAR_RED][i])), 16));
+        quads = _mm512_or_si512(quads, _mm512_slli_epi32(_mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *) &planes[PLANAR_ALPHA][i])), 24));
+
+        if (streaming) {
+            _mm512_stream_si512((__m512i *) &pixels[i * 4], quads);
+        } else {
+            _mm512_storeu_si512((__m512i *) &pixels[i * 4], quads);
+        }
+    }
+    if (streaming) {
+        _mm_sfence();
+    }
+#else
+    (void) streaming;
+#endif
+
+    for (; i < end; ++i) {
+        pixels[i * 4] = planes[PLANAR_BLUE][i];
+        pixels[i * 4 + 1] = planes[PLANAR_GREEN][i];
+        pixels[i * 4 + 2] = planes[PLANAR_RED][i];
+        pixels[i * 4 + 3] = planes[PLANAR_ALPHA][i];
+    }
+}
+
+/* Allocates the planes for all pixels of `image` and fills them. */
+static void planar_image_from_bmp(planar_image_t *planar, const bmp_image *image, const char **error_message)
+{
+    size_t pixels_count = image->absolute_image_width * image->absolute_image_height;
+
+    planar_image_allocate_planes(planar, pixels_count, error_message);
+    if (NULL != *error_message) {
+        return;
+    }
+
+    planar_split(planar->planes, image->pixels, 0, pixels_count);
+}
+
+static void planar_image_to_bmp(const planar_image_t *planar, bmp_image *image)
+{
+    planar_merge((const uint8_t *const *) planar->planes, image->pixels, 0, planar->pixels_count, false);
+}
+
+#endif // PLANAR_H
@@ -0,0 +1,547 @@
+#ifndef PNM_H
+#define PNM_H
+
+#include "bmp.h"
+#include "timing.h"
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+    Binary PPM (P6) and PAM (P7) images with 8-bit RGB or RGB_ALPHA samples.
+
+    An image is decoded into a `bmp_image` that looks like a top-down BMP
+    read by `bmp_read_image_data`: the same aligned BGRA `pixels` and BMP
+    headers synthesized from the PNM header. Every filter works on it
+    unchanged, and it can be written as a BMP or a PNM image. The payload
+    holds the PNM samples while an image is read or written, it is sized for
+    the pixel array of the equivalent BMP image, which is never smaller.
+*/
+
+static const char *PNM_Error_Failed_to_Read_Header =
+                    "Failed to read the PNM header",
+                  *PNM_Error_Invalid_Signature =
+                    "Invalid PNM signature (not P6 or P7)",
+                  *PNM_Error_Invalid_Header =
+                    "Invalid PNM header",
+                  *PNM_Error_Unsupported_Maximum_Value =
+                    "Unsupported maximum sample value (not 255)",
+                  *PNM_Error_Unsupported_Tuple_Type =
+                    "Unsupported PAM tuple type (not RGB or RGB_ALPHA)",
+                  *PNM_Error_Failed_to_Write_Header =
+                    "Failed to write the PNM header";
+
+typedef enum _pnm_format
+{
+    PNM_FORMAT_PPM,     /* P6, RGB samples                  */
+    PNM_FORMAT_PAM      /* P7, RGB or RGB_ALPHA samples     */
+} pnm_format;
+
+#define PNM_MAX_TOKEN_SIZE 32
+#define PNM_MAX_SAMPLE_VALUE 255
+
+/* Reads the next header token and skips the whitespace and the comments
+   before it. The single whitespace character after the token is consumed,
+   which makes it the separator before the samples after the last token. */
+static bool _pnm_read_token(FILE *file_descriptor, char *token, size_t *header_size)
+{
+    int c = getc(file_descriptor);
+    ++*header_size;
+    while ('#' == c || isspace(c)) {
+        if ('#' == c) {
+            while ('\n' != c && EOF != c) {
+                c = getc(file_descriptor);
+                ++*header_size;
+            }
+        } else {
+            c = getc(file_descriptor);
+            ++*header_size;
+        }
+    }
+
+    size_t length = 0;
+    while (EOF != c && !isspace(c)) {
+        if (length + 1 >= PNM_MAX_TOKEN_SIZE) {
+            return false;
+        }
+        token[length++] = (char) c;
+
+        c = getc(file_descriptor);
+        ++*header_size;
+    }
+    token[length] = '\0';
+
+    return length > 0;
+}
+
+static bool _pnm_read_number(FILE *file_descriptor, size_t *number, size_t *header_size)
+{
+    char token[PNM_MAX_TOKEN_SIZE];
+    if (!_pnm_read_token(file_descriptor, token, header_size) || !isdigit((unsigned char) token[0])) {
+        return false;
+    }
+
+    char *end;
+    unsigned long long value = strtoull(token, &end, 10);
+    if ('\0' != *end || value > INT32_MAX) {
+        return false;
+    }
+    *number = (size_t) value;
+
+    return true;
+}
+
+static inline size_t _pnm_get_bmp_row_padding(size_t width, size_t channels)
+{
+    return (channels * 8 * width + 31) / 32 * 4 - width * channels;
+}
+
+static void pnm_open_image_headers(
+                FILE *file_descriptor,
+                bmp_image *image,
+                pnm_format *format,
+                const char **error_message
+            )
+{
+    *error_message = NULL;
+
+    if (NULL == image) {
+        if (NULL != error_message) {
+            *error_message = BMP_Error_Invalid_Image_Structure;
+        }
+
+        goto end;
+    }
+
+    if (NULL == file_descriptor) {
+        if (NULL != error_message) {
+            *error_message = BMP_Error_Invalid_File_Descriptor;
+        }
+
+        goto end;
+    }
+
+    uint64_t start_time = timing_start();
+
+    size_t header_size = 0;
+    char token[PNM_MAX_TOKEN_SIZE];
+    if (!_pnm_read_token(file_descriptor, token, &header_size)) {
+        if (NULL != error_message) {
+            *error_message = PNM_Error_Failed_to_Read_Header;
+        }
+
+        goto end;
+    }
+
+    size_t width = 0, height = 0, channels = 0, maximum_value = 0;
+    if (0 == strcmp(token, "P6")) {
+        *format = PNM_FORMAT_PPM;
+        channels = 3;
+
+        if (!_pnm_read_number(file_descriptor, &width, &header_size) ||
+            !_pnm_read_number(file_descriptor, &height, &header_size) ||
+            !_pnm_read_number(file_descriptor, &maximum_value, &header_size)) {
+            if (NULL != error_message) {
+                *error_message = PNM_Error_Invalid_Header;
+            }
+
+            goto end;
+        }
+    } else if (0 == strcmp(token, "P7")) {
+        *format = PNM_FORMAT_PAM;
+
+        char tuple_type[PNM_MAX_TOKEN_SIZE] = "";
+        for (;;) {
+            bool valid = _pnm_read_token(file_descriptor, token, &header_size);
+            if (valid && 0 == strcmp(token, "ENDHDR")) {
+                break;
+            }
+
+            if (valid && 0 == strcmp(token, "WIDTH")) {
+                valid = _pnm_read_number(file_descriptor, &width, &header_size);
+            } else if (valid && 0 == strcmp(token, "HEIGHT")) {
+                valid = _pnm_read_number(file_descriptor, &height, &header_size);
+            } else if (valid && 0 == strcmp(token, "DEPTH")) {
+                valid = _pnm_read_number(file_descriptor, &channels, &header_size);
+            } else if (valid && 0 == strcmp(token, "MAXVAL")) {
+                valid = _pnm_read_number(file_descriptor, &maximum_value, &header_size);
+            } else if (valid && 0 == strcmp(token, "TUPLTYPE")) {
+                valid = _pnm_read_token(file_descriptor, tuple_type, &header_size);
+            } else {
+                valid = false;
+            }
+
+            if (!valid) {
+                if (NULL != error_message) {
+                    *error_message = PNM_Error_Invalid_Header;
+                }
+
+                goto end;
+            }
+        }
+
+        if ((3 != channels && 4 != channels) ||
+            ('\0' != tuple_type[0] &&
+                 0 != strcmp(tuple_type, 3 == channels ? "RGB" : "RGB_ALPHA"))) {
+            if (NULL != error_message) {
+                *error_message = PNM_Error_Unsupported_Tuple_Type;
+            }
+
+            goto end;
+        }
+    } else {
+        if (NULL != error_message) {
+            *error_message = PNM_Error_Invalid_Signature;
+        }
+
+        goto end;
+    }
+
+    if (PNM_MAX_SAMPLE_VALUE != maximum_value) {
+        if (NULL != error_message) {
+            *error_message = PNM_Error_Unsupported_Maximum_Value;
+        }
+
+        goto end;
+    }
+
+    /* The synthesized BMP headers have to be able to describe the image */
+    size_t total_header_size =
+        sizeof(image->file_header) + sizeof(image->dib_header);
+    if (0 == width || 0 == height ||
+        width * channels + _pnm_get_bmp_row_padding(width, channels) > (UINT32_MAX - total_header_size) / height) {
+        if (NULL != error_message) {
+            *error_message = BMP_Error_Invalid_Size_Information;
+        }
+
+        goto end;
+    }
+
+    bmp_init_plain_headers(image, width, height, true, channels);
+
+    timing_stop(TIMING_STAGE_HEADERS, start_time, header_size, 0);
+
+end:
+    return;
+}
+
+/*
+    Reads the samples of an image opened with `pnm_open_image_headers` and
+    unpacks them into BGRA `pixels` in the requested orientation. PNM images
+    are stored top-down.
+*/
+static void pnm_read_image_data_oriented(
+                FILE *file_descriptor,
+                bmp_image *image,
+                bmp_orientation orientation,
+                const char **error_message
+            )
+{
+    *error_message = NULL;
+
+    if (NULL == image) {
+        if (NULL != error_message) {
+            *error_message = BMP_Error_Invalid_Image_Structure;
+        }
+
+        goto end;
+    }
+
+    if (NULL == file_descriptor) {
+        if (NULL != error_message) {
+            *error_message = BMP_Error_Invalid_File_Descriptor;
+        }
+
+        goto end;
+    }
+
+    size_t width =
+        (size_t) image->dib_header.image_width;
+    size_t height =
+        (size_t) -image->dib_header.image_height;
+    size_t channels =
+        image->channels;
+
+    size_t row_size =
+        width * channels;
+    size_t padding =
+        _pnm_get_bmp_row_padding(width, channels);
+
+    image->payload_size = height * (row_size + padding);
+    image->payload = bmp_allocate_buffer(image->payload_size);
+    if (NULL == image->payload) {
+        if (NULL != error_message) {
+            *error_message = BMP_Error_Not_Enough_Memory_to_Read;
+        }
+
+        goto end;
+    }
+    image->raw_pixels =
+        image->payload;
+
+    image->absolute_image_width  =
+        width;
+    image->absolute_image_height =
+        height;
+    image->pixel_row_padding =
+        padding;
+    image->image_size =
+        height * (row_size + padding);
+
+    uint64_t start_time = timing_start();
+
+    if (!fread(image->raw_pixels, height * row_size, 1, file_descriptor)) {
+        if (NULL != error_message) {
+            *error_message = BMP_Error_Failed_to_Read_Image_Data;
+        }
+
+        goto cleanup;
+    }
+
+    timing_stop(TIMING_STAGE_READ, start_time, height * row_size, width * height);
+
+    size_t extended_to_4_image_size =
+        height * (width * 4 + padding);
+
+    image->pixels = bmp_allocate_aligned_pixels(extended_to_4_image_size, &image->aligned_image_size);
+    if (NULL == image->pixels) {
+        if (NULL != error_message) {
+            *error_message = BMP_Error_Not_Enough_Memory_to_Read;
+        }
+
+        goto cleanup;
+    }
+
+    start_time = timing_start();
+
+    bool flip = BMP_ORIENTATION_BOTTOM_UP == orientation;
+    if (flip) {
+        image->dib_header.image_height = -image->dib_header.image_height;
+    }
+
+    for (size_t y = 0; y < height; ++y) {
+        const uint8_t *source = image->raw_pixels + y * row_size;
+        uint8_t *destination = image->pixels + (flip ? height - 1 - y : y) * width * 4;
+
+        if (4 == channels) {
+            for (size_t x = 0; x < width; ++x, source += 4, destination += 4) {
+                destination[0] = source[2];
+                destination[1] = source[1];
+                destination[2] = source[0];
+                destination[3] = source[3];
+            }
+        } else {
+            for (size_t x = 0; x < width; ++x, source += 3, destination += 4) {
+                destination[0] = source[2];
+                destination[1] = source[1];
+                destination[2] = source[0];
+                destination[3] = 255;
+            }
+        }
+    }
+
+    for (size_t linear_position = height * width * 4; linear_position < image->aligned_image_size; ++linear_position) {
+        image->pixels[linear_position] = 0;
+    }
+
+    timing_stop(TIMING_STAGE_UNPACK, start_time, height * row_size, width * height);
+
+end:
+    return;
+
+cleanup:
+    if (NULL != image->payload)
+    {
+        bmp_free_buffer(image->payload, image->payload_size);
+        image->payload = NULL;
+    }
+    if (NULL != image->pixels)
+    {
+        bmp_free_buffer(image->pixels, image->aligned_image_size);
+        image->pixels = NULL;
+    }
+}
+
+static inline void pnm_read_image_data(
+                       FILE *file_descriptor,
+                       bmp_image *image,
+                       const char **error_message
+                   )
+{
+    pnm_read_image_data_oriented(file_descriptor, image, BMP_ORIENTATION_AS_STORED, error_message);
+}
+
+/* PPM images have no alpha channel, PAM images keep the channels of the
+   image. */
+static inline size_t pnm_get_channels(const bmp_image *image, pnm_format format)
+{
+    return PNM_FORMAT_PPM == format ? 3 : image->channels;
+}
+
+static void pnm_write_image_headers(
+                FILE *file_descriptor,
+                bmp_image *image,
+                pnm_format format,
+                const char **error_message
+            )
+{
+    *error_message = NULL;
+
+    if (NULL == image) {
+        if (NULL != error_message) {
+            *error_message = BMP_Error_Invalid_Image_Structure;
+        }
+
+        goto end;
+    }
+
+    if (NULL == file_descriptor) {
+        if (NULL != error_message) {
+            *error_message = BMP_Error_Invalid_File_Descriptor;
+        }
+
+        goto end;
+    }
+
+    uint64_t start_time = timing_start();
+
+    int header_size;
+    if (PNM_FORMAT_PPM == format) {
+        header_size =
+            fprintf(
+                file_descriptor,
+                "P6\n%zu %zu\n%d\n",
+                image->absolute_image_width,
+                image->absolute_image_height,
+                PNM_MAX_SAMPLE_VALUE
+            );
+    } else {
+        size_t channels = pnm_get_channels(image, format);
+        header_size =
+            fprintf(
+                file_descriptor,
+                "P7\nWIDTH %zu\nHEIGHT %zu\nDEPTH %zu\nMAXVAL %d\nTUPLTYPE %s\nENDHDR\n",
+                image->absolute_image_width,
+                image->absolute_image_height,
+                channels,
+                PNM_MAX_SAMPLE_VALUE,
+                4 == channels ? "RGB_ALPHA" : "RGB"
+            );
+    }
+
+    if (header_size < 0) {
+        if (NULL != error_message) {
+            *error_message = PNM_Error_Failed_to_Write_Header;
+        }
+
+        goto end;
+    }
+
+    timing_stop(TIMING_STAGE_WRITE, start_time, (size_t) header_size, 0);
+
+end:
+    return;
+}
+
+/*
+    Packs the BGRA `pixels` into RGB or RGBA samples in the payload and
+    writes them top-down, whatever the orientation of `pixels` is.
+*/
+static void pnm_write_image_data(
+                FILE *file_descriptor,
+                bmp_image *image,
+                pnm_format format,
+                const char **error_message
+            )
+{
+    *error_message = NULL;
+
+    if (NULL == image) {
+        if (NULL != error_message) {
+            *error_message = BMP_Error_Invalid_Image_Structure;
+        }
+
+        goto end;
+    }
+
+    if (NULL == file_descriptor) {
+        if (NULL != error_message) {
+            *error_message = BMP_Error_Invalid_File_Descriptor;
+        }
+
+        goto end;
+    }
+
+    size_t width =
+        image->absolute_image_width;
+    size_t height =
+        image->absolute_image_height;
+    size_t channels =
+        pnm_get_channels(image, format);
+    size_t row_size =
+        width * channels;
+    bool flip =
+        !bmp_is_top_down(image);
+
+    uint64_t start_time = timing_start();
+
+    for (size_t y = 0; y < height; ++y) {
+        const uint8_t *source = image->pixels + (flip ? height - 1 - y : y) * width * 4;
+        uint8_t *destination = image->raw_pixels + y * row_size;
+
+        if (4 == channels) {
+            for (size_t x = 0; x < width; ++x, source += 4, destination += 4) {
+                destination[0] = source[2];
+                destination[1] = source[1];
+                destination[2] = source[0];
+                destination[3] = source[3];
+            }
+        } else {
+            for (size_t x = 0; x < width; ++x, source += 4, destination += 3) {
+                destination[0] = source[2];
+                destination[1] = source[1];
+                destination[2] = source[0];
+            }
+        }
+    }
+
+    timing_stop(TIMING_STAGE_PACK, start_time, height * row_size, width * height);
+
+    start_time = timing_start();
+
+    if (!fwrite(image->raw_pixels, height * row_size, 1, file_descriptor)) {
+        if (NULL != error_message) {
+            *error_message = BMP_Error_Failed_to_Write_Image_Data;
+        }
+
+        goto end;
+    }
+
+    /* Include the time to hand the buffered data over to the kernel */
+    if (timing_is_enabled()) {
+        fflush(file_descriptor);
+    }
+
+    timing_stop(TIMING_STAGE_WRITE, start_time, height * row_size, width * height);
+
+end:
+    return;
+}
+
+/* Swaps the red and the blue channels of RGBA samples in place, turning
+   them into BGRA pixels for the filters and back. */
+static void pnm_swap_red_and_blue(uint8_t *pixels, size_t channels_count)
+{
+    for (size_t position = 0; position + 4 <= channels_count; position += 4) {
+        uint8_t red = pixels[position];
+        pixels[position] = pixels[position + 2];
+        pixels[position + 2] = red;
+    }
+}
+
+#endif // PNM_H
@@ -0,0 +1,148 @@
+#include "bmp.h"
+#include "image_io.h"
+#include "pyramid.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#if !defined C_IMPLEMENTATION && \
+    !defined SIMD_INTRINSICS_IMPLEMENTATION && \
+    !defined SIMD_ASM_IMPLEMENTATION
+#define C_IMPLEMENTATION 1
+#endif
+
+int main(int argc, char *argv[])
+{
+    int result = EXIT_FAILURE;
+
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <source file> <dest. file prefix>\n", argv[0]);
+        return result;
+    }
+
+    char *source_file_name = argv[1];
+    char *destination_file_prefix = argv[2];
+    FILE *source_descriptor = NULL;
+    FILE *destination_descriptor = NULL;
+
+    bmp_image image; bmp_init_image_structure(&image);
+    image_format source_format = IMAGE_FORMAT_BMP;
+    pyramid_t pyramid = { NULL, 0 };
+
+    source_descriptor = fopen(source_file_name, "r");
+    if (source_descriptor == NULL) {
+        fprintf(stderr, "Failed to open the source image file '%s'\n", source_file_name);
+        goto cleanup;
+    }
+
+    const char *error_message;
+    image_io_open_image_headers(source_descriptor, &image, &source_format, &error_message);
+    if (error_message != NULL) {
+        fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", source_file_name, error_message);
+        goto cleanup;
+    }
+
+    image_io_read_image_data(source_descriptor, &image, source_format, &error_message);
+    if (error_message != NULL) {
+        fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", source_file_name, error_message);
+        goto cleanup;
+    }
+
+    pyramid.level_count =
+        pyramid_count_levels(image.absolute_image_width, image.absolute_image_height);
+    pyramid.levels = calloc(pyramid.level_count, sizeof(*pyramid.levels));
+    if (pyramid.levels == NULL) {
+        fputs("Out of memory.\n", stderr);
+        goto cleanup;
+    }
+
+    pyramid.levels[0] = image;
+    for (size_t level = 1; level < pyramid.level_count; ++level) {
+        bmp_create_image_from_template(
+            &pyramid.levels[level],
+            &image,
+            pyramid_next_level_size(pyramid.levels[level - 1].absolute_image_width),
+            pyramid_next_level_size(pyramid.levels[level - 1].absolute_image_height),
+            &error_message
+        );
+        if (error_message != NULL) {
+            fprintf(stderr, "Failed to create the pyramid level %zu:\n\t%s\n", level, error_message);
+            goto cleanup;
+        }
+    }
+
+    /* Main Image Processing Loop */
+    uint64_t kernel_start_time = timing_start();
+
+    pyramid_build(&pyramid);
+
+    timing_stop(
+        TIMING_STAGE_KERNEL,
+        kernel_start_time,
+        image.absolute_image_width * image.absolute_image_height * 4,
+        image.absolute_image_width * image.absolute_image_height
+    );
+
+    for (size_t level = 1; level < pyramid.level_count; ++level) {
+        char destination_file_name[FILENAME_MAX];
+        snprintf(
+            destination_file_name,
+            sizeof(destination_file_name),
+            "%s_%zu%s",
+            destination_file_prefix,
+            level,
+            image_io_get_extension(source_format)
+        );
+
+        destination_descriptor = fopen(destination_file_name, "w");
+        if (destination_descriptor == NULL) {
+            fprintf(stderr, "Failed to create the output image '%s'\n", destination_file_name);
+            goto cleanup;
+        }
+
+        image_io_write_image_headers(destination_descriptor, &pyramid.levels[level], source_format, &error_message);
+        if (error_message != NULL) {
+            fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", destination_file_name, error_message);
+            goto cleanup;
+        }
+
+        image_io_write_image_data(destination_descriptor, &pyramid.levels[level], source_format, &error_message);
+        if (error_message != NULL) {
+            fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", destination_file_name, error_message);
+            goto cleanup;
+        }
+
+        fclose(destination_descriptor);
+        destination_descriptor = NULL;
+    }
+
+    /* All levels come from one decoded image, so they are reported as one */
+    timing_finish_image(destination_file_prefix);
+
+    result = EXIT_SUCCESS;
+
+cleanup:
+    if (pyramid.levels != NULL) {
+        for (size_t level = 1; level < pyramid.level_count; ++level) {
+            bmp_free_image_structure(&pyramid.levels[level]);
+        }
+        free(pyramid.levels);
+        pyramid.levels = NULL;
+    }
+
+    bmp_free_image_structure(&image);
+
+    if (source_descriptor != NULL) {
+        fclose(source_descriptor);
+        source_descriptor = NULL;
+    }
+
+    if (destination_descriptor != NULL) {
+        fclose(destination_descriptor);
+        destination_descriptor = NULL;
+    }
+
+    return result;
+}
@@ -0,0 +1,152 @@
+#ifndef PYRAMID_H
+#define PYRAMID_H
+
+#include "bmp.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined SIMD_INTRINSICS_IMPLEMENTATION || defined SIMD_ASM_IMPLEMENTATION
+#include <immintrin.h>
+#endif
+
+/* Size of the next pyramid level along one axis. Odd trailing rows and
+   columns are dropped, a single row or column is kept. */
+static inline size_t pyramid_next_level_size(size_t size)
+{
+    return size > 1 ? size / 2 : 1;
+}
+
+/*
+    Averages every 2x2 block of BGRA pixels of the source rows `first_row` and
+    `second_row` into one pixel of `destination_row` with exact rounding:
+    (a + b + c + d + 2) / 4. A source that is one pixel wide is sampled twice.
+*/
+static inline void pyramid_downsample_row(
+                       const uint8_t *first_row,
+                       const uint8_t *second_row,
+                       size_t source_width,
+                       uint8_t *destination_row,
+                       size_t destination_width
+                   )
+{
+    size_t x = 0;
+
+#if (defined SIMD_INTRINSICS_IMPLEMENTATION || defined SIMD_ASM_IMPLEMENTATION) && \
+    defined __AVX512BW__
+    if (source_width > 1) {
+        const __m512i rounding = _mm512_set1_epi16(2);
+        const __m256i order = _mm256_set_epi32(7, 5, 3, 1, 6, 4, 2, 0);
+
+        /* 16 source pixels of both rows produce 8 destination pixels */
+        for (; x + 8 <= destination_width; x += 8) {
+            __m512i top = _mm512_loadu_si512((const void *) &first_row[x * 8]);
+            __m512i bottom = _mm512_loadu_si512((const void *) &second_row[x * 8]);
+
+            __m512i low =
+                _mm512_add_epi16(
+                    _mm512_cvtepu8_epi16(_mm512_castsi512_si256(top)),
+                    _mm512_cvtepu8_epi16(_mm512_castsi512_si256(bottom))
+                );
+            __m512i high =
+                _mm512_add_epi16(
+                    _mm512_cvtepu8_epi16(_mm512_extracti64x4_epi64(top, 1)),
+                    _mm512_cvtepu8_epi16(_mm512_extracti64x4_epi64(bottom, 1))
+                );
+
+            /* Every 64-bit lane holds the four channels of one pixel. Adding
+               the even and odd lanes sums horizontal neighbours, leaving the
+               pixels ordered as 0, 4, 1, 5, 2, 6, 3, 7. */
+            __m512i sum =
+                _mm512_add_epi16(
+                    _mm512_unpacklo_epi64(low, high),
+                    _mm512_unpackhi_epi64(low, high)
+                );
+            sum = _mm512_srli_epi16(_mm512_add_epi16(sum, rounding), 2);
+
+            __m256i pixels = _mm256_permutevar8x32_epi32(_mm512_cvtepi16_epi8(sum), order);
+            _mm256_storeu_si256((__m256i *) &destination_row[x * 4], pixels);
+        }
+    }
+#endif
+
+    for (; x < destination_width; ++x) {
+        size_t left = UTILS_MIN(x * 2, source_width - 1) * 4;
+        size_t right = UTILS_MIN(x * 2 + 1, source_width - 1) * 4;
+
+        for (size_t channel = 0; channel < 4; ++channel) {
+            uint32_t sum =
+                (uint32_t) first_row[left + channel]  + first_row[right + channel] +
+                (uint32_t) second_row[left + channel] + second_row[right + channel];
+            destination_row[x * 4 + channel] = (uint8_t) ((sum + 2) >> 2);
+        }
+    }
+}
+
+/*
+    A pyramid of images where every level halves the previous one, down to a
+    single pixel. Levels are produced in one streaming pass: as soon as two
+    rows of a level are complete, the row of the next level that depends on
+    them is computed while the inputs are still in cache.
+*/
+typedef struct _pyramid
+{
+    bmp_image *levels;      /* levels[0] is the source image, not owned */
+    size_t level_count;
+} pyramid_t;
+
+static inline size_t pyramid_count_levels(size_t width, size_t height)
+{
+    size_t count = 1;
+    while (width > 1 || height > 1) {
+        width = pyramid_next_level_size(width);
+        height = pyramid_next_level_size(height);
+        ++count;
+    }
+
+    return count;
+}
+
+static void _pyramid_complete_row(pyramid_t *pyramid, size_t level, size_t row)
+{
+    while (level + 1 < pyramid->level_count) {
+        bmp_image *source = &pyramid->levels[level];
+        bmp_image *destination = &pyramid->levels[level + 1];
+
+        size_t source_height = source->absolute_image_height;
+        size_t destination_row = row / 2;
+
+        bool pair_complete =
+            1 == source_height ||
+            (1 == row % 2 && destination_row < destination->absolute_image_height);
+        if (!pair_complete) {
+            return;
+        }
+
+        size_t source_stride = source->absolute_image_width * 4;
+        size_t destination_stride = destination->absolute_image_width * 4;
+        size_t second_row = UTILS_MIN(destination_row * 2 + 1, source_height - 1);
+
+        pyramid_downsample_row(
+            source->pixels + destination_row * 2 * source_stride,
+            source->pixels + second_row * source_stride,
+            source->absolute_image_width,
+            destination->pixels + destination_row * destination_stride,
+            destination->absolute_image_width
+        );
+
+        level += 1;
+        row = destination_row;
+    }
+}
+
+static void pyramid_build(pyramid_t *pyramid)
+{
+    size_t height = pyramid->levels[0].absolute_image_height;
+    for (size_t row = 0; row < height; ++row) {
+        _pyramid_complete_row(pyramid, 0, row);
+    }
+}
+
+#endif // PYRAMID_H
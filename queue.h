@@ -233,4 +233,28 @@ static void *queue_pop(queue_t *queue)
     return result;
 }
 
+/* Removes `item`, which has to be in the queue, and returns its content. */
+static void *queue_remove(queue_t *queue, queue_item_t *item)
+{
+    void *result = NULL;
+
+    if (NULL != queue && NULL != item && 0 < queue->size) {
+        if (item == queue->last) {
+            return queue_pop(queue);
+        }
+        if (item == queue->first) {
+            return queue_deque(queue);
+        }
+
+        item->previous->next = item->next;
+        item->next->previous = item->previous;
+        queue->size -= 1;
+
+        result = item->content;
+        queue_item_destroy(item);
+    }
+
+    return result;
+}
+
 #endif // QUEUE_H
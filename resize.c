@@ -0,0 +1,264 @@
+#include "bmp.h"
+#include "image_io.h"
+#include "resize.h"
+#include "threadpool.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#if !defined C_IMPLEMENTATION && \
+    !defined SIMD_INTRINSICS_IMPLEMENTATION && \
+    !defined SIMD_ASM_IMPLEMENTATION
+#define C_IMPLEMENTATION 1
+#endif
+
+/* The smallest number of output rows a single task resamples. Every band
+   resamples horizontally only the source rows it needs, so bands that are
+   too thin spend most of their time on the rows shared with the neighbours. */
+#define RESIZE_MINIMUM_BAND_ROWS 16
+
+typedef struct _filters_resize_data
+{
+    const bmp_image *source;
+    bmp_image *destination;
+    const resize_weights_t *horizontal_weights;
+    const resize_weights_t *vertical_weights;
+    size_t first_row;
+    size_t rows_to_process;
+    volatile ssize_t *rows_left;
+    volatile bool *barrier_sense;
+} filters_resize_data_t;
+
+static void resize_processing_task(
+                void *task_data,
+                void (*result_callback)(void *result) __attribute__((unused))
+            )
+{
+    filters_resize_data_t *data = task_data;
+
+    const resize_weights_t *horizontal_weights = data->horizontal_weights;
+    const resize_weights_t *vertical_weights = data->vertical_weights;
+
+    size_t source_row_size = data->source->absolute_image_width * 4;
+    size_t destination_row_size = data->destination->absolute_image_width * 4;
+    size_t band_row_stride = ((destination_row_size - 1) / 16 + 1) * 16;
+
+    size_t first_row = data->first_row;
+    size_t last_row = first_row + data->rows_to_process - 1;
+
+    size_t band_first_row = vertical_weights->first[first_row];
+    size_t band_last_row =
+        UTILS_MIN(vertical_weights->first[last_row] + vertical_weights->taps, vertical_weights->in_size);
+    size_t band_rows = band_last_row - band_first_row;
+
+    size_t band_size = sizeof(float) * band_rows * band_row_stride;
+    band_size = ((band_size - 1) / 64 + 1) * 64;
+    float *band = (float *) aligned_alloc(64, band_size);
+    if (band == NULL) {
+        fputs("Out of memory.\n", stderr);
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t y = band_first_row; y < band_last_row; ++y) {
+        resize_horizontal_row(
+            data->source->pixels + y * source_row_size,
+            band + (y - band_first_row) * band_row_stride,
+            horizontal_weights
+        );
+    }
+
+    for (size_t y = first_row; y <= last_row; ++y) {
+        resize_vertical_row(
+            band,
+            band_first_row,
+            band_row_stride,
+            data->destination->pixels + y * destination_row_size,
+            destination_row_size,
+            vertical_weights,
+            y
+        );
+    }
+
+    free(band);
+    band = NULL;
+
+    ssize_t rows_left = __sync_sub_and_fetch(data->rows_left, (ssize_t) data->rows_to_process);
+    if (rows_left <= 0) {
+        __sync_lock_test_and_set(data->barrier_sense, true);
+    }
+
+    free(data);
+    data = NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int result = EXIT_FAILURE;
+
+    if (argc < 6) {
+        fprintf(stderr, "Usage: %s <bilinear|bicubic|lanczos> <width> <height> <source file> <dest. file>\n", argv[0]);
+        return result;
+    }
+
+    resize_filter_t filter;
+    if (!resize_parse_filter(argv[1], &filter)) {
+        fprintf(stderr, "Unknown resampling filter '%s'\n", argv[1]);
+        return result;
+    }
+
+    long width = strtol(argv[2], NULL, 10);
+    long height = strtol(argv[3], NULL, 10);
+    if (width <= 0 || height <= 0) {
+        fprintf(stderr, "Invalid output size '%s' x '%s'\n", argv[2], argv[3]);
+        return result;
+    }
+
+    char *source_file_name = argv[4];
+    char *destination_file_name = argv[5];
+    FILE *source_descriptor = NULL;
+    FILE *destination_descriptor = NULL;
+    threadpool_t *threadpool = NULL;
+
+    resize_weights_t *horizontal_weights = NULL;
+    resize_weights_t *vertical_weights = NULL;
+
+    bmp_image image; bmp_init_image_structure(&image);
+    image_format source_format = IMAGE_FORMAT_BMP;
+    bmp_image resized_image; bmp_init_image_structure(&resized_image);
+
+    source_descriptor = fopen(source_file_name, "r");
+    if (source_descriptor == NULL) {
+        fprintf(stderr, "Failed to open the source image file '%s'\n", source_file_name);
+        goto cleanup;
+    }
+
+    const char *error_message;
+    image_io_open_image_headers(source_descriptor, &image, &source_format, &error_message);
+    if (error_message != NULL) {
+        fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", source_file_name, error_message);
+        goto cleanup;
+    }
+
+    image_io_read_image_data(source_descriptor, &image, source_format, &error_message);
+    if (error_message != NULL) {
+        fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", source_file_name, error_message);
+        goto cleanup;
+    }
+
+    bmp_create_image_from_template(&resized_image, &image, (size_t) width, (size_t) height, &error_message);
+    if (error_message != NULL) {
+        fprintf(stderr, "Failed to create the output image '%s':\n\t%s\n", destination_file_name, error_message);
+        goto cleanup;
+    }
+
+    image_format destination_format = image_io_get_format_for_file_name(destination_file_name, source_format);
+    destination_descriptor = fopen(destination_file_name, "w");
+    if (destination_descriptor == NULL) {
+        fprintf(stderr, "Failed to create the output image '%s'\n", destination_file_name);
+        goto cleanup;
+    }
+
+    image_io_write_image_headers(destination_descriptor, &resized_image, destination_format, &error_message);
+    if (error_message != NULL) {
+        fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", destination_file_name, error_message);
+        goto cleanup;
+    }
+
+    horizontal_weights =
+        resize_weights_create(image.absolute_image_width, resized_image.absolute_image_width, filter);
+    vertical_weights =
+        resize_weights_create(image.absolute_image_height, resized_image.absolute_image_height, filter);
+    if (horizontal_weights == NULL || vertical_weights == NULL) {
+        fputs("Out of memory.\n", stderr);
+        goto cleanup;
+    }
+
+    size_t pool_size = utils_get_number_of_cpu_cores();
+    threadpool = threadpool_create(pool_size);
+    if (threadpool == NULL) {
+        fputs("Failed to create a threadpool.\n", stderr);
+        goto cleanup;
+    }
+
+    uint64_t kernel_start_time = timing_start();
+
+    /* Main Image Processing Loop */
+    {
+        static volatile ssize_t rows_left = 0;
+        static volatile bool barrier_sense = false;
+
+        size_t rows_count = resized_image.absolute_image_height;
+        rows_left = rows_count;
+
+        /* A few bands per worker keep the pool balanced without making the
+           bands so thin that the overlapping source rows dominate. */
+        size_t rows_per_task = (rows_count - 1) / (pool_size * 4) + 1;
+        rows_per_task = UTILS_MAX(rows_per_task, RESIZE_MINIMUM_BAND_ROWS);
+
+        for (size_t row = 0; row < rows_count; row += rows_per_task) {
+            filters_resize_data_t *task_data = malloc(sizeof(*task_data));
+            if (task_data == NULL) {
+                fputs("Out of memory.\n", stderr);
+                goto cleanup;
+            }
+
+            task_data->source = &image;
+            task_data->destination = &resized_image;
+            task_data->horizontal_weights = horizontal_weights;
+            task_data->vertical_weights = vertical_weights;
+            task_data->first_row = row;
+            task_data->rows_to_process =
+                row + rows_per_task > rows_count ?
+                    rows_count - row :
+                    rows_per_task;
+            task_data->rows_left = &rows_left;
+            task_data->barrier_sense = &barrier_sense;
+
+            threadpool_enqueue_task(threadpool, resize_processing_task, task_data, NULL);
+        }
+
+        while (!barrier_sense) { }
+    }
+
+    timing_stop(
+        TIMING_STAGE_KERNEL,
+        kernel_start_time,
+        resized_image.absolute_image_width * resized_image.absolute_image_height * 4,
+        resized_image.absolute_image_width * resized_image.absolute_image_height
+    );
+
+    image_io_write_image_data(destination_descriptor, &resized_image, destination_format, &error_message);
+    if (error_message != NULL) {
+        fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", destination_file_name, error_message);
+        goto cleanup;
+    }
+
+    timing_finish_image(destination_file_name);
+
+    result = EXIT_SUCCESS;
+
+cleanup:
+    /* The pool finishes its queued tasks before the pixels are freed */
+    threadpool_destroy(threadpool);
+    threadpool = NULL;
+
+    resize_weights_destroy(horizontal_weights);
+    resize_weights_destroy(vertical_weights);
+
+    bmp_free_image_structure(&image);
+    bmp_free_image_structure(&resized_image);
+
+    if (source_descriptor != NULL) {
+        fclose(source_descriptor);
+        source_descriptor = NULL;
+    }
+
+    if (destination_descriptor != NULL) {
+        fclose(destination_descriptor);
+        destination_descriptor = NULL;
+    }
+
+    return result;
+}
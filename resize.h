@@ -0,0 +1,354 @@
+#ifndef RESIZE_H
+#define RESIZE_H
+
+#include "bmp.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined SIMD_INTRINSICS_IMPLEMENTATION || defined SIMD_ASM_IMPLEMENTATION
+#include <immintrin.h>
+#endif
+
+#if (defined SIMD_INTRINSICS_IMPLEMENTATION || defined SIMD_ASM_IMPLEMENTATION) && \
+    defined __AVX512F__
+#define RESIZE_AVX512_KERNELS 1
+#elif (defined SIMD_INTRINSICS_IMPLEMENTATION || defined SIMD_ASM_IMPLEMENTATION) && \
+    defined __AVX2__ && defined __FMA__
+#define RESIZE_AVX2_KERNELS 1
+#endif
+
+/* Taps are padded to a multiple of this value so that the SIMD kernels can
+   consume four BGRA source pixels (16 channels) per step without a tail. */
+#define RESIZE_TAP_GROUP 4
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/* Filters */
+
+typedef enum _resize_filter
+{
+    RESIZE_FILTER_BILINEAR,
+    RESIZE_FILTER_BICUBIC,
+    RESIZE_FILTER_LANCZOS
+} resize_filter_t;
+
+static inline double _resize_sinc(double x)
+{
+    if (0.0 == x) {
+        return 1.0;
+    }
+
+    x *= M_PI;
+
+    return sin(x) / x;
+}
+
+static inline double resize_filter_support(resize_filter_t filter)
+{
+    switch (filter) {
+        case RESIZE_FILTER_BILINEAR: return 1.0;
+        case RESIZE_FILTER_BICUBIC:  return 2.0;
+        case RESIZE_FILTER_LANCZOS:  return 3.0;
+    }
+
+    return 1.0;
+}
+
+static inline double resize_filter_evaluate(resize_filter_t filter, double x)
+{
+    x = fabs(x);
+
+    switch (filter) {
+        case RESIZE_FILTER_BILINEAR:
+            return x < 1.0 ? 1.0 - x : 0.0;
+        case RESIZE_FILTER_BICUBIC: {
+            /* Keys cubic convolution with a = -0.5 (Catmull-Rom) */
+            static const double a = -0.5;
+            if (x < 1.0) {
+                return ((a + 2.0) * x - (a + 3.0)) * x * x + 1.0;
+            }
+            if (x < 2.0) {
+                return (((x - 5.0) * x + 8.0) * x - 4.0) * a;
+            }
+            return 0.0;
+        }
+        case RESIZE_FILTER_LANCZOS:
+            return x < 3.0 ? _resize_sinc(x) * _resize_sinc(x / 3.0) : 0.0;
+    }
+
+    return 0.0;
+}
+
+static inline bool resize_parse_filter(const char *name, resize_filter_t *filter)
+{
+    if (0 == strcmp(name, "bilinear")) {
+        *filter = RESIZE_FILTER_BILINEAR;
+    } else if (0 == strcmp(name, "bicubic")) {
+        *filter = RESIZE_FILTER_BICUBIC;
+    } else if (0 == strcmp(name, "lanczos")) {
+        *filter = RESIZE_FILTER_LANCZOS;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+/* Weight Tables */
+
+typedef struct _resize_weights
+{
+    size_t in_size;
+    size_t out_size;
+    size_t taps;          /* weights per output sample, a multiple of RESIZE_TAP_GROUP */
+    bool vectorizable;    /* every window of `taps` samples lies inside [0, in_size)   */
+    size_t *first;        /* first source sample of every output sample                */
+    float *weights;       /* out_size * taps normalized weights                        */
+} resize_weights_t;
+
+static inline void resize_weights_destroy(resize_weights_t *weights)
+{
+    if (NULL != weights) {
+        if (NULL != weights->first) {
+            free(weights->first);
+        }
+        if (NULL != weights->weights) {
+            free(weights->weights);
+        }
+        free(weights);
+    }
+}
+
+static resize_weights_t *resize_weights_create(size_t in_size, size_t out_size, resize_filter_t filter)
+{
+    resize_weights_t *weights = (resize_weights_t *) calloc(1, sizeof(*weights));
+    if (NULL == weights) {
+        return weights;
+    }
+
+    double scale = (double) in_size / (double) out_size;
+    double filter_scale = UTILS_MAX(scale, 1.0);
+    double support = resize_filter_support(filter) * filter_scale;
+
+    size_t max_count = (size_t) ceil(support) * 2 + 1;
+    size_t taps = ((max_count - 1) / RESIZE_TAP_GROUP + 1) * RESIZE_TAP_GROUP;
+
+    weights->in_size = in_size;
+    weights->out_size = out_size;
+    weights->taps = taps;
+    weights->vectorizable = in_size >= taps;
+    weights->first = (size_t *) malloc(sizeof(*weights->first) * out_size);
+    weights->weights = (float *) calloc(out_size * taps, sizeof(*weights->weights));
+    if (NULL == weights->first || NULL == weights->weights) {
+        resize_weights_destroy(weights);
+
+        return NULL;
+    }
+
+    for (size_t i = 0; i < out_size; ++i) {
+        double center = ((double) i + 0.5) * scale;
+
+        ssize_t min = (ssize_t) (center - support + 0.5);
+        ssize_t max = (ssize_t) (center + support + 0.5);
+        min = UTILS_MAX(min, 0);
+        max = UTILS_MIN(max, (ssize_t) in_size);
+
+        size_t count = (size_t) (max - min);
+        count = UTILS_MIN(count, taps);
+
+        float *row = &weights->weights[i * taps];
+
+        double sum = 0.0;
+        for (size_t k = 0; k < count; ++k) {
+            double weight =
+                resize_filter_evaluate(
+                    filter,
+                    ((double) ((size_t) min + k) - center + 0.5) / filter_scale
+                );
+            row[k] = (float) weight;
+            sum += weight;
+        }
+        if (0.0 != sum) {
+            for (size_t k = 0; k < count; ++k) {
+                row[k] = (float) (row[k] / sum);
+            }
+        }
+
+        /* Slide windows that run past the end of the source back inside it so
+           that every load of `taps` samples stays in bounds. */
+        size_t first = (size_t) min;
+        if (weights->vectorizable && first + taps > in_size) {
+            size_t shift = first + taps - in_size;
+            memmove(row + shift, row, sizeof(*row) * count);
+            memset(row, 0, sizeof(*row) * shift);
+            first -= shift;
+        }
+
+        weights->first[i] = first;
+    }
+
+    return weights;
+}
+
+/* Kernels */
+
+/*
+    Horizontal pass: resamples one row of BGRA pixels into `weights->out_size`
+    BGRA float samples.
+*/
+static inline void resize_horizontal_row(
+                       const uint8_t *source_row,
+                       float *destination_row,
+                       const resize_weights_t *weights
+                   )
+{
+    size_t taps = weights->taps;
+
+#if defined RESIZE_AVX512_KERNELS
+    if (weights->vectorizable) {
+        const __m512i broadcast_index =
+            _mm512_set_epi32(3, 3, 3, 3, 2, 2, 2, 2, 1, 1, 1, 1, 0, 0, 0, 0);
+
+        for (size_t i = 0; i < weights->out_size; ++i) {
+            const uint8_t *source = source_row + weights->first[i] * 4;
+            const float *row = &weights->weights[i * taps];
+
+            __m512 sum = _mm512_setzero_ps();
+            for (size_t k = 0; k < taps; k += RESIZE_TAP_GROUP) {
+                __m512 samples =
+                    _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *) &source[k * 4])));
+                __m512 coefficients =
+                    _mm512_permutexvar_ps(broadcast_index, _mm512_castps128_ps512(_mm_loadu_ps(&row[k])));
+                sum = _mm512_fmadd_ps(samples, coefficients, sum);
+            }
+
+            __m256 half = _mm256_add_ps(_mm512_castps512_ps256(sum), _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(sum), 1)));
+            __m128 quarter = _mm_add_ps(_mm256_castps256_ps128(half), _mm256_extractf128_ps(half, 1));
+            _mm_storeu_ps(&destination_row[i * 4], quarter);
+        }
+
+        return;
+    }
+#elif defined RESIZE_AVX2_KERNELS
+    if (weights->vectorizable) {
+        for (size_t i = 0; i < weights->out_size; ++i) {
+            const uint8_t *source = source_row + weights->first[i] * 4;
+            const float *row = &weights->weights[i * taps];
+
+            __m256 sum = _mm256_setzero_ps();
+            for (size_t k = 0; k < taps; k += 2) {
+                __m256 samples =
+                    _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) &source[k * 4])));
+                __m256 coefficients =
+                    _mm256_set_m128(_mm_set1_ps(row[k + 1]), _mm_set1_ps(row[k]));
+                sum = _mm256_fmadd_ps(samples, coefficients, sum);
+            }
+
+            __m128 quarter = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+            _mm_storeu_ps(&destination_row[i * 4], quarter);
+        }
+
+        return;
+    }
+#endif
+
+    for (size_t i = 0; i < weights->out_size; ++i) {
+        size_t first = weights->first[i];
+        size_t count = UTILS_MIN(taps, weights->in_size - first);
+        const uint8_t *source = source_row + first * 4;
+        const float *row = &weights->weights[i * taps];
+
+        float blue = 0.0f, green = 0.0f, red = 0.0f, alpha = 0.0f;
+        for (size_t k = 0; k < count; ++k) {
+            blue  += row[k] * source[k * 4];
+            green += row[k] * source[k * 4 + 1];
+            red   += row[k] * source[k * 4 + 2];
+            alpha += row[k] * source[k * 4 + 3];
+        }
+
+        destination_row[i * 4]     = blue;
+        destination_row[i * 4 + 1] = green;
+        destination_row[i * 4 + 2] = red;
+        destination_row[i * 4 + 3] = alpha;
+    }
+}
+
+/*
+    Vertical pass: combines the horizontally resampled rows of `band` into the
+    output row `y`. `band` holds the source rows starting from `band_first_row`
+    with `band_row_stride` floats between rows, `channels_count` is the number
+    of channels in a row.
+*/
+static inline void resize_vertical_row(
+                       const float *band,
+                       size_t band_first_row,
+                       size_t band_row_stride,
+                       uint8_t *destination_row,
+                       size_t channels_count,
+                       const resize_weights_t *weights,
+                       size_t y
+                   )
+{
+    size_t taps = weights->taps;
+    size_t first = weights->first[y];
+    size_t count = UTILS_MIN(taps, weights->in_size - first);
+    const float *row = &weights->weights[y * taps];
+    const float *source = band + (first - band_first_row) * band_row_stride;
+
+    size_t position = 0;
+
+#if defined RESIZE_AVX512_KERNELS
+    const __m512i zero = _mm512_setzero_si512();
+    for (; position < channels_count; position += 16) {
+        size_t left = channels_count - position;
+        __mmask16 mask = left >= 16 ? (__mmask16) 0xffff : (__mmask16) ((1u << left) - 1);
+
+        __m512 sum = _mm512_setzero_ps();
+        for (size_t k = 0; k < count; ++k) {
+            sum = _mm512_fmadd_ps(
+                      _mm512_set1_ps(row[k]),
+                      _mm512_maskz_loadu_ps(mask, &source[k * band_row_stride + position]),
+                      sum
+                  );
+        }
+
+        __m512i ints = _mm512_max_epi32(_mm512_cvtps_epi32(sum), zero);
+        _mm512_mask_cvtusepi32_storeu_epi8(&destination_row[position], mask, ints);
+    }
+#elif defined RESIZE_AVX2_KERNELS
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i maximum = _mm256_set1_epi32(255);
+    for (; position + 8 <= channels_count; position += 8) {
+        __m256 sum = _mm256_setzero_ps();
+        for (size_t k = 0; k < count; ++k) {
+            sum = _mm256_fmadd_ps(
+                      _mm256_set1_ps(row[k]),
+                      _mm256_loadu_ps(&source[k * band_row_stride + position]),
+                      sum
+                  );
+        }
+
+        __m256i ints = _mm256_min_epi32(_mm256_max_epi32(_mm256_cvtps_epi32(sum), zero), maximum);
+        __m128i words = _mm_packus_epi32(_mm256_castsi256_si128(ints), _mm256_extracti128_si256(ints, 1));
+        _mm_storel_epi64((__m128i *) &destination_row[position], _mm_packus_epi16(words, words));
+    }
+#endif
+
+    for (; position < channels_count; ++position) {
+        float sum = 0.0f;
+        for (size_t k = 0; k < count; ++k) {
+            sum += row[k] * source[k * band_row_stride + position];
+        }
+
+        destination_row[position] = (uint8_t) UTILS_CLAMP(sum + 0.5f, 0.0f, 255.0f);
+    }
+}
+
+#endif // RESIZE_H
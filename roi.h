@@ -0,0 +1,253 @@
+#ifndef ROI_H
+#define ROI_H
+
+#include "bmp.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *ROI_Error_Invalid_Format =
+                    "Invalid region of interest (expected x,y,width,height[;x,y,width,height...])",
+                  *ROI_Error_Not_Enough_Memory =
+                    "Not enough memory to store the region of interest";
+
+/*
+    A region of interest is a list of rectangles. They are parsed in image
+    coordinates (the origin is the top-left corner of the image) and converted
+    by `roi_prepare` into disjoint rectangles in the row order of
+    `bmp_image.pixels`, so that every pixel is processed at most once.
+*/
+
+typedef struct _roi_rectangle
+{
+    size_t x, y;
+    size_t width, height;
+} roi_rectangle_t;
+
+typedef struct _roi
+{
+    roi_rectangle_t *rectangles;
+    size_t count;
+} roi_t;
+
+static inline void roi_init(roi_t *roi)
+{
+    roi->rectangles = NULL;
+    roi->count = 0;
+}
+
+static inline void roi_free(roi_t *roi)
+{
+    if (NULL != roi->rectangles) {
+        free(roi->rectangles);
+        roi->rectangles = NULL;
+    }
+    roi->count = 0;
+}
+
+static inline bool _roi_append(roi_t *roi, size_t x, size_t y, size_t width, size_t height)
+{
+    roi_rectangle_t *rectangles =
+        (roi_rectangle_t *) realloc(roi->rectangles, sizeof(*rectangles) * (roi->count + 1));
+    if (NULL == rectangles) {
+        return false;
+    }
+
+    rectangles[roi->count].x = x;
+    rectangles[roi->count].y = y;
+    rectangles[roi->count].width = width;
+    rectangles[roi->count].height = height;
+    roi->rectangles = rectangles;
+    roi->count += 1;
+
+    return true;
+}
+
+static void roi_parse(const char *text, roi_t *roi, const char **error_message)
+{
+    *error_message = NULL;
+
+    const char *cursor = text;
+    while ('\0' != *cursor) {
+        size_t values[4];
+        for (size_t i = 0; i < 4; ++i) {
+            char *end;
+            unsigned long long value = strtoull(cursor, &end, 10);
+            if (end == cursor || '-' == *cursor || (i < 3 && ',' != *end) ||
+                (3 == i && ';' != *end && '\0' != *end)) {
+                *error_message = ROI_Error_Invalid_Format;
+                goto cleanup;
+            }
+            values[i] = (size_t) value;
+            cursor = ',' == *end || ';' == *end ? end + 1 : end;
+        }
+
+        if (!_roi_append(roi, values[0], values[1], values[2], values[3])) {
+            *error_message = ROI_Error_Not_Enough_Memory;
+            goto cleanup;
+        }
+    }
+
+    if (0 == roi->count) {
+        *error_message = ROI_Error_Invalid_Format;
+    }
+
+    return;
+
+cleanup:
+    roi_free(roi);
+}
+
+static inline bool roi_set_full(roi_t *roi, size_t width, size_t height)
+{
+    roi_free(roi);
+
+    return _roi_append(roi, 0, 0, width, height);
+}
+
+static int _roi_compare_sizes(const void *first, const void *second)
+{
+    size_t a = *(const size_t *) first, b = *(const size_t *) second;
+
+    return a < b ? -1 : a > b;
+}
+
+/*
+    Clips the rectangles to the image, converts their rows to the order of
+    `pixels` and splits overlapping rectangles into disjoint ones. An empty
+    region stays empty.
+*/
+static void roi_prepare(roi_t *roi, size_t width, size_t height, bool top_down, const char **error_message)
+{
+    *error_message = NULL;
+
+    roi_t result; roi_init(&result);
+    size_t *boundaries = NULL;
+    size_t *intervals = NULL;
+
+    size_t count = 0;
+    for (size_t i = 0; i < roi->count; ++i) {
+        roi_rectangle_t rectangle = roi->rectangles[i];
+        if (rectangle.x >= width || rectangle.y >= height) {
+            continue;
+        }
+
+        rectangle.width = UTILS_MIN(rectangle.width, width - rectangle.x);
+        rectangle.height = UTILS_MIN(rectangle.height, height - rectangle.y);
+        if (0 == rectangle.width || 0 == rectangle.height) {
+            continue;
+        }
+
+        if (!top_down) {
+            rectangle.y = height - (rectangle.y + rectangle.height);
+        }
+
+        roi->rectangles[count++] = rectangle;
+    }
+    roi->count = count;
+
+    if (count < 2) {
+        return;
+    }
+
+    boundaries = (size_t *) malloc(sizeof(*boundaries) * count * 2);
+    intervals = (size_t *) malloc(sizeof(*intervals) * count * 2);
+    if (NULL == boundaries || NULL == intervals) {
+        *error_message = ROI_Error_Not_Enough_Memory;
+        goto cleanup;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        boundaries[i * 2] = roi->rectangles[i].y;
+        boundaries[i * 2 + 1] = roi->rectangles[i].y + roi->rectangles[i].height;
+    }
+    qsort(boundaries, count * 2, sizeof(*boundaries), _roi_compare_sizes);
+
+    /* Between two consecutive row boundaries the set of covering rectangles
+       does not change, so the merged column intervals form disjoint
+       rectangles spanning that band of rows. */
+    for (size_t b = 0; b + 1 < count * 2; ++b) {
+        size_t first_row = boundaries[b], last_row = boundaries[b + 1];
+        if (first_row == last_row) {
+            continue;
+        }
+
+        size_t interval_count = 0;
+        for (size_t i = 0; i < count; ++i) {
+            roi_rectangle_t *rectangle = &roi->rectangles[i];
+            if (rectangle->y <= first_row && rectangle->y + rectangle->height >= last_row) {
+                intervals[interval_count * 2] = rectangle->x;
+                intervals[interval_count * 2 + 1] = rectangle->x + rectangle->width;
+                ++interval_count;
+            }
+        }
+        qsort(intervals, interval_count, sizeof(*intervals) * 2, _roi_compare_sizes);
+
+        for (size_t i = 0; i < interval_count;) {
+            size_t start = intervals[i * 2], end = intervals[i * 2 + 1];
+            for (++i; i < interval_count && intervals[i * 2] <= end; ++i) {
+                end = UTILS_MAX(end, intervals[i * 2 + 1]);
+            }
+
+            if (!_roi_append(&result, start, first_row, end - start, last_row - first_row)) {
+                *error_message = ROI_Error_Not_Enough_Memory;
+                goto cleanup;
+            }
+        }
+    }
+
+    roi_free(roi);
+    *roi = result;
+    roi_init(&result);
+
+cleanup:
+    roi_free(&result);
+    if (NULL != boundaries) {
+        free(boundaries);
+    }
+    if (NULL != intervals) {
+        free(intervals);
+    }
+}
+
+/* Number of channels a prepared region covers. */
+static inline size_t roi_get_channel_count(const roi_t *roi)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < roi->count; ++i) {
+        count += roi->rectangles[i].width * roi->rectangles[i].height * 4;
+    }
+
+    return count;
+}
+
+/*
+    A rectangle of a prepared region is walked as contiguous spans of channels
+    in `pixels`: one span per row, or a single span if the rectangle covers
+    whole rows.
+*/
+static inline size_t roi_rectangle_get_span_count(const roi_rectangle_t *rectangle, size_t image_width)
+{
+    return rectangle->width == image_width ? 1 : rectangle->height;
+}
+
+static inline void roi_rectangle_get_span(
+                       const roi_rectangle_t *rectangle,
+                       size_t image_width,
+                       size_t span,
+                       size_t *start,
+                       size_t *end
+                   )
+{
+    if (rectangle->width == image_width) {
+        *start = rectangle->y * image_width * 4;
+        *end = *start + rectangle->height * image_width * 4;
+    } else {
+        *start = ((rectangle->y + span) * image_width + rectangle->x) * 4;
+        *end = *start + rectangle->width * 4;
+    }
+}
+
+#endif // ROI_H
@@ -0,0 +1,560 @@
+#include "autotune.h"
+#include "bmp.h"
+#include "filters.h"
+#include "image_io.h"
+#include "sync_queue.h"
+#include "threadpool.h"
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined C_IMPLEMENTATION && \
+    !defined SIMD_INTRINSICS_IMPLEMENTATION && \
+    !defined SIMD_ASM_IMPLEMENTATION
+#define C_IMPLEMENTATION 1
+#endif
+
+/*
+    Applies a filter chain to a numbered sequence of frames, e.g.
+    frame_00001.bmp to frame_00240.bmp, as a pipeline of three stages
+    connected by bounded queues:
+
+        decode  SEQUENCE_DECODER_THREADS threads read and decode frames
+        filter  one thread runs the chain of every frame on the threadpool
+        encode  the main thread encodes the frames in sequence order
+
+    While one frame is filtered the next ones are read and the previous ones
+    written, so the throughput is set by the slowest stage instead of the sum
+    of all of them. The queues hold at most SEQUENCE_QUEUE_CAPACITY frames,
+    which stops the decoders from filling the memory when a later stage is
+    slower. Decoders finish frames out of order, the encoder holds them back
+    until all earlier frames are written. With `-` as the destination the
+    frames are written one after another to the standard output, e.g. for a
+    video encoder.
+
+    A parameter of the chain can change over the sequence. `<first>~<last>`
+    goes linearly from the value for the first frame to the value for the
+    last frame, e.g. a brightness ramp:
+
+        brightness:0~40:1,sepia
+
+    At the end the tool prints the frame rate and how busy every stage was.
+    The busiest stage is the one that limits the frame rate. With BMP_TIMING
+    set, the stages of every frame travel with it through the pipeline and
+    are reported once the frame is encoded.
+*/
+
+#define SEQUENCE_DECODER_THREADS 2
+#define SEQUENCE_QUEUE_CAPACITY 4
+#define SEQUENCE_MAX_CHAIN_SIZE 1024
+
+static const char *Sequence_Error_Failed_to_Open_Source =
+                    "Failed to open the source image file",
+                  *Sequence_Error_Failed_to_Create_Destination =
+                    "Failed to create the output image",
+                  *Sequence_Error_Invalid_Ramp =
+                    "Invalid parameter ramp (expected <first>~<last>)",
+                  *Sequence_Error_Not_Enough_Memory =
+                    "Not enough memory to filter the frame";
+
+typedef enum _sequence_stage
+{
+    SEQUENCE_STAGE_DECODE,
+    SEQUENCE_STAGE_FILTER,
+    SEQUENCE_STAGE_ENCODE,
+    SEQUENCE_STAGE_COUNT
+} sequence_stage_t;
+
+typedef struct _sequence_frame
+{
+    size_t index;               /* position in the sequence, 0 for the first frame */
+    char source_path[PATH_MAX];
+    bmp_image image;
+    image_format format;
+    filters_chain_t chain;
+    const char *error_message;  /* set by the stage that failed */
+    timing_counter_t timing[TIMING_STAGE_COUNT];
+} sequence_frame_t;
+
+typedef struct _sequence
+{
+    const char *chain_text;
+    const char *source_pattern;
+    const char *destination_pattern;
+    int first_number;
+    size_t frame_count;
+
+    volatile size_t next_index;         /* the next frame for a decoder  */
+    volatile size_t decoders_left;
+    volatile bool failed;               /* stops the decoders            */
+
+    sync_queue_t *decoded;
+    sync_queue_t *filtered;
+
+    threadpool_t *threadpool;
+    size_t pool_size;
+    autotune_table_t tuning;
+
+    volatile uint64_t busy_time[SEQUENCE_STAGE_COUNT];  /* ns, summed over the threads of a stage */
+} sequence_t;
+
+/* Patterns have exactly one conversion %d with an optional width, e.g.
+   frame_%05d.bmp, so that they can be passed to snprintf. */
+static bool sequence_is_valid_pattern(const char *pattern)
+{
+    size_t conversions = 0;
+    for (const char *c = pattern; '\0' != *c; ++c) {
+        if ('%' != *c) {
+            continue;
+        }
+
+        ++c;
+        while (*c >= '0' && *c <= '9') {
+            ++c;
+        }
+        if ('d' != *c) {
+            return false;
+        }
+        ++conversions;
+    }
+
+    return 1 == conversions;
+}
+
+static inline bool sequence_get_path(const char *pattern, int number, char *path, size_t size)
+{
+    int length = snprintf(path, size, pattern, number);
+
+    return length >= 0 && (size_t) length < size;
+}
+
+/*
+    Writes the chain of the frame at `progress` (0 for the first frame, 1 for
+    the last one) to `chain`, every `<first>~<last>` parameter replaced by its
+    value for the frame.
+*/
+static void sequence_get_frame_chain(
+                const char *text,
+                double progress,
+                filters_chain_t *chain,
+                const char **error_message
+            )
+{
+    *error_message = NULL;
+
+    char frame_text[SEQUENCE_MAX_CHAIN_SIZE];
+    size_t length = 0;
+
+    for (const char *cursor = text; '\0' != *cursor;) {
+        size_t token_length = strcspn(cursor, ":,");
+        const char *ramp = memchr(cursor, '~', token_length);
+
+        int written;
+        if (NULL == ramp) {
+            written = snprintf(frame_text + length, sizeof(frame_text) - length, "%.*s", (int) token_length, cursor);
+        } else {
+            char *end;
+            double first = strtod(cursor, &end);
+            bool valid = end == ramp && end != cursor;
+            double last = strtod(ramp + 1, &end);
+            valid = valid && end == cursor + token_length && end != ramp + 1;
+            if (!valid) {
+                if (NULL != error_message) {
+                    *error_message = Sequence_Error_Invalid_Ramp;
+                }
+
+                return;
+            }
+
+            written = snprintf(
+                          frame_text + length,
+                          sizeof(frame_text) - length,
+                          "%.9g",
+                          first + (last - first) * progress
+                      );
+        }
+        cursor += token_length;
+
+        if (written < 0 || (size_t) written + 1 >= sizeof(frame_text) - length) {
+            if (NULL != error_message) {
+                *error_message = Filters_Error_Invalid_Parameters;
+            }
+
+            return;
+        }
+        length += (size_t) written;
+
+        if ('\0' != *cursor) {
+            frame_text[length++] = *cursor++;
+            frame_text[length] = '\0';
+        }
+    }
+    frame_text[length] = '\0';
+
+    filters_parse_chain(frame_text, chain, error_message);
+}
+
+static void sequence_free_frame(sequence_frame_t *frame)
+{
+    if (NULL == frame) {
+        return;
+    }
+
+    bmp_free_image_structure(&frame->image);
+    free(frame);
+}
+
+/* Stages */
+
+static void *sequence_decode(void *context)
+{
+    sequence_t *sequence = context;
+
+    while (!sequence->failed) {
+        size_t index = __sync_fetch_and_add(&sequence->next_index, 1);
+        if (index >= sequence->frame_count) {
+            break;
+        }
+
+        uint64_t start_time = timing_get_time_ns();
+
+        sequence_frame_t *frame = malloc(sizeof(*frame));
+        if (NULL == frame) {
+            sequence->failed = true;
+            break;
+        }
+        frame->index = index;
+        bmp_init_image_structure(&frame->image);
+        frame->format = IMAGE_FORMAT_BMP;
+        frame->error_message = NULL;
+
+        double progress = sequence->frame_count > 1 ? (double) index / (double) (sequence->frame_count - 1) : 0.0;
+        sequence_get_frame_chain(sequence->chain_text, progress, &frame->chain, &frame->error_message);
+
+        sequence_get_path(
+            sequence->source_pattern,
+            sequence->first_number + (int) index,
+            frame->source_path,
+            sizeof(frame->source_path)
+        );
+        FILE *source_descriptor = NULL;
+        if (NULL == frame->error_message) {
+            source_descriptor = fopen(frame->source_path, "r");
+            if (NULL == source_descriptor) {
+                frame->error_message = Sequence_Error_Failed_to_Open_Source;
+            }
+        }
+        if (NULL == frame->error_message) {
+            image_io_open_image_headers(source_descriptor, &frame->image, &frame->format, &frame->error_message);
+        }
+        if (NULL == frame->error_message) {
+            image_io_read_image_data(source_descriptor, &frame->image, frame->format, &frame->error_message);
+        }
+        if (NULL != source_descriptor) {
+            fclose(source_descriptor);
+        }
+        timing_take_image(frame->timing);
+
+        __sync_fetch_and_add(&sequence->busy_time[SEQUENCE_STAGE_DECODE], timing_get_time_ns() - start_time);
+
+        sync_queue_enqueue(sequence->decoded, frame);
+    }
+
+    /* The last decoder to finish ends the stream of decoded frames */
+    if (0 == __sync_sub_and_fetch(&sequence->decoders_left, 1)) {
+        sync_queue_close(sequence->decoded);
+    }
+
+    return NULL;
+}
+
+static void *sequence_filter(void *context)
+{
+    sequence_t *sequence = context;
+
+    sequence_frame_t *frame;
+    while (NULL != (frame = sync_queue_pop(sequence->decoded))) {
+        if (NULL == frame->error_message) {
+            uint64_t start_time = timing_get_time_ns();
+            timing_add_image(frame->timing);
+            uint64_t kernel_start_time = timing_start();
+
+            size_t channels_count = frame->image.absolute_image_width * frame->image.absolute_image_height * 4;
+            autotune_config_t config =
+                autotune_get_config(
+                    &sequence->tuning,
+                    frame->chain.stages[0].kernel->name,
+                    channels_count,
+                    sequence->pool_size
+                );
+            bool filtered =
+                filters_run_chain(
+                    1 == config.threads ? NULL : sequence->threadpool,
+                    config.grain,
+                    config.streaming,
+                    &frame->chain,
+                    frame->image.pixels,
+                    channels_count
+                );
+            if (!filtered) {
+                frame->error_message = Sequence_Error_Not_Enough_Memory;
+            }
+            timing_stop(TIMING_STAGE_KERNEL, kernel_start_time, channels_count, channels_count / 4);
+            timing_take_image(frame->timing);
+
+            sequence->busy_time[SEQUENCE_STAGE_FILTER] += timing_get_time_ns() - start_time;
+        }
+
+        sync_queue_enqueue(sequence->filtered, frame);
+    }
+
+    sync_queue_close(sequence->filtered);
+
+    return NULL;
+}
+
+/* Writes a frame to its own file or to the standard output. */
+static void sequence_encode(sequence_t *sequence, sequence_frame_t *frame, const char **error_message)
+{
+    *error_message = NULL;
+
+    bool to_standard_output = 0 == strcmp(sequence->destination_pattern, "-");
+
+    char destination_path[PATH_MAX];
+    FILE *destination_descriptor = stdout;
+    image_format destination_format = frame->format;
+    if (!to_standard_output) {
+        sequence_get_path(
+            sequence->destination_pattern,
+            sequence->first_number + (int) frame->index,
+            destination_path,
+            sizeof(destination_path)
+        );
+        destination_format = image_io_get_format_for_file_name(destination_path, frame->format);
+
+        destination_descriptor = fopen(destination_path, "w");
+        if (NULL == destination_descriptor) {
+            if (NULL != error_message) {
+                *error_message = Sequence_Error_Failed_to_Create_Destination;
+            }
+
+            goto end;
+        }
+    }
+
+    image_io_write_image_headers(destination_descriptor, &frame->image, destination_format, error_message);
+    if (NULL == *error_message) {
+        image_io_write_image_data(destination_descriptor, &frame->image, destination_format, error_message);
+    }
+
+    if (to_standard_output) {
+        fflush(destination_descriptor);
+    } else {
+        fclose(destination_descriptor);
+    }
+
+end:
+    return;
+}
+
+int main(int argc, char *argv[])
+{
+    int result = EXIT_FAILURE;
+
+    if (argc < 6) {
+        fprintf(
+            stderr,
+            "Usage: %s <filter chain> <source pattern> <dest. pattern|-> <first frame> <last frame>\n",
+            argv[0]
+        );
+        return result;
+    }
+
+    sequence_t sequence;
+    memset(&sequence, 0, sizeof(sequence));
+    sequence.chain_text = argv[1];
+    sequence.source_pattern = argv[2];
+    sequence.destination_pattern = argv[3];
+    int first_number = atoi(argv[4]);
+    int last_number = atoi(argv[5]);
+
+    sequence_frame_t **pending = NULL;
+    pthread_t decoders[SEQUENCE_DECODER_THREADS];
+    size_t decoder_count = 0;
+    pthread_t filter;
+    bool filter_started = false;
+
+    autotune_init(&sequence.tuning);
+
+    const char *error_message;
+    filters_chain_t chain;
+    sequence_get_frame_chain(sequence.chain_text, 0.0, &chain, &error_message);
+    if (error_message != NULL) {
+        fprintf(stderr, "%s '%s'\n", error_message, sequence.chain_text);
+        goto cleanup;
+    }
+
+    if (!sequence_is_valid_pattern(sequence.source_pattern) ||
+        (0 != strcmp(sequence.destination_pattern, "-") && !sequence_is_valid_pattern(sequence.destination_pattern))) {
+        fputs("The file name patterns need exactly one frame number conversion, e.g. frame_%05d.bmp\n", stderr);
+        goto cleanup;
+    }
+
+    if (last_number < first_number) {
+        fputs("The last frame comes before the first one\n", stderr);
+        goto cleanup;
+    }
+    sequence.first_number = first_number;
+    sequence.frame_count = (size_t) ((long) last_number - first_number + 1);
+
+    autotune_load(&sequence.tuning, autotune_get_file_path(), &error_message);
+    if (error_message != NULL) {
+        fprintf(stderr, "Ignoring the tuning file '%s':\n\t%s\n", autotune_get_file_path(), error_message);
+    }
+
+    pending = calloc(sequence.frame_count, sizeof(*pending));
+    sequence.decoded = sync_queue_create();
+    sequence.filtered = sync_queue_create();
+    if (pending == NULL || sequence.decoded == NULL || sequence.filtered == NULL) {
+        fputs("Out of memory.\n", stderr);
+        goto cleanup;
+    }
+    sync_queue_set_capacity(sequence.decoded, SEQUENCE_QUEUE_CAPACITY);
+    sync_queue_set_capacity(sequence.filtered, SEQUENCE_QUEUE_CAPACITY);
+
+    sequence.pool_size = utils_get_number_of_cpu_cores();
+    if (sequence.pool_size > 1) {
+        sequence.threadpool = threadpool_create(sequence.pool_size);
+        if (sequence.threadpool == NULL) {
+            fputs("Failed to create a threadpool.\n", stderr);
+            goto cleanup;
+        }
+    }
+
+    uint64_t start_time = timing_get_time_ns();
+
+    sequence.decoders_left = SEQUENCE_DECODER_THREADS;
+    for (; decoder_count < SEQUENCE_DECODER_THREADS; ++decoder_count) {
+        if (0 != pthread_create(&decoders[decoder_count], NULL, sequence_decode, &sequence)) {
+            break;
+        }
+    }
+    /* Decoders that were not started do not wait to close the queue */
+    if (decoder_count < SEQUENCE_DECODER_THREADS &&
+        0 == __sync_sub_and_fetch(&sequence.decoders_left, SEQUENCE_DECODER_THREADS - decoder_count)) {
+        sync_queue_close(sequence.decoded);
+    }
+    filter_started = 0 != decoder_count && 0 == pthread_create(&filter, NULL, sequence_filter, &sequence);
+    if (!filter_started) {
+        fputs("Failed to start the pipeline threads.\n", stderr);
+        sequence.failed = true;
+        sync_queue_close(sequence.decoded);
+        goto cleanup;
+    }
+
+    /* Encode Stage */
+    size_t next_index = 0;
+    sequence_frame_t *frame;
+    while (NULL != (frame = sync_queue_pop(sequence.filtered))) {
+        pending[frame->index] = frame;
+
+        for (; next_index < sequence.frame_count && NULL != pending[next_index]; ++next_index) {
+            frame = pending[next_index];
+            pending[next_index] = NULL;
+
+            if (NULL == frame->error_message) {
+                uint64_t encode_start_time = timing_get_time_ns();
+                timing_add_image(frame->timing);
+                sequence_encode(&sequence, frame, &frame->error_message);
+                sequence.busy_time[SEQUENCE_STAGE_ENCODE] += timing_get_time_ns() - encode_start_time;
+            }
+
+            if (NULL != frame->error_message) {
+                fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", frame->source_path, frame->error_message);
+                sequence.failed = true;
+                timing_take_image(NULL);
+            } else {
+                timing_finish_image(frame->source_path);
+            }
+
+            sequence_free_frame(frame);
+        }
+    }
+
+    double seconds = (timing_get_time_ns() - start_time) / 1e9;
+    size_t stage_threads[SEQUENCE_STAGE_COUNT] = { decoder_count, 1, 1 };
+    double busy[SEQUENCE_STAGE_COUNT];
+    for (size_t stage = 0; stage < SEQUENCE_STAGE_COUNT; ++stage) {
+        busy[stage] = 100.0 * sequence.busy_time[stage] / 1e9 / (seconds * stage_threads[stage]);
+    }
+    fprintf(
+        stderr,
+        "%zu frames in %.3f s, %.2f frames/s\n"
+        "\tbusy: decode %.0f%%, filter %.0f%%, encode %.0f%%, most queued frames: %zu decoded, %zu filtered\n",
+        next_index,
+        seconds,
+        next_index / seconds,
+        busy[SEQUENCE_STAGE_DECODE],
+        busy[SEQUENCE_STAGE_FILTER],
+        busy[SEQUENCE_STAGE_ENCODE],
+        sync_queue_get_maximum_size(sequence.decoded),
+        sync_queue_get_maximum_size(sequence.filtered)
+    );
+
+    if (!sequence.failed && next_index == sequence.frame_count) {
+        result = EXIT_SUCCESS;
+    }
+
+cleanup:
+    /* Unblocks the decoders if the encoder stopped early */
+    sequence.failed = sequence.failed || result != EXIT_SUCCESS;
+    if (sequence.filtered != NULL) {
+        sync_queue_close(sequence.filtered);
+        while (NULL != (frame = sync_queue_pop(sequence.filtered))) {
+            sequence_free_frame(frame);
+        }
+    }
+
+    for (size_t i = 0; i < decoder_count; ++i) {
+        pthread_join(decoders[i], NULL);
+    }
+    if (filter_started) {
+        pthread_join(filter, NULL);
+    }
+
+    if (sequence.decoded != NULL) {
+        while (NULL != (frame = sync_queue_pop(sequence.decoded))) {
+            sequence_free_frame(frame);
+        }
+    }
+
+    if (sequence.filtered != NULL) {
+        while (NULL != (frame = sync_queue_pop(sequence.filtered))) {
+            sequence_free_frame(frame);
+        }
+    }
+
+    if (pending != NULL) {
+        for (size_t i = 0; i < sequence.frame_count; ++i) {
+            sequence_free_frame(pending[i]);
+        }
+        free(pending);
+        pending = NULL;
+    }
+
+    threadpool_destroy(sequence.threadpool);
+    sequence.threadpool = NULL;
+
+    sync_queue_destroy(sequence.decoded);
+    sync_queue_destroy(sequence.filtered);
+
+    autotune_free(&sequence.tuning);
+
+    return result;
+}
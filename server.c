@@ -0,0 +1,738 @@
+#include "autotune.h"
+#include "bmp.h"
+#include "cache.h"
+#include "filters.h"
+#include "image_io.h"
+#include "threadpool.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#if !defined C_IMPLEMENTATION && \
+    !defined SIMD_INTRINSICS_IMPLEMENTATION && \
+    !defined SIMD_ASM_IMPLEMENTATION
+#define C_IMPLEMENTATION 1
+#endif
+
+/*
+    The server keeps the threadpool and the filter dispatch table alive between
+    requests. A client connects to the Unix domain socket and sends any number
+    of requests, one per line, with tab-separated fields:
+
+        <filter chain>\t<source file>\t<dest. file>\n
+
+    Instead of the paths, the client can attach open file descriptors to the
+    request (SCM_RIGHTS) and send only the filter chain, so that no pixel data
+    and no paths cross the socket: a source and a destination descriptor, or a
+    single descriptor of a memfd or shared memory object holding a 32-bit BMP
+    or an RGB_ALPHA PAM image that is filtered in place. The reply signals that the work is complete.
+
+    Every request is answered with one line, the times are in nanoseconds:
+
+        OK\t<decode>\t<filter>\t<encode>\t<total>[\tcached]\n
+        ERROR\t<message>\n
+
+    With BMP_CACHE_DIR set, the results of requests with a source and a
+    destination are kept in a cache (see cache.h). A repeated request is
+    answered with `cached`, its encode time is the time to copy the stored
+    image, and the decode time includes hashing the pixels.
+*/
+
+#define SERVER_MAX_REQUEST_SIZE 8192
+#define SERVER_MAX_RESPONSE_SIZE 1024
+#define SERVER_MAX_DESCRIPTORS 2
+
+static volatile sig_atomic_t server_running = 1;
+
+/* Tuned thread counts and grain sizes, loaded once at startup */
+static autotune_table_t server_tuning;
+
+/* Results of earlier requests, closed if caching is off */
+static cache_t server_cache;
+
+static void server_stop(int signal_number __attribute__((unused)))
+{
+    server_running = 0;
+}
+
+static inline uint64_t server_get_time_ns(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+
+    return (uint64_t) time.tv_sec * 1000000000ull + (uint64_t) time.tv_nsec;
+}
+
+/* New image buffers are spread over the NUMA nodes of the pinned workers
+   that filter them. */
+static void server_touch_buffer(void *memory, size_t size, void *context)
+{
+    threadpool_touch_local((threadpool_t *) context, memory, size);
+}
+
+/* Runs the chain with the configuration tuned for its first filter and the
+   size of the image. */
+static bool server_run_chain(
+                threadpool_t *threadpool,
+                size_t pool_size,
+                const filters_chain_t *chain,
+                uint8_t *pixels,
+                size_t channels_count
+            )
+{
+    autotune_config_t config =
+        autotune_get_config(&server_tuning, chain->stages[0].kernel->name, channels_count, pool_size);
+
+    return filters_run_chain(
+               1 == config.threads ? NULL : threadpool,
+               config.grain,
+               config.streaming,
+               chain,
+               pixels,
+               channels_count
+           );
+}
+
+static void server_format_times(
+                char *response,
+                size_t response_size,
+                uint64_t start_time,
+                uint64_t decode_time,
+                uint64_t filter_time,
+                uint64_t end_time,
+                bool cached
+            )
+{
+    snprintf(
+        response,
+        response_size,
+        "OK\t%llu\t%llu\t%llu\t%llu%s\n",
+        (unsigned long long) (decode_time - start_time),
+        (unsigned long long) (filter_time - decode_time),
+        (unsigned long long) (end_time - filter_time),
+        (unsigned long long) (end_time - start_time),
+        cached ? "\tcached" : ""
+    );
+}
+
+/* Decodes the image from `source_descriptor`, filters it and encodes it to
+   `destination_descriptor`. The output format follows the extension of
+   `name`, images passed as descriptors keep the format of the source. With
+   the cache open, a stored result is copied to the destination instead, and
+   a new result is encoded into the cache first and copied from there. */
+static void server_process_stream(
+                threadpool_t *threadpool,
+                size_t pool_size,
+                const filters_chain_t *chain,
+                const char *name,
+                FILE *source_descriptor,
+                FILE *destination_descriptor,
+                char *response,
+                size_t response_size
+            )
+{
+    bmp_image image; bmp_init_image_structure(&image);
+    image_format source_format = IMAGE_FORMAT_BMP;
+
+    FILE *output_descriptor = destination_descriptor;
+    FILE *cache_entry = NULL;
+    char cache_entry_path[PATH_MAX];
+
+    uint64_t start_time = server_get_time_ns();
+
+    const char *error_message;
+    image_io_open_image_headers(source_descriptor, &image, &source_format, &error_message);
+    if (error_message != NULL) {
+        snprintf(response, response_size, "ERROR\t%s\n", error_message);
+        goto cleanup;
+    }
+
+    image_io_read_image_data(source_descriptor, &image, source_format, &error_message);
+    if (error_message != NULL) {
+        snprintf(response, response_size, "ERROR\t%s\n", error_message);
+        goto cleanup;
+    }
+
+    image_format destination_format = image_io_get_format_for_file_name(name, source_format);
+    const char *extension = image_io_get_extension(destination_format);
+
+    cache_key_t key = { 0, 0 };
+    if (cache_is_open(&server_cache)) {
+        key = cache_get_image_key(&image, chain, destination_format);
+        uint64_t hash_time = server_get_time_ns();
+
+        bool hit = cache_fetch(&server_cache, key, extension, fileno(destination_descriptor), &error_message);
+        if (error_message != NULL) {
+            snprintf(response, response_size, "ERROR\t%s\n", error_message);
+            goto cleanup;
+        }
+        if (hit) {
+            uint64_t end_time = server_get_time_ns();
+
+            server_format_times(response, response_size, start_time, hash_time, hash_time, end_time, true);
+            timing_finish_image(name);
+            goto cleanup;
+        }
+
+        cache_entry = cache_create_entry(&server_cache, cache_entry_path, sizeof(cache_entry_path));
+        if (cache_entry != NULL) {
+            output_descriptor = cache_entry;
+        }
+    }
+
+    uint64_t decode_time = server_get_time_ns();
+
+    size_t channels_count = image.absolute_image_width * image.absolute_image_height * 4;
+    if (!server_run_chain(threadpool, pool_size, chain, image.pixels, channels_count)) {
+        snprintf(response, response_size, "ERROR\tOut of memory\n");
+        goto cleanup;
+    }
+
+    uint64_t filter_time = server_get_time_ns();
+    timing_stop(TIMING_STAGE_KERNEL, decode_time, channels_count, channels_count / 4);
+
+    image_io_write_image_headers(output_descriptor, &image, destination_format, &error_message);
+    if (error_message != NULL) {
+        snprintf(response, response_size, "ERROR\t%s\n", error_message);
+        goto cleanup;
+    }
+
+    image_io_write_image_data(output_descriptor, &image, destination_format, &error_message);
+    if (error_message != NULL) {
+        snprintf(response, response_size, "ERROR\t%s\n", error_message);
+        goto cleanup;
+    }
+
+    if (fflush(output_descriptor) != 0) {
+        snprintf(response, response_size, "ERROR\tFailed to write the output image\n");
+        goto cleanup;
+    }
+
+    if (cache_entry != NULL) {
+        cache_commit_entry(
+            &server_cache,
+            cache_entry,
+            cache_entry_path,
+            key,
+            extension,
+            fileno(destination_descriptor),
+            &error_message
+        );
+        cache_entry = NULL;
+        if (error_message != NULL) {
+            snprintf(response, response_size, "ERROR\t%s\n", error_message);
+            goto cleanup;
+        }
+    }
+
+    uint64_t end_time = server_get_time_ns();
+
+    server_format_times(response, response_size, start_time, decode_time, filter_time, end_time, false);
+    timing_finish_image(name);
+
+cleanup:
+    /* A failed image is not reported and its stages do not count towards
+       the next one */
+    timing_take_image(NULL);
+
+    if (cache_entry != NULL) {
+        cache_discard_entry(cache_entry, cache_entry_path);
+        cache_entry = NULL;
+    }
+
+    bmp_free_image_structure(&image);
+}
+
+/*
+    Filters a 32-bit BMP or an RGB_ALPHA PAM file held by `descriptor` (a
+    memfd, a shared memory object or a regular file) in place. The pixel
+    array is mapped and passed to the kernels directly, so nothing is
+    decoded, copied or encoded. Rows of 32-bit images have no padding, which
+    makes the pixel array one contiguous range of channels. The red and the
+    blue samples of PAM images are swapped in place for the filters and back.
+*/
+static void server_process_mapped_image(
+                threadpool_t *threadpool,
+                size_t pool_size,
+                const filters_chain_t *chain,
+                int descriptor,
+                char *response,
+                size_t response_size
+            )
+{
+    uint8_t *map = MAP_FAILED;
+    size_t map_size = 0;
+    FILE *header_descriptor = NULL;
+
+    bmp_image image; bmp_init_image_structure(&image);
+    image_format format = IMAGE_FORMAT_BMP;
+
+    uint64_t start_time = server_get_time_ns();
+
+    struct stat status;
+    if (fstat(descriptor, &status) < 0 || status.st_size <= 0) {
+        snprintf(response, response_size, "ERROR\tFailed to get the size of the shared image\n");
+        goto cleanup;
+    }
+    map_size = (size_t) status.st_size;
+
+    map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, descriptor, 0);
+    if (map == MAP_FAILED) {
+        snprintf(response, response_size, "ERROR\tFailed to map the shared image\n");
+        goto cleanup;
+    }
+
+    header_descriptor = fmemopen(map, map_size, "r");
+    if (header_descriptor == NULL) {
+        snprintf(response, response_size, "ERROR\tOut of memory\n");
+        goto cleanup;
+    }
+
+    const char *error_message;
+    image_io_open_image_headers(header_descriptor, &image, &format, &error_message);
+    if (error_message != NULL) {
+        snprintf(response, response_size, "ERROR\t%s\n", error_message);
+        goto cleanup;
+    }
+
+    if (4 != image.channels ||
+        (IMAGE_FORMAT_BMP != format && IMAGE_FORMAT_PAM != format) ||
+        (IMAGE_FORMAT_BMP == format && !bmp_has_plain_pixel_array(&image))) {
+        snprintf(response, response_size, "ERROR\tOnly uncompressed 32-bit images can be filtered in place\n");
+        goto cleanup;
+    }
+
+    size_t width = (size_t) llabs((long long) image.dib_header.image_width);
+    size_t height = (size_t) llabs((long long) image.dib_header.image_height);
+    size_t offset =
+        IMAGE_FORMAT_PAM == format ?
+            (size_t) ftell(header_descriptor) :
+            (size_t) image.file_header.pixel_array_offset;
+    if (offset > map_size || 0 == width || 0 == height ||
+        width > (map_size - offset) / 4 / height) {
+        snprintf(response, response_size, "ERROR\t%s\n", BMP_Error_Invalid_Size_Information);
+        goto cleanup;
+    }
+
+    if (IMAGE_FORMAT_PAM == format) {
+        pnm_swap_red_and_blue(map + offset, width * height * 4);
+    }
+
+    uint64_t decode_time = server_get_time_ns();
+
+    bool filtered = server_run_chain(threadpool, pool_size, chain, map + offset, width * height * 4);
+
+    uint64_t filter_time = server_get_time_ns();
+
+    if (IMAGE_FORMAT_PAM == format) {
+        pnm_swap_red_and_blue(map + offset, width * height * 4);
+    }
+
+    if (!filtered) {
+        snprintf(response, response_size, "ERROR\tOut of memory\n");
+        goto cleanup;
+    }
+    timing_stop(TIMING_STAGE_KERNEL, decode_time, width * height * 4, width * height);
+
+    munmap(map, map_size);
+    map = MAP_FAILED;
+
+    uint64_t end_time = server_get_time_ns();
+
+    server_format_times(response, response_size, start_time, decode_time, filter_time, end_time, false);
+    timing_finish_image("shared image");
+
+cleanup:
+    timing_take_image(NULL);
+
+    if (header_descriptor != NULL) {
+        fclose(header_descriptor);
+        header_descriptor = NULL;
+    }
+
+    if (map != MAP_FAILED) {
+        munmap(map, map_size);
+        map = MAP_FAILED;
+    }
+}
+
+/*
+    A request without descriptors names the source and destination files,
+    one with descriptors carries only the filter chain:
+
+        no descriptors:    <chain>\t<source file>\t<dest. file>
+        two descriptors:   <chain> (readable source, writable destination)
+        one descriptor:    <chain> (a 32-bit BMP or PAM filtered in place)
+
+    The descriptors are closed by this function.
+*/
+static void server_process_request(
+                threadpool_t *threadpool,
+                size_t pool_size,
+                char *request,
+                int *descriptors,
+                size_t descriptor_count,
+                char *response,
+                size_t response_size
+            )
+{
+    FILE *source_descriptor = NULL;
+    FILE *destination_descriptor = NULL;
+
+    char *chain_text = request;
+    char *source_file_name = strchr(chain_text, '\t');
+    char *destination_file_name = source_file_name != NULL ? strchr(source_file_name + 1, '\t') : NULL;
+    if ((0 == descriptor_count && destination_file_name == NULL) ||
+        (0 != descriptor_count && source_file_name != NULL)) {
+        snprintf(response, response_size, "ERROR\tMalformed request\n");
+        goto cleanup;
+    }
+    if (0 == descriptor_count) {
+        *source_file_name++ = '\0';
+        *destination_file_name++ = '\0';
+    }
+
+    const char *error_message;
+    filters_chain_t chain;
+    filters_parse_chain(chain_text, &chain, &error_message);
+    if (error_message != NULL) {
+        snprintf(response, response_size, "ERROR\t%s '%s'\n", error_message, chain_text);
+        goto cleanup;
+    }
+
+    if (1 == descriptor_count) {
+        server_process_mapped_image(threadpool, pool_size, &chain, descriptors[0], response, response_size);
+        goto cleanup;
+    }
+
+    if (2 == descriptor_count) {
+        source_descriptor = fdopen(descriptors[0], "r");
+        if (source_descriptor != NULL) {
+            descriptors[0] = -1;
+        }
+        destination_descriptor = fdopen(descriptors[1], "w");
+        if (destination_descriptor != NULL) {
+            descriptors[1] = -1;
+        }
+    } else {
+        source_descriptor = fopen(source_file_name, "r");
+        if (source_descriptor == NULL) {
+            snprintf(response, response_size, "ERROR\tFailed to open the source image file '%s'\n", source_file_name);
+            goto cleanup;
+        }
+        destination_descriptor = fopen(destination_file_name, "w");
+        if (destination_descriptor == NULL) {
+            snprintf(response, response_size, "ERROR\tFailed to create the output image '%s'\n", destination_file_name);
+            goto cleanup;
+        }
+    }
+
+    if (source_descriptor == NULL || destination_descriptor == NULL) {
+        snprintf(response, response_size, "ERROR\tInvalid file descriptors\n");
+        goto cleanup;
+    }
+
+    server_process_stream(
+        threadpool,
+        pool_size,
+        &chain,
+        0 == descriptor_count ? destination_file_name : "descriptor",
+        source_descriptor,
+        destination_descriptor,
+        response,
+        response_size
+    );
+
+cleanup:
+    if (source_descriptor != NULL) {
+        fclose(source_descriptor);
+        source_descriptor = NULL;
+    }
+
+    if (destination_descriptor != NULL) {
+        fclose(destination_descriptor);
+        destination_descriptor = NULL;
+    }
+
+    for (size_t i = 0; i < descriptor_count; ++i) {
+        if (descriptors[i] >= 0) {
+            close(descriptors[i]);
+            descriptors[i] = -1;
+        }
+    }
+}
+
+static bool server_write_all(int descriptor, const char *data, size_t size)
+{
+    while (size > 0) {
+        ssize_t written = write(descriptor, data, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+
+        data += written;
+        size -= (size_t) written;
+    }
+
+    return true;
+}
+
+/*
+    Receives the next part of the request stream. Descriptors attached to it
+    are appended to `descriptors`; ones that do not fit are closed and make
+    `overflow` true.
+*/
+static ssize_t server_receive(
+                   int connection,
+                   char *buffer,
+                   size_t size,
+                   int *descriptors,
+                   size_t *descriptor_count,
+                   bool *overflow
+               )
+{
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int) * SERVER_MAX_DESCRIPTORS)];
+    } control;
+
+    struct iovec vector = { .iov_base = buffer, .iov_len = size };
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &vector;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+
+    ssize_t received = recvmsg(connection, &message, MSG_CMSG_CLOEXEC);
+    if (received < 0) {
+        return received;
+    }
+
+    if (message.msg_flags & MSG_CTRUNC) {
+        *overflow = true;
+    }
+
+    for (struct cmsghdr *header = CMSG_FIRSTHDR(&message); header != NULL; header = CMSG_NXTHDR(&message, header)) {
+        if (SOL_SOCKET != header->cmsg_level || SCM_RIGHTS != header->cmsg_type) {
+            continue;
+        }
+
+        size_t count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < count; ++i) {
+            int descriptor;
+            memcpy(&descriptor, CMSG_DATA(header) + i * sizeof(int), sizeof(int));
+            if (*descriptor_count < SERVER_MAX_DESCRIPTORS) {
+                descriptors[(*descriptor_count)++] = descriptor;
+            } else {
+                close(descriptor);
+                *overflow = true;
+            }
+        }
+    }
+
+    return received;
+}
+
+static void server_serve_connection(threadpool_t *threadpool, size_t pool_size, int connection)
+{
+    char request[SERVER_MAX_REQUEST_SIZE];
+    char response[SERVER_MAX_RESPONSE_SIZE];
+    size_t length = 0;
+
+    /* Descriptors received since the last complete request belong to the next one */
+    int descriptors[SERVER_MAX_DESCRIPTORS];
+    size_t descriptor_count = 0;
+    bool overflow = false;
+
+    while (server_running) {
+        ssize_t received =
+            server_receive(
+                connection,
+                request + length,
+                sizeof(request) - 1 - length,
+                descriptors,
+                &descriptor_count,
+                &overflow
+            );
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            break;
+        }
+        length += (size_t) received;
+        request[length] = '\0';
+
+        char *line = request;
+        char *line_end;
+        while ((line_end = strchr(line, '\n')) != NULL) {
+            *line_end = '\0';
+
+            if (overflow) {
+                snprintf(response, sizeof(response), "ERROR\tToo many file descriptors\n");
+                for (size_t i = 0; i < descriptor_count; ++i) {
+                    close(descriptors[i]);
+                }
+            } else {
+                server_process_request(
+                    threadpool,
+                    pool_size,
+                    line,
+                    descriptors,
+                    descriptor_count,
+                    response,
+                    sizeof(response)
+                );
+            }
+            descriptor_count = 0;
+            overflow = false;
+
+            if (!server_write_all(connection, response, strlen(response))) {
+                goto cleanup;
+            }
+
+            line = line_end + 1;
+        }
+
+        length = strlen(line);
+        memmove(request, line, length + 1);
+        if (length == sizeof(request) - 1) {
+            snprintf(response, sizeof(response), "ERROR\tRequest is too long\n");
+            server_write_all(connection, response, strlen(response));
+            goto cleanup;
+        }
+    }
+
+cleanup:
+    for (size_t i = 0; i < descriptor_count; ++i) {
+        close(descriptors[i]);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int result = EXIT_FAILURE;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <socket path>\n", argv[0]);
+        return result;
+    }
+
+    char *socket_path = argv[1];
+    int server_socket = -1;
+    bool socket_bound = false;
+    threadpool_t *threadpool = NULL;
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "The socket path '%s' is too long\n", socket_path);
+        return result;
+    }
+    strcpy(address.sun_path, socket_path);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = server_stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    const char *error_message;
+    autotune_init(&server_tuning);
+    autotune_load(&server_tuning, autotune_get_file_path(), &error_message);
+    if (error_message != NULL) {
+        fprintf(stderr, "Ignoring the tuning file '%s':\n\t%s\n", autotune_get_file_path(), error_message);
+    }
+
+    cache_init(&server_cache);
+    if (NULL != cache_get_directory()) {
+        cache_open(&server_cache, cache_get_directory(), cache_get_maximum_size(), &error_message);
+        if (error_message != NULL) {
+            fprintf(stderr, "Caching is off, the cache '%s' is not usable:\n\t%s\n", cache_get_directory(), error_message);
+        }
+    }
+
+    size_t pool_size = utils_get_number_of_cpu_cores();
+    threadpool = threadpool_create(pool_size);
+    if (threadpool == NULL) {
+        fputs("Failed to create a threadpool.\n", stderr);
+        goto cleanup;
+    }
+    if (threadpool->pinned) {
+        buffer_pool_set_touch(&BMP_Buffer_Pool, server_touch_buffer, threadpool);
+    }
+
+    server_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server_socket < 0) {
+        perror("socket");
+        goto cleanup;
+    }
+
+    unlink(socket_path);
+    if (bind(server_socket, (struct sockaddr *) &address, sizeof(address)) < 0) {
+        perror("bind");
+        goto cleanup;
+    }
+    socket_bound = true;
+
+    if (listen(server_socket, SOMAXCONN) < 0) {
+        perror("listen");
+        goto cleanup;
+    }
+
+    while (server_running) {
+        int connection = accept(server_socket, NULL, NULL);
+        if (connection < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("accept");
+            break;
+        }
+
+        server_serve_connection(threadpool, pool_size, connection);
+        close(connection);
+    }
+
+    result = EXIT_SUCCESS;
+
+cleanup:
+    threadpool_destroy(threadpool);
+    threadpool = NULL;
+
+    buffer_pool_deinit(&BMP_Buffer_Pool);
+
+    autotune_free(&server_tuning);
+
+    cache_close(&server_cache);
+
+    if (server_socket >= 0) {
+        close(server_socket);
+        server_socket = -1;
+    }
+
+    if (socket_bound) {
+        unlink(socket_path);
+    }
+
+    return result;
+}
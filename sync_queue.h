@@ -3,16 +3,29 @@
 
 #include "queue.h"
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
 
+/*
+    A queue shared between threads. Consumers wait in `sync_queue_pop` while
+    it is empty. With a capacity set, producers wait in `sync_queue_enqueue`
+    while it is full, so a fast stage of a pipeline cannot run ahead of a
+    slow one by more than the capacity.
+*/
+
 typedef struct _sync_queue
 {
     pthread_mutex_t access_mutex;
     pthread_cond_t not_empty_condition;
+    pthread_cond_t not_full_condition;
     queue_t implementation;
+
+    bool closed;                /* no more elements will be added         */
+    size_t capacity;            /* the most elements it holds, 0 for any  */
+    size_t maximum_size;        /* the largest size the queue has reached */
 } sync_queue_t;
 
 static inline sync_queue_t *sync_queue_allocate()
@@ -31,8 +44,19 @@ static inline sync_queue_t *sync_queue_init(sync_queue_t *queue)
 
         return NULL;
     }
+
+    if (0 != pthread_cond_init(&queue->not_full_condition, NULL)) {
+        pthread_cond_destroy(&queue->not_empty_condition);
+        pthread_mutex_destroy(&queue->access_mutex);
+
+        return NULL;
+    }
     queue_init(&queue->implementation);
 
+    queue->closed = false;
+    queue->capacity = 0;
+    queue->maximum_size = 0;
+
     return queue;
 }
 
@@ -60,7 +84,8 @@ static inline void sync_queue_destroy(sync_queue_t *queue)
 
     pthread_mutex_destroy(&queue->access_mutex);
     pthread_cond_destroy(&queue->not_empty_condition);
-    queue_destroy(&queue->implementation);
+    pthread_cond_destroy(&queue->not_full_condition);
+    queue_deinit(&queue->implementation);
     free(queue);
 }
 
@@ -74,13 +99,39 @@ static inline bool sync_queue_is_empty(sync_queue_t *queue)
     return queue_is_empty(&queue->implementation);
 }
 
+/* Limits the queue to `capacity` elements, 0 removes the limit. */
+static void sync_queue_set_capacity(sync_queue_t *queue, size_t capacity)
+{
+    if (0 != pthread_mutex_lock(&queue->access_mutex)) {
+        return;
+    }
+
+    queue->capacity = capacity;
+    pthread_cond_broadcast(&queue->not_full_condition);
+
+    pthread_mutex_unlock(&queue->access_mutex);
+}
+
+/* Waits while the queue is full. Elements added after it was closed are
+   still taken by the consumers. */
 static sync_queue_t *sync_queue_enqueue(sync_queue_t *queue, void *data)
 {
     if (0 != pthread_mutex_lock(&queue->access_mutex)) {
         return NULL;
     }
 
+    while (0 != queue->capacity &&
+           (size_t) queue_get_size(&queue->implementation) >= queue->capacity &&
+           !queue->closed) {
+        if (0 != pthread_cond_wait(&queue->not_full_condition, &queue->access_mutex)) {
+            return NULL;
+        }
+    }
+
     queue_push(&queue->implementation, data);
+    if (queue_get_size(&queue->implementation) > queue->maximum_size) {
+        queue->maximum_size = queue_get_size(&queue->implementation);
+    }
     pthread_cond_broadcast(&queue->not_empty_condition);
 
     if (0 != pthread_mutex_unlock(&queue->access_mutex)) {
@@ -90,6 +141,52 @@ static sync_queue_t *sync_queue_enqueue(sync_queue_t *queue, void *data)
     return queue;
 }
 
+/* Wakes up all consumers and producers. Once the queue is closed and empty,
+   `sync_queue_pop` returns NULL instead of waiting. */
+static void sync_queue_close(sync_queue_t *queue)
+{
+    if (0 != pthread_mutex_lock(&queue->access_mutex)) {
+        return;
+    }
+
+    queue->closed = true;
+    pthread_cond_broadcast(&queue->not_empty_condition);
+    pthread_cond_broadcast(&queue->not_full_condition);
+
+    pthread_mutex_unlock(&queue->access_mutex);
+}
+
+/* True once the queue was closed and all of its elements were taken. */
+static bool sync_queue_is_closed(sync_queue_t *queue)
+{
+    bool closed = false;
+
+    if (0 != pthread_mutex_lock(&queue->access_mutex)) {
+        return closed;
+    }
+
+    closed = queue->closed && queue_is_empty(&queue->implementation);
+
+    pthread_mutex_unlock(&queue->access_mutex);
+
+    return closed;
+}
+
+static size_t sync_queue_get_maximum_size(sync_queue_t *queue)
+{
+    size_t maximum_size = 0;
+
+    if (0 != pthread_mutex_lock(&queue->access_mutex)) {
+        return maximum_size;
+    }
+
+    maximum_size = queue->maximum_size;
+
+    pthread_mutex_unlock(&queue->access_mutex);
+
+    return maximum_size;
+}
+
 static void *sync_queue_pop(sync_queue_t *queue)
 {
     void *data = NULL;
@@ -98,13 +195,58 @@ static void *sync_queue_pop(sync_queue_t *queue)
         return data;
     }
 
-    while (queue_is_empty(&queue->implementation)) {
+    while (queue_is_empty(&queue->implementation) && !queue->closed) {
         if (0 != pthread_cond_wait(&queue->not_empty_condition, &queue->access_mutex)) {
             return data;
         }
     }
 
     data = queue_pop(&queue->implementation);
+    pthread_cond_broadcast(&queue->not_full_condition);
+
+    if (0 != pthread_mutex_unlock(&queue->access_mutex)) {
+        return data;
+    }
+
+    return data;
+}
+
+/* Like `sync_queue_pop`, but takes the last element for which `accept`
+   returns true and waits while there is none. */
+static void *sync_queue_pop_if(
+                 sync_queue_t *queue,
+                 bool (*accept)(void *element, void *context),
+                 void *context
+             )
+{
+    void *data = NULL;
+
+    if (0 != pthread_mutex_lock(&queue->access_mutex)) {
+        return data;
+    }
+
+    while (true) {
+        queue_item_t *item = queue_is_empty(&queue->implementation) ? NULL : queue->implementation.last;
+        for (; NULL != item; item = item == queue->implementation.first ? NULL : item->previous) {
+            if (accept(item->content, context)) {
+                break;
+            }
+        }
+
+        if (NULL != item) {
+            data = queue_remove(&queue->implementation, item);
+            pthread_cond_broadcast(&queue->not_full_condition);
+            break;
+        }
+
+        if (queue->closed) {
+            break;
+        }
+
+        if (0 != pthread_cond_wait(&queue->not_empty_condition, &queue->access_mutex)) {
+            return data;
+        }
+    }
 
     if (0 != pthread_mutex_unlock(&queue->access_mutex)) {
         return data;
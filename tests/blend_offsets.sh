@@ -0,0 +1,59 @@
+#!/bin/sh
+
+# Blends images/image_small.bmp (800x800, 24 bits, bottom-up) over itself at
+# positions where the overlay lies outside of the image or only partly inside
+# of it. An overlay outside of the image has to give back the source file
+# byte for byte, a partly covering one has to change exactly the covered
+# rows, and no position may crash the tool.
+#
+#     sh tests/blend_offsets.sh
+
+set -u
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+IMAGE="$ROOT/images/image_small.bmp"
+HEADER_SIZE=54
+ROW_SIZE=2400
+FAILED=0
+
+gcc -O2 -march=native -pthread -DC_IMPLEMENTATION "$ROOT/blend.c" -o "$WORK/blend" -lm || exit 1
+
+blend() {
+    "$WORK/blend" over "$1" "$2" "$IMAGE" "$IMAGE" "$WORK/$3.bmp" > /dev/null
+}
+
+for position in "800 0" "-800 0" "5000 0" "-5000 0" "0 800" "0 -800" "0 -5000" "800 800" "-800 -800"; do
+    set -- $position
+    if ! blend "$1" "$2" outside; then
+        echo "FAIL: x=$1 y=$2 exited with an error"; FAILED=1
+    elif ! cmp -s "$IMAGE" "$WORK/outside.bmp"; then
+        echo "FAIL: x=$1 y=$2 changed the image"; FAILED=1
+    fi
+done
+
+for position in "-400 0" "700 0" "0 -600" "0 600" "-300 -300" "500 500"; do
+    set -- $position
+    if ! blend "$1" "$2" partial; then
+        echo "FAIL: x=$1 y=$2 exited with an error"; FAILED=1
+    elif cmp -s "$IMAGE" "$WORK/partial.bmp"; then
+        echo "FAIL: x=$1 y=$2 did not change the image"; FAILED=1
+    fi
+done
+
+# The rows are stored bottom-up, so an overlay on the bottom 100 rows of the
+# image may only change the first 100 stored rows and one on the top 100 rows
+# the last ones
+if ! blend 0 700 bottom_rows || cmp -s "$IMAGE" "$WORK/bottom_rows.bmp" ||
+   ! cmp -s -i $((HEADER_SIZE + 100 * ROW_SIZE)) "$IMAGE" "$WORK/bottom_rows.bmp"; then
+    echo "FAIL: x=0 y=700 did not change only the bottom rows"; FAILED=1
+fi
+if ! blend 0 -700 top_rows || cmp -s "$IMAGE" "$WORK/top_rows.bmp" ||
+   ! cmp -s -n $((HEADER_SIZE + 700 * ROW_SIZE)) "$IMAGE" "$WORK/top_rows.bmp"; then
+    echo "FAIL: x=0 y=-700 did not change only the top rows"; FAILED=1
+fi
+
+[ 0 -eq "$FAILED" ] && echo "OK"
+exit "$FAILED"
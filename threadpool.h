@@ -6,8 +6,11 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <pthread.h>
 
 /* Useful Helpers */
@@ -21,6 +24,83 @@
     #include <unistd.h>
 #endif
 
+#ifdef __linux__
+    #include <sys/syscall.h>
+#endif
+
+#define UTILS_MAX_CPUS 1024
+
+/* Fills `cpus` with the CPUs the affinity mask of the process allows and
+   returns their count, or 0 if the mask is not available. */
+static size_t utils_get_allowed_cpus(int *cpus, size_t capacity)
+{
+    size_t count = 0;
+
+#ifdef __linux__
+    unsigned long mask[UTILS_MAX_CPUS / (8 * sizeof(unsigned long))];
+    long mask_size = syscall(SYS_sched_getaffinity, 0, sizeof(mask), mask);
+    if (mask_size <= 0) {
+        return count;
+    }
+
+    for (size_t cpu = 0; cpu < (size_t) mask_size * 8; ++cpu) {
+        if (1 & (mask[cpu / (8 * sizeof(unsigned long))] >> (cpu % (8 * sizeof(unsigned long))))) {
+            if (NULL != cpus && count < capacity) {
+                cpus[count] = (int) cpu;
+            }
+            ++count;
+        }
+    }
+#else
+    (void) cpus;
+    (void) capacity;
+#endif
+
+    return count;
+}
+
+/* Returns the CPU quota of the cgroup of the process rounded up to whole
+   CPUs, or 0 if there is no limit. Containers see their own cgroup at the
+   root of /sys/fs/cgroup. */
+static size_t utils_get_cgroup_cpu_limit()
+{
+    long long quota = -1, period = 0;
+
+#ifdef __linux__
+    FILE *file = fopen("/sys/fs/cgroup/cpu.max", "r");
+    if (NULL != file) {
+        char text[32];
+        if (2 == fscanf(file, "%31s %lld", text, &period) && 0 != strcmp(text, "max")) {
+            quota = atoll(text);
+        }
+        fclose(file);
+    } else {
+        file = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r");
+        if (NULL != file) {
+            if (1 != fscanf(file, "%lld", &quota)) {
+                quota = -1;
+            }
+            fclose(file);
+        }
+        file = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r");
+        if (NULL != file) {
+            if (1 != fscanf(file, "%lld", &period)) {
+                period = 0;
+            }
+            fclose(file);
+        }
+    }
+#endif
+
+    if (quota <= 0 || period <= 0) {
+        return 0;
+    }
+
+    return (size_t) ((quota + period - 1) / period);
+}
+
+/* The number of CPUs the process can actually use: the online CPUs limited
+   by the affinity mask and the cgroup quota. */
 static size_t utils_get_number_of_cpu_cores()
 {
     int result;
@@ -52,6 +132,16 @@ static size_t utils_get_number_of_cpu_cores()
 #else
     result =
         (int) sysconf(_SC_NPROCESSORS_ONLN);
+
+    size_t allowed_cpus = utils_get_allowed_cpus(NULL, 0);
+    if (allowed_cpus > 0 && allowed_cpus < (size_t) result) {
+        result = (int) allowed_cpus;
+    }
+
+    size_t cpu_limit = utils_get_cgroup_cpu_limit();
+    if (cpu_limit > 0 && cpu_limit < (size_t) result) {
+        result = (int) cpu_limit;
+    }
 #endif
 
     if (result < 1) {
@@ -61,27 +151,146 @@ static size_t utils_get_number_of_cpu_cores()
     return (size_t) result;
 }
 
+/* Statistics */
+
+/*
+    Every worker counts the tasks it ran, the time it spent running them
+    (busy) and waiting for the queue (idle), and the time its tasks spent in
+    the queue between `threadpool_enqueue_task` and their start. Latencies go
+    into a histogram with power of two buckets: bucket `i` counts latencies in
+    [2^i, 2^(i + 1)) ns. The pool has a single shared queue, so there is no
+    work stealing to count.
+
+    Each worker only writes its own counters, the readers may see values that
+    are a few tasks behind.
+*/
+
+#define THREADPOOL_LATENCY_BUCKETS 40
+
+typedef struct _threadpool_worker_statistics
+{
+    uint64_t tasks_run;
+    uint64_t busy_time;
+    uint64_t idle_time;
+    uint64_t latency_time;
+    uint64_t maximum_latency;
+    uint64_t latency_histogram[THREADPOOL_LATENCY_BUCKETS];
+} threadpool_worker_statistics_t;
+
+static inline uint64_t _threadpool_get_time_ns(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+
+    return (uint64_t) time.tv_sec * 1000000000ull + (uint64_t) time.tv_nsec;
+}
+
+/* Counters have a single writer, a relaxed store is enough and avoids a
+   locked instruction per update. */
+static inline void _threadpool_add(uint64_t *counter, uint64_t value)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+static inline size_t _threadpool_get_latency_bucket(uint64_t latency)
+{
+    size_t bucket = latency < 2 ? 0 : (size_t) (63 - __builtin_clzll(latency));
+
+    return bucket < THREADPOOL_LATENCY_BUCKETS ? bucket : THREADPOOL_LATENCY_BUCKETS - 1;
+}
+
 /* Threadpool */
 
+/*
+    With the environment variable THREADPOOL_PIN set, worker `i` is pinned to
+    the `i`-th CPU of the affinity mask. Pinned pools also keep memory local:
+    `threadpool_touch_local` lets every worker touch its own band of a new
+    buffer first, so Linux places the pages on the NUMA node of that worker,
+    and `threadpool_get_band_worker` sends the tasks of a band to the same
+    worker later.
+*/
+
+typedef struct _threadpool_worker
+{
+    sync_queue_t *queue;
+    size_t index;
+    int cpu;                /* the CPU the worker is pinned to, or -1 */
+    threadpool_worker_statistics_t statistics;
+} __attribute__((aligned(64))) threadpool_worker_t;
+
 typedef struct _threadpool
 {
     sync_queue_t *queue;
 
     pthread_t *threads;
+    threadpool_worker_t *workers;
     size_t thread_count;
+    bool pinned;
 } threadpool_t;
 
+static inline bool _threadpool_is_option_set(const char *name)
+{
+    const char *value = getenv(name);
+
+    return NULL != value && '\0' != value[0] && 0 != strcmp(value, "0");
+}
+
+static inline void _threadpool_pin_to_cpu(int cpu)
+{
+#ifdef __linux__
+    unsigned long mask[UTILS_MAX_CPUS / (8 * sizeof(unsigned long))];
+    memset(mask, 0, sizeof(mask));
+    mask[cpu / (8 * sizeof(unsigned long))] |= 1ul << (cpu % (8 * sizeof(unsigned long)));
+
+    syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask);
+#else
+    (void) cpu;
+#endif
+}
+
+static bool _threadpool_accepts(void *element, void *context)
+{
+    work_item_t *work_item = (work_item_t *) element;
+    threadpool_worker_t *worker = (threadpool_worker_t *) context;
+
+    return WORK_ITEM_ANY_WORKER == work_item->worker || worker->index == work_item->worker;
+}
+
 static void *_thread_start(void *args)
 {
-    sync_queue_t *queue = (sync_queue_t *) args;
+    threadpool_worker_t *worker = (threadpool_worker_t *) args;
+    threadpool_worker_statistics_t *statistics = &worker->statistics;
+
+    if (worker->cpu >= 0) {
+        _threadpool_pin_to_cpu(worker->cpu);
+    }
+
+    uint64_t idle_start_time = _threadpool_get_time_ns();
     while (true) {
-        work_item_t *work_item = (work_item_t *) sync_queue_pop(queue);
+        work_item_t *work_item = (work_item_t *) sync_queue_pop_if(worker->queue, _threadpool_accepts, worker);
         if (NULL == work_item) {
+            if (sync_queue_is_closed(worker->queue)) {
+                _threadpool_add(&statistics->idle_time, _threadpool_get_time_ns() - idle_start_time);
+                break;
+            }
             continue;
         }
 
+        uint64_t start_time = _threadpool_get_time_ns();
+        uint64_t latency = start_time - work_item->enqueue_time;
+        _threadpool_add(&statistics->idle_time, start_time - idle_start_time);
+        _threadpool_add(&statistics->latency_time, latency);
+        _threadpool_add(&statistics->latency_histogram[_threadpool_get_latency_bucket(latency)], 1);
+        if (latency > statistics->maximum_latency) {
+            __atomic_store_n(&statistics->maximum_latency, latency, __ATOMIC_RELAXED);
+        }
+
         work_item->task(work_item->task_data, work_item->result_callback);
         work_item_destroy(work_item);
+
+        idle_start_time = _threadpool_get_time_ns();
+        _threadpool_add(&statistics->busy_time, idle_start_time - start_time);
+        _threadpool_add(&statistics->tasks_run, 1);
     }
 
     return NULL;
@@ -103,19 +312,40 @@ static threadpool_t *threadpool_init(threadpool_t *threadpool, size_t pool_size)
     }
 
     threadpool->threads = (pthread_t *) malloc(sizeof(pthread_t) * pool_size);
-    if (NULL == threadpool->threads) {
+    threadpool->workers =
+        (threadpool_worker_t *) aligned_alloc(
+                                    _Alignof(threadpool_worker_t),
+                                    sizeof(threadpool_worker_t) * pool_size
+                                );
+    if (NULL == threadpool->threads || NULL == threadpool->workers) {
+        free(threadpool->threads);
+        threadpool->threads = NULL;
+        free(threadpool->workers);
+        threadpool->workers = NULL;
         sync_queue_destroy(threadpool->queue);
         threadpool->queue = NULL;
 
         return NULL;
     }
+    memset(threadpool->workers, 0, sizeof(threadpool_worker_t) * pool_size);
+
+    int cpus[UTILS_MAX_CPUS];
+    size_t cpu_count = 0;
+    if (_threadpool_is_option_set("THREADPOOL_PIN")) {
+        cpu_count = utils_get_allowed_cpus(cpus, UTILS_MAX_CPUS);
+        cpu_count = cpu_count < UTILS_MAX_CPUS ? cpu_count : UTILS_MAX_CPUS;
+    }
+    threadpool->pinned = cpu_count > 0;
 
     for (size_t i = 0; i < pool_size; ++i) {
+        threadpool->workers[i].queue = threadpool->queue;
+        threadpool->workers[i].index = i;
+        threadpool->workers[i].cpu = threadpool->pinned ? cpus[i % cpu_count] : -1;
         pthread_create(
             &threadpool->threads[i],
             NULL,
             _thread_start,
-            (void *) threadpool->queue
+            (void *) &threadpool->workers[i]
         );
     }
 
@@ -138,6 +368,111 @@ static inline threadpool_t *threadpool_create(size_t pool_size)
     return threadpool;
 }
 
+/* Copies the counters of the worker `index`, or the sum over all workers
+   if `index` is the thread count. */
+static void threadpool_get_statistics(
+                threadpool_t *threadpool,
+                size_t index,
+                threadpool_worker_statistics_t *statistics
+            )
+{
+    memset(statistics, 0, sizeof(*statistics));
+
+    size_t first = index < threadpool->thread_count ? index : 0;
+    size_t last = index < threadpool->thread_count ? index + 1 : threadpool->thread_count;
+    for (size_t i = first; i < last; ++i) {
+        threadpool_worker_statistics_t *worker = &threadpool->workers[i].statistics;
+
+        statistics->tasks_run += __atomic_load_n(&worker->tasks_run, __ATOMIC_RELAXED);
+        statistics->busy_time += __atomic_load_n(&worker->busy_time, __ATOMIC_RELAXED);
+        statistics->idle_time += __atomic_load_n(&worker->idle_time, __ATOMIC_RELAXED);
+        statistics->latency_time += __atomic_load_n(&worker->latency_time, __ATOMIC_RELAXED);
+        uint64_t maximum_latency = __atomic_load_n(&worker->maximum_latency, __ATOMIC_RELAXED);
+        if (maximum_latency > statistics->maximum_latency) {
+            statistics->maximum_latency = maximum_latency;
+        }
+        for (size_t bucket = 0; bucket < THREADPOOL_LATENCY_BUCKETS; ++bucket) {
+            statistics->latency_histogram[bucket] +=
+                __atomic_load_n(&worker->latency_histogram[bucket], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/* The number of tasks waiting in the queue right now and the most that ever
+   waited at once. */
+static inline size_t threadpool_get_queue_depth(threadpool_t *threadpool)
+{
+    return sync_queue_get_size(threadpool->queue);
+}
+
+static inline size_t threadpool_get_maximum_queue_depth(threadpool_t *threadpool)
+{
+    return sync_queue_get_maximum_size(threadpool->queue);
+}
+
+static void threadpool_print_statistics(threadpool_t *threadpool, FILE *file)
+{
+    threadpool_worker_statistics_t total;
+    threadpool_get_statistics(threadpool, threadpool->thread_count, &total);
+
+    fprintf(
+        file,
+        "threadpool: %zu workers, %llu tasks, maximum queue depth %zu\n"
+        "    worker      tasks      busy ms      idle ms   utilization\n",
+        threadpool->thread_count,
+        (unsigned long long) total.tasks_run,
+        threadpool_get_maximum_queue_depth(threadpool)
+    );
+
+    for (size_t i = 0; i <= threadpool->thread_count; ++i) {
+        threadpool_worker_statistics_t statistics;
+        threadpool_get_statistics(threadpool, i, &statistics);
+
+        uint64_t time = statistics.busy_time + statistics.idle_time;
+        char name[32];
+        if (i < threadpool->thread_count) {
+            snprintf(name, sizeof(name), "%zu", i);
+        } else {
+            snprintf(name, sizeof(name), "all");
+        }
+        fprintf(
+            file,
+            "    %6s %10llu %12.3f %12.3f %12.1f%%\n",
+            name,
+            (unsigned long long) statistics.tasks_run,
+            statistics.busy_time / 1e6,
+            statistics.idle_time / 1e6,
+            0 == time ? 0.0 : 100.0 * (double) statistics.busy_time / (double) time
+        );
+    }
+
+    if (0 == total.tasks_run) {
+        return;
+    }
+
+    fprintf(
+        file,
+        "    enqueue to start: mean %.3f us, maximum %.3f us\n",
+        (double) total.latency_time / (double) total.tasks_run / 1e3,
+        total.maximum_latency / 1e3
+    );
+    for (size_t bucket = 0; bucket < THREADPOOL_LATENCY_BUCKETS; ++bucket) {
+        if (0 != total.latency_histogram[bucket]) {
+            fprintf(
+                file,
+                "        < %14llu ns %10llu\n",
+                2ull << bucket,
+                (unsigned long long) total.latency_histogram[bucket]
+            );
+        }
+    }
+}
+
+/*
+    Lets the workers finish the queued tasks, joins them and frees the pool.
+    With the environment variable THREADPOOL_STATISTICS set, the statistics
+    are printed to stderr first.
+*/
 static void threadpool_destroy(threadpool_t *threadpool)
 {
     if (NULL == threadpool) {
@@ -145,12 +480,23 @@ static void threadpool_destroy(threadpool_t *threadpool)
     }
 
     if (NULL != threadpool->threads) {
+        sync_queue_close(threadpool->queue);
+
         for (size_t i = 0; i < threadpool->thread_count; ++i) {
             pthread_join(threadpool->threads[i], NULL);
         }
 
         free(threadpool->threads);
         threadpool->threads = NULL;
+
+        if (_threadpool_is_option_set("THREADPOOL_STATISTICS")) {
+            threadpool_print_statistics(threadpool, stderr);
+        }
+    }
+
+    if (NULL != threadpool->workers) {
+        free(threadpool->workers);
+        threadpool->workers = NULL;
     }
 
     if (NULL != threadpool->queue) {
@@ -161,8 +507,11 @@ static void threadpool_destroy(threadpool_t *threadpool)
     free(threadpool);
 }
 
-static inline void threadpool_enqueue_task(
+/* Queues a task that only the worker `worker` runs, or any worker if it is
+   WORK_ITEM_ANY_WORKER. */
+static inline void threadpool_enqueue_task_on(
                        threadpool_t *threadpool,
+                       size_t worker,
                        void (*task)(void *task_data, void (*result_callback)(void *result)),
                        void *task_data,
                        void (*result_callback)(void *result)
@@ -172,8 +521,92 @@ static inline void threadpool_enqueue_task(
     if (NULL == work_item) {
         return;
     }
+    work_item->enqueue_time = _threadpool_get_time_ns();
+    work_item->worker = worker < threadpool->thread_count ? worker : WORK_ITEM_ANY_WORKER;
 
     sync_queue_enqueue(threadpool->queue, work_item);
 }
 
+static inline void threadpool_enqueue_task(
+                       threadpool_t *threadpool,
+                       void (*task)(void *task_data, void (*result_callback)(void *result)),
+                       void *task_data,
+                       void (*result_callback)(void *result)
+                   )
+{
+    threadpool_enqueue_task_on(threadpool, WORK_ITEM_ANY_WORKER, task, task_data, result_callback);
+}
+
+/* NUMA Placement */
+
+/* The worker whose band of a `size` bytes buffer touched by
+   `threadpool_touch_local` holds `offset`. Unpinned pools let any worker
+   take the task. */
+static inline size_t threadpool_get_band_worker(threadpool_t *threadpool, size_t offset, size_t size)
+{
+    if (NULL == threadpool || !threadpool->pinned || offset >= size) {
+        return WORK_ITEM_ANY_WORKER;
+    }
+
+    return offset * threadpool->thread_count / size;
+}
+
+typedef struct _threadpool_touch_data
+{
+    uint8_t *memory;
+    size_t size;
+    size_t page_size;
+    volatile ssize_t *bands_left;
+} threadpool_touch_data_t;
+
+static void _threadpool_touch_task(
+                void *task_data,
+                void (*result_callback)(void *result) __attribute__((unused))
+            )
+{
+    threadpool_touch_data_t *data = task_data;
+
+    for (size_t offset = 0; offset < data->size; offset += data->page_size) {
+        data->memory[offset] = 0;
+    }
+
+    __sync_sub_and_fetch(data->bands_left, 1);
+}
+
+/*
+    Lets worker `i` of a pinned pool touch the `i`-th of `thread_count` equal
+    bands of fresh, page aligned `memory` first, which places the pages of the
+    band on its NUMA node. Unpinned pools leave the memory as it is.
+*/
+static void threadpool_touch_local(threadpool_t *threadpool, void *memory, size_t size)
+{
+    if (NULL == threadpool || !threadpool->pinned) {
+        return;
+    }
+
+    size_t band_count = threadpool->thread_count;
+    threadpool_touch_data_t *bands = (threadpool_touch_data_t *) malloc(sizeof(*bands) * band_count);
+    if (NULL == bands) {
+        return;
+    }
+
+    size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    volatile ssize_t bands_left = (ssize_t) band_count;
+    for (size_t i = 0; i < band_count; ++i) {
+        size_t start = size * i / band_count / page_size * page_size;
+        size_t end = i + 1 == band_count ? size : size * (i + 1) / band_count / page_size * page_size;
+
+        bands[i].memory = (uint8_t *) memory + start;
+        bands[i].size = end - start;
+        bands[i].page_size = page_size;
+        bands[i].bands_left = &bands_left;
+
+        threadpool_enqueue_task_on(threadpool, i, _threadpool_touch_task, &bands[i], NULL);
+    }
+
+    while (bands_left > 0) { }
+
+    free(bands);
+}
+
 #endif // THREADPOOL_H
@@ -0,0 +1,385 @@
+#include "bmp.h"
+#include "image_io.h"
+#include "threadpool.h"
+#include "tiled.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#if !defined C_IMPLEMENTATION && \
+    !defined SIMD_INTRINSICS_IMPLEMENTATION && \
+    !defined SIMD_ASM_IMPLEMENTATION
+#define C_IMPLEMENTATION 1
+#endif
+
+/*
+    Converts images to and from the tiled formats of `tiled.h`. Every row of
+    tiles is a separate task: tiled source files are mapped and their tiles are
+    copied or decoded out of the map, tiled destinations are written with one
+    `pwrite` per tile, and packed destinations are packed in memory before
+    they are written. Other formats go through `image_io.h`, so the tool also
+    converts between BMP, PPM and PAM images or changes the tile size of a
+    tiled image.
+*/
+
+typedef enum _tile_operation
+{
+    TILE_OPERATION_READ,    /* copy the tiles of a mapped file into the pixels   */
+    TILE_OPERATION_WRITE,   /* write the tiles of the pixels into the file       */
+    TILE_OPERATION_PACK     /* pack the tiles of the pixels into memory          */
+} tile_operation_t;
+
+typedef struct _tile_task_data
+{
+    tile_operation_t operation;
+    const tiled_header *header;
+    const tiled_file *file;         /* the source or destination of READ and WRITE  */
+    uint8_t *packed;                /* the tile slots of PACK                        */
+    tiled_tile_entry *index;        /* the index entries of PACK                     */
+    uint8_t *pixels;
+    bool top_down;                  /* row order of `pixels`                         */
+    size_t tile_y;
+    volatile ssize_t *rows_left;
+    volatile bool *barrier_sense;
+    volatile bool *failed;
+} tile_task_data_t;
+
+static void tile_processing_task(
+                void *task_data,
+                void (*result_callback)(void *result) __attribute__((unused))
+            )
+{
+    tile_task_data_t *data = task_data;
+
+    const tiled_header *header = data->header;
+    size_t tile_size = tiled_get_tile_size(header);
+
+    uint8_t *tile = bmp_allocate_buffer(tile_size);
+    if (tile == NULL) {
+        *data->failed = true;
+    } else if (data->operation == TILE_OPERATION_READ) {
+        if (!tiled_read_mapped_tile_row(data->file, data->tile_y, tile, data->pixels, data->top_down)) {
+            *data->failed = true;
+        }
+    } else if (data->operation == TILE_OPERATION_WRITE) {
+        for (size_t tile_x = 0; tile_x < header->tiles_across; ++tile_x) {
+            tiled_copy_tile_from_pixels(header, data->pixels, data->top_down, tile_x, data->tile_y, tile);
+
+            const char *error_message;
+            tiled_write_tile(data->file, tile_x, data->tile_y, tile, &error_message);
+            if (error_message != NULL) {
+                *data->failed = true;
+                break;
+            }
+        }
+    } else {
+        tiled_pack_tile_row(header, data->pixels, data->top_down, data->tile_y, tile, data->packed, data->index);
+    }
+
+    if (tile != NULL) {
+        bmp_free_buffer(tile, tile_size);
+        tile = NULL;
+    }
+
+    ssize_t rows_left = __sync_sub_and_fetch(data->rows_left, 1);
+    if (rows_left <= 0) {
+        __sync_lock_test_and_set(data->barrier_sense, true);
+    }
+
+    free(data);
+    data = NULL;
+}
+
+/* Runs a task for every row of tiles with the fields of `template` and
+   returns false if one of them failed. */
+static bool tile_run(threadpool_t *threadpool, const tile_task_data_t *template)
+{
+    static volatile ssize_t rows_left = 0;
+    static volatile bool barrier_sense = false;
+    static volatile bool failed = false;
+
+    size_t row_count = template->header->tiles_down;
+    rows_left = row_count;
+    barrier_sense = false;
+    failed = false;
+
+    size_t enqueued_rows = 0;
+    for (size_t tile_y = 0; tile_y < row_count; ++tile_y) {
+        tile_task_data_t *task_data = malloc(sizeof(*task_data));
+        if (task_data == NULL) {
+            failed = true;
+            break;
+        }
+
+        *task_data = *template;
+        task_data->tile_y = tile_y;
+        task_data->rows_left = &rows_left;
+        task_data->barrier_sense = &barrier_sense;
+        task_data->failed = &failed;
+
+        ++enqueued_rows;
+        if (threadpool == NULL) {
+            tile_processing_task(task_data, NULL);
+        } else {
+            threadpool_enqueue_task(threadpool, tile_processing_task, task_data, NULL);
+        }
+    }
+
+    /* Rows that were never enqueued are not waited for */
+    if (enqueued_rows < row_count &&
+        __sync_sub_and_fetch(&rows_left, (ssize_t) (row_count - enqueued_rows)) <= 0) {
+        __sync_lock_test_and_set(&barrier_sense, true);
+    }
+
+    while (row_count > 0 && !barrier_sense) { }
+
+    return !failed;
+}
+
+int main(int argc, char *argv[])
+{
+    int result = EXIT_FAILURE;
+
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <source file> <dest. file> [<tile size>]\n", argv[0]);
+        return result;
+    }
+
+    char *source_file_name = argv[1];
+    char *destination_file_name = argv[2];
+    size_t tile_size = argc > 3 ? (size_t) strtoul(argv[3], NULL, 10) : 0;
+    FILE *source_descriptor = NULL;
+    FILE *destination_descriptor = NULL;
+    threadpool_t *threadpool = NULL;
+
+    bmp_image image; bmp_init_image_structure(&image);
+    image_format source_format = IMAGE_FORMAT_BMP;
+    tiled_file source_tiles; tiled_init_file_structure(&source_tiles);
+    tiled_file destination_tiles; tiled_init_file_structure(&destination_tiles);
+    tiled_header packed_header;
+    tiled_tile_entry *packed_index = NULL;
+    uint8_t *packed = NULL;
+    size_t packed_size = 0;
+
+    if (argc > 3 && !tiled_is_valid_tile_size(tile_size)) {
+        fprintf(stderr, "%s\n", TILED_Error_Invalid_Tile_Size);
+        goto cleanup;
+    }
+
+    source_descriptor = fopen(source_file_name, "r");
+    if (source_descriptor == NULL) {
+        perror(NULL);
+        fprintf(stderr, "Failed to open the source image file '%s'\n", source_file_name);
+        goto cleanup;
+    }
+
+    size_t threads = utils_get_number_of_cpu_cores();
+    if (threads > 1) {
+        threadpool = threadpool_create(threads);
+        if (threadpool == NULL) {
+            fputs("Failed to create a threadpool.\n", stderr);
+            goto cleanup;
+        }
+    }
+
+    const char *error_message;
+    /* Pipes are read front to back through image_io.h */
+    struct stat source_status;
+    source_format = image_io_peek_format(source_descriptor);
+    if (source_format == IMAGE_FORMAT_TILED &&
+        fstat(fileno(source_descriptor), &source_status) == 0 && S_ISREG(source_status.st_mode)) {
+        tiled_open_file(&source_tiles, source_file_name, false, &error_message);
+        if (error_message == NULL) {
+            tiled_map_file(&source_tiles, &error_message);
+        }
+        if (error_message == NULL) {
+            tiled_allocate_image(&image, &source_tiles.header, true, &error_message);
+        }
+        if (error_message != NULL) {
+            fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", source_file_name, error_message);
+            goto cleanup;
+        }
+
+        for (size_t i = 0; i < tiled_get_tile_count(&source_tiles.header); ++i) {
+            if (source_tiles.index[i].encoding != TILED_ENCODING_RAW) {
+                source_format = IMAGE_FORMAT_PACKED_TILED;
+                break;
+            }
+        }
+
+        uint64_t start_time = timing_start();
+
+        tile_task_data_t template = {
+            .operation = TILE_OPERATION_READ,
+            .header = &source_tiles.header,
+            .file = &source_tiles,
+            .pixels = image.pixels,
+            .top_down = true
+        };
+        if (!tile_run(threadpool, &template)) {
+            fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", source_file_name, TILED_Error_Invalid_Packed_Tile);
+            goto cleanup;
+        }
+
+        timing_stop(
+            TIMING_STAGE_READ,
+            start_time,
+            source_tiles.header.file_size,
+            image.absolute_image_width * image.absolute_image_height
+        );
+    } else {
+        image_io_open_image_headers(source_descriptor, &image, &source_format, &error_message);
+        if (error_message != NULL) {
+            fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", source_file_name, error_message);
+            goto cleanup;
+        }
+
+        image_io_read_image_data(source_descriptor, &image, source_format, &error_message);
+        if (error_message != NULL) {
+            fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", source_file_name, error_message);
+            goto cleanup;
+        }
+    }
+
+    size_t width = image.absolute_image_width;
+    size_t height = image.absolute_image_height;
+    size_t tile_width = tile_size != 0 ? tile_size : tiled_get_default_tile_size(width);
+    size_t tile_height = tile_size != 0 ? tile_size : tiled_get_default_tile_size(height);
+
+    image_format destination_format = image_io_get_format_for_file_name(destination_file_name, source_format);
+    if (destination_format == IMAGE_FORMAT_TILED) {
+        tiled_create_file(
+            &destination_tiles,
+            destination_file_name,
+            width,
+            height,
+            image.channels,
+            tile_width,
+            tile_height,
+            &error_message
+        );
+        if (error_message != NULL) {
+            fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", destination_file_name, error_message);
+            goto cleanup;
+        }
+
+        uint64_t start_time = timing_start();
+
+        tile_task_data_t template = {
+            .operation = TILE_OPERATION_WRITE,
+            .header = &destination_tiles.header,
+            .file = &destination_tiles,
+            .pixels = image.pixels,
+            .top_down = bmp_is_top_down(&image)
+        };
+        if (!tile_run(threadpool, &template)) {
+            fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", destination_file_name, TILED_Error_Failed_to_Write_Tile);
+            goto cleanup;
+        }
+
+        timing_stop(TIMING_STAGE_WRITE, start_time, destination_tiles.header.file_size, width * height);
+    } else if (destination_format == IMAGE_FORMAT_PACKED_TILED) {
+        tiled_init_header(&packed_header, width, height, image.channels, tile_width, tile_height, &error_message);
+        if (error_message != NULL) {
+            fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", destination_file_name, error_message);
+            goto cleanup;
+        }
+
+        packed_size = tiled_get_tile_count(&packed_header) * tiled_get_packed_tile_stride(&packed_header);
+        packed = bmp_allocate_buffer(packed_size);
+        packed_index = malloc(tiled_get_tile_count(&packed_header) * sizeof(*packed_index));
+        if (packed == NULL || packed_index == NULL) {
+            fputs("Out of memory.\n", stderr);
+            goto cleanup;
+        }
+
+        uint64_t start_time = timing_start();
+
+        tile_task_data_t template = {
+            .operation = TILE_OPERATION_PACK,
+            .header = &packed_header,
+            .packed = packed,
+            .index = packed_index,
+            .pixels = image.pixels,
+            .top_down = bmp_is_top_down(&image)
+        };
+        if (!tile_run(threadpool, &template)) {
+            fputs("Out of memory.\n", stderr);
+            goto cleanup;
+        }
+
+        timing_stop(TIMING_STAGE_PACK, start_time, width * height * 4, width * height);
+
+        destination_descriptor = fopen(destination_file_name, "w");
+        if (destination_descriptor == NULL) {
+            fprintf(stderr, "Failed to create the output image '%s'\n", destination_file_name);
+            goto cleanup;
+        }
+
+        start_time = timing_start();
+
+        tiled_write_packed_tiles(destination_descriptor, &packed_header, packed_index, packed, &error_message);
+        if (error_message != NULL) {
+            fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", destination_file_name, error_message);
+            goto cleanup;
+        }
+
+        timing_stop(TIMING_STAGE_WRITE, start_time, packed_header.file_size, width * height);
+    } else {
+        destination_descriptor = fopen(destination_file_name, "w");
+        if (destination_descriptor == NULL) {
+            fprintf(stderr, "Failed to create the output image '%s'\n", destination_file_name);
+            goto cleanup;
+        }
+
+        image_io_write_image_headers(destination_descriptor, &image, destination_format, &error_message);
+        if (error_message != NULL) {
+            fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", destination_file_name, error_message);
+            goto cleanup;
+        }
+
+        image_io_write_image_data(destination_descriptor, &image, destination_format, &error_message);
+        if (error_message != NULL) {
+            fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", destination_file_name, error_message);
+            goto cleanup;
+        }
+    }
+
+    timing_finish_image(destination_file_name);
+
+    result = EXIT_SUCCESS;
+
+cleanup:
+    /* The pool finishes its queued tasks before the files are closed */
+    threadpool_destroy(threadpool);
+    threadpool = NULL;
+
+    tiled_close_file(&source_tiles);
+    tiled_close_file(&destination_tiles);
+
+    if (packed != NULL) {
+        bmp_free_buffer(packed, packed_size);
+        packed = NULL;
+    }
+
+    if (packed_index != NULL) {
+        free(packed_index);
+        packed_index = NULL;
+    }
+    bmp_free_image_structure(&image);
+
+    if (source_descriptor != NULL) {
+        fclose(source_descriptor);
+        source_descriptor = NULL;
+    }
+
+    if (destination_descriptor != NULL) {
+        fclose(destination_descriptor);
+        destination_descriptor = NULL;
+    }
+
+    return result;
+}
@@ -0,0 +1,1599 @@
+#ifndef TILED_H
+#define TILED_H
+
+#include "bmp.h"
+#include "timing.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+    A tiled container for large intermediate images. The image is cut into
+    fixed-size tiles of top-down BGRA pixels, and every tile is one contiguous
+    range of the file. Workers can read and write tiles with `pread` and
+    `pwrite` or use them in place through `mmap`, independently of each
+    other:
+
+        header      64 bytes (`tiled_header`)
+        tile index  one `tiled_tile_entry` per tile, row by row
+        tiles       64-byte aligned
+
+    An uncompressed tile holds tile_width * tile_height * 4 bytes. Tile
+    dimensions are multiples of 16 pixels, so every row of a tile starts on
+    a cache line of a mapped file. The tiles on the right and bottom edges
+    are padded to the full size with zeros. The numbers are little-endian
+    like in BMP files.
+
+    Packed tiled images (`TILED_FORMAT_PACKED`) store every tile in the
+    smallest of its encodings (see "Packed Tiles" below), so the tiles have
+    different sizes and only the uncompressed ones can be used in place.
+
+    Through `image_io.h` a tiled image is read into and written from the same
+    `bmp_image` as the other formats. Between `tiled_open_image_headers` and
+    `tiled_read_image_data` the payload holds the header and the tile index.
+    It is sized for the pixel array of the equivalent BMP image as well, so
+    the image can be written as a BMP image afterwards.
+*/
+
+static const char *TILED_Error_Failed_to_Open_File =
+                    "Failed to open the tiled image file",
+                  *TILED_Error_Failed_to_Read_Header =
+                    "Failed to read the tiled image header",
+                  *TILED_Error_Invalid_Signature =
+                    "Invalid tiled image signature",
+                  *TILED_Error_Unsupported_Version =
+                    "Unsupported tiled image version",
+                  *TILED_Error_Invalid_Header =
+                    "Invalid tiled image header",
+                  *TILED_Error_Invalid_Tile_Size =
+                    "Invalid tile size (not a multiple of 16 pixels up to 4096)",
+                  *TILED_Error_Invalid_Tile_Index =
+                    "Invalid tile index",
+                  *TILED_Error_Not_Enough_Memory =
+                    "Not enough memory for the tiled image",
+                  *TILED_Error_Failed_to_Read_Tile =
+                    "Failed to read a tile",
+                  *TILED_Error_Failed_to_Write_Header =
+                    "Failed to write the tiled image header",
+                  *TILED_Error_Failed_to_Write_Tile =
+                    "Failed to write a tile",
+                  *TILED_Error_Failed_to_Map_File =
+                    "Failed to map the tiled image file",
+                  *TILED_Error_Invalid_Packed_Tile =
+                    "Invalid packed tile";
+
+static const uint8_t TILED_Signature[8] = { 'T', 'I', 'L', 'E', 'B', 'G', 'R', 'A' };
+
+#define TILED_VERSION 1
+#define TILED_ALIGNMENT 64
+#define TILED_TILE_SIZE_STEP (TILED_ALIGNMENT / 4)
+#define TILED_MAX_TILE_SIZE 4096
+#define TILED_DEFAULT_TILE_SIZE 256
+
+struct _tiled_header
+{
+    uint8_t  signature[8];
+    uint32_t version;
+    uint32_t channels;          /* channels of the source image (3 or 4), tiles always hold BGRA */
+    uint32_t image_width;
+    uint32_t image_height;
+    uint32_t tile_width;
+    uint32_t tile_height;
+    uint32_t tiles_across;
+    uint32_t tiles_down;
+    uint64_t index_offset;
+    uint64_t data_offset;       /* first byte after the index that may hold a tile */
+    uint64_t file_size;
+} __attribute__((packed));
+
+typedef struct _tiled_header tiled_header;
+
+typedef enum _tiled_format
+{
+    TILED_FORMAT_RAW,       /* every tile is uncompressed           */
+    TILED_FORMAT_PACKED     /* every tile in its smallest encoding  */
+} tiled_format;
+
+typedef enum _tiled_encoding
+{
+    TILED_ENCODING_RAW,     /* tile_width * tile_height BGRA pixels                 */
+    TILED_ENCODING_SOLID,   /* one BGRA pixel repeated over the whole tile          */
+    TILED_ENCODING_PACKED   /* bit-packed differences to the row above in 64-pixel groups */
+} tiled_encoding;
+
+struct _tiled_tile_entry
+{
+    uint64_t offset;
+    uint32_t size;
+    uint32_t encoding;
+} __attribute__((packed));
+
+typedef struct _tiled_tile_entry tiled_tile_entry;
+
+static inline size_t tiled_get_tile_count(const tiled_header *header)
+{
+    return (size_t) header->tiles_across * header->tiles_down;
+}
+
+/* The size of an uncompressed tile in bytes */
+static inline size_t tiled_get_tile_size(const tiled_header *header)
+{
+    return (size_t) header->tile_width * header->tile_height * 4;
+}
+
+static inline size_t _tiled_align(size_t value)
+{
+    return (value + TILED_ALIGNMENT - 1) / TILED_ALIGNMENT * TILED_ALIGNMENT;
+}
+
+static inline bool tiled_is_valid_tile_size(size_t tile_size)
+{
+    return 0 != tile_size && tile_size <= TILED_MAX_TILE_SIZE && 0 == tile_size % TILED_TILE_SIZE_STEP;
+}
+
+/* The default tile size is shrunk for small images, so that their files are
+   not mostly padding. */
+static inline size_t tiled_get_default_tile_size(size_t extent)
+{
+    return UTILS_MIN(TILED_DEFAULT_TILE_SIZE, _tiled_align(extent * 4) / 4);
+}
+
+/* Fills `header` for an image with uncompressed tiles stored in row order
+   right after the index. */
+static void tiled_init_header(
+                tiled_header *header,
+                size_t width,
+                size_t height,
+                size_t channels,
+                size_t tile_width,
+                size_t tile_height,
+                const char **error_message
+            )
+{
+    *error_message = NULL;
+
+    if (!tiled_is_valid_tile_size(tile_width) || !tiled_is_valid_tile_size(tile_height)) {
+        if (NULL != error_message) {
+            *error_message = TILED_Error_Invalid_Tile_Size;
+        }
+
+        goto end;
+    }
+
+    if (0 == width || 0 == height || width > UINT32_MAX || height > UINT32_MAX ||
+        (3 != channels && 4 != channels)) {
+        if (NULL != error_message) {
+            *error_message = TILED_Error_Invalid_Header;
+        }
+
+        goto end;
+    }
+
+    size_t tiles_across = (width + tile_width - 1) / tile_width;
+    size_t tiles_down = (height + tile_height - 1) / tile_height;
+    size_t tile_size = tile_width * tile_height * 4;
+    if (tiles_across > (SIZE_MAX / 2) / (tile_size + sizeof(tiled_tile_entry)) / tiles_down) {
+        if (NULL != error_message) {
+            *error_message = TILED_Error_Invalid_Header;
+        }
+
+        goto end;
+    }
+
+    memset(header, 0, sizeof(*header));
+    memcpy(header->signature, TILED_Signature, sizeof(header->signature));
+    header->version = TILED_VERSION;
+    header->channels = (uint32_t) channels;
+    header->image_width = (uint32_t) width;
+    header->image_height = (uint32_t) height;
+    header->tile_width = (uint32_t) tile_width;
+    header->tile_height = (uint32_t) tile_height;
+    header->tiles_across = (uint32_t) tiles_across;
+    header->tiles_down = (uint32_t) tiles_down;
+    header->index_offset = sizeof(*header);
+    header->data_offset =
+        _tiled_align(sizeof(*header) + tiles_across * tiles_down * sizeof(tiled_tile_entry));
+    header->file_size =
+        header->data_offset + tiles_across * tiles_down * tile_size;
+
+end:
+    return;
+}
+
+static void tiled_init_index(const tiled_header *header, tiled_tile_entry *index)
+{
+    size_t tile_size = tiled_get_tile_size(header);
+    for (size_t i = 0, tile_count = tiled_get_tile_count(header); i < tile_count; ++i) {
+        index[i].offset = header->data_offset + i * tile_size;
+        index[i].size = (uint32_t) tile_size;
+        index[i].encoding = TILED_ENCODING_RAW;
+    }
+}
+
+/* Returns the error for an invalid header or NULL. A `file_size` of zero
+   stands for an unknown size, e.g. of a pipe. */
+static const char *_tiled_validate_header(const tiled_header *header, size_t file_size)
+{
+    if (0 != memcmp(header->signature, TILED_Signature, sizeof(header->signature))) {
+        return TILED_Error_Invalid_Signature;
+    }
+
+    if (TILED_VERSION != header->version) {
+        return TILED_Error_Unsupported_Version;
+    }
+
+    if (!tiled_is_valid_tile_size(header->tile_width) || !tiled_is_valid_tile_size(header->tile_height)) {
+        return TILED_Error_Invalid_Tile_Size;
+    }
+
+    if ((3 != header->channels && 4 != header->channels) ||
+        0 == header->image_width || 0 == header->image_height ||
+        header->tiles_across != (header->image_width - 1) / header->tile_width + 1 ||
+        header->tiles_down != (header->image_height - 1) / header->tile_height + 1 ||
+        header->index_offset < sizeof(*header) ||
+        header->data_offset < header->index_offset ||
+        header->file_size < header->data_offset ||
+        (0 != file_size && header->file_size > file_size) ||
+        tiled_get_tile_count(header) > (header->data_offset - header->index_offset) / sizeof(tiled_tile_entry)) {
+        return TILED_Error_Invalid_Header;
+    }
+
+    return NULL;
+}
+
+#define TILED_GROUP_PIXELS 64
+#define TILED_GROUP_HEADER_SIZE 4
+
+static inline bool _tiled_is_valid_tile_entry(const tiled_header *header, const tiled_tile_entry *entry)
+{
+    size_t tile_size = tiled_get_tile_size(header);
+    switch (entry->encoding) {
+        case TILED_ENCODING_RAW:
+            return tile_size == entry->size;
+        case TILED_ENCODING_SOLID:
+            return 4 == entry->size;
+        case TILED_ENCODING_PACKED:
+            return
+                entry->size >= tile_size / 4 / TILED_GROUP_PIXELS * TILED_GROUP_HEADER_SIZE &&
+                entry->size < tile_size;
+        default:
+            return false;
+    }
+}
+
+/* The tiles have to be aligned, lie between the index and the end of the
+   file and follow each other without overlapping, which lets a stream be
+   read front to back and keeps the writes to different tiles apart. */
+static const char *_tiled_validate_index(const tiled_header *header, const tiled_tile_entry *index)
+{
+    uint64_t end = header->data_offset;
+    for (size_t i = 0, tile_count = tiled_get_tile_count(header); i < tile_count; ++i) {
+        if (0 != index[i].offset % TILED_ALIGNMENT || index[i].offset < end ||
+            !_tiled_is_valid_tile_entry(header, &index[i]) || index[i].offset > header->file_size ||
+            index[i].size > header->file_size - index[i].offset) {
+            return TILED_Error_Invalid_Tile_Index;
+        }
+        end = index[i].offset + index[i].size;
+    }
+
+    return NULL;
+}
+
+/* Returns the rectangle of the image covered by a tile in top-down
+   coordinates. */
+static inline void tiled_get_tile_bounds(
+                       const tiled_header *header,
+                       size_t tile_x,
+                       size_t tile_y,
+                       size_t *x,
+                       size_t *y,
+                       size_t *width,
+                       size_t *height
+                   )
+{
+    *x = tile_x * header->tile_width;
+    *y = tile_y * header->tile_height;
+    *width = UTILS_MIN((size_t) header->tile_width, header->image_width - *x);
+    *height = UTILS_MIN((size_t) header->tile_height, header->image_height - *y);
+}
+
+/* Copies a tile out of the BGRA pixels of the whole image and pads it with
+   zeros. `top_down` is the row order of `pixels`. */
+static void tiled_copy_tile_from_pixels(
+                const tiled_header *header,
+                const uint8_t *pixels,
+                bool top_down,
+                size_t tile_x,
+                size_t tile_y,
+                uint8_t *tile
+            )
+{
+    size_t x, y, width, height;
+    tiled_get_tile_bounds(header, tile_x, tile_y, &x, &y, &width, &height);
+
+    size_t image_height = header->image_height;
+    size_t image_row_size = (size_t) header->image_width * 4;
+    size_t tile_row_size = (size_t) header->tile_width * 4;
+
+    for (size_t row = 0; row < height; ++row) {
+        size_t image_row = top_down ? y + row : image_height - 1 - (y + row);
+        uint8_t *destination = tile + row * tile_row_size;
+        memcpy(destination, pixels + image_row * image_row_size + x * 4, width * 4);
+        memset(destination + width * 4, 0, tile_row_size - width * 4);
+    }
+    memset(tile + height * tile_row_size, 0, (header->tile_height - height) * tile_row_size);
+}
+
+/* Copies the part of a tile inside the image into the BGRA pixels of the
+   whole image. */
+static void tiled_copy_tile_to_pixels(
+                const tiled_header *header,
+                const uint8_t *tile,
+                size_t tile_x,
+                size_t tile_y,
+                uint8_t *pixels,
+                bool top_down
+            )
+{
+    size_t x, y, width, height;
+    tiled_get_tile_bounds(header, tile_x, tile_y, &x, &y, &width, &height);
+
+    size_t image_height = header->image_height;
+    size_t image_row_size = (size_t) header->image_width * 4;
+    size_t tile_row_size = (size_t) header->tile_width * 4;
+
+    for (size_t row = 0; row < height; ++row) {
+        size_t image_row = top_down ? y + row : image_height - 1 - (y + row);
+        memcpy(pixels + image_row * image_row_size + x * 4, tile + row * tile_row_size, width * 4);
+    }
+}
+
+/* Packed Tiles */
+
+/*
+    A packed tile is coded in groups of 64 pixels in row order. Every byte is
+    replaced by its difference to the same byte of the pixel above (of zero
+    in the first row) in zigzag order, so that small changes either way turn
+    into small numbers. The 64 differences of each of the B, G, R and A bytes
+    of a group form a block that is bit-packed with the smallest width of 0,
+    1, 2, 4 or 8 bits holding all of them:
+
+        group       4 widths, then 4 blocks of 8 * width bytes
+
+    Uniform areas and opaque alpha channels pack into empty blocks. A byte of
+    a block with width w holds the values i, i + 8w, i + 16w... of the block,
+    so packing and unpacking are shifts and masks over whole blocks that the
+    compiler vectorizes. There are no tables or entropy coding to decode.
+*/
+
+static inline uint8_t _tiled_zigzag(uint8_t difference)
+{
+    return (uint8_t) ((difference << 1) ^ (uint8_t) ((int8_t) difference >> 7));
+}
+
+static inline uint8_t _tiled_unzigzag(uint8_t value)
+{
+    return (uint8_t) ((value >> 1) ^ (uint8_t) -(value & 1));
+}
+
+static inline size_t _tiled_get_block_width(uint8_t bits)
+{
+    return 0 == bits ? 0 : bits < 2 ? 1 : bits < 4 ? 2 : bits < 16 ? 4 : 8;
+}
+
+static inline void _tiled_pack_block_with_width(const uint8_t *values, uint8_t *output, size_t width)
+{
+    size_t size = TILED_GROUP_PIXELS / 8 * width;
+    for (size_t i = 0; i < size; ++i) {
+        uint8_t packed = 0;
+        for (size_t k = 0; k < 8 / width; ++k) {
+            packed |= (uint8_t) (values[i + k * size] << (k * width));
+        }
+        output[i] = packed;
+    }
+}
+
+static inline void _tiled_unpack_block_with_width(const uint8_t *input, uint8_t *values, size_t width)
+{
+    size_t size = TILED_GROUP_PIXELS / 8 * width;
+    uint8_t mask = (uint8_t) ((1u << width) - 1);
+    for (size_t k = 0; k < 8 / width; ++k) {
+        for (size_t i = 0; i < size; ++i) {
+            values[i + k * size] = (uint8_t) ((input[i] >> (k * width)) & mask);
+        }
+    }
+}
+
+/* Constant widths let every case unroll into whole-block operations */
+static size_t _tiled_pack_block(const uint8_t *values, uint8_t *output, size_t width)
+{
+    switch (width) {
+        case 1: _tiled_pack_block_with_width(values, output, 1); break;
+        case 2: _tiled_pack_block_with_width(values, output, 2); break;
+        case 4: _tiled_pack_block_with_width(values, output, 4); break;
+        case 8: memcpy(output, values, TILED_GROUP_PIXELS);      break;
+        default:                                                 break;
+    }
+
+    return TILED_GROUP_PIXELS / 8 * width;
+}
+
+static void _tiled_unpack_block(const uint8_t *input, uint8_t *values, size_t width)
+{
+    switch (width) {
+        case 1: _tiled_unpack_block_with_width(input, values, 1); break;
+        case 2: _tiled_unpack_block_with_width(input, values, 2); break;
+        case 4: _tiled_unpack_block_with_width(input, values, 4); break;
+        case 8: memcpy(values, input, TILED_GROUP_PIXELS);        break;
+        default: memset(values, 0, TILED_GROUP_PIXELS);           break;
+    }
+}
+
+/* Fills `differences` with the zigzag coded differences between the bytes of
+   the group at `group` and the bytes one row above them. The bytes of the
+   first row are kept. */
+static inline void _tiled_get_group_differences(
+                       const uint8_t *tile,
+                       size_t group,
+                       size_t row_size,
+                       uint8_t differences[TILED_GROUP_PIXELS * 4]
+                   )
+{
+    const uint8_t *bytes = &tile[group];
+    size_t first_row_end = group < row_size ? UTILS_MIN(row_size - group, TILED_GROUP_PIXELS * 4) : 0;
+    for (size_t i = 0; i < first_row_end; ++i) {
+        differences[i] = _tiled_zigzag(bytes[i]);
+    }
+    for (size_t i = first_row_end; i < TILED_GROUP_PIXELS * 4; ++i) {
+        differences[i] = _tiled_zigzag((uint8_t) (bytes[i] - bytes[i - row_size]));
+    }
+}
+
+/* Splits the BGRA bytes of a group into its four channel blocks */
+static inline void _tiled_split_group(
+                       const uint8_t interleaved[TILED_GROUP_PIXELS * 4],
+                       uint8_t values[4][TILED_GROUP_PIXELS]
+                   )
+{
+    for (size_t i = 0; i < TILED_GROUP_PIXELS; ++i) {
+        uint32_t pixel;
+        memcpy(&pixel, &interleaved[i * 4], sizeof(pixel));
+        values[0][i] = (uint8_t) pixel;
+        values[1][i] = (uint8_t) (pixel >> 8);
+        values[2][i] = (uint8_t) (pixel >> 16);
+        values[3][i] = (uint8_t) (pixel >> 24);
+    }
+}
+
+/* Interleaves the channel blocks of a group, decodes the zigzag coded
+   differences and adds them to the bytes one row above. */
+static inline void _tiled_add_group_differences(
+                       const uint8_t values[4][TILED_GROUP_PIXELS],
+                       size_t group,
+                       size_t row_size,
+                       uint8_t *tile
+                   )
+{
+    uint8_t *bytes = &tile[group];
+    for (size_t i = 0; i < TILED_GROUP_PIXELS; ++i) {
+        uint32_t pixel =
+            (uint32_t) values[0][i]         |
+            (uint32_t) values[1][i] << 8    |
+            (uint32_t) values[2][i] << 16   |
+            (uint32_t) values[3][i] << 24;
+        memcpy(&bytes[i * 4], &pixel, sizeof(pixel));
+    }
+
+    size_t first_row_end = group < row_size ? UTILS_MIN(row_size - group, TILED_GROUP_PIXELS * 4) : 0;
+    for (size_t i = 0; i < first_row_end; ++i) {
+        bytes[i] = _tiled_unzigzag(bytes[i]);
+    }
+    for (size_t i = first_row_end; i < TILED_GROUP_PIXELS * 4; ++i) {
+        bytes[i] = (uint8_t) (bytes[i - row_size] + _tiled_unzigzag(bytes[i]));
+    }
+}
+
+/* The largest packed tile: every block of every group with 8 bits */
+static inline size_t tiled_get_packed_tile_bound(const tiled_header *header)
+{
+    size_t tile_size = tiled_get_tile_size(header);
+
+    return tile_size + tile_size / 4 / TILED_GROUP_PIXELS * TILED_GROUP_HEADER_SIZE;
+}
+
+/* Encodes a tile into `output` (`tiled_get_packed_tile_bound` bytes) in the
+   smallest encoding and returns its size. */
+static size_t tiled_encode_tile(
+                  const tiled_header *header,
+                  const uint8_t *tile,
+                  uint8_t *output,
+                  tiled_encoding *encoding
+              )
+{
+    size_t tile_size = tiled_get_tile_size(header);
+    size_t row_size = (size_t) header->tile_width * 4;
+
+    uint32_t first_pixel, differences = 0;
+    memcpy(&first_pixel, tile, sizeof(first_pixel));
+    for (size_t position = 0; position < tile_size; position += 4) {
+        uint32_t pixel;
+        memcpy(&pixel, &tile[position], sizeof(pixel));
+        differences |= pixel ^ first_pixel;
+    }
+    if (0 == differences) {
+        memcpy(output, tile, 4);
+        *encoding = TILED_ENCODING_SOLID;
+
+        return 4;
+    }
+
+    size_t size = 0;
+    for (size_t group = 0; group < tile_size && size < tile_size; group += TILED_GROUP_PIXELS * 4) {
+        uint8_t differences[TILED_GROUP_PIXELS * 4] __attribute__((aligned(64)));
+        _tiled_get_group_differences(tile, group, row_size, differences);
+
+        uint8_t values[4][TILED_GROUP_PIXELS] __attribute__((aligned(64)));
+        _tiled_split_group(differences, values);
+
+        uint8_t bits[4] = { 0, 0, 0, 0 };
+        for (size_t channel = 0; channel < 4; ++channel) {
+            for (size_t i = 0; i < TILED_GROUP_PIXELS; ++i) {
+                bits[channel] |= values[channel][i];
+            }
+        }
+
+        uint8_t *widths = &output[size];
+        size += TILED_GROUP_HEADER_SIZE;
+        for (size_t channel = 0; channel < 4; ++channel) {
+            size_t width = _tiled_get_block_width(bits[channel]);
+            widths[channel] = (uint8_t) width;
+            size += _tiled_pack_block(values[channel], &output[size], width);
+        }
+    }
+
+    if (size >= tile_size) {
+        memcpy(output, tile, tile_size);
+        *encoding = TILED_ENCODING_RAW;
+
+        return tile_size;
+    }
+
+    *encoding = TILED_ENCODING_PACKED;
+
+    return size;
+}
+
+/* Decodes a tile of `size` bytes into `tile` and returns false if the data
+   are not a valid tile. */
+static bool tiled_decode_tile(
+                const tiled_header *header,
+                const uint8_t *data,
+                size_t size,
+                tiled_encoding encoding,
+                uint8_t *tile
+            )
+{
+    size_t tile_size = tiled_get_tile_size(header);
+    size_t row_size = (size_t) header->tile_width * 4;
+
+    if (TILED_ENCODING_RAW == encoding) {
+        if (tile_size != size) {
+            return false;
+        }
+        memcpy(tile, data, tile_size);
+
+        return true;
+    }
+
+    if (TILED_ENCODING_SOLID == encoding) {
+        if (4 != size) {
+            return false;
+        }
+        uint32_t pixel;
+        memcpy(&pixel, data, sizeof(pixel));
+        for (size_t position = 0; position < tile_size; position += 4) {
+            memcpy(&tile[position], &pixel, sizeof(pixel));
+        }
+
+        return true;
+    }
+
+    if (TILED_ENCODING_PACKED != encoding) {
+        return false;
+    }
+
+    size_t offset = 0;
+    for (size_t group = 0; group < tile_size; group += TILED_GROUP_PIXELS * 4) {
+        if (size - offset < TILED_GROUP_HEADER_SIZE) {
+            return false;
+        }
+        const uint8_t *widths = &data[offset];
+        offset += TILED_GROUP_HEADER_SIZE;
+
+        uint8_t values[4][TILED_GROUP_PIXELS] __attribute__((aligned(64)));
+        for (size_t channel = 0; channel < 4; ++channel) {
+            size_t width = widths[channel];
+            size_t block_size = TILED_GROUP_PIXELS / 8 * width;
+            if ((0 != width && 1 != width && 2 != width && 4 != width && 8 != width) ||
+                size - offset < block_size) {
+                return false;
+            }
+            _tiled_unpack_block(&data[offset], values[channel], width);
+            offset += block_size;
+        }
+
+        _tiled_add_group_differences(values, group, row_size, tile);
+    }
+
+    return offset == size;
+}
+
+/* Random Access */
+
+typedef struct _tiled_file
+{
+    int descriptor;
+    bool writable;
+    tiled_header header;
+    tiled_tile_entry *index;
+    uint8_t *map;               /* the whole file after `tiled_map_file` */
+} tiled_file;
+
+static inline void tiled_init_file_structure(tiled_file *file)
+{
+    if (NULL != file) {
+        memset(file, 0, sizeof(*file));
+        file->descriptor = -1;
+    }
+}
+
+static void tiled_close_file(tiled_file *file)
+{
+    if (NULL == file) {
+        return;
+    }
+
+    if (NULL != file->map) {
+        munmap(file->map, file->header.file_size);
+        file->map = NULL;
+    }
+
+    if (NULL != file->index) {
+        free(file->index);
+        file->index = NULL;
+    }
+
+    if (file->descriptor >= 0) {
+        close(file->descriptor);
+        file->descriptor = -1;
+    }
+}
+
+static bool _tiled_read_at(int descriptor, void *buffer, size_t size, size_t offset)
+{
+    uint8_t *position = (uint8_t *) buffer;
+    while (size > 0) {
+        ssize_t result = pread(descriptor, position, size, (off_t) offset);
+        if (result < 0 && EINTR == errno) {
+            continue;
+        }
+        if (result <= 0) {
+            return false;
+        }
+        position += result;
+        offset += (size_t) result;
+        size -= (size_t) result;
+    }
+
+    return true;
+}
+
+static bool _tiled_write_at(int descriptor, const void *buffer, size_t size, size_t offset)
+{
+    const uint8_t *position = (const uint8_t *) buffer;
+    while (size > 0) {
+        ssize_t result = pwrite(descriptor, position, size, (off_t) offset);
+        if (result < 0 && EINTR == errno) {
+            continue;
+        }
+        if (result <= 0) {
+            return false;
+        }
+        position += result;
+        offset += (size_t) result;
+        size -= (size_t) result;
+    }
+
+    return true;
+}
+
+/* Creates a tiled image file with zeroed tiles. The tiles are written
+   afterwards with `tiled_write_tile` or through the map, by any number of
+   threads. */
+static void tiled_create_file(
+                tiled_file *file,
+                const char *file_name,
+                size_t width,
+                size_t height,
+                size_t channels,
+                size_t tile_width,
+                size_t tile_height,
+                const char **error_message
+            )
+{
+    *error_message = NULL;
+
+    tiled_init_header(&file->header, width, height, channels, tile_width, tile_height, error_message);
+    if (NULL != *error_message) {
+        goto end;
+    }
+
+    size_t index_size = tiled_get_tile_count(&file->header) * sizeof(tiled_tile_entry);
+    file->index = (tiled_tile_entry *) malloc(index_size);
+    if (NULL == file->index) {
+        if (NULL != error_message) {
+            *error_message = TILED_Error_Not_Enough_Memory;
+        }
+
+        goto cleanup;
+    }
+    tiled_init_index(&file->header, file->index);
+
+    file->descriptor = open(file_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (file->descriptor < 0) {
+        if (NULL != error_message) {
+            *error_message = TILED_Error_Failed_to_Open_File;
+        }
+
+        goto cleanup;
+    }
+    file->writable = true;
+
+    /* The tiles stay holes until they are written */
+    if (!_tiled_write_at(file->descriptor, &file->header, sizeof(file->header), 0) ||
+        !_tiled_write_at(file->descriptor, file->index, index_size, file->header.index_offset) ||
+        0 != ftruncate(file->descriptor, (off_t) file->header.file_size)) {
+        if (NULL != error_message) {
+            *error_message = TILED_Error_Failed_to_Write_Header;
+        }
+
+        goto cleanup;
+    }
+
+end:
+    return;
+
+cleanup:
+    tiled_close_file(file);
+}
+
+static void tiled_open_file(
+                tiled_file *file,
+                const char *file_name,
+                bool writable,
+                const char **error_message
+            )
+{
+    *error_message = NULL;
+
+    file->descriptor = open(file_name, writable ? O_RDWR : O_RDONLY);
+    if (file->descriptor < 0) {
+        if (NULL != error_message) {
+            *error_message = TILED_Error_Failed_to_Open_File;
+        }
+
+        goto end;
+    }
+    file->writable = writable;
+
+    struct stat status;
+    if (0 != fstat(file->descriptor, &status) ||
+        !_tiled_read_at(file->descriptor, &file->header, sizeof(file->header), 0)) {
+        if (NULL != error_message) {
+            *error_message = TILED_Error_Failed_to_Read_Header;
+        }
+
+        goto cleanup;
+    }
+
+    const char *validation_error = _tiled_validate_header(&file->header, (size_t) status.st_size);
+    if (NULL != validation_error) {
+        if (NULL != error_message) {
+            *error_message = validation_error;
+        }
+
+        goto cleanup;
+    }
+
+    size_t index_size = tiled_get_tile_count(&file->header) * sizeof(tiled_tile_entry);
+    file->index = (tiled_tile_entry *) malloc(index_size);
+    if (NULL == file->index) {
+        if (NULL != error_message) {
+            *error_message = TILED_Error_Not_Enough_Memory;
+        }
+
+        goto cleanup;
+    }
+
+    if (!_tiled_read_at(file->descriptor, file->index, index_size, file->header.index_offset)) {
+        if (NULL != error_message) {
+            *error_message = TILED_Error_Failed_to_Read_Header;
+        }
+
+        goto cleanup;
+    }
+
+    validation_error = _tiled_validate_index(&file->header, file->index);
+    if (NULL != validation_error) {
+        if (NULL != error_message) {
+            *error_message = validation_error;
+        }
+
+        goto cleanup;
+    }
+
+end:
+    return;
+
+cleanup:
+    tiled_close_file(file);
+}
+
+/* Reads and decodes a tile into `tile` (`tiled_get_tile_size` bytes). Safe
+   to call from several threads on the same file. */
+static void tiled_read_tile(
+                const tiled_file *file,
+                size_t tile_x,
+                size_t tile_y,
+                uint8_t *tile,
+                const char **error_message
+            )
+{
+    *error_message = NULL;
+
+    if (tile_x >= file->header.tiles_across || tile_y >= file->header.tiles_down) {
+        if (NULL != error_message) {
+            *error_message = TILED_Error_Invalid_Tile_Index;
+        }
+
+        return;
+    }
+
+    const tiled_tile_entry *entry = &file->index[tile_y * file->header.tiles_across + tile_x];
+    if (TILED_ENCODING_RAW == entry->encoding) {
+        if (!_tiled_read_at(file->descriptor, tile, entry->size, entry->offset)) {
+            if (NULL != error_message) {
+                *error_message = TILED_Error_Failed_to_Read_Tile;
+            }
+        }
+
+        return;
+    }
+
+    uint8_t *data = (uint8_t *) malloc(entry->size);
+    if (NULL == data) {
+        if (NULL != error_message) {
+            *error_message = TILED_Error_Not_Enough_Memory;
+        }
+
+        return;
+    }
+
+    if (!_tiled_read_at(file->descriptor, data, entry->size, entry->offset)) {
+        if (NULL != error_message) {
+            *error_message = TILED_Error_Failed_to_Read_Tile;
+        }
+    } else if (!tiled_decode_tile(&file->header, data, entry->size, (tiled_encoding) entry->encoding, tile)) {
+        if (NULL != error_message) {
+            *error_message = TILED_Error_Invalid_Packed_Tile;
+        }
+    }
+
+    free(data);
+}
+
+/* Writes an uncompressed tile from `tile`. Safe to call from several
+   threads on the same file, as long as they write different tiles. Packed
+   tiles can not be replaced in place. */
+static void tiled_write_tile(
+                const tiled_file *file,
+                size_t tile_x,
+                size_t tile_y,
+                const uint8_t *tile,
+                const char **error_message
+            )
+{
+    *error_message = NULL;
+
+    if (tile_x >= file->header.tiles_across || tile_y >= file->header.tiles_down) {
+        if (NULL != error_message) {
+            *error_message = TILED_Error_Invalid_Tile_Index;
+        }
+
+        return;
+    }
+
+    const tiled_tile_entry *entry = &file->index[tile_y * file->header.tiles_across + tile_x];
+    if (!file->writable || TILED_ENCODING_RAW != entry->encoding ||
+        !_tiled_write_at(file->descriptor, tile, entry->size, entry->offset)) {
+        if (NULL != error_message) {
+            *error_message = TILED_Error_Failed_to_Write_Tile;
+        }
+    }
+}
+
+/* Maps the whole file, shared and writable if it was opened for writing */
+static void tiled_map_file(tiled_file *file, const char **error_message)
+{
+    *error_message = NULL;
+
+    if (NULL != file->map) {
+        return;
+    }
+
+    void *map =
+        mmap(
+            NULL,
+            file->header.file_size,
+            file->writable ? PROT_READ | PROT_WRITE : PROT_READ,
+            MAP_SHARED,
+            file->descriptor,
+            0
+        );
+    if (MAP_FAILED == map) {
+        if (NULL != error_message) {
+            *error_message = TILED_Error_Failed_to_Map_File;
+        }
+
+        return;
+    }
+
+    file->map = (uint8_t *) map;
+}
+
+/* Returns the pixels of an uncompressed tile in the map of the file or NULL
+   for a packed one */
+static inline uint8_t *tiled_get_tile_pixels(const tiled_file *file, size_t tile_x, size_t tile_y)
+{
+    const tiled_tile_entry *entry = &file->index[tile_y * file->header.tiles_across + tile_x];
+
+    return TILED_ENCODING_RAW == entry->encoding ? file->map + entry->offset : NULL;
+}
+
+/* Copies a row of tiles of a mapped file into the BGRA pixels of the whole
+   image. Uncompressed tiles are copied straight out of the map, the others
+   are decoded into `tile` first. Returns false for an invalid packed tile. */
+static bool tiled_read_mapped_tile_row(
+                const tiled_file *file,
+                size_t tile_y,
+                uint8_t *tile,
+                uint8_t *pixels,
+                bool top_down
+            )
+{
+    const tiled_header *header = &file->header;
+    for (size_t tile_x = 0; tile_x < header->tiles_across; ++tile_x) {
+        const tiled_tile_entry *entry = &file->index[tile_y * header->tiles_across + tile_x];
+        const uint8_t *data = file->map + entry->offset;
+        if (TILED_ENCODING_RAW != entry->encoding) {
+            if (!tiled_decode_tile(header, data, entry->size, (tiled_encoding) entry->encoding, tile)) {
+                return false;
+            }
+            data = tile;
+        }
+
+        tiled_copy_tile_to_pixels(header, data, tile_x, tile_y, pixels, top_down);
+    }
+
+    return true;
+}
+
+/* Returns the distance between the packed tiles in a buffer filled by
+   `tiled_pack_tile_row` */
+static inline size_t tiled_get_packed_tile_stride(const tiled_header *header)
+{
+    return _tiled_align(tiled_get_packed_tile_bound(header));
+}
+
+/* Packs a row of tiles out of the BGRA pixels of the whole image into their
+   slots of `packed` and fills their index entries with the sizes and the
+   encodings. Rows can be packed by different threads. */
+static void tiled_pack_tile_row(
+                const tiled_header *header,
+                const uint8_t *pixels,
+                bool top_down,
+                size_t tile_y,
+                uint8_t *tile,
+                uint8_t *packed,
+                tiled_tile_entry *index
+            )
+{
+    size_t stride = tiled_get_packed_tile_stride(header);
+    for (size_t tile_x = 0; tile_x < header->tiles_across; ++tile_x) {
+        size_t i = tile_y * header->tiles_across + tile_x;
+
+        tiled_copy_tile_from_pixels(header, pixels, top_down, tile_x, tile_y, tile);
+
+        tiled_encoding encoding;
+        index[i].size = (uint32_t) tiled_encode_tile(header, tile, packed + i * stride, &encoding);
+        index[i].encoding = encoding;
+    }
+}
+
+/* Writes the header, the index and the tiles of a packed image from the
+   slots filled by `tiled_pack_tile_row`. The tiles are moved next to each
+   other, the index is rewritten with their offsets in the file. */
+static void tiled_write_packed_tiles(
+                FILE *file_descriptor,
+                tiled_header *header,
+                tiled_tile_entry *index,
+                const uint8_t *packed,
+                const char **error_message
+            )
+{
+    static const uint8_t Padding[TILED_ALIGNMENT] = { 0 };
+
+    *error_message = NULL;
+
+    size_t tile_count = tiled_get_tile_count(header);
+    size_t offset = header->data_offset;
+    for (size_t i = 0; i < tile_count; ++i) {
+        index[i].offset = offset;
+        offset += _tiled_align(index[i].size);
+    }
+    header->file_size = offset;
+
+    size_t index_size = tile_count * sizeof(*index);
+    if (!fwrite(header, sizeof(*header), 1, file_descriptor) ||
+        !fwrite(index, index_size, 1, file_descriptor) ||
+        (header->data_offset > header->index_offset + index_size &&
+            !fwrite(Padding, header->data_offset - header->index_offset - index_size, 1, file_descriptor))) {
+        if (NULL != error_message) {
+            *error_message = TILED_Error_Failed_to_Write_Header;
+        }
+
+        return;
+    }
+
+    size_t stride = tiled_get_packed_tile_stride(header);
+    for (size_t i = 0; i < tile_count; ++i) {
+        size_t padding = _tiled_align(index[i].size) - index[i].size;
+        if (!fwrite(packed + i * stride, index[i].size, 1, file_descriptor) ||
+            (0 != padding && !fwrite(Padding, padding, 1, file_descriptor))) {
+            if (NULL != error_message) {
+                *error_message = BMP_Error_Failed_to_Write_Image_Data;
+            }
+
+            return;
+        }
+    }
+}
+
+/* Sets up `image` as an uncompressed BMP image with the size and channels
+   of a tiled image and allocates its pixels. The payload is allocated for
+   the pixel array of the BMP image unless it is already there. */
+static void tiled_allocate_image(
+                bmp_image *image,
+                const tiled_header *header,
+                bool top_down,
+                const char **error_message
+            )
+{
+    *error_message = NULL;
+
+    size_t width = header->image_width;
+    size_t height = header->image_height;
+    size_t channels = header->channels;
+    size_t padding = (channels * 8 * width + 31) / 32 * 4 - width * channels;
+
+    /* The BMP headers have to be able to describe the image */
+    size_t total_header_size =
+        sizeof(image->file_header) + sizeof(image->dib_header);
+    if (width * channels + padding > (UINT32_MAX - total_header_size) / height) {
+        if (NULL != error_message) {
+            *error_message = BMP_Error_Invalid_Size_Information;
+        }
+
+        goto end;
+    }
+
+    bmp_init_plain_headers(image, width, height, top_down, channels);
+
+    if (NULL == image->payload) {
+        image->payload_size = image->dib_header.image_size;
+        image->payload = bmp_allocate_buffer(image->payload_size);
+    }
+    if (NULL != image->payload) {
+        image->pixels = bmp_allocate_aligned_pixels(height * (width * 4 + padding), &image->aligned_image_size);
+    }
+    if (NULL == image->payload || NULL == image->pixels) {
+        if (NULL != error_message) {
+            *error_message = BMP_Error_Not_Enough_Memory_to_Read;
+        }
+
+        goto end;
+    }
+
+    image->raw_pixels = image->payload;
+    image->absolute_image_width = width;
+    image->absolute_image_height = height;
+    image->pixel_row_padding = padding;
+    image->image_size = image->dib_header.image_size;
+
+    for (size_t linear_position = height * width * 4; linear_position < image->aligned_image_size; ++linear_position) {
+        image->pixels[linear_position] = 0;
+    }
+
+end:
+    return;
+}
+
+/* Streams */
+
+static void tiled_open_image_headers(
+                FILE *file_descriptor,
+                bmp_image *image,
+                tiled_format *format,
+                const char **error_message
+            )
+{
+    *error_message = NULL;
+
+    if (NULL == image) {
+        if (NULL != error_message) {
+            *error_message = BMP_Error_Invalid_Image_Structure;
+        }
+
+        goto end;
+    }
+
+    if (NULL == file_descriptor) {
+        if (NULL != error_message) {
+            *error_message = BMP_Error_Invalid_File_Descriptor;
+        }
+
+        goto end;
+    }
+
+    uint64_t start_time = timing_start();
+
+    tiled_header header;
+    if (!fread(&header, sizeof(header), 1, file_descriptor)) {
+        if (NULL != error_message) {
+            *error_message = TILED_Error_Failed_to_Read_Header;
+        }
+
+        goto end;
+    }
+
+    const char *validation_error = _tiled_validate_header(&header, 0);
+    if (NULL != validation_error) {
+        if (NULL != error_message) {
+            *error_message = validation_error;
+        }
+
+        goto end;
+    }
+
+    size_t width = header.image_width;
+    size_t height = header.image_height;
+    size_t channels = header.channels;
+    size_t padding = (channels * 8 * width + 31) / 32 * 4 - width * channels;
+    size_t total_header_size =
+        sizeof(image->file_header) + sizeof(image->dib_header);
+    if (width * channels + padding > (UINT32_MAX - total_header_size) / height ||
+        header.data_offset > UINT32_MAX) {
+        if (NULL != error_message) {
+            *error_message = BMP_Error_Invalid_Size_Information;
+        }
+
+        goto end;
+    }
+
+    bmp_init_plain_headers(image, width, height, true, channels);
+
+    image->payload_size = UTILS_MAX((size_t) image->dib_header.image_size, (size_t) header.data_offset);
+    image->payload = bmp_allocate_buffer(image->payload_size);
+    if (NULL == image->payload) {
+        if (NULL != error_message) {
+            *error_message = BMP_Error_Not_Enough_Memory_to_Read;
+        }
+
+        goto end;
+    }
+
+    memcpy(image->payload, &header, sizeof(header));
+    if (!fread(image->payload + sizeof(header), header.data_offset - sizeof(header), 1, file_descriptor)) {
+        if (NULL != error_message) {
+            *error_message = TILED_Error_Failed_to_Read_Header;
+        }
+
+        goto cleanup;
+    }
+
+    const tiled_tile_entry *index = (const tiled_tile_entry *) (image->payload + header.index_offset);
+    validation_error = _tiled_validate_index(&header, index);
+    if (NULL != validation_error) {
+        if (NULL != error_message) {
+            *error_message = validation_error;
+        }
+
+        goto cleanup;
+    }
+
+    *format = TILED_FORMAT_RAW;
+    for (size_t i = 0, tile_count = tiled_get_tile_count(&header); i < tile_count; ++i) {
+        if (TILED_ENCODING_RAW != index[i].encoding) {
+            *format = TILED_FORMAT_PACKED;
+            break;
+        }
+    }
+
+    timing_stop(TIMING_STAGE_HEADERS, start_time, header.data_offset, 0);
+
+end:
+    return;
+
+cleanup:
+    bmp_free_buffer(image->payload, image->payload_size);
+    image->payload = NULL;
+}
+
+/*
+    Reads the tiles of an image opened with `tiled_open_image_headers` front
+    to back, decodes the packed ones and copies them into BGRA `pixels` in
+    the requested orientation. Tiled images are stored top-down.
+*/
+static void tiled_read_image_data_oriented(
+                FILE *file_descriptor,
+                bmp_image *image,
+                bmp_orientation orientation,
+                const char **error_message
+            )
+{
+    *error_message = NULL;
+
+    uint8_t *tile = NULL;
+    uint8_t *data = NULL;
+
+    if (NULL == image || NULL == image->payload) {
+        if (NULL != error_message) {
+            *error_message = BMP_Error_Invalid_Image_Structure;
+        }
+
+        goto end;
+    }
+
+    if (NULL == file_descriptor) {
+        if (NULL != error_message) {
+            *error_message = BMP_Error_Invalid_File_Descriptor;
+        }
+
+        goto end;
+    }
+
+    tiled_header header;
+    memcpy(&header, image->payload, sizeof(header));
+    const tiled_tile_entry *index = (const tiled_tile_entry *) (image->payload + header.index_offset);
+
+    bool top_down = BMP_ORIENTATION_BOTTOM_UP != orientation;
+    tiled_allocate_image(image, &header, top_down, error_message);
+    if (NULL != *error_message) {
+        goto cleanup;
+    }
+
+    /* Packed tiles are smaller than uncompressed ones */
+    size_t tile_size = tiled_get_tile_size(&header);
+    tile = bmp_allocate_buffer(tile_size);
+    data = bmp_allocate_buffer(tile_size);
+    if (NULL == tile || NULL == data) {
+        if (NULL != error_message) {
+            *error_message = BMP_Error_Not_Enough_Memory_to_Read;
+        }
+
+        goto cleanup;
+    }
+
+    size_t position = header.data_offset;
+    for (size_t tile_y = 0, i = 0; tile_y < header.tiles_down; ++tile_y) {
+        for (size_t tile_x = 0; tile_x < header.tiles_across; ++tile_x, ++i) {
+            size_t x, y, width, height;
+            tiled_get_tile_bounds(&header, tile_x, tile_y, &x, &y, &width, &height);
+
+            uint64_t start_time = timing_start();
+
+            /* Skip the gap before the tile */
+            while (position < index[i].offset) {
+                size_t skipped = UTILS_MIN(tile_size, (size_t) index[i].offset - position);
+                if (!fread(data, skipped, 1, file_descriptor)) {
+                    break;
+                }
+                position += skipped;
+            }
+
+            bool raw = TILED_ENCODING_RAW == index[i].encoding;
+            if (position != index[i].offset || !fread(raw ? tile : data, index[i].size, 1, file_descriptor)) {
+                if (NULL != error_message) {
+                    *error_message = BMP_Error_Failed_to_Read_Image_Data;
+                }
+
+                goto cleanup;
+            }
+            position += index[i].size;
+
+            timing_stop(TIMING_STAGE_READ, start_time, index[i].size, width * height);
+
+            start_time = timing_start();
+
+            if (!raw && !tiled_decode_tile(&header, data, index[i].size, (tiled_encoding) index[i].encoding, tile)) {
+                if (NULL != error_message) {
+                    *error_message = TILED_Error_Invalid_Packed_Tile;
+                }
+
+                goto cleanup;
+            }
+
+            tiled_copy_tile_to_pixels(&header, tile, tile_x, tile_y, image->pixels, top_down);
+
+            timing_stop(TIMING_STAGE_UNPACK, start_time, tile_size, width * height);
+        }
+    }
+
+    bmp_free_buffer(tile, tile_size);
+    tile = NULL;
+    bmp_free_buffer(data, tile_size);
+    data = NULL;
+
+end:
+    return;
+
+cleanup:
+    if (NULL != tile) {
+        bmp_free_buffer(tile, tiled_get_tile_size(&header));
+        tile = NULL;
+    }
+    if (NULL != data) {
+        bmp_free_buffer(data, tiled_get_tile_size(&header));
+        data = NULL;
+    }
+    if (NULL != image->pixels) {
+        bmp_free_buffer(image->pixels, image->aligned_image_size);
+        image->pixels = NULL;
+    }
+}
+
+static inline void tiled_read_image_data(
+                       FILE *file_descriptor,
+                       bmp_image *image,
+                       const char **error_message
+                   )
+{
+    tiled_read_image_data_oriented(file_descriptor, image, BMP_ORIENTATION_AS_STORED, error_message);
+}
+
+static inline void _tiled_init_image_header(const bmp_image *image, tiled_header *header, const char **error_message)
+{
+    tiled_init_header(
+        header,
+        image->absolute_image_width,
+        image->absolute_image_height,
+        image->channels,
+        tiled_get_default_tile_size(image->absolute_image_width),
+        tiled_get_default_tile_size(image->absolute_image_height),
+        error_message
+    );
+}
+
+/* Writes the header and the index of an image with the default tile size.
+   The index of a packed image depends on the sizes of its tiles, so it is
+   written with them by `tiled_write_image_data`. */
+static void tiled_write_image_headers(
+                FILE *file_descriptor,
+                bmp_image *image,
+                tiled_format format,
+                const char **error_message
+            )
+{
+    *error_message = NULL;
+
+    tiled_tile_entry *index = NULL;
+
+    if (NULL == image) {
+        if (NULL != error_message) {
+            *error_message = BMP_Error_Invalid_Image_Structure;
+        }
+
+        goto end;
+    }
+
+    if (NULL == file_descriptor) {
+        if (NULL != error_message) {
+            *error_message = BMP_Error_Invalid_File_Descriptor;
+        }
+
+        goto end;
+    }
+
+    uint64_t start_time = timing_start();
+
+    tiled_header header;
+    _tiled_init_image_header(image, &header, error_message);
+    if (NULL != *error_message || TILED_FORMAT_PACKED == format) {
+        goto end;
+    }
+
+    /* The index is followed by zeros up to the first tile */
+    size_t index_size = header.data_offset - header.index_offset;
+    index = (tiled_tile_entry *) calloc(1, index_size);
+    if (NULL == index) {
+        if (NULL != error_message) {
+            *error_message = TILED_Error_Not_Enough_Memory;
+        }
+
+        goto end;
+    }
+    tiled_init_index(&header, index);
+
+    if (!fwrite(&header, sizeof(header), 1, file_descriptor) ||
+        !fwrite(index, index_size, 1, file_descriptor)) {
+        if (NULL != error_message) {
+            *error_message = TILED_Error_Failed_to_Write_Header;
+        }
+
+        goto end;
+    }
+
+    timing_stop(TIMING_STAGE_WRITE, start_time, header.data_offset, 0);
+
+end:
+    if (NULL != index) {
+        free(index);
+        index = NULL;
+    }
+}
+
+/* Cuts the BGRA `pixels` into tiles and writes them in row order, whatever
+   the orientation of `pixels` is. Packed images are packed in memory
+   first and written with their header and index. */
+static void tiled_write_image_data(
+                FILE *file_descriptor,
+                bmp_image *image,
+                tiled_format format,
+                const char **error_message
+            )
+{
+    *error_message = NULL;
+
+    uint8_t *tile = NULL;
+    size_t tile_size = 0;
+    uint8_t *packed = NULL;
+    size_t packed_size = 0;
+    tiled_tile_entry *index = NULL;
+
+    if (NULL == image) {
+        if (NULL != error_message) {
+            *error_message = BMP_Error_Invalid_Image_Structure;
+        }
+
+        goto end;
+    }
+
+    if (NULL == file_descriptor) {
+        if (NULL != error_message) {
+            *error_message = BMP_Error_Invalid_File_Descriptor;
+        }
+
+        goto end;
+    }
+
+    tiled_header header;
+    _tiled_init_image_header(image, &header, error_message);
+    if (NULL != *error_message) {
+        goto end;
+    }
+
+    tile_size = tiled_get_tile_size(&header);
+    tile = bmp_allocate_buffer(tile_size);
+    if (NULL == tile) {
+        if (NULL != error_message) {
+            *error_message = TILED_Error_Not_Enough_Memory;
+        }
+
+        goto end;
+    }
+
+    bool top_down = bmp_is_top_down(image);
+    if (TILED_FORMAT_PACKED == format) {
+        packed_size = tiled_get_tile_count(&header) * tiled_get_packed_tile_stride(&header);
+        packed = bmp_allocate_buffer(packed_size);
+        index = (tiled_tile_entry *) malloc(tiled_get_tile_count(&header) * sizeof(*index));
+        if (NULL == packed || NULL == index) {
+            if (NULL != error_message) {
+                *error_message = TILED_Error_Not_Enough_Memory;
+            }
+
+            goto end;
+        }
+
+        uint64_t start_time = timing_start();
+
+        for (size_t tile_y = 0; tile_y < header.tiles_down; ++tile_y) {
+            tiled_pack_tile_row(&header, image->pixels, top_down, tile_y, tile, packed, index);
+        }
+
+        size_t pixel_count = (size_t) header.image_width * header.image_height;
+        timing_stop(TIMING_STAGE_PACK, start_time, pixel_count * 4, pixel_count);
+
+        start_time = timing_start();
+
+        tiled_write_packed_tiles(file_descriptor, &header, index, packed, error_message);
+        if (NULL != *error_message) {
+            goto end;
+        }
+
+        if (timing_is_enabled()) {
+            fflush(file_descriptor);
+        }
+
+        timing_stop(TIMING_STAGE_WRITE, start_time, header.file_size, pixel_count);
+
+        goto end;
+    }
+
+    for (size_t tile_y = 0; tile_y < header.tiles_down; ++tile_y) {
+        for (size_t tile_x = 0; tile_x < header.tiles_across; ++tile_x) {
+            size_t x, y, width, height;
+            tiled_get_tile_bounds(&header, tile_x, tile_y, &x, &y, &width, &height);
+
+            uint64_t start_time = timing_start();
+
+            tiled_copy_tile_from_pixels(&header, image->pixels, top_down, tile_x, tile_y, tile);
+
+            timing_stop(TIMING_STAGE_PACK, start_time, tile_size, width * height);
+
+            start_time = timing_start();
+
+            if (!fwrite(tile, tile_size, 1, file_descriptor)) {
+                if (NULL != error_message) {
+                    *error_message = BMP_Error_Failed_to_Write_Image_Data;
+                }
+
+                goto end;
+            }
+
+            timing_stop(TIMING_STAGE_WRITE, start_time, tile_size, width * height);
+        }
+    }
+
+    /* Include the time to hand the buffered data over to the kernel */
+    if (timing_is_enabled()) {
+        uint64_t start_time = timing_start();
+        fflush(file_descriptor);
+        timing_stop(TIMING_STAGE_WRITE, start_time, 0, 0);
+    }
+
+end:
+    if (NULL != tile) {
+        bmp_free_buffer(tile, tile_size);
+        tile = NULL;
+    }
+    if (NULL != packed) {
+        bmp_free_buffer(packed, packed_size);
+        packed = NULL;
+    }
+    if (NULL != index) {
+        free(index);
+        index = NULL;
+    }
+}
+
+#endif // TILED_H
@@ -0,0 +1,231 @@
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+    Per-stage instrumentation of the image tools. It is switched on with the
+    environment variable BMP_TIMING:
+
+        BMP_TIMING=text     a human-readable summary per image on stderr
+        BMP_TIMING=json     one JSON line per image on stderr
+
+    When several images are processed by one run, an aggregate over all of
+    them is printed at exit. While the variable is not set, every probe costs
+    a single predictable branch.
+
+    The stages of the current image are counted per thread, so threads that
+    decode or encode different images at the same time do not mix their
+    counters. A tool that passes an image from thread to thread moves its
+    counters along with timing_take_image and timing_add_image, and the
+    thread that finishes the image reports it.
+*/
+
+typedef enum _timing_stage
+{
+    TIMING_STAGE_HEADERS,   /* bmp_open_image_headers                         */
+    TIMING_STAGE_READ,      /* fread of the payload                           */
+    TIMING_STAGE_UNPACK,    /* copy of the rows into `pixels` (24 -> 32 bits) */
+    TIMING_STAGE_KERNEL,    /* the processing loop of the tool                */
+    TIMING_STAGE_PACK,      /* copy of `pixels` back into the payload         */
+    TIMING_STAGE_WRITE,     /* fwrite of the headers and the payload          */
+    TIMING_STAGE_COUNT
+} timing_stage_t;
+
+static const char *Timing_Stage_Names[TIMING_STAGE_COUNT] = {
+    "headers", "read", "unpack", "kernel", "pack", "write"
+};
+
+typedef enum _timing_format
+{
+    TIMING_FORMAT_UNKNOWN,
+    TIMING_FORMAT_DISABLED,
+    TIMING_FORMAT_TEXT,
+    TIMING_FORMAT_JSON
+} timing_format_t;
+
+typedef struct _timing_counter
+{
+    uint64_t nanoseconds;
+    uint64_t bytes;
+    uint64_t pixels;
+} timing_counter_t;
+
+typedef struct _timing_report
+{
+    timing_format_t format;
+    timing_counter_t total[TIMING_STAGE_COUNT];
+    size_t image_count;
+} timing_report_t;
+
+static timing_report_t Timing_Report;
+static __thread timing_counter_t Timing_Image[TIMING_STAGE_COUNT];
+
+static inline uint64_t timing_get_time_ns(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+
+    return (uint64_t) time.tv_sec * 1000000000ull + (uint64_t) time.tv_nsec;
+}
+
+static void timing_print_summary(void);
+
+static inline bool timing_is_enabled(void)
+{
+    timing_format_t current_format = __atomic_load_n(&Timing_Report.format, __ATOMIC_ACQUIRE);
+    if (__builtin_expect(TIMING_FORMAT_UNKNOWN == current_format, 0)) {
+        const char *format = getenv("BMP_TIMING");
+        if (NULL == format || '\0' == format[0] || 0 == strcmp(format, "0")) {
+            current_format = TIMING_FORMAT_DISABLED;
+        } else {
+            current_format = 0 == strcmp(format, "json") ? TIMING_FORMAT_JSON : TIMING_FORMAT_TEXT;
+        }
+
+        /* Only the first thread to get here registers the summary */
+        timing_format_t unknown = TIMING_FORMAT_UNKNOWN;
+        if (__atomic_compare_exchange_n(
+                &Timing_Report.format, &unknown, current_format,
+                false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE
+            ) && TIMING_FORMAT_DISABLED != current_format) {
+            atexit(timing_print_summary);
+        }
+    }
+
+    return TIMING_FORMAT_DISABLED != current_format;
+}
+
+/* Returns the start time of a stage, or 0 when the timing is off. */
+static inline uint64_t timing_start(void)
+{
+    return timing_is_enabled() ? timing_get_time_ns() : 0;
+}
+
+static inline void timing_stop(timing_stage_t stage, uint64_t start_time, size_t bytes, size_t pixels)
+{
+    if (timing_is_enabled()) {
+        timing_counter_t *counter = &Timing_Image[stage];
+        counter->nanoseconds += timing_get_time_ns() - start_time;
+        counter->bytes += bytes;
+        counter->pixels += pixels;
+    }
+}
+
+static void _timing_print(const char *name, const timing_counter_t *counters, size_t image_count)
+{
+    uint64_t total_nanoseconds = 0;
+    for (size_t stage = 0; stage < TIMING_STAGE_COUNT; ++stage) {
+        total_nanoseconds += counters[stage].nanoseconds;
+    }
+
+    if (TIMING_FORMAT_JSON == Timing_Report.format) {
+        fputs("{", stderr);
+        if (NULL != name) {
+            fputs("\"image\":\"", stderr);
+            for (const char *c = name; '\0' != *c; ++c) {
+                if ('"' == *c || '\\' == *c) {
+                    fputc('\\', stderr);
+                }
+                fputc((unsigned char) *c < 0x20 ? '?' : *c, stderr);
+            }
+            fputs("\",", stderr);
+        } else {
+            fprintf(stderr, "\"images\":%zu,", image_count);
+        }
+        fputs("\"stages\":{", stderr);
+        for (size_t stage = 0; stage < TIMING_STAGE_COUNT; ++stage) {
+            const timing_counter_t *counter = &counters[stage];
+            fprintf(
+                stderr,
+                "%s\"%s\":{\"ns\":%llu,\"bytes\":%llu,\"pixels\":%llu,\"gbps\":%.3f}",
+                0 == stage ? "" : ",",
+                Timing_Stage_Names[stage],
+                (unsigned long long) counter->nanoseconds,
+                (unsigned long long) counter->bytes,
+                (unsigned long long) counter->pixels,
+                0 == counter->nanoseconds ? 0.0 : (double) counter->bytes / (double) counter->nanoseconds
+            );
+        }
+        fprintf(stderr, "},\"total_ns\":%llu}\n", (unsigned long long) total_nanoseconds);
+    } else {
+        if (NULL != name) {
+            fprintf(stderr, "%s: %.3f ms\n", name, total_nanoseconds / 1e6);
+        } else {
+            fprintf(stderr, "all %zu images: %.3f ms\n", image_count, total_nanoseconds / 1e6);
+        }
+        for (size_t stage = 0; stage < TIMING_STAGE_COUNT; ++stage) {
+            const timing_counter_t *counter = &counters[stage];
+            if (0 == counter->nanoseconds && 0 == counter->bytes) {
+                continue;
+            }
+            fprintf(
+                stderr,
+                "    %-8s %10.3f ms %12llu bytes %10llu pixels %8.3f GB/s\n",
+                Timing_Stage_Names[stage],
+                counter->nanoseconds / 1e6,
+                (unsigned long long) counter->bytes,
+                (unsigned long long) counter->pixels,
+                0 == counter->nanoseconds ? 0.0 : (double) counter->bytes / (double) counter->nanoseconds
+            );
+        }
+    }
+}
+
+/* Moves the stages the calling thread recorded since its previous image into
+   `counters`, or drops them if `counters` is NULL, e.g. for an image that
+   failed. */
+static inline void timing_take_image(timing_counter_t counters[TIMING_STAGE_COUNT])
+{
+    if (NULL != counters) {
+        memcpy(counters, Timing_Image, sizeof(Timing_Image));
+    }
+    memset(Timing_Image, 0, sizeof(Timing_Image));
+}
+
+/* Adds the stages of an image that another thread took with
+   timing_take_image to the current image of the calling thread. */
+static inline void timing_add_image(const timing_counter_t counters[TIMING_STAGE_COUNT])
+{
+    for (size_t stage = 0; stage < TIMING_STAGE_COUNT; ++stage) {
+        Timing_Image[stage].nanoseconds += counters[stage].nanoseconds;
+        Timing_Image[stage].bytes += counters[stage].bytes;
+        Timing_Image[stage].pixels += counters[stage].pixels;
+    }
+}
+
+/* Reports the stages the calling thread recorded since its previous image
+   and adds them to the aggregate of the run. */
+static void timing_finish_image(const char *name)
+{
+    if (!timing_is_enabled()) {
+        return;
+    }
+
+    /* Keeps the lines of images finished by different threads together */
+    flockfile(stderr);
+    _timing_print(name, Timing_Image, 1);
+    funlockfile(stderr);
+
+    for (size_t stage = 0; stage < TIMING_STAGE_COUNT; ++stage) {
+        __atomic_fetch_add(&Timing_Report.total[stage].nanoseconds, Timing_Image[stage].nanoseconds, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&Timing_Report.total[stage].bytes, Timing_Image[stage].bytes, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&Timing_Report.total[stage].pixels, Timing_Image[stage].pixels, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&Timing_Report.image_count, 1, __ATOMIC_RELAXED);
+    timing_take_image(NULL);
+}
+
+static void timing_print_summary(void)
+{
+    if (Timing_Report.image_count > 1) {
+        _timing_print(NULL, Timing_Report.total, Timing_Report.image_count);
+    }
+}
+
+#endif // TIMING_H
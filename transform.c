@@ -0,0 +1,144 @@
+#include "bmp.h"
+#include "image_io.h"
+#include "transform.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined C_IMPLEMENTATION && \
+    !defined SIMD_INTRINSICS_IMPLEMENTATION && \
+    !defined SIMD_ASM_IMPLEMENTATION
+#define C_IMPLEMENTATION 1
+#endif
+
+int main(int argc, char *argv[])
+{
+    int result = EXIT_FAILURE;
+
+    if (argc < 4) {
+        fprintf(
+            stderr,
+            "Usage: %s <rotate90|rotate180|rotate270|transpose|flip-horizontal|flip-vertical|top-down|bottom-up> "
+            "<source file> <dest. file>\n",
+            argv[0]
+        );
+        return result;
+    }
+
+    /* `top-down` and `bottom-up` only normalize the row order while the image
+       is loaded and do not need a second buffer. */
+    bmp_orientation orientation = BMP_ORIENTATION_AS_STORED;
+    transform_operation_t operation = TRANSFORM_FLIP_VERTICAL;
+    if (0 == strcmp(argv[1], "top-down")) {
+        orientation = BMP_ORIENTATION_TOP_DOWN;
+    } else if (0 == strcmp(argv[1], "bottom-up")) {
+        orientation = BMP_ORIENTATION_BOTTOM_UP;
+    } else if (!transform_parse_operation(argv[1], &operation)) {
+        fprintf(stderr, "Unknown operation '%s'\n", argv[1]);
+        return result;
+    }
+
+    char *source_file_name = argv[2];
+    char *destination_file_name = argv[3];
+    FILE *source_descriptor = NULL;
+    FILE *destination_descriptor = NULL;
+
+    bmp_image image; bmp_init_image_structure(&image);
+    image_format source_format = IMAGE_FORMAT_BMP;
+    bmp_image transformed_image; bmp_init_image_structure(&transformed_image);
+
+    source_descriptor = fopen(source_file_name, "r");
+    if (source_descriptor == NULL) {
+        fprintf(stderr, "Failed to open the source image file '%s'\n", source_file_name);
+        goto cleanup;
+    }
+
+    const char *error_message;
+    image_io_open_image_headers(source_descriptor, &image, &source_format, &error_message);
+    if (error_message != NULL) {
+        fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", source_file_name, error_message);
+        goto cleanup;
+    }
+
+    image_io_read_image_data_oriented(source_descriptor, &image, source_format, orientation, &error_message);
+    if (error_message != NULL) {
+        fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", source_file_name, error_message);
+        goto cleanup;
+    }
+
+    bmp_image *output_image = &image;
+    if (BMP_ORIENTATION_AS_STORED == orientation) {
+        size_t width = image.absolute_image_width;
+        size_t height = image.absolute_image_height;
+        bool swap = transform_swaps_dimensions(operation);
+
+        bmp_create_image_from_template(
+            &transformed_image,
+            &image,
+            swap ? height : width,
+            swap ? width : height,
+            &error_message
+        );
+        if (error_message != NULL) {
+            fprintf(stderr, "Failed to create the output image '%s':\n\t%s\n", destination_file_name, error_message);
+            goto cleanup;
+        }
+
+        /* Main Image Processing Loop */
+        uint64_t kernel_start_time = timing_start();
+
+        transform_apply(
+            image.pixels,
+            width,
+            height,
+            transformed_image.pixels,
+            transform_get_mapping(operation, bmp_is_top_down(&image))
+        );
+
+        timing_stop(TIMING_STAGE_KERNEL, kernel_start_time, width * height * 4, width * height);
+
+        output_image = &transformed_image;
+    }
+
+    image_format destination_format = image_io_get_format_for_file_name(destination_file_name, source_format);
+    destination_descriptor = fopen(destination_file_name, "w");
+    if (destination_descriptor == NULL) {
+        fprintf(stderr, "Failed to create the output image '%s'\n", destination_file_name);
+        goto cleanup;
+    }
+
+    image_io_write_image_headers(destination_descriptor, output_image, destination_format, &error_message);
+    if (error_message != NULL) {
+        fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", destination_file_name, error_message);
+        goto cleanup;
+    }
+
+    image_io_write_image_data(destination_descriptor, output_image, destination_format, &error_message);
+    if (error_message != NULL) {
+        fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", destination_file_name, error_message);
+        goto cleanup;
+    }
+
+    timing_finish_image(destination_file_name);
+
+    result = EXIT_SUCCESS;
+
+cleanup:
+    bmp_free_image_structure(&image);
+    bmp_free_image_structure(&transformed_image);
+
+    if (source_descriptor != NULL) {
+        fclose(source_descriptor);
+        source_descriptor = NULL;
+    }
+
+    if (destination_descriptor != NULL) {
+        fclose(destination_descriptor);
+        destination_descriptor = NULL;
+    }
+
+    return result;
+}
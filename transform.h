@@ -0,0 +1,306 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include "bmp.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined SIMD_INTRINSICS_IMPLEMENTATION || defined SIMD_ASM_IMPLEMENTATION
+#include <immintrin.h>
+#endif
+
+#if (defined SIMD_INTRINSICS_IMPLEMENTATION || defined SIMD_ASM_IMPLEMENTATION) && \
+    defined __AVX2__
+#define TRANSFORM_TILE_SIZE 8
+#elif (defined SIMD_INTRINSICS_IMPLEMENTATION || defined SIMD_ASM_IMPLEMENTATION) && \
+    defined __SSE2__
+#define TRANSFORM_TILE_SIZE 4
+#else
+#define TRANSFORM_TILE_SIZE 1
+#endif
+
+/* Register tiles are visited in blocks of this many pixels on each side, so
+   the destination rows a block writes to stay in L1 while it is processed. */
+#define TRANSFORM_BLOCK_SIZE 64
+
+typedef enum _transform_operation
+{
+    TRANSFORM_ROTATE_90,        /* clockwise */
+    TRANSFORM_ROTATE_180,
+    TRANSFORM_ROTATE_270,
+    TRANSFORM_TRANSPOSE,        /* mirror along the top-left to bottom-right diagonal */
+    TRANSFORM_FLIP_HORIZONTAL,
+    TRANSFORM_FLIP_VERTICAL
+} transform_operation_t;
+
+static inline bool transform_parse_operation(const char *name, transform_operation_t *operation)
+{
+    if (0 == strcmp(name, "rotate90")) {
+        *operation = TRANSFORM_ROTATE_90;
+    } else if (0 == strcmp(name, "rotate180")) {
+        *operation = TRANSFORM_ROTATE_180;
+    } else if (0 == strcmp(name, "rotate270")) {
+        *operation = TRANSFORM_ROTATE_270;
+    } else if (0 == strcmp(name, "transpose")) {
+        *operation = TRANSFORM_TRANSPOSE;
+    } else if (0 == strcmp(name, "flip-horizontal")) {
+        *operation = TRANSFORM_FLIP_HORIZONTAL;
+    } else if (0 == strcmp(name, "flip-vertical")) {
+        *operation = TRANSFORM_FLIP_VERTICAL;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+static inline bool transform_swaps_dimensions(transform_operation_t operation)
+{
+    return TRANSFORM_ROTATE_90 == operation ||
+           TRANSFORM_ROTATE_270 == operation ||
+           TRANSFORM_TRANSPOSE == operation;
+}
+
+/*
+    Every operation is a mapping of the pixels in memory: an optional transpose
+    followed by optional reversal of the destination columns and rows. The
+    operations are defined for a top-down image; for a bottom-up image the
+    memory rows run in the opposite direction, which inverts both reversals of
+    the transposing operations.
+*/
+typedef struct _transform_mapping
+{
+    bool transpose;
+    bool reverse_columns;
+    bool reverse_rows;
+} transform_mapping_t;
+
+static inline transform_mapping_t transform_get_mapping(transform_operation_t operation, bool top_down)
+{
+    transform_mapping_t mapping = { false, false, false };
+
+    switch (operation) {
+        case TRANSFORM_ROTATE_90:
+            mapping.transpose = true;
+            mapping.reverse_columns = true;
+            break;
+        case TRANSFORM_ROTATE_180:
+            mapping.reverse_columns = true;
+            mapping.reverse_rows = true;
+            break;
+        case TRANSFORM_ROTATE_270:
+            mapping.transpose = true;
+            mapping.reverse_rows = true;
+            break;
+        case TRANSFORM_TRANSPOSE:
+            mapping.transpose = true;
+            break;
+        case TRANSFORM_FLIP_HORIZONTAL:
+            mapping.reverse_columns = true;
+            break;
+        case TRANSFORM_FLIP_VERTICAL:
+            mapping.reverse_rows = true;
+            break;
+    }
+
+    if (mapping.transpose && !top_down) {
+        mapping.reverse_columns = !mapping.reverse_columns;
+        mapping.reverse_rows = !mapping.reverse_rows;
+    }
+
+    return mapping;
+}
+
+/* Register Tiles */
+
+/*
+    Transposes a square tile of TRANSFORM_TILE_SIZE BGRA pixels. `rows` point
+    to the source rows of the tile in the order they become the destination
+    columns, `destination_rows` receive the transposed rows.
+*/
+static inline void transform_transpose_tile(const uint32_t *const *rows, uint32_t *const *destination_rows)
+{
+#if TRANSFORM_TILE_SIZE == 8
+    __m256i r0 = _mm256_loadu_si256((const __m256i *) rows[0]);
+    __m256i r1 = _mm256_loadu_si256((const __m256i *) rows[1]);
+    __m256i r2 = _mm256_loadu_si256((const __m256i *) rows[2]);
+    __m256i r3 = _mm256_loadu_si256((const __m256i *) rows[3]);
+    __m256i r4 = _mm256_loadu_si256((const __m256i *) rows[4]);
+    __m256i r5 = _mm256_loadu_si256((const __m256i *) rows[5]);
+    __m256i r6 = _mm256_loadu_si256((const __m256i *) rows[6]);
+    __m256i r7 = _mm256_loadu_si256((const __m256i *) rows[7]);
+
+    __m256i t0 = _mm256_unpacklo_epi32(r0, r1);
+    __m256i t1 = _mm256_unpackhi_epi32(r0, r1);
+    __m256i t2 = _mm256_unpacklo_epi32(r2, r3);
+    __m256i t3 = _mm256_unpackhi_epi32(r2, r3);
+    __m256i t4 = _mm256_unpacklo_epi32(r4, r5);
+    __m256i t5 = _mm256_unpackhi_epi32(r4, r5);
+    __m256i t6 = _mm256_unpacklo_epi32(r6, r7);
+    __m256i t7 = _mm256_unpackhi_epi32(r6, r7);
+
+    __m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+    __m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+    __m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+    __m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+    __m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+    __m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+    __m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+    __m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+
+    _mm256_storeu_si256((__m256i *) destination_rows[0], _mm256_permute2x128_si256(u0, u4, 0x20));
+    _mm256_storeu_si256((__m256i *) destination_rows[1], _mm256_permute2x128_si256(u1, u5, 0x20));
+    _mm256_storeu_si256((__m256i *) destination_rows[2], _mm256_permute2x128_si256(u2, u6, 0x20));
+    _mm256_storeu_si256((__m256i *) destination_rows[3], _mm256_permute2x128_si256(u3, u7, 0x20));
+    _mm256_storeu_si256((__m256i *) destination_rows[4], _mm256_permute2x128_si256(u0, u4, 0x31));
+    _mm256_storeu_si256((__m256i *) destination_rows[5], _mm256_permute2x128_si256(u1, u5, 0x31));
+    _mm256_storeu_si256((__m256i *) destination_rows[6], _mm256_permute2x128_si256(u2, u6, 0x31));
+    _mm256_storeu_si256((__m256i *) destination_rows[7], _mm256_permute2x128_si256(u3, u7, 0x31));
+#elif TRANSFORM_TILE_SIZE == 4
+    __m128i r0 = _mm_loadu_si128((const __m128i *) rows[0]);
+    __m128i r1 = _mm_loadu_si128((const __m128i *) rows[1]);
+    __m128i r2 = _mm_loadu_si128((const __m128i *) rows[2]);
+    __m128i r3 = _mm_loadu_si128((const __m128i *) rows[3]);
+
+    __m128i t0 = _mm_unpacklo_epi32(r0, r1);
+    __m128i t1 = _mm_unpackhi_epi32(r0, r1);
+    __m128i t2 = _mm_unpacklo_epi32(r2, r3);
+    __m128i t3 = _mm_unpackhi_epi32(r2, r3);
+
+    _mm_storeu_si128((__m128i *) destination_rows[0], _mm_unpacklo_epi64(t0, t2));
+    _mm_storeu_si128((__m128i *) destination_rows[1], _mm_unpackhi_epi64(t0, t2));
+    _mm_storeu_si128((__m128i *) destination_rows[2], _mm_unpacklo_epi64(t1, t3));
+    _mm_storeu_si128((__m128i *) destination_rows[3], _mm_unpackhi_epi64(t1, t3));
+#else
+    *destination_rows[0] = *rows[0];
+#endif
+}
+
+/* Copies `count` pixels from `source` to `destination` in reverse order. */
+static inline void transform_reverse_row(const uint32_t *source, uint32_t *destination, size_t count)
+{
+    size_t x = 0;
+
+#if TRANSFORM_TILE_SIZE == 8
+    const __m256i reverse = _mm256_set_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    for (; x + 8 <= count; x += 8) {
+        __m256i pixels = _mm256_loadu_si256((const __m256i *) &source[count - x - 8]);
+        _mm256_storeu_si256((__m256i *) &destination[x], _mm256_permutevar8x32_epi32(pixels, reverse));
+    }
+#elif TRANSFORM_TILE_SIZE == 4
+    for (; x + 4 <= count; x += 4) {
+        __m128i pixels = _mm_loadu_si128((const __m128i *) &source[count - x - 4]);
+        _mm_storeu_si128((__m128i *) &destination[x], _mm_shuffle_epi32(pixels, 0x1b));
+    }
+#endif
+
+    for (; x < count; ++x) {
+        destination[x] = source[count - 1 - x];
+    }
+}
+
+/* Transforms */
+
+/*
+    Applies `mapping` to the BGRA `source` of `width` x `height` pixels and
+    writes the result to `destination`, which must have room for the same
+    number of pixels with the dimensions swapped if the mapping transposes.
+*/
+static void transform_apply(
+                const uint8_t *source,
+                size_t width,
+                size_t height,
+                uint8_t *destination,
+                transform_mapping_t mapping
+            )
+{
+    const uint32_t *source_pixels = (const uint32_t *) source;
+    uint32_t *destination_pixels = (uint32_t *) destination;
+
+    if (!mapping.transpose) {
+        for (size_t y = 0; y < height; ++y) {
+            const uint32_t *source_row = &source_pixels[y * width];
+            uint32_t *destination_row =
+                &destination_pixels[(mapping.reverse_rows ? height - 1 - y : y) * width];
+
+            if (mapping.reverse_columns) {
+                transform_reverse_row(source_row, destination_row, width);
+            } else {
+                memcpy(destination_row, source_row, width * 4);
+            }
+        }
+
+        return;
+    }
+
+    /* The destination is `height` pixels wide and `width` pixels tall: the
+       source pixel (x, y) moves to the destination pixel (y, x) before the
+       reversals. */
+    size_t destination_width = height;
+
+    for (size_t block_y = 0; block_y < height; block_y += TRANSFORM_BLOCK_SIZE) {
+        size_t block_height = UTILS_MIN(TRANSFORM_BLOCK_SIZE, height - block_y);
+
+        for (size_t block_x = 0; block_x < width; block_x += TRANSFORM_BLOCK_SIZE) {
+            size_t block_width = UTILS_MIN(TRANSFORM_BLOCK_SIZE, width - block_x);
+
+            size_t tile_y = block_y;
+            for (; tile_y + TRANSFORM_TILE_SIZE <= block_y + block_height; tile_y += TRANSFORM_TILE_SIZE) {
+                size_t tile_x = block_x;
+                for (; tile_x + TRANSFORM_TILE_SIZE <= block_x + block_width; tile_x += TRANSFORM_TILE_SIZE) {
+                    const uint32_t *rows[TRANSFORM_TILE_SIZE];
+                    uint32_t *destination_rows[TRANSFORM_TILE_SIZE];
+
+                    /* Loading the source rows in reverse order reverses the
+                       columns of the transposed tile. */
+                    for (size_t i = 0; i < TRANSFORM_TILE_SIZE; ++i) {
+                        size_t y =
+                            mapping.reverse_columns ?
+                                tile_y + TRANSFORM_TILE_SIZE - 1 - i :
+                                tile_y + i;
+                        rows[i] = &source_pixels[y * width + tile_x];
+                    }
+
+                    size_t destination_x =
+                        mapping.reverse_columns ?
+                            height - tile_y - TRANSFORM_TILE_SIZE :
+                            tile_y;
+                    for (size_t i = 0; i < TRANSFORM_TILE_SIZE; ++i) {
+                        size_t destination_y =
+                            mapping.reverse_rows ?
+                                width - 1 - (tile_x + i) :
+                                tile_x + i;
+                        destination_rows[i] = &destination_pixels[destination_y * destination_width + destination_x];
+                    }
+
+                    transform_transpose_tile(rows, destination_rows);
+                }
+
+                /* Columns at the right edge of the block that do not fill a tile */
+                for (size_t y = tile_y; y < tile_y + TRANSFORM_TILE_SIZE; ++y) {
+                    for (size_t x = tile_x; x < block_x + block_width; ++x) {
+                        size_t destination_x = mapping.reverse_columns ? height - 1 - y : y;
+                        size_t destination_y = mapping.reverse_rows ? width - 1 - x : x;
+                        destination_pixels[destination_y * destination_width + destination_x] =
+                            source_pixels[y * width + x];
+                    }
+                }
+            }
+
+            /* Rows at the bottom of the block that do not fill a tile */
+            for (size_t y = tile_y; y < block_y + block_height; ++y) {
+                for (size_t x = block_x; x < block_x + block_width; ++x) {
+                    size_t destination_x = mapping.reverse_columns ? height - 1 - y : y;
+                    size_t destination_y = mapping.reverse_rows ? width - 1 - x : x;
+                    destination_pixels[destination_y * destination_width + destination_x] =
+                        source_pixels[y * width + x];
+                }
+            }
+        }
+    }
+}
+
+#endif // TRANSFORM_H
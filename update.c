@@ -0,0 +1,355 @@
+#include "bmp.h"
+#include "filters.h"
+#include "image_io.h"
+#include "incremental.h"
+#include "threadpool.h"
+#include "tiled.h"
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#if !defined C_IMPLEMENTATION && \
+    !defined SIMD_INTRINSICS_IMPLEMENTATION && \
+    !defined SIMD_ASM_IMPLEMENTATION
+#define C_IMPLEMENTATION 1
+#endif
+
+/*
+    Applies a filter chain to a new version of an image and patches the tiled
+    output of the previous version in place (see incremental.h). The tiles of
+    the input are hashed and compared with the state file next to the output,
+    and only the dirty tiles are filtered and written with `pwrite`. Every
+    row of tiles is a separate task in both passes.
+
+    The kernels of filters.h see runs of channels without their rows, so a
+    chain with a radius could not find the neighbors of the pixels at the
+    edges of a tile. Such chains are rejected until the kernels get a row
+    stride.
+*/
+
+typedef enum _update_operation
+{
+    UPDATE_OPERATION_HASH,      /* hash the tiles of the input                */
+    UPDATE_OPERATION_FILTER     /* filter the dirty tiles into the output     */
+} update_operation_t;
+
+typedef struct _update_task_data
+{
+    update_operation_t operation;
+    const filters_chain_t *chain;
+    const tiled_file *output;
+    incremental_state_t *state;
+    const bool *dirty;
+    uint8_t *pixels;
+    bool top_down;                  /* row order of `pixels` */
+    size_t tile_y;
+    volatile ssize_t *rows_left;
+    volatile bool *barrier_sense;
+    volatile bool *failed;
+} update_task_data_t;
+
+/* Only uncompressed tiles can be written over in place */
+static bool update_has_raw_tiles(const tiled_file *file)
+{
+    for (size_t i = 0; i < tiled_get_tile_count(&file->header); ++i) {
+        if (file->index[i].encoding != TILED_ENCODING_RAW) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Filters a tile into `tile`, the padding of edge tiles stays zero. */
+static void update_filter_tile(const update_task_data_t *data, size_t tile_x, uint8_t *tile)
+{
+    const tiled_header *header = &data->output->header;
+
+    size_t x, y, width, height;
+    tiled_get_tile_bounds(header, tile_x, data->tile_y, &x, &y, &width, &height);
+
+    size_t tile_row_size = (size_t) header->tile_width * 4;
+    tiled_copy_tile_from_pixels(header, data->pixels, data->top_down, tile_x, data->tile_y, tile);
+    for (size_t row = 0; row < height; ++row) {
+        filters_apply_chain(data->chain, tile + row * tile_row_size, 0, width * 4, false);
+    }
+}
+
+static void update_processing_task(
+                void *task_data,
+                void (*result_callback)(void *result) __attribute__((unused))
+            )
+{
+    update_task_data_t *data = task_data;
+
+    const tiled_header *header = &data->output->header;
+    size_t across = header->tiles_across;
+
+    if (data->operation == UPDATE_OPERATION_HASH) {
+        for (size_t tile_x = 0; tile_x < across; ++tile_x) {
+            data->state->hashes[data->tile_y * across + tile_x] =
+                incremental_hash_tile(header, data->pixels, data->top_down, tile_x, data->tile_y);
+        }
+    } else {
+        size_t tile_size = tiled_get_tile_size(header);
+
+        uint8_t *tile = bmp_allocate_buffer(tile_size);
+        if (tile == NULL) {
+            *data->failed = true;
+        } else {
+            for (size_t tile_x = 0; tile_x < across; ++tile_x) {
+                if (!data->dirty[data->tile_y * across + tile_x]) {
+                    continue;
+                }
+
+                update_filter_tile(data, tile_x, tile);
+
+                const char *error_message;
+                tiled_write_tile(data->output, tile_x, data->tile_y, tile, &error_message);
+                if (error_message != NULL) {
+                    *data->failed = true;
+                    break;
+                }
+            }
+        }
+
+        if (tile != NULL) {
+            bmp_free_buffer(tile, tile_size);
+            tile = NULL;
+        }
+    }
+
+    ssize_t rows_left = __sync_sub_and_fetch(data->rows_left, 1);
+    if (rows_left <= 0) {
+        __sync_lock_test_and_set(data->barrier_sense, true);
+    }
+
+    free(data);
+    data = NULL;
+}
+
+/* Runs a task for every row of tiles with the fields of `template` and
+   returns false if one of them failed. */
+static bool update_run(threadpool_t *threadpool, const update_task_data_t *template)
+{
+    static volatile ssize_t rows_left = 0;
+    static volatile bool barrier_sense = false;
+    static volatile bool failed = false;
+
+    size_t row_count = template->output->header.tiles_down;
+    rows_left = row_count;
+    barrier_sense = false;
+    failed = false;
+
+    size_t enqueued_rows = 0;
+    for (size_t tile_y = 0; tile_y < row_count; ++tile_y) {
+        update_task_data_t *task_data = malloc(sizeof(*task_data));
+        if (task_data == NULL) {
+            failed = true;
+            break;
+        }
+
+        *task_data = *template;
+        task_data->tile_y = tile_y;
+        task_data->rows_left = &rows_left;
+        task_data->barrier_sense = &barrier_sense;
+        task_data->failed = &failed;
+
+        ++enqueued_rows;
+        if (threadpool == NULL) {
+            update_processing_task(task_data, NULL);
+        } else {
+            threadpool_enqueue_task(threadpool, update_processing_task, task_data, NULL);
+        }
+    }
+
+    /* Rows that were never enqueued are not waited for */
+    if (enqueued_rows < row_count &&
+        __sync_sub_and_fetch(&rows_left, (ssize_t) (row_count - enqueued_rows)) <= 0) {
+        __sync_lock_test_and_set(&barrier_sense, true);
+    }
+
+    while (row_count > 0 && !barrier_sense) { }
+
+    return !failed;
+}
+
+int main(int argc, char *argv[])
+{
+    int result = EXIT_FAILURE;
+
+    if (argc < 4) {
+        fprintf(stderr, "Usage: %s <filter chain> <source file> <dest. file>.tiled [<tile size>]\n", argv[0]);
+        return result;
+    }
+
+    char *chain_text = argv[1];
+    char *source_file_name = argv[2];
+    char *destination_file_name = argv[3];
+    size_t tile_size = argc > 4 ? (size_t) strtoul(argv[4], NULL, 10) : 0;
+    FILE *source_descriptor = NULL;
+    threadpool_t *threadpool = NULL;
+    bool *dirty = NULL;
+
+    bmp_image image; bmp_init_image_structure(&image);
+    image_format source_format = IMAGE_FORMAT_BMP;
+    tiled_file output; tiled_init_file_structure(&output);
+    incremental_state_t previous; incremental_init_state(&previous);
+    incremental_state_t current; incremental_init_state(&current);
+
+    const char *error_message;
+    filters_chain_t chain;
+    filters_parse_chain(chain_text, &chain, &error_message);
+    if (error_message != NULL) {
+        fprintf(stderr, "%s '%s'\n", error_message, chain_text);
+        goto cleanup;
+    }
+
+    if (0 != filters_get_chain_radius(&chain)) {
+        fprintf(stderr, "Chains that read neighboring pixels cannot be updated by tiles '%s'\n", chain_text);
+        goto cleanup;
+    }
+
+    if (argc > 4 && !tiled_is_valid_tile_size(tile_size)) {
+        fprintf(stderr, "%s\n", TILED_Error_Invalid_Tile_Size);
+        goto cleanup;
+    }
+
+    if (image_io_get_format_for_file_name(destination_file_name, IMAGE_FORMAT_BMP) != IMAGE_FORMAT_TILED) {
+        fprintf(stderr, "The output image '%s' has to be a tiled image (.tiled)\n", destination_file_name);
+        goto cleanup;
+    }
+
+    char state_path[PATH_MAX];
+    if (!incremental_get_state_path(destination_file_name, state_path, sizeof(state_path))) {
+        fprintf(stderr, "The output path '%s' is too long\n", destination_file_name);
+        goto cleanup;
+    }
+
+    source_descriptor = fopen(source_file_name, "r");
+    if (source_descriptor == NULL) {
+        fprintf(stderr, "Failed to open the source image file '%s'\n", source_file_name);
+        goto cleanup;
+    }
+
+    image_io_open_image_headers(source_descriptor, &image, &source_format, &error_message);
+    if (error_message != NULL) {
+        fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", source_file_name, error_message);
+        goto cleanup;
+    }
+
+    image_io_read_image_data(source_descriptor, &image, source_format, &error_message);
+    if (error_message != NULL) {
+        fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", source_file_name, error_message);
+        goto cleanup;
+    }
+
+    size_t threads = utils_get_number_of_cpu_cores();
+    if (threads > 1) {
+        threadpool = threadpool_create(threads);
+        if (threadpool == NULL) {
+            fputs("Failed to create a threadpool.\n", stderr);
+            goto cleanup;
+        }
+    }
+
+    size_t width = image.absolute_image_width;
+    size_t height = image.absolute_image_height;
+    size_t tile_width = tile_size != 0 ? tile_size : tiled_get_default_tile_size(width);
+    size_t tile_height = tile_size != 0 ? tile_size : tiled_get_default_tile_size(height);
+
+    /* The previous output is patched if it has the same geometry, otherwise
+       it is made again from scratch */
+    tiled_open_file(&output, destination_file_name, true, &error_message);
+    if (error_message != NULL ||
+        output.header.image_width != width || output.header.image_height != height ||
+        output.header.tile_width != tile_width || output.header.tile_height != tile_height ||
+        output.header.channels != image.channels ||
+        !update_has_raw_tiles(&output)) {
+        tiled_close_file(&output);
+        tiled_create_file(&output, destination_file_name, width, height, image.channels, tile_width, tile_height, &error_message);
+        if (error_message != NULL) {
+            fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", destination_file_name, error_message);
+            goto cleanup;
+        }
+    } else {
+        incremental_load_state(&previous, state_path, &error_message);
+    }
+
+    incremental_create_state(&current, &output.header, &chain, &error_message);
+    dirty = malloc(UTILS_MAX(incremental_get_tile_count(&current), 1) * sizeof(*dirty));
+    if (error_message != NULL || dirty == NULL) {
+        fputs("Out of memory.\n", stderr);
+        goto cleanup;
+    }
+
+    update_task_data_t template = {
+        .operation = UPDATE_OPERATION_HASH,
+        .chain = &chain,
+        .output = &output,
+        .state = &current,
+        .dirty = dirty,
+        .pixels = image.pixels,
+        .top_down = bmp_is_top_down(&image)
+    };
+    if (!update_run(threadpool, &template)) {
+        fputs("Out of memory.\n", stderr);
+        goto cleanup;
+    }
+
+    size_t tile_count = incremental_get_tile_count(&current);
+    size_t dirty_count = incremental_mark_dirty_tiles(&previous, &current, dirty);
+
+    /* A crash while patching must not leave the old state next to a partly
+       new output */
+    unlink(state_path);
+
+    uint64_t start_time = timing_start();
+
+    template.operation = UPDATE_OPERATION_FILTER;
+    if (!update_run(threadpool, &template)) {
+        fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", destination_file_name, TILED_Error_Failed_to_Write_Tile);
+        goto cleanup;
+    }
+
+    timing_stop(TIMING_STAGE_KERNEL, start_time, dirty_count * tiled_get_tile_size(&output.header), 0);
+
+    incremental_save_state(&current, state_path, &error_message);
+    if (error_message != NULL) {
+        fprintf(stderr, "Failed to process the image '%s':\n\t%s\n", state_path, error_message);
+        goto cleanup;
+    }
+
+    printf("%s: %zu of %zu tiles filtered\n", destination_file_name, dirty_count, tile_count);
+    timing_finish_image(destination_file_name);
+
+    result = EXIT_SUCCESS;
+
+cleanup:
+    /* The pool finishes its queued tasks before the file is closed */
+    threadpool_destroy(threadpool);
+    threadpool = NULL;
+
+    tiled_close_file(&output);
+
+    incremental_free_state(&previous);
+    incremental_free_state(&current);
+
+    if (dirty != NULL) {
+        free(dirty);
+        dirty = NULL;
+    }
+
+    bmp_free_image_structure(&image);
+
+    if (source_descriptor != NULL) {
+        fclose(source_descriptor);
+        source_descriptor = NULL;
+    }
+
+    return result;
+}
@@ -1,13 +1,20 @@
 #ifndef WORK_ITEM_H
 #define WORK_ITEM_H
 
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 
+#define WORK_ITEM_ANY_WORKER SIZE_MAX
+
 typedef struct work_item
 {
     void (*task)(void *task_data, void (*result_callback)(void *result));
     void *task_data;
     void (*result_callback)(void *result);
+
+    uint64_t enqueue_time;  /* monotonic time in ns when the item was queued          */
+    size_t worker;          /* the worker that has to run it, or WORK_ITEM_ANY_WORKER */
 } work_item_t;
 
 static inline work_item_t *work_item_create(
@@ -24,6 +31,8 @@ static inline work_item_t *work_item_create(
     work_item->task = task;
     work_item->task_data = task_data;
     work_item->result_callback = result_callback;
+    work_item->enqueue_time = 0;
+    work_item->worker = WORK_ITEM_ANY_WORKER;
 
     return work_item;
 }